@@ -0,0 +1,497 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "copy.h"
+
+/*
+ * Benchmark of read strategies of copy procedure on simulated disks.
+ * Disk is a defect map, i.e. sorted list of unreadable extents, and a timing model:
+ * transfer rate falls from outer to inner tracks, any jump costs seek (growing as square root
+ * of distance) plus half a revolution, and read which meets bad sector costs error_ms on top,
+ * as drive retries it before giving up. Layout is serpentine: each head reads stripe_sectors
+ * in turn, so dead head makes every heads-th stripe unreadable.
+ * Strategies are driven the same way copy procedure does, on the same unread zones,
+ * and report simulated time to recover 90/99/100% of readable sectors.
+ */
+
+typedef struct bad_extent {
+    int64_t begin_lba;
+    int64_t end_lba;
+} BadExtent;
+
+typedef struct sim_disk {
+    int64_t nb_sectors;
+    BadExtent *bad;  // sorted, not overlapping nor adjacent
+    uint64_t nb_bad;
+    uint64_t bad_allocated;
+    int64_t bad_sectors;
+} SimDisk;
+
+// All parameters are given as key=value on command line
+typedef struct bench_params {
+    int64_t size_mb;
+    int64_t blk_sectors;
+    int64_t skip_blocks;
+    int64_t seed;
+    int64_t rpm;
+    int64_t outer_track_sectors;
+    int64_t inner_track_sectors;
+    int64_t track_seek_us;
+    int64_t full_seek_us;
+    int64_t command_us;
+    int64_t error_ms;
+    int64_t heads;
+    int64_t stripe_sectors;
+    int64_t clusters;
+    int64_t limit_hours;  // strategy is stopped when simulated time exceeds it, 0 for no limit
+    int64_t check;  // fail if multipass is slower than plain
+} BenchParams;
+
+static const struct {
+    const char *name;
+    size_t offset;
+    const char *help;
+} bench_options[] = {
+    { "size_mb", offsetof(BenchParams, size_mb), "disk size" },
+    { "blk_sectors", offsetof(BenchParams, blk_sectors), "sectors read at once" },
+    { "skip_blocks", offsetof(BenchParams, skip_blocks), "jump on read error, in blocks" },
+    { "seed", offsetof(BenchParams, seed), "seed of defects placement" },
+    { "rpm", offsetof(BenchParams, rpm), "rotation speed" },
+    { "outer_track_sectors", offsetof(BenchParams, outer_track_sectors), "sectors per track at LBA 0" },
+    { "inner_track_sectors", offsetof(BenchParams, inner_track_sectors), "sectors per track at the end" },
+    { "track_seek_us", offsetof(BenchParams, track_seek_us), "track-to-track seek" },
+    { "full_seek_us", offsetof(BenchParams, full_seek_us), "full stroke seek" },
+    { "command_us", offsetof(BenchParams, command_us), "overhead of each read" },
+    { "error_ms", offsetof(BenchParams, error_ms), "time drive spends on retries before failing read" },
+    { "heads", offsetof(BenchParams, heads), "number of heads" },
+    { "stripe_sectors", offsetof(BenchParams, stripe_sectors), "sectors read by one head before switching to next" },
+    { "clusters", offsetof(BenchParams, clusters), "number of defect clusters" },
+    { "limit_hours", offsetof(BenchParams, limit_hours), "stop strategy after this much simulated time, 0 for no limit" },
+    { "check", offsetof(BenchParams, check), "exit with failure if multipass recovers 90% or 99% later than plain, 1 to enable" },
+};
+
+static const char *scenarios[] = { "clean", "clusters", "scratch", "head", "mixed" };
+
+typedef struct bench_strategy {
+    const char *name;
+    enum ReadStrategy read_strategy;
+    ReadStrategyImpl *impl;
+} BenchStrategy;
+
+extern ReadStrategyImpl read_strategy_plain;
+extern ReadStrategyImpl read_strategy_smart;
+extern ReadStrategyImpl read_strategy_smart_noreverse;
+extern ReadStrategyImpl read_strategy_skipfail;
+extern ReadStrategyImpl read_strategy_skipfail_noreverse;
+extern ReadStrategyImpl read_strategy_multipass;
+
+static BenchStrategy strategies[] = {
+    { "plain", ReadStrategy_ePlain, &read_strategy_plain },
+    { "smart", ReadStrategy_eSmart, &read_strategy_smart },
+    { "smart_noreverse", ReadStrategy_eSmartNoReverse, &read_strategy_smart_noreverse },
+    { "skipfail", ReadStrategy_eSkipfail, &read_strategy_skipfail },
+    { "skipfail_noreverse", ReadStrategy_eSkipfailNoReverse, &read_strategy_skipfail_noreverse },
+    { "multipass", ReadStrategy_eMultipass, &read_strategy_multipass },
+};
+
+typedef struct bench_result {
+    double time_to_percent[3];  // 90, 99 and 100% of readable sectors, negative if not reached
+    double total_time;
+    uint64_t nb_reads;
+    uint64_t nb_bad_reads;
+    int64_t recovered;
+    int limit_reached;
+} BenchResult;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static int64_t rng_range(int64_t n) {
+    return n > 0 ? (int64_t)(rng_next() % (uint64_t)n) : 0;
+}
+
+static void add_bad(SimDisk *disk, int64_t begin_lba, int64_t end_lba) {
+    if (begin_lba < 0)
+        begin_lba = 0;
+    if (end_lba > disk->nb_sectors)
+        end_lba = disk->nb_sectors;
+    if (begin_lba >= end_lba)
+        return;
+    if (disk->nb_bad == disk->bad_allocated) {
+        disk->bad_allocated = disk->bad_allocated ? disk->bad_allocated * 2 : 1024;
+        disk->bad = realloc(disk->bad, disk->bad_allocated * sizeof(BadExtent));
+        assert(disk->bad);
+    }
+    disk->bad[disk->nb_bad].begin_lba = begin_lba;
+    disk->bad[disk->nb_bad].end_lba = end_lba;
+    disk->nb_bad++;
+}
+
+static int compare_bad_extents(const void *a, const void *b) {
+    const BadExtent *x = a;
+    const BadExtent *y = b;
+    if (x->begin_lba != y->begin_lba)
+        return x->begin_lba < y->begin_lba ? -1 : 1;
+    return 0;
+}
+
+static void finalize_bad(SimDisk *disk) {
+    uint64_t nb_merged = 0;
+    qsort(disk->bad, disk->nb_bad, sizeof(BadExtent), compare_bad_extents);
+    for (uint64_t i = 0; i < disk->nb_bad; i++) {
+        if (nb_merged && disk->bad[i].begin_lba <= disk->bad[nb_merged - 1].end_lba) {
+            if (disk->bad[i].end_lba > disk->bad[nb_merged - 1].end_lba)
+                disk->bad[nb_merged - 1].end_lba = disk->bad[i].end_lba;
+            continue;
+        }
+        disk->bad[nb_merged++] = disk->bad[i];
+    }
+    disk->nb_bad = nb_merged;
+    disk->bad_sectors = 0;
+    for (uint64_t i = 0; i < nb_merged; i++)
+        disk->bad_sectors += disk->bad[i].end_lba - disk->bad[i].begin_lba;
+}
+
+static int64_t track_sectors(const BenchParams *params, const SimDisk *disk, int64_t lba) {
+    return params->outer_track_sectors
+        - (params->outer_track_sectors - params->inner_track_sectors) * lba / disk->nb_sectors;
+}
+
+static int64_t head_of(const BenchParams *params, int64_t lba) {
+    return (lba / params->stripe_sectors) % params->heads;
+}
+
+// Groups of small defects, like ones left by head touching platter
+static void add_clusters(SimDisk *disk, const BenchParams *params) {
+    for (int64_t i = 0; i < params->clusters; i++) {
+        int64_t center = rng_range(disk->nb_sectors);
+        int64_t nb_spots = 1 + rng_range(30);
+        for (int64_t j = 0; j < nb_spots; j++) {
+            int64_t lba = center + rng_range(100000) - 50000;
+            add_bad(disk, lba, lba + 1 + rng_range(64));
+        }
+    }
+}
+
+// Scratch on one surface crosses its tracks at the same angle, over 5% of disk
+static void add_scratch(SimDisk *disk, const BenchParams *params) {
+    int64_t head = rng_range(params->heads);
+    int64_t begin_lba = rng_range(disk->nb_sectors - disk->nb_sectors / 20);
+    int64_t end_lba = begin_lba + disk->nb_sectors / 20;
+    int64_t width = 16 + rng_range(32);
+    for (int64_t lba = begin_lba; lba < end_lba; ) {
+        int64_t track = track_sectors(params, disk, lba);
+        if (head_of(params, lba) == head)
+            add_bad(disk, lba + track / 3, lba + track / 3 + width);
+        lba += track;
+    }
+}
+
+// Stripes of one head, all over disk
+static void add_dead_head(SimDisk *disk, const BenchParams *params) {
+    int64_t head = rng_range(params->heads);
+    for (int64_t lba = head * params->stripe_sectors; lba < disk->nb_sectors; lba += params->heads * params->stripe_sectors)
+        add_bad(disk, lba, lba + params->stripe_sectors);
+}
+
+// Same format as priority_file of copy procedure: "LBA sectors" per line
+static int load_map(SimDisk *disk, const char *path) {
+    char line[256];
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Failed to open defect map %s\n", path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        int64_t lba, sectors;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%"SCNd64" %"SCNd64, &lba, &sectors) != 2 || lba < 0 || sectors <= 0) {
+            fprintf(stderr, "Malformed line in defect map: %s", line);
+            fclose(file);
+            return 1;
+        }
+        add_bad(disk, lba, lba + sectors);
+    }
+    fclose(file);
+    return 0;
+}
+
+static void build_scenario(SimDisk *disk, const BenchParams *params, const char *scenario) {
+    rng_state = params->seed ? (uint64_t)params->seed : 1;
+    if (!strcmp(scenario, "clusters") || !strcmp(scenario, "mixed"))
+        add_clusters(disk, params);
+    if (!strcmp(scenario, "scratch") || !strcmp(scenario, "mixed"))
+        add_scratch(disk, params);
+    if (!strcmp(scenario, "head"))
+        add_dead_head(disk, params);
+}
+
+// First bad sector in [lba, end_lba), or end_lba if there is none
+static int64_t first_bad(const SimDisk *disk, int64_t lba, int64_t end_lba) {
+    uint64_t lo = 0, hi = disk->nb_bad;
+    // First extent which ends beyond lba
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (disk->bad[mid].end_lba <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == disk->nb_bad || disk->bad[lo].begin_lba >= end_lba)
+        return end_lba;
+    return disk->bad[lo].begin_lba > lba ? disk->bad[lo].begin_lba : lba;
+}
+
+// Simulates read, returns its duration in seconds
+static double sim_read(const SimDisk *disk, const BenchParams *params, int64_t *head_lba,
+        int64_t lba, int64_t sectors, int *failed) {
+    double rev_us = 60.0 * 1000 * 1000 / params->rpm;
+    double us = params->command_us;
+    if (lba != *head_lba) {
+        int64_t distance = llabs(lba - *head_lba);
+        if (distance >= track_sectors(params, disk, lba))
+            us += params->track_seek_us + (params->full_seek_us - params->track_seek_us)
+                * sqrt((double)distance / disk->nb_sectors);
+        us += rev_us / 2;
+    }
+    int64_t bad_lba = first_bad(disk, lba, lba + sectors);
+    *failed = bad_lba < lba + sectors;
+    us += rev_us * (bad_lba - lba) / track_sectors(params, disk, lba);
+    if (*failed)
+        us += params->error_ms * 1000.0;
+    *head_lba = *failed ? bad_lba : lba + sectors;
+    return us / (1000 * 1000);
+}
+
+// Drives strategy like copy procedure does: until progress is complete or strategy has nothing to read
+static void run_strategy(const SimDisk *disk, const BenchParams *params, BenchStrategy *strategy, BenchResult *result) {
+    CopyPriv *priv = calloc(1, sizeof(CopyPriv));
+    assert(priv);
+    priv->blk_sectors = params->blk_sectors;
+    priv->skip_blocks = params->skip_blocks;
+    priv->read_strategy = strategy->read_strategy;
+    priv->read_strategy_impl = strategy->impl;
+    priv->start_lba = 0;
+    priv->end_lba = disk->nb_sectors;
+    Zone *zone = calloc(1, sizeof(Zone));
+    assert(zone);
+    zone->begin_lba = 0;
+    zone->end_lba = disk->nb_sectors;
+    zone_index_insert(&priv->unread_zones, zone);
+    priv->read_strategy_impl->init(priv);
+
+    int64_t readable = disk->nb_sectors - disk->bad_sectors;
+    int64_t targets[3] = { (readable * 90 + 99) / 100, (readable * 99 + 99) / 100, readable };
+    uint64_t progress_num = 0;
+    uint64_t progress_den = disk->nb_sectors + priv->sectors_to_reread;
+    int64_t head_lba = 0;
+    double now = 0;
+    memset(result, 0, sizeof(*result));
+    for (int i = 0; i < 3; i++)
+        result->time_to_percent[i] = targets[i] ? -1 : 0;
+    priv->sectors_to_reread = 0;
+
+    while (progress_num < progress_den) {
+        int64_t lba_to_read;
+        size_t sectors_to_read;
+        int failed;
+        if (params->limit_hours && now > params->limit_hours * 3600.0) {
+            result->limit_reached = 1;
+            break;
+        }
+        if (priv->read_strategy_impl->get_task(priv, &lba_to_read, &sectors_to_read))
+            break;
+        now += sim_read(disk, params, &head_lba, lba_to_read, sectors_to_read, &failed);
+        result->nb_reads++;
+        DC_BlockReport report = {
+            .lba = lba_to_read,
+            .sectors_processed = sectors_to_read,
+            .blk_status = failed ? DC_BlockStatus_eUnc : DC_BlockStatus_eOk,
+        };
+        if (failed) {
+            result->nb_bad_reads++;
+        } else {
+            result->recovered += sectors_to_read;
+            for (int i = 0; i < 3; i++)
+                if (result->time_to_percent[i] < 0 && result->recovered >= targets[i])
+                    result->time_to_percent[i] = now;
+        }
+        priv->read_strategy_impl->use_results(priv, lba_to_read, sectors_to_read, &report);
+        progress_num += sectors_to_read;
+        progress_den += priv->sectors_to_reread;
+        priv->sectors_to_reread = 0;
+    }
+    result->total_time = now;
+
+    priv->read_strategy_impl->close(priv);
+    zone_index_clear(&priv->unread_zones);
+    free(priv);
+}
+
+static void format_time(char *buf, size_t size, double seconds) {
+    if (seconds < 0) {
+        snprintf(buf, size, "-");
+        return;
+    }
+    uint64_t s = (uint64_t)(seconds + 0.5);
+    snprintf(buf, size, "%"PRIu64":%02"PRIu64":%02"PRIu64, s / 3600, s / 60 % 60, s % 60);
+}
+
+// Mark which plain reaches must be reached by multipass no later
+static int check_multipass(const BenchResult *plain, const BenchResult *multipass, const char *name) {
+    static const int percents[] = { 90, 99 };
+    int failed = 0;
+    for (int i = 0; i < 2; i++) {
+        if (plain->time_to_percent[i] < 0)
+            continue;
+        if (multipass->time_to_percent[i] < 0 || multipass->time_to_percent[i] > plain->time_to_percent[i]) {
+            fprintf(stderr, "%s: multipass recovers %d%% later than plain\n", name, percents[i]);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+// Returns 1 if check is enabled and failed
+static int run_disk(const SimDisk *disk, const BenchParams *params, const char *name) {
+    BenchResult plain = { .time_to_percent = { -1, -1, -1 } }, multipass = plain;
+    printf("\n%s: %"PRId64" MiB, %"PRId64" bad sectors in %"PRIu64" areas\n",
+            name, disk->nb_sectors / 2048, disk->bad_sectors, disk->nb_bad);
+    printf("%-20s %10s %10s %12s %12s %12s %12s %10s\n",
+            "strategy", "reads", "bad reads", "90%", "99%", "100%", "total", "recovered");
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+        BenchResult result;
+        char times[4][32];
+        run_strategy(disk, params, &strategies[i], &result);
+        for (int j = 0; j < 3; j++)
+            format_time(times[j], sizeof(times[j]), result.time_to_percent[j]);
+        format_time(times[3], sizeof(times[3]), result.total_time);
+        int64_t readable = disk->nb_sectors - disk->bad_sectors;
+        printf("%-20s %10"PRIu64" %10"PRIu64" %12s %12s %12s %12s %9.4f%%%s\n",
+                strategies[i].name, result.nb_reads, result.nb_bad_reads,
+                times[0], times[1], times[2], times[3],
+                readable ? 100.0 * result.recovered / readable : 100.0,
+                result.limit_reached ? " (limit)" : "");
+        if (strategies[i].read_strategy == ReadStrategy_ePlain)
+            plain = result;
+        else if (strategies[i].read_strategy == ReadStrategy_eMultipass)
+            multipass = result;
+    }
+    return params->check && check_multipass(&plain, &multipass, name);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [scenario=NAME] [map=FILE] [key=value]...\n", argv0);
+    fprintf(stderr, "Runs read strategies of copy procedure on simulated defective disks.\n");
+    fprintf(stderr, "  scenario: all (default)");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        fprintf(stderr, ", %s", scenarios[i]);
+    fprintf(stderr, "\n  map: file with \"LBA sectors\" of unreadable extents per line, instead of scenario\n");
+    for (size_t i = 0; i < sizeof(bench_options) / sizeof(bench_options[0]); i++)
+        fprintf(stderr, "  %s: %s\n", bench_options[i].name, bench_options[i].help);
+}
+
+int main(int argc, char **argv) {
+    BenchParams params = {
+        .size_mb = 8192,
+        .blk_sectors = 256,
+        .skip_blocks = 5000,  // as copy procedure suggests
+        .seed = 1,
+        .rpm = 7200,
+        .outer_track_sectors = 2000,
+        .inner_track_sectors = 1000,
+        .track_seek_us = 1000,
+        .full_seek_us = 15000,
+        .command_us = 50,
+        .error_ms = 2000,
+        .heads = 4,
+        .stripe_sectors = 200000,
+        .clusters = 40,
+        .limit_hours = 0,
+    };
+    const char *scenario = "all";
+    const char *map_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (!eq) {
+            usage(argv[0]);
+            return 1;
+        }
+        size_t name_len = eq - argv[i];
+        const char *value = eq + 1;
+        if (name_len == strlen("scenario") && !strncmp(argv[i], "scenario", name_len)) {
+            scenario = value;
+            continue;
+        }
+        if (name_len == strlen("map") && !strncmp(argv[i], "map", name_len)) {
+            map_path = value;
+            continue;
+        }
+        size_t j;
+        for (j = 0; j < sizeof(bench_options) / sizeof(bench_options[0]); j++)
+            if (strlen(bench_options[j].name) == name_len && !strncmp(argv[i], bench_options[j].name, name_len))
+                break;
+        char *end;
+        int64_t number = strtoll(value, &end, 0);
+        if (j == sizeof(bench_options) / sizeof(bench_options[0]) || !*value || *end || number < 0) {
+            fprintf(stderr, "Invalid option %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+        *(int64_t *)((char *)&params + bench_options[j].offset) = number;
+    }
+    if (!params.size_mb || !params.blk_sectors || !params.rpm || !params.heads || !params.stripe_sectors
+            || !params.inner_track_sectors || params.inner_track_sectors > params.outer_track_sectors) {
+        fprintf(stderr, "Invalid disk model\n");
+        return 1;
+    }
+
+    printf("Model: %"PRId64" rpm, %"PRId64"..%"PRId64" sectors per track, seek %"PRId64"..%"PRId64" us, "
+            "failed read %"PRId64" ms; blk_sectors %"PRId64", skip_blocks %"PRId64"\n",
+            params.rpm, params.outer_track_sectors, params.inner_track_sectors,
+            params.track_seek_us, params.full_seek_us, params.error_ms, params.blk_sectors, params.skip_blocks);
+
+    int found = 0;
+    int check_failed = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]) || map_path; i++) {
+        SimDisk disk = { .nb_sectors = params.size_mb * 2048 };
+        const char *name = map_path ? map_path : scenarios[i];
+        if (map_path) {
+            if (load_map(&disk, map_path))
+                return 1;
+        } else if (!strcmp(scenario, "all") || !strcmp(scenario, name)) {
+            build_scenario(&disk, &params, name);
+        } else {
+            continue;
+        }
+        found = 1;
+        finalize_bad(&disk);
+        check_failed |= run_disk(&disk, &params, name);
+        free(disk.bad);
+        if (map_path)
+            break;
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown scenario %s\n", scenario);
+        usage(argv[0]);
+        return 1;
+    }
+    return check_failed;
+}
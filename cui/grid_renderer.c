@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <curses.h>
+#include <assert.h>
+
+#include "render.h"
+#include "utils.h"
+#include "ncurses_convenience.h"
+#include "procedure.h"
+#include "job.h"
+#include "vis.h"
+
+typedef struct {
+    WINDOW *header;
+    WINDOW **tiles;
+    int nb_tiles;  // may be less than number of jobs on small screen
+
+    // For current speed calculation, per job
+    uint64_t *prev_bytes_processed;
+    struct timespec prev_time;
+    uint64_t *cur_speed;
+
+    pthread_t render_thread;
+    int order_hangup; // if all jobs ended, render final state and end render thread
+} Grid;
+
+/*
+25x80, one tile per job, as many as fit
+
++--------------------------------------------------------------------------------+
+|Read test on 4 devices: 3 running, 1 done, 0 failed               Ctrl+C to abort|
+|sda ST1000DM003-1CH162     sdb WDC WD10EZEX-08WN4A0  sdc ...                     |
+|[#########-------]  45%    [###############-]  93%                               |
+|  123 MB/s E:0   RUNNING     98 MB/s E:12  RUNNING                               |
+|sdd ...                                                                          |
+|                                                                                 |
+| XHDD rev. @EngMoPro                                                            |
++--------------------------------------------------------------------------------+
+*/
+#define TILE_WIDTH 26
+#define TILE_HEIGHT 3
+#define TILE_BAR_WIDTH (TILE_WIDTH - 1 /* spacing */ - 2 /* brackets */ - 5 /* percentage */)
+
+static void render_tile(Grid *priv, WINDOW *tile, DC_Job *job, int job_index) {
+    werase(tile);
+
+    wattrset(tile, COLOR_PAIR(MY_COLOR_WHITE_ON_BLUE));
+    wprintw(tile, "%-*.*s", TILE_WIDTH - 1, TILE_WIDTH - 1, job->dev->dev_fs_name);
+    mvwprintw(tile, 0, strlen(job->dev->dev_fs_name) + 1, "%.*s",
+            (int)(TILE_WIDTH - 2 - strlen(job->dev->dev_fs_name)), job->dev->model_str);
+
+    wattrset(tile, COLOR_PAIR(MY_COLOR_GRAY));
+    uint64_t percent = 0;
+    if (job->progress.den)
+        percent = job->progress.num * 100 / job->progress.den;
+    if (percent > 100)
+        percent = 100;
+    int filled = percent * TILE_BAR_WIDTH / 100;
+    mvwaddch(tile, 1, 0, '[');
+    for (int i = 0; i < TILE_BAR_WIDTH; i++)
+        waddch(tile, i < filled ? '#' : '-');
+    wprintw(tile, "] %3"PRIu64"%%", percent);
+
+    uint64_t speed = job->state == DC_JobState_eRunning ? priv->cur_speed[job_index] : dc_job_avg_speed(job);
+    mvwprintw(tile, 2, 0, "%5"PRIu64" MB/s E:%-4"PRIu64" ", speed / (1024*1024), job->errors_count);
+    int color;
+    switch (job->state) {
+        case DC_JobState_eCompleted:
+            color = job->errors_count ? MY_COLOR_ORANGE : MY_COLOR_GREEN;
+            break;
+        case DC_JobState_eAborted:
+            color = MY_COLOR_ORANGE;
+            break;
+        case DC_JobState_eFailed:
+            color = MY_COLOR_RED;
+            break;
+        default:
+            color = job->errors_count ? MY_COLOR_RED : MY_COLOR_GRAY;
+            break;
+    }
+    wattrset(tile, COLOR_PAIR(color) | A_BOLD);
+    wprintw(tile, "%s", dc_job_state_name(job->state));
+    wnoutrefresh(tile);
+}
+
+static void render_header(Grid *priv, DC_JobEngine *engine) {
+    int nb_by_state[DC_JobState_eFailed + 1] = { 0 };
+    for (DC_Job *job = engine->jobs; job; job = job->next)
+        nb_by_state[job->state]++;
+
+    werase(priv->header);
+    wprintw(priv->header, "%s on %d devices: %d running, %d done, %d failed",
+            engine->jobs ? engine->jobs->procedure->display_name : "",
+            engine->nb_jobs,
+            nb_by_state[DC_JobState_eQueued] + nb_by_state[DC_JobState_eRunning],
+            nb_by_state[DC_JobState_eCompleted] + nb_by_state[DC_JobState_eAborted],
+            nb_by_state[DC_JobState_eFailed]);
+    if (priv->nb_tiles < engine->nb_jobs)
+        wprintw(priv->header, " (%d not shown)", engine->nb_jobs - priv->nb_tiles);
+    if (!priv->order_hangup)
+        mvwprintw(priv->header, 0, COLS - 15, "Ctrl+C to abort");
+    wnoutrefresh(priv->header);
+}
+
+static void render_all(Grid *priv, DC_JobEngine *engine) {
+    struct timespec now;
+    int r = clock_gettime(DC_BEST_CLOCK, &now);
+    assert(!r);
+    uint64_t time_elapsed_ms = now.tv_sec * 1000 + now.tv_nsec / (1000*1000)
+        - priv->prev_time.tv_sec * 1000 - priv->prev_time.tv_nsec / (1000*1000);
+
+    int i = 0;
+    for (DC_Job *job = engine->jobs; job; job = job->next, i++) {
+        uint64_t bytes_processed = job->bytes_processed;
+        if (time_elapsed_ms > 0)
+            priv->cur_speed[i] = (bytes_processed - priv->prev_bytes_processed[i]) * 1000 / time_elapsed_ms;
+        priv->prev_bytes_processed[i] = bytes_processed;
+        if (i < priv->nb_tiles)
+            render_tile(priv, priv->tiles[i], job, i);
+    }
+    priv->prev_time = now;
+    render_header(priv, engine);
+    doupdate();
+}
+
+static void *render_thread_proc(void *arg) {
+    DC_RendererCtx *ctx = arg;
+    Grid *priv = ctx->priv;
+    while (!priv->order_hangup) {
+        render_all(priv, ctx->job_engine);
+        usleep(250000);  // Speed figures are too jumpy on higher rates
+    }
+    render_all(priv, ctx->job_engine);
+    return NULL;
+}
+
+static int Open(DC_RendererCtx *ctx) {
+    Grid *priv = ctx->priv;
+    DC_JobEngine *engine = ctx->job_engine;
+
+    // TODO Raise error message
+    if (LINES < 25 || COLS < 80)
+        return -1;
+
+    priv->header = derwin(stdscr, 1, COLS, 0, 0);
+    assert(priv->header);
+    wbkgd(priv->header, COLOR_PAIR(MY_COLOR_GRAY));
+
+    int tiles_per_row = COLS / TILE_WIDTH;
+    int rows = (LINES - 2 /* header and footer */) / TILE_HEIGHT;
+    priv->nb_tiles = tiles_per_row * rows;
+    if (priv->nb_tiles > engine->nb_jobs)
+        priv->nb_tiles = engine->nb_jobs;
+
+    priv->tiles = calloc(priv->nb_tiles, sizeof(WINDOW*));
+    priv->prev_bytes_processed = calloc(engine->nb_jobs, sizeof(uint64_t));
+    priv->cur_speed = calloc(engine->nb_jobs, sizeof(uint64_t));
+    if (!priv->tiles || !priv->prev_bytes_processed || !priv->cur_speed)
+        return 1; // FIXME leak
+    for (int i = 0; i < priv->nb_tiles; i++) {
+        priv->tiles[i] = derwin(stdscr, TILE_HEIGHT, TILE_WIDTH - 1,
+                1 /* header */ + (i / tiles_per_row) * TILE_HEIGHT, (i % tiles_per_row) * TILE_WIDTH);
+        assert(priv->tiles[i]);
+        wbkgd(priv->tiles[i], COLOR_PAIR(MY_COLOR_GRAY));
+    }
+
+    int r = clock_gettime(DC_BEST_CLOCK, &priv->prev_time);
+    assert(!r);
+    r = pthread_create(&priv->render_thread, NULL, render_thread_proc, ctx);
+    if (r)
+        return r; // FIXME leak
+    return 0;
+}
+
+static int HandleReport(DC_RendererCtx *ctx) {
+    // Job engine accumulates all we display, so there's nothing to do per block
+    (void)ctx;
+    return 0;
+}
+
+static void Close(DC_RendererCtx *ctx) {
+    Grid *priv = ctx->priv;
+
+    priv->order_hangup = 1;
+    pthread_join(priv->render_thread, NULL);
+    wprintw(priv->header, ". Press 'm' for menu");
+    wrefresh(priv->header);
+    beep();
+    while (getchar() != 'm')
+        ;
+    for (int i = 0; i < priv->nb_tiles; i++)
+        delwin(priv->tiles[i]);
+    delwin(priv->header);
+    free(priv->tiles);
+    free(priv->prev_bytes_processed);
+    free(priv->cur_speed);
+    clear_body();
+}
+
+DC_Renderer grid = {
+    .name = "grid",
+    .open = Open,
+    .handle_report = HandleReport,
+    .close = Close,
+    .priv_data_size = sizeof(Grid),
+};
@@ -18,6 +18,7 @@
 #include "vis.h"
 #include "ncurses_convenience.h"
 #include "render.h"
+#include "job.h"
 #include "ui_mutual.h"
 
 // Forward declaration
@@ -26,8 +27,12 @@ void register_procedures(void);  // Register erase and other procedures
 
 static int global_init(void);
 static void global_fini(void);
-static DC_Dev *menu_choose_device(DC_DevList *devlist);
-static DC_Procedure *menu_choose_procedure(DC_Dev *dev);
+static DC_Dev *menu_choose_device(DC_DevList *devlist, int *several_devices);
+static int menu_choose_devices(DC_DevList *devlist, DC_Dev **chosen_devs);
+static DC_Procedure *menu_choose_procedure(DC_Dev *dev, int several_devices);
+static void run_on_several_devices(DC_DevList *devlist);
+
+#define SEVERAL_DEVICES_TAG "*"
 
 static int ask_option_value(DC_Procedure *act, DC_OptionSetting *setting, DC_ProcedureOption *option) {
     int r;
@@ -96,6 +101,58 @@ static int ask_option_value(DC_Procedure *act, DC_OptionSetting *setting, DC_Pro
     return 0;
 }
 
+// Returns 0 if user agrees to run invasive procedure on all given devices
+static int confirm_invasive(DC_Dev **devs, int nb_devs) {
+    int r;
+    char *ask;
+    if (nb_devs == 1) {
+        r = asprintf(&ask, "This operation is invasive and may destroy data. Proceed on %s (%s)?",
+                devs[0]->dev_fs_name, devs[0]->model_str);
+    } else {
+        char dev_names[200] = "";
+        for (int i = 0; i < nb_devs; i++)
+            snprintf(dev_names + strlen(dev_names), sizeof(dev_names) - strlen(dev_names),
+                    "%s%s", i ? ", " : "", devs[i]->dev_fs_name);
+        r = asprintf(&ask, "This operation is invasive and may destroy data. Proceed on %d devices: %s?",
+                nb_devs, dev_names);
+    }
+    assert(r != -1);
+    dialog_vars.default_button = 1;  // Focus on "No"
+    r = dialog_yesno("Confirmation", ask, 0, 0);
+    free(ask);
+    if (r)
+        return r;
+
+    for (int i = 0; i < nb_devs; i++) {
+        if (devs[i]->mounted) {
+            dialog_vars.default_button = 1;
+            r = dialog_yesno("Confirmation", nb_devs == 1 ? "This disk is mounted. Are you really sure?"
+                    : "Some of disks are mounted. Are you really sure?", 0, 0);
+            return r;
+        }
+    }
+    return 0;
+}
+
+// Returns NULL-terminated option settings, or NULL if cancelled
+static DC_OptionSetting *ask_options(DC_Procedure *act, DC_Dev *dev) {
+    int r = 0;
+    DC_OptionSetting *option_set = calloc(act->options_num + 1, sizeof(DC_OptionSetting));
+    assert(option_set);
+    for (int i = 0; i < act->options_num; i++) {
+        option_set[i].name = act->options[i].name;
+        r = act->suggest_default_value(dev, &option_set[i]);
+        if (r) break;
+        r = ask_option_value(act, &option_set[i], &act->options[i]);
+        if (r) break;
+    }
+    if (r) {
+        free(option_set);
+        return NULL;
+    }
+    return option_set;
+}
+
 int main() {
     int r;
 
@@ -114,39 +171,25 @@ int main() {
 
     while (1) {
         // Draw menu of device choice
-        DC_Dev *chosen_dev = menu_choose_device(devlist);
+        int several_devices = 0;
+        DC_Dev *chosen_dev = menu_choose_device(devlist, &several_devices);
+        if (several_devices) {
+            run_on_several_devices(devlist);
+            continue;
+        }
         if (!chosen_dev) break;
 
         // Draw procedures menu
-        DC_Procedure *act = menu_choose_procedure(chosen_dev);
+        DC_Procedure *act = menu_choose_procedure(chosen_dev, 0);
         if (!act) continue;
 
         if (act->flags & DC_PROC_FLAG_INVASIVE) {
-            char *ask;
-            r = asprintf(&ask, "This operation is invasive and may destroy data. Proceed on %s (%s)?",
-                    chosen_dev->dev_fs_name, chosen_dev->model_str);
-            assert(r != -1);
-            dialog_vars.default_button = 1;  // Focus on "No"
-            r = dialog_yesno("Confirmation", ask, 0, 0);
-            free(ask);
+            r = confirm_invasive(&chosen_dev, 1);
             if (r) continue;
-
-            if (chosen_dev->mounted) {
-                dialog_vars.default_button = 1;
-                r = dialog_yesno("Confirmation", "This disk is mounted. Are you really sure?", 0, 0);
-                if (r) continue;
-            }
         }
 
-        DC_OptionSetting *option_set = calloc(act->options_num + 1, sizeof(DC_OptionSetting));
-        for (int i = 0; i < act->options_num; i++) {
-            option_set[i].name = act->options[i].name;
-            r = act->suggest_default_value(chosen_dev, &option_set[i]);
-            if (r) break;
-            r = ask_option_value(act, &option_set[i], &act->options[i]);
-            if (r) break;
-        }
-        if (r) continue;
+        DC_OptionSetting *option_set = ask_options(act, chosen_dev);
+        if (!option_set) continue;
 
         if (!strcmp(act->name, "copy")) {
             int uses_journal = 0;
@@ -177,6 +220,46 @@ int main() {
     return 0;
 }
 
+static void run_on_several_devices(DC_DevList *devlist) {
+    int r;
+    DC_Dev *chosen_devs[dc_dev_list_size(devlist)];
+    int nb_chosen = menu_choose_devices(devlist, chosen_devs);
+    if (nb_chosen <= 0)
+        return;
+
+    // Offer only procedures which every chosen device supports, and suggest values for the least capable one
+    DC_Dev *least_capable_dev = chosen_devs[0];
+    for (int i = 0; i < nb_chosen; i++)
+        if (!chosen_devs[i]->ata_capable)
+            least_capable_dev = chosen_devs[i];
+
+    DC_Procedure *act = menu_choose_procedure(least_capable_dev, 1);
+    if (!act)
+        return;
+
+    if (act->flags & DC_PROC_FLAG_INVASIVE) {
+        r = confirm_invasive(chosen_devs, nb_chosen);
+        if (r)
+            return;
+    }
+
+    DC_OptionSetting *option_set = ask_options(act, least_capable_dev);
+    if (!option_set)
+        return;
+
+    clear_body();
+
+    DC_JobEngine *engine = dc_job_engine_new();
+    assert(engine);
+    for (int i = 0; i < nb_chosen; i++) {
+        DC_Job *job = dc_job_engine_add(engine, act, chosen_devs[i], option_set);
+        assert(job);
+    }
+    if (act->perform)
+        render_jobs(engine, dc_find_renderer("grid"));
+    dc_job_engine_free(engine);
+}
+
 static int global_init(void) {
     int r;
     setlocale(LC_ALL, "");
@@ -197,6 +280,7 @@ static int global_init(void) {
     assert(!r);
     RENDERER_REGISTER(sliding_window);
     RENDERER_REGISTER(whole_space);
+    RENDERER_REGISTER(grid);
     dc_log_set_callback(log_cb, NULL);
 
     r = atexit(global_fini);
@@ -209,14 +293,15 @@ static void global_fini(void) {
     endwin();
 }
 
-static DC_Dev *menu_choose_device(DC_DevList *devlist) {
+static DC_Dev *menu_choose_device(DC_DevList *devlist, int *several_devices) {
     int devs_num = dc_dev_list_size(devlist);
     if (devs_num == 0) {
         dialog_msgbox("Info", "No devices found", 0, 0, 1);
         return NULL;
     }
 
-    char *items[2 * devs_num];
+    int items_num = devs_num > 1 ? devs_num + 1 : devs_num;
+    char *items[2 * items_num];
     for (int i = 0; i < devs_num; i++) {
         DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
         char dev_descr_buf[80];
@@ -224,19 +309,28 @@ static DC_Dev *menu_choose_device(DC_DevList *devlist) {
         items[2*i] = dev->dev_fs_name;
         items[2*i+1] = strdup(dev_descr_buf);
     }
+    if (items_num > devs_num) {
+        items[2*devs_num] = SEVERAL_DEVICES_TAG;
+        items[2*devs_num+1] = strdup("Run on several devices at once");
+    }
 
     clear_body();
     dialog_vars.no_items = 0;
     dialog_vars.item_help = 0;
     dialog_vars.input_result = NULL;
     dialog_vars.default_button = 0;
-    int ret = dialog_menu("Choose device", "", 0, 0, 0, devs_num, items);
+    int ret = dialog_menu("Choose device", "", 0, 0, 0, items_num, items);
 
-    for (int i = 0; i < devs_num; i++)
+    for (int i = 0; i < items_num; i++)
         free(items[2*i+1]);
 
     if (ret != 0) return NULL;
 
+    if (!strcmp(dialog_vars.input_result, SEVERAL_DEVICES_TAG)) {
+        *several_devices = 1;
+        return NULL;
+    }
+
     for (int i = 0; i < devs_num; i++) {
         DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
         if (!strcmp(dev->dev_fs_name, dialog_vars.input_result))
@@ -246,8 +340,50 @@ static DC_Dev *menu_choose_device(DC_DevList *devlist) {
     return NULL;
 }
 
-static DC_Procedure *menu_choose_procedure(DC_Dev *dev) {
-    (void)dev;
+// Fills chosen_devs, which must fit all devices of list. Returns number of chosen devices, -1 if cancelled
+static int menu_choose_devices(DC_DevList *devlist, DC_Dev **chosen_devs) {
+    int devs_num = dc_dev_list_size(devlist);
+    int items_table_cols = 3;
+    char *items[items_table_cols * devs_num];
+    for (int i = 0; i < devs_num; i++) {
+        DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
+        char dev_descr_buf[80];
+        ui_dev_descr_format(dev_descr_buf, sizeof(dev_descr_buf), dev);
+        items[items_table_cols*i] = dev->dev_fs_name;
+        items[items_table_cols*i+1] = strdup(dev_descr_buf);
+        items[items_table_cols*i+2] = dev->mounted ? "off" : "on";
+    }
+
+    clear_body();
+    dialog_vars.no_items = 0;
+    dialog_vars.item_help = 0;
+    dialog_vars.input_result = NULL;
+    dialog_vars.default_button = 0;
+    int ret = dialog_checklist("Choose devices", "Procedure will run on all chosen devices at once",
+            0, 0, 0, devs_num, items, FLAG_CHECK);
+
+    for (int i = 0; i < devs_num; i++)
+        free(items[items_table_cols*i+1]);
+
+    if (ret != 0) return -1;
+
+    // Result is list of tags separated by spaces, possibly quoted
+    int nb_chosen = 0;
+    char *saveptr;
+    for (char *tag = strtok_r(dialog_vars.input_result, " \"\n", &saveptr); tag;
+            tag = strtok_r(NULL, " \"\n", &saveptr)) {
+        for (int i = 0; i < devs_num; i++) {
+            DC_Dev *dev = dc_dev_list_get_entry(devlist, i);
+            if (!strcmp(dev->dev_fs_name, tag)) {
+                chosen_devs[nb_chosen++] = dev;
+                break;
+            }
+        }
+    }
+    return nb_chosen;
+}
+
+static DC_Procedure *menu_choose_procedure(DC_Dev *dev, int several_devices) {
     int nb_procedures = dc_get_nb_procedures();
     const char *items[nb_procedures];
     DC_Procedure *procedures[nb_procedures];
@@ -257,6 +393,9 @@ static DC_Procedure *menu_choose_procedure(DC_Dev *dev) {
     while ((procedure = dc_get_next_procedure(procedure))) {
         if (!dev->ata_capable && (procedure->flags & DC_PROC_FLAG_REQUIRES_ATA))
             continue;
+        // Jobs share options, so they would write to the same destination
+        if (several_devices && (procedure->flags & DC_PROC_FLAG_DESTINATION))
+            continue;
         items[nb_items] = procedure->display_name;
         procedures[nb_items] = procedure;
         nb_items++;
@@ -33,6 +33,7 @@ typedef struct {
     uint64_t bytes_processed;
     uint64_t avg_processing_speed;
     uint64_t eta_time; // estimated time
+    uint64_t reports_handled;
     uint64_t cur_lba;
 
     pthread_t render_thread;
@@ -115,14 +116,7 @@ static void render_update_vis(SlidingWindow *priv, blk_report_t *rep) {
     else
     {
         print_vis(priv->vis, choose_vis(rep->report.blk_access_time));
-        unsigned int i;
-        for (i = 0; i < 5; i++)
-            if (rep->report.blk_access_time < bs_vis[i].access_time) {
-                priv->access_time_stats_accum[i]++;
-                break;
-            }
-        if (i == 5)
-            priv->access_time_stats_accum[5]++; // of exceed
+        priv->access_time_stats_accum[choose_vis_index(rep->report.blk_access_time)]++;
     }
     wnoutrefresh(priv->vis);
 }
@@ -265,11 +259,12 @@ static int HandleReport(DC_RendererCtx *ctx) {
     priv->bytes_processed += actctx->report.sectors_processed * 512;
     priv->cur_lba = actctx->report.lba + actctx->report.sectors_processed;
 
-    if (actctx->progress.num == 1) {  // TODO fix priv hack
+    priv->reports_handled++;
+    if (priv->reports_handled == 1) {  // TODO fix priv hack
         r = clock_gettime(DC_BEST_CLOCK, &priv->start_time);
         assert(!r);
     } else {
-        if ((actctx->progress.num % 10) == 0) {
+        if ((priv->reports_handled % 10) == 0) {
             struct timespec now;
             r = clock_gettime(DC_BEST_CLOCK, &now);
             assert(!r);
@@ -277,11 +272,11 @@ static int HandleReport(DC_RendererCtx *ctx) {
                 - priv->start_time.tv_sec * 1000 - priv->start_time.tv_nsec / (1000*1000);
             if (time_elapsed_ms > 0) {
                 priv->avg_processing_speed = priv->bytes_processed * 1000 / time_elapsed_ms; // Byte/s
-                // capacity / speed = total_time
-                // total_time = elapsed + eta
-                // eta = total_time - elapsed
-                // eta = capacity / speed  -  elapsed
-                priv->eta_time = actctx->dev->capacity / priv->avg_processing_speed - time_elapsed_ms / 1000;
+                // Progress units differ between procedures (sectors, time), so extrapolate the progress rate
+                // eta = elapsed * (den - num) / num
+                if (actctx->progress.num && actctx->progress.num < actctx->progress.den)
+                    priv->eta_time = (double)time_elapsed_ms * (actctx->progress.den - actctx->progress.num)
+                        / actctx->progress.num / 1000;
 
             }
         }
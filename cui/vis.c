@@ -28,12 +28,17 @@ void init_my_colors(void) {
     init_pair(MY_COLOR_YELLOW, COLOR_YELLOW, COLOR_BLACK);
 }
 
-vis_t choose_vis(uint64_t access_time) {
+unsigned int choose_vis_index(uint64_t access_time) {
     unsigned int i;
-    for (i = 0; i < sizeof(bs_vis)/sizeof(*bs_vis); i++)
+    for (i = 0; i < BS_VIS_NUM; i++)
         if (access_time < bs_vis[i].access_time)
-            return bs_vis[i];
-    return exceed_vis;
+            break;
+    return i;
+}
+
+vis_t choose_vis(uint64_t access_time) {
+    unsigned int i = choose_vis_index(access_time);
+    return i < BS_VIS_NUM ? bs_vis[i] : exceed_vis;
 }
 
 
@@ -48,7 +53,7 @@ void print_vis(WINDOW *win, vis_t vis) {
 
 void show_legend(WINDOW *win) {
     unsigned int i;
-    for (i = 0; i < sizeof(bs_vis)/sizeof(*bs_vis); i++) {
+    for (i = 0; i < BS_VIS_NUM; i++) {
         print_vis(win, bs_vis[i]);
         wattrset(win, A_NORMAL);
         wprintw(win, " <%"PRIu64"ms\n", bs_vis[i].access_time / 1000);
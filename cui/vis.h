@@ -21,11 +21,14 @@ typedef struct vis_t {
     int color_pair;
 } vis_t;
 
-extern vis_t bs_vis[];
+#define BS_VIS_NUM 5
+extern vis_t bs_vis[BS_VIS_NUM];
 extern vis_t exceed_vis;
 extern vis_t error_vis[]; // 0th is unused, rest go as in enum
 
 void init_my_colors(void);
+// Index in bs_vis, or BS_VIS_NUM if access time exceeds all of them
+unsigned int choose_vis_index(uint64_t access_time);
 vis_t choose_vis(uint64_t access_time);
 void print_vis(WINDOW *win, vis_t vis);
 void show_legend(WINDOW *win);
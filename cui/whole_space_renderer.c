@@ -158,14 +158,7 @@ static void update_blocks_info(WholeSpace *priv, blk_report_t *rep) {
     else
     {
         *map_pointer = 1;  //block processed successfully
-        unsigned int i;
-        for (i = 0; i < 5; i++)
-            if (rep->report.blk_access_time < bs_vis[i].access_time) {
-                priv->access_time_stats_accum[i]++;
-                break;
-            }
-        if (i == 5)
-            priv->access_time_stats_accum[5]++; // of exceed
+        priv->access_time_stats_accum[choose_vis_index(rep->report.blk_access_time)]++;
         priv->read_ok_count += rep->report.sectors_processed;
     }
     priv->unread_count -= rep->report.sectors_processed;
@@ -276,27 +269,24 @@ static int Open(DC_RendererCtx *ctx) {
     priv->sectors_per_block = actctx->blk_size / 512;
     priv->blocks_map = calloc(priv->nb_blocks, sizeof(uint8_t));
     assert(priv->blocks_map);
-    int journal_fd = ((CopyPriv*)actctx->priv)->journal_fd;
-    lseek(journal_fd, 0, SEEK_SET);
-    if (((CopyPriv*)actctx->priv)->use_journal) {
+    CopyPriv *copy_priv = actctx->priv;
+    if (copy_priv->use_journal) {
+        DC_CopyJournal *journal = &copy_priv->journal;
+        uint64_t extent_index = 0;
         priv->unread_count = 0;
-        uint8_t journal_chunk[1*1024*1024];
-        int64_t chunklen;
-        int64_t end_lba = ((CopyPriv*)actctx->priv)->end_lba;
         for (int64_t i = 0; i < priv->nb_blocks; i++) {
-            int64_t lba = i * priv->sectors_per_block;
-            if (lba % sizeof(journal_chunk) == 0) {
-                chunklen = (end_lba - lba) < (int64_t)sizeof(journal_chunk) ? (end_lba - lba) : (int64_t)sizeof(journal_chunk);
-                int ret = read(journal_fd, journal_chunk, chunklen);
-                if (ret != chunklen)
-                    return 1;
-            }
-            char sector_status = journal_chunk[lba % sizeof(journal_chunk)];
+            uint64_t lba = i * priv->sectors_per_block;
+            // Blocks are shown by status of their first sector
+            while (extent_index < journal->nb_extents && journal->extents[extent_index].end_lba <= lba)
+                extent_index++;
+            SectorStatus sector_status = SectorStatus_eUnread;
+            if (extent_index < journal->nb_extents && journal->extents[extent_index].begin_lba <= lba)
+                sector_status = journal->extents[extent_index].status;
             priv->blocks_map[i] = sector_status;
             int sectors_in_block = priv->sectors_per_block;
             if (i == priv->nb_blocks - 1)  // Last block may be smaller
                 sectors_in_block = (actctx->dev->capacity % actctx->blk_size) / 512;
-            switch ((enum SectorStatus)sector_status) {
+            switch (sector_status) {
                 case SectorStatus_eUnread:
                     priv->unread_count += sectors_in_block;
                     break;
@@ -307,6 +297,9 @@ static int Open(DC_RendererCtx *ctx) {
                 case SectorStatus_eSectorReadError:
                     priv->errors_count += sectors_in_block;
                     break;
+                case SectorStatus_eSkipped:
+                    // Free space of file system, shown as done but not counted as copied
+                    break;
             }
         }
     }
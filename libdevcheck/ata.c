@@ -26,3 +26,12 @@ void prepare_ata_command(AtaCommand *cmd_buffer, int cmd, uint64_t lba, int size
     cmd_buffer->task.req_cmd = IDE_DRIVE_TASK_NO_DATA;
 }
 
+
+void prepare_ata_fpdma_command(AtaCommand *cmd_buffer, int cmd, uint64_t lba, int size_in_sectors) {
+    // NCQ commands carry sector count in FEATURE registers; COUNT holds the tag, which is assigned by kernel
+    prepare_ata_command(cmd_buffer, cmd, lba, 0);
+    task_struct_t *io_ports = (task_struct_t*)&cmd_buffer->task.io_ports;
+    hob_struct_t *hob_ports = (hob_struct_t*)&cmd_buffer->task.hob_ports;
+    io_ports->feature  = size_in_sectors & 0x00ff;
+    hob_ports->feature = (size_in_sectors >> 8) & 0x00ff;
+}
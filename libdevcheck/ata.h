@@ -10,7 +10,10 @@ typedef struct ata_command {
     // Because you need buffer right below `task`.
 } AtaCommand;
 
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+
 void prepare_ata_command(AtaCommand *cmd_buffer, int cmd, uint64_t lba, int size_in_sectors);
+void prepare_ata_fpdma_command(AtaCommand *cmd_buffer, int cmd, uint64_t lba, int size_in_sectors);
 
 #endif  // ATA_H
 
@@ -15,6 +15,7 @@
 #include "procedure.h"
 #include "scsi.h"
 #include "copy.h"
+#include "utils.h"
 
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     (void)dev;
@@ -25,344 +26,768 @@ static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
             setting->value = strdup("posix");
     } else if (!strcmp(setting->name, "read_strategy")) {
         setting->value = strdup("smart_noreverse");
+    } else if (!strcmp(setting->name, "bulk_strategy")) {
+        setting->value = strdup("smart_noreverse");
+    } else if (!strcmp(setting->name, "priority_file")) {
+        setting->value = strdup("");
     } else if (!strcmp(setting->name, "dst_file")) {
         setting->value = strdup("/dev/null");
     } else if (!strcmp(setting->name, "use_journal")) {
         setting->value = strdup("yes");
+    } else if (!strcmp(setting->name, "dst_format")) {
+        setting->value = strdup("raw");
+    } else if (!strcmp(setting->name, "dst_direct")) {
+        setting->value = strdup("yes");
+    } else if (!strcmp(setting->name, "sparse")) {
+        setting->value = strdup("yes");
+    } else if (!strcmp(setting->name, "zero_out_blockdev")) {
+        setting->value = strdup("no");
+    } else if (!strcmp(setting->name, "hash")) {
+        setting->value = strdup("no");
+    } else if (!strcmp(setting->name, "fs_aware")) {
+        setting->value = strdup("no");
+    } else if (!strcmp(setting->name, "journal_commit_seconds")) {
+        setting->value = strdup("5");
+    } else if (!strcmp(setting->name, "journal_commit_mb")) {
+        setting->value = strdup("256");
     } else if (!strcmp(setting->name, "skip_blocks")) {
         setting->value = strdup("5000");
+    } else if (!strcmp(setting->name, "queue_depth")) {
+        setting->value = strdup("1");
+    } else if (!strcmp(setting->name, "blk_sectors")) {
+        setting->value = strdup(DC_STRINGIFY(DC_DEFAULT_BLK_SECTORS));
+    } else if (!strcmp(setting->name, "write_buffers")) {
+        setting->value = strdup("16");
     } else {
         return 1;
     }
     return 0;
 }
 
-static void append_zone(CopyPriv *priv, Zone *current_zone) {
-    if (!priv->unread_zones) {
-        priv->unread_zones = current_zone;
-    } else {
-        Zone *last_zone = priv->unread_zones;
-        while (last_zone->next)
-            last_zone = last_zone->next;
-        last_zone->next = current_zone;
+static void journal_mark(CopyPriv *priv, int64_t lba, size_t sectors, SectorStatus sector_status) {
+    int r = dc_copy_journal_mark(&priv->journal, lba, sectors, sector_status);
+    if (r)
+        dc_log(DC_LOG_ERROR, "Failed to update journal\n");
+}
+
+static int sync_destination(void *opaque) {
+    CopyPriv *priv = opaque;
+    int r = 0;
+    for (int i = 0; i < priv->nb_dsts; i++) {
+        CopyDestination *dest = &priv->dsts[i];
+        // Failed destination isn't going to be complete anyway
+        if (__atomic_load_n(&dest->failed, __ATOMIC_RELAXED))
+            continue;
+        if (priv->use_image) {
+            r |= dc_image_sync(&dest->image);
+            continue;
+        }
+        // Syncing is not supported by some files, like /dev/null, which is fine
+        if (fdatasync(dest->dst.fd) && errno != EINVAL) {
+            dc_log(DC_LOG_ERROR, "Failed to sync destination %s, errno %d\n", dest->path, errno);
+            r = 1;
+        }
     }
-    //fprintf(stderr, "appending %dth zone - begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", priv->nb_zones, current_zone->begin_lba, current_zone->end_lba, current_zone->begin_lba_defective, current_zone->end_lba_defective);
-    priv->nb_zones++;
+    return r;
 }
 
-static int Open(DC_ProcedureCtx *ctx) {
-    int r;
-    CopyPriv *priv = ctx->priv;
+static ssize_t image_read(void *opaque, void *buf, size_t size, uint64_t offset) {
+    return dc_image_pread(opaque, buf, size, offset);
+}
 
-    // Setting context
-    if (!strcmp(priv->api_str, "ata")) {
-        priv->api = Api_eAta;
-    } else if (!strcmp(priv->api_str, "posix")) {
-        priv->api = Api_ePosix;
-    } else {
+static CopyPendingBlock *pending_block(CopyPriv *priv, uint64_t index) {
+    // One slot more than write_buffers: writer may fail after it was checked, and get one more block then
+    return &priv->pending[index % (priv->write_buffers + 1)];
+}
+
+// Blocks are marked as read only when all destinations which haven't failed have them.
+// Once all destinations have failed, blocks not marked yet are dropped, so that they are copied again on resume
+static void pending_advance_locked(CopyPriv *priv) {
+    int nb_active = 0;
+    for (int i = 0; i < priv->nb_dsts; i++)
+        if (!priv->dsts[i].failed)
+            nb_active++;
+    if (!nb_active) {
+        priv->pending_head = priv->pending_tail;
+        return;
+    }
+    while (priv->pending_head != priv->pending_tail) {
+        for (int i = 0; i < priv->nb_dsts; i++)
+            if (!priv->dsts[i].failed && priv->dsts[i].nb_done <= priv->pending_head)
+                return;
+        CopyPendingBlock *block = pending_block(priv, priv->pending_head);
+        if (priv->use_journal)
+            journal_mark(priv, block->lba, block->sectors, SectorStatus_eReadOk);
+        priv->pending_head++;
+    }
+}
+
+static void destination_block_written(void *opaque, int64_t lba, size_t sectors, const void *buf) {
+    CopyDestination *dest = opaque;
+    CopyPriv *priv = dest->priv;
+    if (priv->use_hash && dest == &priv->dsts[0])
+        dc_merkle_add_block(&priv->merkle, lba, sectors, buf);
+    pthread_mutex_lock(&priv->pending_mutex);
+    dest->nb_done++;
+    pending_advance_locked(priv);
+    pthread_mutex_unlock(&priv->pending_mutex);
+}
+
+// Copying goes on to other destinations; blocks are marked as read once they have them
+static void destination_failed(CopyPriv *priv, CopyDestination *dest, const char *reason) {
+    dc_log(DC_LOG_ERROR, "%s, copying to %s is stopped\n", reason, dest->path);
+    pthread_mutex_lock(&priv->pending_mutex);
+    __atomic_store_n(&dest->failed, 1, __ATOMIC_RELAXED);
+    pending_advance_locked(priv);
+    pthread_mutex_unlock(&priv->pending_mutex);
+}
+
+// Stops copying to destinations which failed or can't take block ending at end_lba. Returns 1 if none is left
+static int check_destinations(CopyPriv *priv, int64_t end_lba) {
+    int nb_active = 0;
+    for (int i = 0; i < priv->nb_dsts; i++) {
+        CopyDestination *dest = &priv->dsts[i];
+        if (dest->failed)
+            continue;
+        if (dest->end_lba && end_lba > dest->end_lba)
+            destination_failed(priv, dest, "Destination is smaller than source");
+        else if (priv->use_writer && dc_copy_writer_failed(&dest->writer))
+            destination_failed(priv, dest, "Writing to destination failed");
+        else
+            nb_active++;
+    }
+    if (!nb_active)
+        dc_log(DC_LOG_FATAL, "Writing to all destinations failed\n");
+    return !nb_active;
+}
+
+// Block is read into buffer of first destination which hasn't failed; others get copies of it
+static void queue_block(CopyPriv *priv, CopyDestination *first, void *buf, int64_t lba, size_t sectors) {
+    void *bufs[COPY_MAX_DESTINATIONS];
+    // Ring of pending blocks can't overflow as long as every destination has a buffer for block
+    for (CopyDestination *dest = first + 1; dest < &priv->dsts[priv->nb_dsts]; dest++)
+        if (!dest->failed)
+            bufs[dest - priv->dsts] = dc_copy_writer_get_buffer(&dest->writer);
+    pthread_mutex_lock(&priv->pending_mutex);
+    assert(priv->pending_tail - priv->pending_head <= (uint64_t)priv->write_buffers);
+    *pending_block(priv, priv->pending_tail++) = (CopyPendingBlock){ lba, sectors };
+    pthread_mutex_unlock(&priv->pending_mutex);
+    for (CopyDestination *dest = first + 1; dest < &priv->dsts[priv->nb_dsts]; dest++) {
+        if (dest->failed)
+            continue;
+        memcpy(bufs[dest - priv->dsts], buf, sectors * 512);
+        dc_copy_writer_queue(&dest->writer, bufs[dest - priv->dsts], lba, sectors);
+    }
+    dc_copy_writer_queue(&first->writer, buf, lba, sectors);
+}
+
+static int write_destination(CopyDestination *dest, int64_t lba, size_t sectors, void *buf, int zero) {
+    if (dest->priv->use_image)
+        return dc_image_write(&dest->image, lba, sectors, buf);
+    // Zeros are deallocated on destination instead of writing, if that works
+    if (zero && dest->use_sparse && !dc_sparse_dst_zero(&dest->sparse, lba, sectors))
+        return 0;
+    struct iovec iov = { buf, sectors * 512 };
+    return dc_dst_io_pwritev(&dest->dst, &iov, 1, lba * 512);
+}
+
+static int open_raw_destination(CopyPriv *priv, CopyDestination *dest) {
+    // Destination is read back to hash chunks which weren't hashed while copied
+    if (dc_dst_io_open(&dest->dst, dest->path, (priv->use_hash ? O_RDWR : O_WRONLY) | O_LARGEFILE | O_NOATIME | O_CREAT,
+                !strcmp(priv->dst_direct_str, "yes")))
         return 1;
+
+    dest->use_sparse = priv->use_sparse;
+    if (dest->use_sparse && dc_sparse_dst_open(&dest->sparse, dest->dst.fd, priv->use_zero_out_blockdev)) {
+        dc_log(DC_LOG_DEBUG, "Destination %s can't be sparse, zeros will be written\n", dest->path);
+        dest->use_sparse = 0;
     }
+    // Regular file is given size of source at once, so that it doesn't get fragmented as it grows
+    if (dc_dst_io_preallocate(&dest->dst, priv->end_lba * 512, dest->use_sparse))
+        dc_log(DC_LOG_WARNING, "File system of destination %s has no space for whole copy\n", dest->path);
 
-    if (priv->api == Api_eAta && !ctx->dev->ata_capable)
+    off_t dst_size = lseek(dest->dst.fd, 0, SEEK_END);
+    if (dst_size == -1) {
+        dc_dst_io_close(&dest->dst);
+        return 1;
+    }
+    dest->end_lba = dst_size / 512;
+    if (dest->end_lba && (dest->end_lba < priv->end_lba))
+        dc_log(DC_LOG_WARNING, "Size of destination %s (%"PRId64" bytes) is less than of source disk (%"PRId64" bytes). Copying to it will stop with error when exceeding space will be reached.\n", dest->path, dest->end_lba * 512, priv->end_lba * 512);
+    return 0;
+}
+
+static int open_destination(CopyPriv *priv, CopyDestination *dest) {
+    int r;
+    dest->priv = priv;
+    if (priv->use_image)
+        r = dc_image_open(&dest->image, dest->path, priv->end_lba, 1);
+    else
+        r = open_raw_destination(priv, dest);
+    if (r)
+        dc_log(DC_LOG_FATAL, "open %s fail\n", dest->path);
+    return r;
+}
+
+static void close_destination(CopyPriv *priv, CopyDestination *dest) {
+    if (priv->use_image)
+        dc_image_close(&dest->image);
+    else
+        dc_dst_io_close(&dest->dst);
+}
+
+static int add_skipped(DC_CopyJournalExtent **skipped, uint64_t *nb_skipped, uint64_t *allocated, uint64_t begin_lba, uint64_t end_lba) {
+    if (begin_lba >= end_lba)
+        return 0;
+    if (*nb_skipped == *allocated) {
+        uint64_t new_allocated = *allocated ? *allocated * 2 : 1024;
+        DC_CopyJournalExtent *extents = realloc(*skipped, new_allocated * sizeof(*extents));
+        if (!extents)
+            return 1;
+        *skipped = extents;
+        *allocated = new_allocated;
+    }
+    (*skipped)[(*nb_skipped)++] = (DC_CopyJournalExtent){ begin_lba, end_lba, SectorStatus_eSkipped, 0 };
+    return 0;
+}
+
+// Lists free space of file systems on source which journal doesn't cover yet, and marks it skipped in journal
+static int skip_free_space(CopyPriv *priv, DC_CopyJournalExtent **skipped, uint64_t *nb_skipped) {
+    DC_CopyJournal *journal = &priv->journal;
+    DC_FsMap *map = &priv->fs_map;
+    uint64_t allocated = 0;
+    uint64_t skipped_sectors = 0;
+
+    for (uint64_t i = 0; i < map->nb_free; i++) {
+        uint64_t begin_lba = map->free[i].begin_lba > (uint64_t)priv->start_lba ? map->free[i].begin_lba : (uint64_t)priv->start_lba;
+        uint64_t end_lba = map->free[i].end_lba;
+        // Sectors which journal has status of are not skipped: they may be copied or failed already
+        uint64_t j = priv->use_journal ? dc_copy_journal_find(journal, begin_lba) : 0;
+        for (; priv->use_journal && j < journal->nb_extents && journal->extents[j].begin_lba < end_lba; j++) {
+            if (add_skipped(skipped, nb_skipped, &allocated, begin_lba, journal->extents[j].begin_lba))
+                goto fail;
+            if (journal->extents[j].end_lba > begin_lba)
+                begin_lba = journal->extents[j].end_lba;
+        }
+        if (add_skipped(skipped, nb_skipped, &allocated, begin_lba, end_lba))
+            goto fail;
+    }
+
+    for (uint64_t i = 0; i < *nb_skipped; i++) {
+        skipped_sectors += (*skipped)[i].end_lba - (*skipped)[i].begin_lba;
+        if (priv->use_journal && dc_copy_journal_mark(journal, (*skipped)[i].begin_lba,
+                    (*skipped)[i].end_lba - (*skipped)[i].begin_lba, SectorStatus_eSkipped))
+            goto fail_journal;
+    }
+    if (priv->use_journal && *nb_skipped && dc_copy_journal_commit(journal))
+        goto fail_journal;
+    dc_log(DC_LOG_INFO, "%"PRIu64" MiB of free space of file systems are skipped\n", skipped_sectors / 2048);
+    return 0;
+
+fail:
+    dc_log(DC_LOG_FATAL, "Failed to allocate map of free space\n");
+    free(*skipped);
+    return 1;
+fail_journal:
+    dc_log(DC_LOG_FATAL, "Failed to update journal\n");
+    free(*skipped);
+    return 1;
+}
+
+// Skipped free space is deallocated on destinations which are sparse, so that it reads as zeros there
+static void zero_skipped_space(CopyPriv *priv, DC_CopyJournalExtent *skipped, uint64_t nb_skipped) {
+    if (priv->use_image || !nb_skipped)
+        return;
+    for (int i = 0; i < priv->nb_dsts; i++) {
+        CopyDestination *dest = &priv->dsts[i];
+        uint64_t j;
+        for (j = 0; dest->use_sparse && j < nb_skipped; j++)
+            if (dc_sparse_dst_zero(&dest->sparse, skipped[j].begin_lba, skipped[j].end_lba - skipped[j].begin_lba))
+                break;
+        if (j < nb_skipped)
+            dc_log(DC_LOG_WARNING, "Skipped free space keeps former contents of destination %s\n", dest->path);
+        // Only zeros of copied blocks are reported on closing
+        dest->sparse.zeroed_bytes = 0;
+    }
+}
+
+static int compare_fs_extents(const void *a, const void *b) {
+    const DC_FsExtent *x = a;
+    const DC_FsExtent *y = b;
+    return x->begin_lba < y->begin_lba ? -1 : x->begin_lba > y->begin_lba;
+}
+
+/**
+ * Reads priority extents: each line is first LBA and number of sectors, e.g. converted from FIEMAP
+ * of files which are needed most. Empty lines and lines starting with '#' are skipped
+ */
+static int load_priority_extents(CopyPriv *priv) {
+    FILE *file = fopen(priv->priority_file, "r");
+    char line[256];
+    uint64_t allocated = 0;
+    unsigned line_no = 0;
+    if (!file) {
+        dc_log(DC_LOG_FATAL, "Failed to open priority file %s\n", priv->priority_file);
         return 1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        uint64_t lba, sectors;
+        char tail;
+        line_no++;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+            continue;
+        if (sscanf(line, "%"SCNu64" %"SCNu64" %c", &lba, &sectors, &tail) != 2 || !sectors
+                || lba >= (uint64_t)priv->end_lba || sectors > priv->end_lba - lba) {
+            dc_log(DC_LOG_FATAL, "Line %u of priority file is not an extent within device\n", line_no);
+            goto fail;
+        }
+        if (priv->nb_priority_extents == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            DC_FsExtent *extents = realloc(priv->priority_extents, allocated * sizeof(*extents));
+            if (!extents)
+                goto fail;
+            priv->priority_extents = extents;
+        }
+        priv->priority_extents[priv->nb_priority_extents++] = (DC_FsExtent){ lba, lba + sectors };
+    }
+    fclose(file);
+
+    // Extents are read in LBA order, not to seek back and forth
+    qsort(priv->priority_extents, priv->nb_priority_extents, sizeof(DC_FsExtent), compare_fs_extents);
+    uint64_t nb_merged = 0;
+    uint64_t sectors = 0;
+    for (uint64_t i = 0; i < priv->nb_priority_extents; i++) {
+        DC_FsExtent *extent = &priv->priority_extents[i];
+        if (nb_merged && priv->priority_extents[nb_merged - 1].end_lba >= extent->begin_lba) {
+            if (priv->priority_extents[nb_merged - 1].end_lba < extent->end_lba)
+                priv->priority_extents[nb_merged - 1].end_lba = extent->end_lba;
+        } else {
+            priv->priority_extents[nb_merged++] = *extent;
+        }
+    }
+    priv->nb_priority_extents = nb_merged;
+    for (uint64_t i = 0; i < nb_merged; i++)
+        sectors += priv->priority_extents[i].end_lba - priv->priority_extents[i].begin_lba;
+    dc_log(DC_LOG_INFO, "%"PRIu64" priority extents of %"PRIu64" MiB are read first\n", nb_merged, sectors / 2048);
+    return 0;
 
-    if (!strcmp(priv->read_strategy_str, "smart")) {
+fail:
+    fclose(file);
+    free(priv->priority_extents);
+    priv->priority_extents = NULL;
+    return 1;
+}
+
+// Sets strategy by name; metadata_first is not one of them, it is set on top
+static int select_read_strategy(CopyPriv *priv, const char *name) {
+    if (!strcmp(name, "smart")) {
         priv->read_strategy = ReadStrategy_eSmart;
         extern ReadStrategyImpl read_strategy_smart;
         priv->read_strategy_impl = &read_strategy_smart;
-    } else if (!strcmp(priv->read_strategy_str, "smart_noreverse")) {
+    } else if (!strcmp(name, "smart_noreverse")) {
         priv->read_strategy = ReadStrategy_eSmartNoReverse;
         extern ReadStrategyImpl read_strategy_smart_noreverse;
         priv->read_strategy_impl = &read_strategy_smart_noreverse;
-    } else if (!strcmp(priv->read_strategy_str, "plain")) {
+    } else if (!strcmp(name, "plain")) {
         priv->read_strategy = ReadStrategy_ePlain;
         extern ReadStrategyImpl read_strategy_plain;
         priv->read_strategy_impl = &read_strategy_plain;
-    } else if (!strcmp(priv->read_strategy_str, "skipfail")) {
+    } else if (!strcmp(name, "skipfail")) {
         priv->read_strategy = ReadStrategy_eSkipfail;
         extern ReadStrategyImpl read_strategy_skipfail;
         priv->read_strategy_impl = &read_strategy_skipfail;
-    } else if (!strcmp(priv->read_strategy_str, "skipfail_noreverse")) {
+    } else if (!strcmp(name, "skipfail_noreverse")) {
         priv->read_strategy = ReadStrategy_eSkipfailNoReverse;
         extern ReadStrategyImpl read_strategy_skipfail_noreverse;
         priv->read_strategy_impl = &read_strategy_skipfail_noreverse;
+    } else if (!strcmp(name, "multipass")) {
+        priv->read_strategy = ReadStrategy_eMultipass;
+        extern ReadStrategyImpl read_strategy_multipass;
+        priv->read_strategy_impl = &read_strategy_multipass;
     } else {
         return 1;
     }
-    priv->read_strategy_impl->init(priv);
+    return 0;
+}
+
+static int Open(DC_ProcedureCtx *ctx) {
+    int r;
+    CopyPriv *priv = ctx->priv;
+
+    // Setting context
+    if (!strcmp(priv->api_str, "ata")) {
+        priv->api = Api_eAta;
+    } else if (!strcmp(priv->api_str, "posix")) {
+        priv->api = Api_ePosix;
+    } else if (!strcmp(priv->api_str, "scsi")) {
+        priv->api = Api_eScsi;
+    } else {
+        return 1;
+    }
+
+    if (priv->api == Api_eAta && !ctx->dev->ata_capable)
+        return 1;
+
+    if (!strcmp(priv->read_strategy_str, "metadata_first")) {
+        priv->metadata_first = 1;
+        if (select_read_strategy(priv, priv->bulk_strategy_str))
+            return 1;
+    } else if (select_read_strategy(priv, priv->read_strategy_str)) {
+        return 1;
+    }
 
     priv->use_journal = !strcmp(priv->use_journal_str, "yes");
+    priv->use_sparse = !strcmp(priv->sparse_str, "yes");
+    priv->use_zero_out_blockdev = !strcmp(priv->zero_out_blockdev_str, "yes");
+    priv->use_hash = !strcmp(priv->hash_str, "yes");
+    priv->use_fs_aware = !strcmp(priv->fs_aware_str, "yes");
+    if (!strcmp(priv->dst_format_str, "image"))
+        priv->use_image = 1;
+    else if (strcmp(priv->dst_format_str, "raw"))
+        return 1;
 
-    ctx->blk_size = BLK_SIZE;
+    int64_t max_blk_sectors = dc_dev_max_blk_sectors(ctx->dev);
+    if (priv->blk_sectors < 1 || priv->blk_sectors > max_blk_sectors) {
+        dc_log(DC_LOG_FATAL, "Block size must be within 1..%"PRId64" sectors for this device\n", max_blk_sectors);
+        return 1;
+    }
+    ctx->blk_size = priv->blk_sectors * 512;
     priv->end_lba = ctx->dev->capacity / 512;
     priv->lba_to_process = priv->end_lba - priv->start_lba;
     ctx->progress.den = priv->lba_to_process;
 
-    r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
+    if (priv->priority_file[0] && load_priority_extents(priv))
+        return 1;
+    // Extents to read first are read by strategy wrapping the chosen one
+    if (priv->metadata_first || priv->nb_priority_extents) {
+        priv->bulk_strategy_impl = priv->read_strategy_impl;
+        extern ReadStrategyImpl read_strategy_extents_first;
+        priv->read_strategy_impl = &read_strategy_extents_first;
+    }
+
+    if (priv->queue_depth < 1 || priv->write_buffers < 0
+            || priv->journal_commit_seconds < 0 || priv->journal_commit_mb < 0)
+        goto fail_buf;
+    // Synchronous commands read ahead would be wasted when read strategy jumps
+    if (priv->api == Api_eScsi && priv->queue_depth > 1) {
+        dc_log(DC_LOG_WARNING, "SCSI commands are issued with queue depth of 1\n");
+        priv->queue_depth = 1;
+    }
+    const DC_IoBackend *backend = priv->queue_depth > 1 ? dc_io_backend_queued_for_api(priv->api) : dc_io_backend_for_api(priv->api);
+    r = dc_io_open(&priv->src_io, ctx->dev, backend, priv->queue_depth, 0);
     if (r)
         goto fail_buf;
-
-    int open_flags = priv->api == Api_eAta ? O_RDWR : O_RDONLY | O_DIRECT | O_LARGEFILE | O_NOATIME;
-    priv->src_fd = open(ctx->dev->dev_path, open_flags);
-    if (priv->src_fd == -1) {
-        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+    // Depth may be lowered by backend
+    priv->queue_depth = priv->src_io.depth;
+    r = posix_memalign(&priv->src_bufs, sysconf(_SC_PAGESIZE), ctx->blk_size * priv->queue_depth);
+    if (r)
         goto fail_open;
+    priv->src_reqs = calloc(priv->queue_depth, sizeof(priv->src_reqs[0]));
+    priv->src_batch = calloc(priv->queue_depth, sizeof(priv->src_batch[0]));
+    if (!priv->src_reqs || !priv->src_batch)
+        goto fail_reqs;
+    for (int i = 0; i < priv->queue_depth; i++) {
+        priv->src_reqs[i].op = DC_IoOp_eRead;
+        priv->src_reqs[i].buf = (uint8_t*)priv->src_bufs + i * ctx->blk_size;
     }
-    r = ioctl(priv->src_fd, BLKFLSBUF, NULL);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
-    r = ioctl(priv->src_fd, BLKRAGET, &priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Getting block device readahead setting failed\n");
-    r = ioctl(priv->src_fd, BLKRASET, 0);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Disabling block device readahead setting failed\n");
-
-    // We use no O_DIRECT to allow output to generic file etc.
-    priv->dst_fd = open(priv->dst_file, O_WRONLY | O_LARGEFILE | O_NOATIME | O_CREAT, S_IRUSR | S_IWUSR);
-    if (priv->dst_fd == -1) {
-        assert(0);
-        dc_log(DC_LOG_FATAL, "open %s fail\n", priv->dst_file);
+
+    // Chunks of zeros take no space in image anyway
+    if (priv->use_image)
+        priv->use_sparse = 0;
+    priv->dst_paths = strdup(priv->dst_file);
+    if (!priv->dst_paths)
         goto fail_dst_open;
+    char *saveptr;
+    for (char *path = strtok_r(priv->dst_paths, ",", &saveptr); path; path = strtok_r(NULL, ",", &saveptr)) {
+        if (priv->nb_dsts == COPY_MAX_DESTINATIONS) {
+            dc_log(DC_LOG_FATAL, "Copying is possible to %d destinations at most\n", COPY_MAX_DESTINATIONS);
+            goto fail_dst_open;
+        }
+        priv->dsts[priv->nb_dsts].path = path;
+        r = open_destination(priv, &priv->dsts[priv->nb_dsts]);
+        if (r)
+            goto fail_dst_open;
+        priv->nb_dsts++;
     }
-
-    off_t dst_size = lseek(priv->dst_fd, 0, SEEK_END);
-    if (dst_size == -1)
+    if (!priv->nb_dsts) {
+        dc_log(DC_LOG_FATAL, "No destination is given\n");
         goto fail_dst_open;
-    priv->dst_file_end_lba = dst_size / 512;
-    if (priv->dst_file_end_lba && (priv->dst_file_end_lba < priv->end_lba))
-        dc_log(DC_LOG_WARNING, "Size of destination file (%"PRId64" bytes) is less than of source disk (%"PRId64" bytes). Operation will stop with error when exceeding space will be reached.", priv->dst_file_end_lba * 512, priv->end_lba * 512);
+    }
 
-    priv->nb_zones = 1;
-    priv->unread_zones = calloc(1, sizeof(Zone));
-    assert(priv->unread_zones);
-    priv->unread_zones->begin_lba = priv->start_lba;
-    priv->unread_zones->end_lba = priv->end_lba;
+    if (priv->use_hash) {
+        struct stat dst_stat;
+        if (!priv->use_image
+                && (fstat(priv->dsts[0].dst.fd, &dst_stat) || !(S_ISREG(dst_stat.st_mode) || S_ISBLK(dst_stat.st_mode)))) {
+            dc_log(DC_LOG_FATAL, "Hashing needs first destination to be file or block device which can be read back\n");
+            goto fail_dst_open;
+        }
+        char hashes_file_name[100];
+        snprintf(hashes_file_name, sizeof(hashes_file_name), "whdd_copy_hashes__%s__%s", ctx->dev->model_str, ctx->dev->serial_no);
+        r = dc_merkle_open(&priv->merkle, hashes_file_name, priv->end_lba, 1);
+        if (r)
+            goto fail_dst_open;
+    }
 
     if (priv->use_journal) {
         char journal_file_name[100];
         snprintf(journal_file_name, sizeof(journal_file_name), "whdd_copy_journal__%s__%s", ctx->dev->model_str, ctx->dev->serial_no);
-        struct stat journal_file_stat;
-        int journal_file_exists = 1;
-        r = stat(journal_file_name, &journal_file_stat);
-        if (r == -1) {
-            if (errno == ENOENT)
-                journal_file_exists = 0;
-            else
-                goto fail_journal_open;
-        }
-        if (journal_file_exists) {
-            // Check it for sanity - size, maybe sth else
-            if (journal_file_stat.st_size != priv->end_lba) {
-                dc_log(DC_LOG_ERROR, "Wrong size of journal file");
-                goto fail_journal_open;
-            }
-        }
-
-        // Open file
-        priv->journal_fd = open(journal_file_name, O_RDWR | O_NOATIME | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR );
-        if (priv->journal_fd == -1) {
-            dc_log(DC_LOG_ERROR, "Failed to open journal file");
+        r = dc_copy_journal_open(&priv->journal, journal_file_name, priv->end_lba);
+        if (r)
             goto fail_journal_open;
+        dc_copy_journal_set_commit(&priv->journal, sync_destination, priv,
+                priv->journal_commit_seconds * 1000, priv->journal_commit_mb * 1024 * 1024);
+    }
+
+    // Map of file systems is built once, for skipping free space and for reading metadata first
+    if (priv->use_fs_aware || priv->metadata_first) {
+        if (dc_fs_map_build(&priv->fs_map, ctx->dev->dev_path, priv->end_lba))
+            dc_log(DC_LOG_WARNING, "Failed to read file systems of source, it is copied as if there were none\n");
+        else
+            priv->use_fs_map = 1;
+    }
+    DC_CopyJournalExtent *skipped = NULL;
+    uint64_t nb_skipped = 0;
+    if (priv->use_fs_map && priv->use_fs_aware && skip_free_space(priv, &skipped, &nb_skipped))
+        goto fail_fs_map;
+    zero_skipped_space(priv, skipped, nb_skipped);
+
+    // Unread zones are gaps between extents of journal (or of skipped free space without journal), or whole disk if there are none
+    ctx->progress.den = 0;
+    int64_t prev_end_lba = priv->start_lba;
+    int prev_defective = 0;
+    DC_CopyJournalExtent *extents = priv->use_journal ? priv->journal.extents : skipped;
+    uint64_t nb_extents = priv->use_journal ? priv->journal.nb_extents : nb_skipped;
+    for (uint64_t i = 0; i <= nb_extents; i++) {
+        DC_CopyJournalExtent *extent = i < nb_extents ? &extents[i] : NULL;
+        // Free space skipped by former run is copied, unless it is to be skipped again
+        if (extent && extent->status == SectorStatus_eSkipped && !priv->use_fs_aware)
+            continue;
+        int64_t begin_lba = extent ? (int64_t)extent->begin_lba : priv->end_lba;
+        int extent_defective = extent && (extent->status == SectorStatus_eBlockReadError
+                || extent->status == SectorStatus_eSectorReadError);
+        if (begin_lba > prev_end_lba) {
+            Zone *zone = calloc(1, sizeof(*zone));
+            assert(zone);
+            zone->begin_lba = prev_end_lba;
+            zone->end_lba = begin_lba;
+            zone->begin_lba_defective = prev_defective;
+            zone->end_lba_defective = extent_defective;
+            ctx->progress.den += zone->end_lba - zone->begin_lba;
+            zone_index_insert(&priv->unread_zones, zone);
         }
-        if (journal_file_exists) {
-            // Reset zones
-            priv->nb_zones = 0;
-            free(priv->unread_zones);
-            priv->unread_zones = NULL;
-            ctx->progress.den = 0;
-
-            // Parse it to zones structure
-            Zone *current_zone = NULL;
-            char prev_sector_status;
-            uint8_t journal_chunk[1*1024*1024];
-            for (int64_t i = 0; i < priv->end_lba; i++) {
-                char sector_status;
-                if (i % sizeof(journal_chunk) == 0) {
-                    int chunklen = (priv->end_lba - i) < (int64_t)sizeof(journal_chunk) ? (priv->end_lba - i) : (int64_t)sizeof(journal_chunk);
-                    int ret = read(priv->journal_fd, journal_chunk, chunklen);
-                    if (ret != chunklen)
-                        goto fail_journal_read;
-                }
-                sector_status = journal_chunk[i % sizeof(journal_chunk)];
-                switch ((SectorStatus)sector_status) {
-                    case SectorStatus_eUnread:
-                        if (!current_zone) {
-                            current_zone = calloc(1, sizeof(*current_zone));
-                            assert(current_zone);
-                            current_zone->begin_lba = i;
-                            if ((i > 0)
-                                    && ((prev_sector_status == SectorStatus_eBlockReadError)
-                                        || (prev_sector_status == SectorStatus_eSectorReadError)))
-                                current_zone->begin_lba_defective = 1;
-                        }
-                        break;
-                    case SectorStatus_eReadOk:
-                    case SectorStatus_eBlockReadError:
-                    case SectorStatus_eSectorReadError:
-                        if (current_zone) {
-                            current_zone->end_lba = i;
-                            if ((sector_status == SectorStatus_eBlockReadError)
-                                    || (sector_status == SectorStatus_eSectorReadError))
-                                current_zone->end_lba_defective = 1;
-                            ctx->progress.den += current_zone->end_lba - current_zone->begin_lba;
-                            append_zone(priv, current_zone);
-                            current_zone = NULL;
-                        }
-                        break;
-                }
-                prev_sector_status = sector_status;
-            }
-            if (current_zone) {  // Zone finishing at end of disk
-                current_zone->end_lba = priv->end_lba;
-                ctx->progress.den += current_zone->end_lba - current_zone->begin_lba;
-                append_zone(priv, current_zone);
-                current_zone = NULL;
-            }
-        } else {
-            // Fill appropriately
-            char filler[1*1024*1024];
-            memset(filler, 0, sizeof(filler));
-            for (int64_t i = 0; i < priv->end_lba;) {
-                int64_t blocksize = priv->end_lba - i;
-                if (blocksize > (int)sizeof(filler))
-                    blocksize = sizeof(filler);
-                r = write(priv->journal_fd, &filler, blocksize);
-                assert(r == blocksize);
-                i += blocksize;
-            }
-            fdatasync(priv->journal_fd);
+        if (extent) {
+            prev_end_lba = extent->end_lba;
+            prev_defective = extent_defective;
         }
     }
+    free(skipped);
 
     //fprintf(stderr, "Zones list at beginning of procedure:\n");
-    //for (Zone *iter = priv->unread_zones; iter; iter = iter->next) {
+    //for (Zone *iter = zone_index_first(&priv->unread_zones); iter; iter = zone_index_next(iter)) {
     //    fprintf(stderr, "begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", iter->begin_lba, iter->end_lba, iter->begin_lba_defective, iter->end_lba_defective);
     //}
+
+    // Strategy may take failed areas from journal for rereading
+    priv->read_strategy_impl->init(priv);
+    ctx->progress.den += priv->sectors_to_reread;
+    priv->sectors_to_reread = 0;
+    if (priv->use_fs_map) {
+        if (priv->metadata_first)
+            dc_log(DC_LOG_INFO, "%"PRIu64" MiB of metadata of file systems are read first\n", priv->fs_map.metadata_sectors / 2048);
+        dc_fs_map_free(&priv->fs_map);
+        priv->use_fs_map = 0;
+    }
+
+    pthread_mutex_init(&priv->pending_mutex, NULL);
+    if (priv->write_buffers > 0) {
+        priv->pending = calloc(priv->write_buffers + 1, sizeof(CopyPendingBlock));
+        if (!priv->pending)
+            goto fail_writer;
+        for (int i = 0; i < priv->nb_dsts; i++) {
+            CopyDestination *dest = &priv->dsts[i];
+            r = dc_copy_writer_open(&dest->writer, &dest->dst, dest->use_sparse ? &dest->sparse : NULL,
+                    priv->use_image ? &dest->image : NULL, priv->write_buffers, ctx->blk_size,
+                    destination_block_written, dest);
+            if (r) {
+                dc_log(DC_LOG_FATAL, "Failed to start destination writer\n");
+                while (i--)
+                    dc_copy_writer_close(&priv->dsts[i].writer);
+                goto fail_writer;
+            }
+        }
+        priv->use_writer = 1;
+    }
     return 0;
-fail_journal_read:
-    close(priv->journal_fd);
+fail_writer:
+    free(priv->pending);
+    pthread_mutex_destroy(&priv->pending_mutex);
+    priv->read_strategy_impl->close(priv);
+    zone_index_clear(&priv->unread_zones);
+fail_fs_map:
+    if (priv->use_fs_map)
+        dc_fs_map_free(&priv->fs_map);
+    if (priv->use_journal)
+        dc_copy_journal_close(&priv->journal);
 fail_journal_open:
-    close(priv->dst_fd);
+    if (priv->use_hash)
+        dc_merkle_close(&priv->merkle);
 fail_dst_open:
-    close(priv->src_fd);
-    r = ioctl(priv->src_fd, BLKRASET, priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
+    while (priv->nb_dsts--)
+        close_destination(priv, &priv->dsts[priv->nb_dsts]);
+    free(priv->dst_paths);
+fail_reqs:
+    free(priv->src_batch);
+    free(priv->src_reqs);
+    free(priv->src_bufs);
 fail_open:
-    free(priv->buf);
+    dc_io_close(&priv->src_io);
 fail_buf:
+    free(priv->priority_extents);
     return 1;
 }
 
+static void queue_source_read(CopyPriv *priv, int64_t lba, size_t sectors, int *nb) {
+    DC_IoRequest *req = &priv->src_reqs[priv->src_tail++ % priv->queue_depth];
+    req->lba = lba;
+    req->sectors = sectors;
+    priv->src_batch[(*nb)++] = req;
+}
+
+// Queue reads of the blocks which read strategy will request next if it stays in current zone,
+// i.e. continuation of current zone in current direction. If it jumps elsewhere, e.g. after failed read, they are dropped.
+static void prefetch_source(CopyPriv *priv, int *nb) {
+    Zone *zone = priv->current_zone;
+    while (zone && (priv->src_head != priv->src_tail) && (priv->src_tail - priv->src_head < (uint64_t)priv->queue_depth)) {
+        DC_IoRequest *last = &priv->src_reqs[(priv->src_tail - 1) % priv->queue_depth];
+        int64_t lba;
+        size_t sectors;
+        if (priv->current_zone_read_direction_reversive) {
+            if ((int64_t)last->lba <= zone->begin_lba)
+                break;
+            sectors = (last->lba - zone->begin_lba < (uint64_t)priv->blk_sectors) ? last->lba - zone->begin_lba : (uint64_t)priv->blk_sectors;
+            lba = last->lba - sectors;
+        } else {
+            lba = last->lba + last->sectors;
+            if (lba >= zone->end_lba)
+                break;
+            sectors = (zone->end_lba - lba < priv->blk_sectors) ? zone->end_lba - lba : priv->blk_sectors;
+        }
+        queue_source_read(priv, lba, sectors, nb);
+    }
+}
+
+// Returns completed read of requested block, submitting it with prefetched ones; NULL if source stopped responding.
+// Request is not reused until next call, so its buffer stays valid while it is written to destination
+static DC_IoRequest *read_source(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, int *ret) {
+    int nb = 0;
+    if (priv->src_head != priv->src_tail) {
+        DC_IoRequest *head = &priv->src_reqs[priv->src_head % priv->queue_depth];
+        if (((int64_t)head->lba != lba_to_read) || (head->sectors != sectors_to_read)) {
+            // Read strategy has jumped elsewhere; speculative reads are dropped
+            for (; priv->src_head != priv->src_tail; priv->src_head++)
+                dc_io_wait(&priv->src_io, &priv->src_reqs[priv->src_head % priv->queue_depth]);
+        }
+    }
+    if (priv->src_head == priv->src_tail)
+        queue_source_read(priv, lba_to_read, sectors_to_read, &nb);
+    prefetch_source(priv, &nb);
+    // Synchronous backend completes request even if device stopped responding, so it is reported
+    if (nb && dc_io_submit(&priv->src_io, priv->src_batch, nb))
+        *ret = 1;
+
+    DC_IoRequest *req = &priv->src_reqs[priv->src_head % priv->queue_depth];
+    if (dc_io_wait(&priv->src_io, req))
+        return NULL;
+    priv->src_head++;
+    return req;
+}
+
 static int Perform(DC_ProcedureCtx *ctx) {
-    ssize_t read_ret;
-    int ioctl_ret;
     int ret = 0;
     CopyPriv *priv = ctx->priv;
     size_t sectors_to_read;
     int64_t lba_to_read;
     int r;
     int error_flag = 0;
+    int written;
+    void *buf;
+    CopyDestination *first = priv->dsts;
 
     // Updating context
     r = priv->read_strategy_impl->get_task(priv, &lba_to_read, &sectors_to_read);
     if (r)
       return r;
-    if (priv->dst_file_end_lba && ((int64_t)(lba_to_read + sectors_to_read) > priv->dst_file_end_lba))
+    if (check_destinations(priv, lba_to_read + sectors_to_read))
         return 1;
-    if (priv->api == Api_ePosix)
-        lseek(priv->src_fd, 512 * lba_to_read, SEEK_SET);
-    lseek(priv->dst_fd, 512 * lba_to_read, SEEK_SET);
+    while (first->failed)
+        first++;
     ctx->report.lba = lba_to_read;
     ctx->report.sectors_processed = sectors_to_read;
     ctx->report.blk_status = DC_BlockStatus_eOk;
     priv->blk_index++;
 
-    // Preparing to act
-    if (priv->api == Api_eAta) {
-        memset(&priv->ata_command, 0, sizeof(priv->ata_command));
-        memset(&priv->scsi_command, 0, sizeof(priv->scsi_command));
-        prepare_ata_command(&priv->ata_command, /* WIN_READ_DMA_EXT */ 0x25, ctx->report.lba, sectors_to_read);
-        prepare_scsi_command_from_ata(&priv->scsi_command, &priv->ata_command);
-        priv->scsi_command.io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-        priv->scsi_command.io_hdr.dxferp = priv->buf;
-        priv->scsi_command.io_hdr.dxfer_len = ctx->blk_size;
-        priv->scsi_command.scsi_cmd[1] = (6 << 1) + 1;  // DMA protocol + EXTEND bit
-        priv->scsi_command.scsi_cmd[2] = 0x0e;  // CK_COND=0 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=10b
-#if 0
-        int i;
-        for (i = 0; i < sizeof(priv->scsi_command.scsi_cmd); i++)
-          fprintf(stderr, "%02hhx", priv->scsi_command.scsi_cmd[i]);
-        fprintf(stderr, "\n");
-#endif
-    }
-
-    // Timing
-    _dc_proc_time_pre(ctx);
-
     // Acting
-    if (priv->api == Api_eAta)
-        ioctl_ret = ioctl(priv->src_fd, SG_IO, &priv->scsi_command);
-    else
-        read_ret = read(priv->src_fd, priv->buf, sectors_to_read * 512);
-
-    // Timing
-    _dc_proc_time_post(ctx);
-
-    // Error handling
-    if (priv->api == Api_eAta) {
-        // Updating context
-        if (ioctl_ret) {
-            ctx->report.blk_status = DC_BlockStatus_eError;
-            ret = 1;
-        }
-        ctx->report.blk_status = scsi_ata_check_return_status(&priv->scsi_command);
-        if (ctx->report.blk_status)
-            error_flag = 1;
-    } else {
-        if (read_ret != (ssize_t)sectors_to_read * 512) {
-            error_flag = 1;
+    DC_IoRequest *req = read_source(priv, lba_to_read, sectors_to_read, &ret);
+    if (!req) {
+        dc_log(DC_LOG_FATAL, "Reading via \"%s\" backend failed\n", priv->src_io.backend->name);
+        return 1;
+    }
 
-            // Updating context
-            ctx->report.blk_status = DC_BlockStatus_eError;
-        }
+    // Updating context
+    ctx->time_pre = req->time_submit;
+    ctx->time_post = req->time_complete;
+    ctx->report = req->report;
+    if (ctx->report.blk_status)
+        error_flag = 1;
+    buf = req->buf;
+    if (priv->use_writer && !error_flag) {
+        // Writer owns queued buffer until block is written
+        buf = dc_copy_writer_get_buffer(&first->writer);
+        memcpy(buf, req->buf, sectors_to_read * 512);
     }
 
     // Acting: writing; not timed
-    if (!error_flag) {
-        int write_ret = write(priv->dst_fd, priv->buf, sectors_to_read * 512);
-
-        // Error handling
-        if (write_ret != (ssize_t)sectors_to_read * 512) {
+    written = 0;
+    if (priv->use_writer) {
+        if (!error_flag)
+            queue_block(priv, first, buf, lba_to_read, sectors_to_read);
+    } else if (!error_flag) {
+        int zero = priv->use_sparse && dc_buffer_is_zero(buf, sectors_to_read * 512);
+        for (CopyDestination *dest = first; dest < &priv->dsts[priv->nb_dsts]; dest++) {
+            if (dest->failed)
+                continue;
+            if (write_destination(dest, lba_to_read, sectors_to_read, buf, zero))
+                destination_failed(priv, dest, "Writing to destination failed");
+            else
+                written = 1;
+        }
+        if (!written) {
             // Updating context
             ctx->report.blk_status = DC_BlockStatus_eError;
-            // TODO Transmit to user info that _write phase_ has failed
+            ret = 1;
+        } else if (priv->use_hash && !priv->dsts[0].failed) {
+            dc_merkle_add_block(&priv->merkle, lba_to_read, sectors_to_read, buf);
         }
     }
 
     // Updating context
     if (priv->use_journal) {
-        char sector_status;
-        if (error_flag) {
-            if (sectors_to_read == 1)
-                sector_status = SectorStatus_eSectorReadError;
-            else
-                sector_status = SectorStatus_eBlockReadError;
-        } else {
-            sector_status = SectorStatus_eReadOk;
-        }
-        assert(r != -1);
-        uint8_t journal_write[sectors_to_read];
-        memset(journal_write, sector_status, sectors_to_read);
-        lseek(priv->journal_fd, lba_to_read, SEEK_SET);
-        r = write(priv->journal_fd, journal_write, sectors_to_read);
-        assert(r == (int)sectors_to_read);
+        if (error_flag)
+            journal_mark(priv, lba_to_read, sectors_to_read,
+                    sectors_to_read == 1 ? SectorStatus_eSectorReadError : SectorStatus_eBlockReadError);
+        else if (written)
+            journal_mark(priv, lba_to_read, sectors_to_read, SectorStatus_eReadOk);
+        // with writers, it is done when block reaches all destinations
     }
+    // Failed sectors are hashed as they are on destination, when copying completes
+    if (priv->use_hash && error_flag)
+        dc_merkle_invalidate(&priv->merkle, lba_to_read, sectors_to_read);
     r = priv->read_strategy_impl->use_results(priv, lba_to_read, sectors_to_read, &ctx->report);
     if (r)
         ret = 1;
     ctx->progress.num += sectors_to_read;
+    ctx->progress.den += priv->sectors_to_reread;
+    priv->sectors_to_reread = 0;
     priv->lba_to_process -= sectors_to_read;
 
     if (ret)
@@ -370,29 +795,138 @@ static int Perform(DC_ProcedureCtx *ctx) {
     return ret;
 }
 
+// Hashes chunks which weren't hashed while copied, reading them from destination, and reports image digest
+static void hash_finalize(DC_ProcedureCtx *ctx) {
+    CopyPriv *priv = ctx->priv;
+    DC_MerklePool pool;
+    uint64_t nb_errors = 0;
+    char root_hex[2 * DC_SHA256_SIZE + 1];
+
+    if (ctx->progress.num < ctx->progress.den) {
+        dc_log(DC_LOG_INFO, "Image digest will be computed when copying is complete\n");
+        return;
+    }
+    // Chunks which were not hashed while copied are read from first destination
+    CopyDestination *dest = &priv->dsts[0];
+    if (dest->failed) {
+        dc_log(DC_LOG_ERROR, "Image digest isn't computed, as copying to %s has failed\n", dest->path);
+        return;
+    }
+    long nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads < 1)
+        nb_threads = 1;
+    if (dc_merkle_pool_start(&pool, &priv->merkle, priv->use_image ? image_read : dc_merkle_read_fd,
+                priv->use_image ? (void*)&dest->image : (void*)&dest->dst.buffered_fd, nb_threads, 0)) {
+        dc_log(DC_LOG_ERROR, "Failed to start hashing threads\n");
+        return;
+    }
+    for (uint64_t i = 0; i < priv->merkle.header->nb_chunks; i++)
+        if (dc_merkle_pool_wait(&pool, i, NULL) != DC_MerkleResult_eOk)
+            nb_errors++;
+    dc_merkle_pool_stop(&pool);
+    if (nb_errors || dc_merkle_compute_root(&priv->merkle)) {
+        dc_log(DC_LOG_ERROR, "Failed to read %"PRIu64" chunks of destination for hashing\n", nb_errors);
+        return;
+    }
+    dc_sha256_to_hex(priv->merkle.header->root, root_hex);
+    dc_log(DC_LOG_INFO, "Image digest (SHA-256 Merkle root of %u KiB chunks): %s\n",
+            priv->merkle.header->chunk_sectors / 2, root_hex);
+}
+
+// Sectors which journal doesn't mark as read are listed in images, so that reading them fails as on source
+static void image_set_bad_map(CopyPriv *priv) {
+    DC_CopyJournal *journal = &priv->journal;
+    DC_ImageBadExtent *extents = calloc(2 * journal->nb_extents + 1, sizeof(*extents));
+    uint64_t nb_extents = 0;
+    uint64_t prev_end_lba = 0;
+    if (!extents) {
+        dc_log(DC_LOG_ERROR, "Failed to store map of sectors which were not copied\n");
+        return;
+    }
+    for (uint64_t i = 0; i <= journal->nb_extents; i++) {
+        DC_CopyJournalExtent *extent = i < journal->nb_extents ? &journal->extents[i] : NULL;
+        uint64_t begin_lba = extent ? extent->begin_lba : journal->nb_sectors;
+        if (begin_lba > prev_end_lba)
+            extents[nb_extents++] = (DC_ImageBadExtent){ prev_end_lba, begin_lba, SectorStatus_eUnread, 0 };
+        if (!extent)
+            break;
+        // Skipped free space reads as zeros, as file system doesn't care what is there
+        if (extent->status != SectorStatus_eReadOk && extent->status != SectorStatus_eSkipped)
+            extents[nb_extents++] = (DC_ImageBadExtent){ extent->begin_lba, extent->end_lba, extent->status, 0 };
+        prev_end_lba = extent->end_lba;
+    }
+    for (int i = 0; i < priv->nb_dsts; i++)
+        if (!priv->dsts[i].failed)
+            dc_image_set_bad_map(&priv->dsts[i].image, extents, nb_extents);
+    free(extents);
+}
+
 static void Close(DC_ProcedureCtx *ctx) {
     CopyPriv *priv = ctx->priv;
-    int r = ioctl(priv->src_fd, BLKRASET, priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
-    free(priv->buf);
-    close(priv->src_fd);
-    close(priv->dst_fd);
-    if (priv->use_journal) {
-        close(priv->journal_fd);
+    // Queued blocks are written out before journal is closed
+    for (int i = 0; priv->use_writer && i < priv->nb_dsts; i++) {
+        CopyDestination *dest = &priv->dsts[i];
+        if (dc_copy_writer_close(&dest->writer) && !dest->failed)
+            destination_failed(priv, dest, "Some blocks failed to be written to destination");
     }
+    for (int i = 0; i < priv->nb_dsts; i++) {
+        CopyDestination *dest = &priv->dsts[i];
+        if (dest->use_sparse)
+            dc_log(DC_LOG_INFO, "%"PRIu64" MiB of zeros were deallocated on %s instead of written\n",
+                    dest->sparse.zeroed_bytes / (1024 * 1024), dest->path);
+        if (dest->failed)
+            dc_log(DC_LOG_ERROR, "Copy on %s is incomplete, as writing to it has failed\n", dest->path);
+    }
+    if (priv->use_image && priv->use_journal)
+        image_set_bad_map(priv);
+    // Final commit syncs destination, so it is closed after journal
+    if (priv->use_journal)
+        dc_copy_journal_close(&priv->journal);
+    if (priv->use_hash) {
+        hash_finalize(ctx);
+        dc_merkle_close(&priv->merkle);
+    }
+    for (int i = 0; priv->use_image && i < priv->nb_dsts; i++)
+        dc_log(DC_LOG_INFO, "Image %s takes %"PRIu64" MiB for %"PRId64" MiB of device\n", priv->dsts[i].path,
+                dc_image_stored_size(&priv->dsts[i].image) / (1024 * 1024), priv->end_lba / 2048);
+    dc_io_close(&priv->src_io);
+    free(priv->src_batch);
+    free(priv->src_reqs);
+    free(priv->src_bufs);
+    for (int i = 0; i < priv->nb_dsts; i++)
+        close_destination(priv, &priv->dsts[i]);
+    free(priv->dst_paths);
+    free(priv->pending);
+    pthread_mutex_destroy(&priv->pending_mutex);
     priv->read_strategy_impl->close(priv);
+    zone_index_clear(&priv->unread_zones);
+    free(priv->priority_extents);
 }
 
-static const char * const api_choices[] = {"ata", "posix", NULL};
-static const char * const strategy_choices[] = {"plain", "smart", "smart_noreverse", "skipfail", "skipfail_noreverse", NULL};
+static const char * const api_choices[] = {"ata", "posix", "scsi", NULL};
+static const char * const strategy_choices[] = {"plain", "smart", "smart_noreverse", "skipfail", "skipfail_noreverse", "multipass", "metadata_first", NULL};
+static const char * const bulk_strategy_choices[] = {"plain", "smart", "smart_noreverse", "skipfail", "skipfail_noreverse", "multipass", NULL};
 static const char * const yesno_choices[] = {"yes", "no", NULL};
+static const char * const dst_format_choices[] = {"raw", "image", NULL};
 static DC_ProcedureOption options[] = {
-    { "api", "select read operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ DMA EXT\" command", offsetof(CopyPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
-    { "read_strategy", "select from options: plain, smart, smart_noreverse, skipfail, skipfail_noreverse. See help on copy procedure for details.", offsetof(CopyPriv, read_strategy_str), DC_ProcedureOptionType_eString, strategy_choices },
-    { "dst_file", "set destination file path", offsetof(CopyPriv, dst_file), DC_ProcedureOptionType_eString },
+    { "api", "select read operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ DMA EXT\" command, \"scsi\" for SCSI \"READ (16)\" command", offsetof(CopyPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
+    { "read_strategy", "select from options: plain, smart, smart_noreverse, skipfail, skipfail_noreverse, multipass, metadata_first. See help on copy procedure for details.", offsetof(CopyPriv, read_strategy_str), DC_ProcedureOptionType_eString, strategy_choices },
+    { "bulk_strategy", "select strategy which reads the rest after metadata, with metadata_first read strategy", offsetof(CopyPriv, bulk_strategy_str), DC_ProcedureOptionType_eString, bulk_strategy_choices },
+    { "priority_file", "set path of file of \"LBA sectors\" lines, listing extents to read before everything else", offsetof(CopyPriv, priority_file), DC_ProcedureOptionType_eString },
+    { "dst_file", "set destination file path, or several of them separated by commas", offsetof(CopyPriv, dst_file), DC_ProcedureOptionType_eString },
+    { "dst_format", "set destination format: \"raw\" copy of device, or compressed \"image\"", offsetof(CopyPriv, dst_format_str), DC_ProcedureOptionType_eString, dst_format_choices },
+    { "dst_direct", "set whether to write raw destination bypassing page cache (yes/no)", offsetof(CopyPriv, dst_direct_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "sparse", "set whether to punch holes for blocks of zeros in destination file instead of writing them (yes/no)", offsetof(CopyPriv, sparse_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "zero_out_blockdev", "set whether to issue BLKZEROOUT for blocks of zeros on destination block device, with sparse (yes/no)", offsetof(CopyPriv, zero_out_blockdev_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "hash", "set whether to compute digest of image while copying, for later verification (yes/no)", offsetof(CopyPriv, hash_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "fs_aware", "set whether to copy only blocks which file systems of source have in use (yes/no)", offsetof(CopyPriv, fs_aware_str), DC_ProcedureOptionType_eString, yesno_choices },
     { "use_journal", "set whether to generate and use journal for operation resume possibility (yes/no)", offsetof(CopyPriv, use_journal_str), DC_ProcedureOptionType_eString, yesno_choices },
-    { "skip_blocks", "set jump size in blocks of 256*512 bytes, when read error is met (for skipfail* strategies)", offsetof(CopyPriv, skip_blocks), DC_ProcedureOptionType_eInt64 },
+    { "journal_commit_seconds", "set how often journal is committed, in seconds", offsetof(CopyPriv, journal_commit_seconds), DC_ProcedureOptionType_eInt64 },
+    { "journal_commit_mb", "set amount of copied data after which journal is committed, in MiB", offsetof(CopyPriv, journal_commit_mb), DC_ProcedureOptionType_eInt64 },
+    { "blk_sectors", "set block size in sectors, up to the limit of device", offsetof(CopyPriv, blk_sectors), DC_ProcedureOptionType_eInt64 },
+    { "skip_blocks", "set jump size in blocks, when read error is met (for skipfail* and multipass strategies)", offsetof(CopyPriv, skip_blocks), DC_ProcedureOptionType_eInt64 },
+    { "queue_depth", "set number of source reads kept in flight, via io_uring with \"posix\" API or NCQ with \"ata\" API", offsetof(CopyPriv, queue_depth), DC_ProcedureOptionType_eInt64 },
+    { "write_buffers", "set number of blocks which may wait to be written by separate thread, 0 to write synchronously", offsetof(CopyPriv, write_buffers), DC_ProcedureOptionType_eInt64 },
     { NULL }
 };
 
@@ -405,19 +939,43 @@ DC_Procedure copy = {
         "api: choose API used to read data from source device.\n"
         "    ata: use ATA \"READ DMA EXT\" command.\n"
         "    posix: use POSIX read() in direct mode.\n"
+        "    scsi: use SCSI \"READ (16)\" command, for drives behind bridges which don't pass ATA commands through.\n"
+        "\n"
+        "dst_file: source is read once and written to each destination; copying goes on while some destination is left.\n"
+        "\n"
+        "use_journal: keep journal of read and failed sectors, committed after destination is synced, so that interrupted copying can be resumed.\n"
+        "\n"
+        "dst_format: with \"image\", destination is a file of compressed 1 MiB chunks, which \"read_test\" and \"copy_verify\" can read.\n"
+        "\n"
+        "dst_direct: raw destination is written bypassing page cache; non-sparse destination file is preallocated to size of source.\n"
+        "\n"
+        "sparse: blocks which are all zeros are deallocated on destination instead of written, where it supports that.\n"
+        "\n"
+        "hash: copied data is hashed into Merkle tree of 1 MiB chunks, which \"copy_verify\" checks image against.\n"
+        "\n"
+        "fs_aware: free space of ext2/3/4 and NTFS volumes on source is not copied.\n"
+        "\n"
+        "write_buffers: if above 0, destination is written by separate thread, so that reading of source doesn't wait for it.\n"
+        "\n"
+        "queue_depth: if above 1, blocks which read strategy is going to request next are read ahead.\n"
         "\n"
         "read_strategy: choose read strategy. All strategies are designed to make least possible harm to defective source device.\n"
         "    plain: read sequentially, abort on first read fail.\n"
-        "    smart: read sequentially until read error is met. Then it reads from another end of disk space. When this ends with read error, too, it jumps to the middle of unread zone and reads forward from there. This results in having two zones of unread data. This way it jumps into middle of unread zones until there are < 1000 of them in table, and they are > 500 MB. When it cannot further jump into zones, it just reads sequentially remaining unread zones. Thus reading near failure points is delayed.\n"
+        "    smart: read sequentially until read error is met. Then it reads from another end of disk space. When this ends with read error, too, it jumps to the middle of unread zone and reads forward from there. This results in having two zones of unread data. This way it jumps into middle of unread zones while they are > 500 MB. When it cannot further jump into zones, it just reads sequentially remaining unread zones. Thus reading near failure points is delayed.\n"
         "    smart_noreverse: same as \"smart\", but reverse reading is prohibited; jump into middle of zone is considered on forward read failure.\n"
-	"    skipfail: read sequentially until fail. Then jump skip_blocks blocks (of 256*512 bytes), and read backward up to failure. Then go forward.\n"
+	"    skipfail: read sequentially until fail. Then jump skip_blocks blocks (of blk_sectors sectors), and read backward up to failure. Then go forward.\n"
 	"    skipfail_noreverse: same as \"skipfail\", but after jump data is read forward (the gap is omitted).\n"
+        "    multipass: sweep with whole blocks, jumping over errors, then trim and scrape failed blocks sector by sector, like ddrescue does.\n"
+        "    metadata_first: read metadata of file systems first, then the rest with bulk_strategy.\n"
+        "\n"
+        "priority_file: extents listed in it are read before anything else, failed blocks of them are left to the rest.\n"
         "",
     .suggest_default_value = SuggestDefaultValue,
     .open = Open,
     .perform = Perform,
     .close = Close,
     .priv_data_size = sizeof(CopyPriv),
+    .flags = DC_PROC_FLAG_DESTINATION,
     .options = options,
 };
 
@@ -4,15 +4,15 @@
 #include <stdlib.h>
 #include "procedure.h"
 #include "scsi.h"
-
-typedef struct zone {
-    // begin_lba < end_lba
-    int64_t begin_lba;
-    int64_t end_lba;  // LBA of the first sector beyond zone
-    int begin_lba_defective;  // Whether reading near begin_lba failed
-    int end_lba_defective;  // Whether reading near end_lba failed
-    struct zone *next;
-} Zone;
+#include "copy_writer.h"
+#include "dst_io.h"
+#include "sparse_dst.h"
+#include "merkle.h"
+#include "image.h"
+#include "copy_journal.h"
+#include "zone_index.h"
+#include "fs_map.h"
+#include "io_backend.h"
 
 enum ReadStrategy {
     ReadStrategy_ePlain,
@@ -20,37 +20,104 @@ enum ReadStrategy {
     ReadStrategy_eSmartNoReverse,
     ReadStrategy_eSkipfail,
     ReadStrategy_eSkipfailNoReverse,
+    ReadStrategy_eMultipass,
 };
 
 typedef struct ReadStrategyImpl ReadStrategyImpl;
 
+#define COPY_MAX_DESTINATIONS 8
+
+// One of destinations which get the same data, e.g. working copy and evidence copy
+typedef struct copy_destination {
+    const char *path;
+    DC_DstIo dst;  // raw destination
+    DC_Image image;  // compressed one
+    int use_sparse;
+    DC_SparseDst sparse;
+    int64_t end_lba;  // 0 if destination may grow
+    DC_CopyWriter writer;
+    int failed;  // writing failed, so it gets no more data
+    uint64_t nb_done;  // blocks written by writer, counted as they are queued
+    struct copy_priv *priv;
+} CopyDestination;
+
+// Block queued to writers, marked as read in journal when all destinations have it
+typedef struct copy_pending_block {
+    int64_t lba;
+    size_t sectors;
+} CopyPendingBlock;
+
 struct copy_priv {
     const char *api_str;
     const char *read_strategy_str;
+    const char *bulk_strategy_str;
     const char *dst_file;
+    const char *dst_format_str;
+    const char *dst_direct_str;
     const char *use_journal_str;
-    int skip_blocks;
+    const char *sparse_str;
+    const char *zero_out_blockdev_str;
+    const char *hash_str;
+    const char *fs_aware_str;
+    const char *priority_file;
+    int64_t journal_commit_seconds;
+    int64_t journal_commit_mb;
+    int64_t skip_blocks;
+    int64_t blk_sectors;  // size of block read at once
     enum Api api;
     enum ReadStrategy read_strategy;
     ReadStrategyImpl *read_strategy_impl;
+    // Priority extents, and metadata with metadata_first, are read by wrapping strategy,
+    // then bulk strategy reads what is left; read_strategy tells which one it is
+    DC_FsExtent *priority_extents;  // sorted and merged
+    uint64_t nb_priority_extents;
+    int metadata_first;
+    ReadStrategyImpl *bulk_strategy_impl;
+    int use_fs_map;
+    DC_FsMap fs_map;  // of source, until read strategy is initialized
     int use_journal;
     int64_t start_lba;
     int64_t end_lba;
     int64_t lba_to_process;
-    int src_fd;
-    int dst_fd;
-    int64_t dst_file_end_lba;
-    void *buf;
-    AtaCommand ata_command;
-    ScsiCommand scsi_command;
-    int old_readahead;
+    DC_Io src_io;
+    // Destinations are listed in dst_file separated by commas. Digest is taken from the first one
+    char *dst_paths;
+    CopyDestination dsts[COPY_MAX_DESTINATIONS];
+    int nb_dsts;
+    int use_image;  // destinations are compressed images rather than raw files or devices
+    int use_sparse;
+    int use_zero_out_blockdev;
+    int use_hash;
+    int use_fs_aware;  // free space of file systems is not copied
+    DC_Merkle merkle;
     uint64_t blk_index;
-    Zone *unread_zones;
-    int nb_zones;
+    ZoneIndex unread_zones;
     Zone *current_zone;
     int current_zone_read_direction_reversive;
     void *read_strategy_priv;
-    int journal_fd;
+    void *first_strategy_priv;  // of wrapping strategy, which leaves read_strategy_priv to bulk strategy
+    // Sectors which strategy is going to read once more, e.g. after block read failed; added to progress
+    int64_t sectors_to_reread;
+    DC_CopyJournal journal;
+
+    // Reads of source: requested block and, with queue_depth > 1, the blocks which read strategy
+    // is going to request next, via "sg_async" backend for "ata" API or "uring" one for "posix" API.
+    // Requests in flight form FIFO src_head..src_tail, index in src_reqs is counter modulo depth
+    int64_t queue_depth;
+    DC_IoRequest *src_reqs;
+    DC_IoRequest **src_batch;
+    void *src_bufs;  // of blk_size for each request
+    uint64_t src_head;
+    uint64_t src_tail;
+
+    // Each destination is written by separate thread if write_buffers > 0.
+    // Blocks in flight form FIFO pending_head..pending_tail, index in ring is counter modulo write_buffers
+    int64_t write_buffers;
+    int use_writer;
+    CopyPendingBlock *pending;
+    uint64_t pending_head;
+    uint64_t pending_tail;
+    pthread_mutex_t pending_mutex;  // also guards failed flags of destinations
 };
 typedef struct copy_priv CopyPriv;
 
@@ -62,15 +129,6 @@ struct ReadStrategyImpl {
     void (*close)(CopyPriv *copy_ctx);
 };
 
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512) // FIXME hardcode
 #define INDIVISIBLE_DEFECT_ZONE_SIZE_SECTORS 1000*1000  // 500 MB
 
-typedef enum SectorStatus {
-    SectorStatus_eUnread = 0,
-    SectorStatus_eReadOk = 1,
-    SectorStatus_eBlockReadError = 2,
-    SectorStatus_eSectorReadError = 3,
-} SectorStatus;
-
 #endif  // COPY_H
@@ -0,0 +1,386 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "copy_journal.h"
+#include "log.h"
+
+static uint32_t record_check(const DC_CopyJournalRecord *record) {
+    uint64_t x = record->lba ^ (record->sectors << 16) ^ ((uint64_t)record->status << 48) ^ 0x5a5aa5a5c3c3e1e1ULL;
+    return (uint32_t)x ^ (uint32_t)(x >> 32);
+}
+
+uint64_t dc_copy_journal_find(DC_CopyJournal *journal, uint64_t lba) {
+    uint64_t lo = 0;
+    uint64_t hi = journal->nb_extents;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (journal->extents[mid].end_lba <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Sets status of range in extents list, merging it with neighbours of the same status
+static int set_range(DC_CopyJournal *journal, uint64_t begin, uint64_t end, uint32_t status) {
+    DC_CopyJournalExtent *ext = journal->extents;
+    DC_CopyJournalExtent pieces[3];
+    int nb_pieces = 0;
+    uint64_t first = dc_copy_journal_find(journal, begin);
+    uint64_t last = first;  // extents first..last-1 overlap the range
+    while (last < journal->nb_extents && ext[last].begin_lba < end)
+        last++;
+
+    if (first < last && ext[first].begin_lba < begin)
+        pieces[nb_pieces++] = (DC_CopyJournalExtent){ ext[first].begin_lba, begin, ext[first].status, 0 };
+    if (status != SectorStatus_eUnread)
+        pieces[nb_pieces++] = (DC_CopyJournalExtent){ begin, end, status, 0 };
+    if (first < last && ext[last - 1].end_lba > end)
+        pieces[nb_pieces++] = (DC_CopyJournalExtent){ end, ext[last - 1].end_lba, ext[last - 1].status, 0 };
+
+    if (nb_pieces) {
+        if (first > 0 && ext[first - 1].end_lba == pieces[0].begin_lba && ext[first - 1].status == pieces[0].status) {
+            first--;
+            pieces[0].begin_lba = ext[first].begin_lba;
+        }
+        if (last < journal->nb_extents && ext[last].begin_lba == pieces[nb_pieces - 1].end_lba
+                && ext[last].status == pieces[nb_pieces - 1].status) {
+            pieces[nb_pieces - 1].end_lba = ext[last].end_lba;
+            last++;
+        }
+        int merged = 1;
+        for (int i = 1; i < nb_pieces; i++) {
+            if (pieces[merged - 1].status == pieces[i].status && pieces[merged - 1].end_lba == pieces[i].begin_lba)
+                pieces[merged - 1].end_lba = pieces[i].end_lba;
+            else
+                pieces[merged++] = pieces[i];
+        }
+        nb_pieces = merged;
+    }
+
+    uint64_t new_nb_extents = journal->nb_extents - (last - first) + nb_pieces;
+    if (new_nb_extents > journal->extents_allocated) {
+        // Splitting one extent adds two, which doubling of array loaded to exact size may not cover
+        uint64_t allocated = journal->extents_allocated ? journal->extents_allocated * 2 : 64;
+        if (allocated < new_nb_extents)
+            allocated = new_nb_extents;
+        ext = realloc(journal->extents, allocated * sizeof(*ext));
+        if (!ext)
+            return 1;
+        journal->extents = ext;
+        journal->extents_allocated = allocated;
+    }
+    memmove(&ext[first + nb_pieces], &ext[last], (journal->nb_extents - last) * sizeof(*ext));
+    memcpy(&ext[first], pieces, nb_pieces * sizeof(*ext));
+    journal->nb_extents = new_nb_extents;
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size) {
+    const uint8_t *p = buf;
+    while (size) {
+        ssize_t r = write(fd, p, size);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 1;
+        p += r;
+        size -= r;
+    }
+    return 0;
+}
+
+// Makes rename of file durable
+static int sync_dir(const char *path) {
+    char path_copy[strlen(path) + 1];
+    strcpy(path_copy, path);
+    int fd = open(dirname(path_copy), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return 1;
+    int r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+// Writes snapshot of extents to new file, which then replaces journal
+static int compact(DC_CopyJournal *journal) {
+    char tmp_path[strlen(journal->path) + 5];
+    DC_CopyJournalHeader header;
+    int r;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_NOATIME | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open %s\n", tmp_path);
+        return 1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DC_COPY_JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = DC_COPY_JOURNAL_VERSION;
+    header.nb_sectors = journal->nb_sectors;
+    header.nb_extents = journal->nb_extents;
+    r = write_full(fd, &header, sizeof(header));
+    if (!r)
+        r = write_full(fd, journal->extents, journal->nb_extents * sizeof(DC_CopyJournalExtent));
+    if (!r)
+        r = fdatasync(fd);
+    if (!r)
+        r = rename(tmp_path, journal->path);
+    if (!r)
+        r = sync_dir(journal->path);
+    if (r) {
+        dc_log(DC_LOG_ERROR, "Failed to write journal snapshot %s\n", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        return 1;
+    }
+    if (journal->fd != -1)
+        close(journal->fd);
+    journal->fd = fd;
+    journal->nb_records = 0;
+    return 0;
+}
+
+static int load(DC_CopyJournal *journal, uint64_t file_size) {
+    DC_CopyJournalHeader header;
+    if (pread(journal->fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.version != DC_COPY_JOURNAL_VERSION) {
+        dc_log(DC_LOG_ERROR, "Journal %s is damaged\n", journal->path);
+        return 1;
+    }
+    if (header.nb_sectors != journal->nb_sectors) {
+        dc_log(DC_LOG_ERROR, "Journal %s is of device of different size\n", journal->path);
+        return 1;
+    }
+    uint64_t snapshot_end = sizeof(header) + header.nb_extents * sizeof(DC_CopyJournalExtent);
+    if (file_size < snapshot_end) {
+        dc_log(DC_LOG_ERROR, "Journal %s is damaged\n", journal->path);
+        return 1;
+    }
+    journal->extents = malloc(header.nb_extents * sizeof(DC_CopyJournalExtent) + 1);
+    if (!journal->extents)
+        return 1;
+    journal->nb_extents = journal->extents_allocated = header.nb_extents;
+    if (header.nb_extents && pread(journal->fd, journal->extents, header.nb_extents * sizeof(DC_CopyJournalExtent), sizeof(header))
+            != (ssize_t)(header.nb_extents * sizeof(DC_CopyJournalExtent)))
+        return 1;
+    for (uint64_t i = 0; i < journal->nb_extents; i++) {
+        DC_CopyJournalExtent *e = &journal->extents[i];
+        if (e->begin_lba >= e->end_lba || e->end_lba > journal->nb_sectors
+                || (i > 0 && e->begin_lba < journal->extents[i - 1].end_lba)) {
+            dc_log(DC_LOG_ERROR, "Journal %s is damaged\n", journal->path);
+            return 1;
+        }
+    }
+
+    // Replay log
+    DC_CopyJournalRecord records[4096];
+    uint64_t offset = snapshot_end;
+    while (offset < file_size) {
+        ssize_t r = pread(journal->fd, records, sizeof(records), offset);
+        if (r < (ssize_t)sizeof(DC_CopyJournalRecord))
+            break;
+        int nb = r / sizeof(DC_CopyJournalRecord);
+        int i;
+        for (i = 0; i < nb; i++) {
+            DC_CopyJournalRecord *record = &records[i];
+            if (record->check != record_check(record) || !record->sectors
+                    || record->lba + record->sectors > journal->nb_sectors
+                    || record->status > SectorStatus_eSkipped)
+                break;
+            if (set_range(journal, record->lba, record->lba + record->sectors, record->status))
+                return 1;
+            journal->nb_records++;
+        }
+        offset += i * sizeof(DC_CopyJournalRecord);
+        if (i < nb)
+            break;
+    }
+    if (offset != file_size) {
+        // Torn record of interrupted update; next records must follow the valid ones
+        dc_log(DC_LOG_WARNING, "Discarding %"PRIu64" bytes of damaged journal tail\n", file_size - offset);
+        if (ftruncate(journal->fd, offset))
+            return 1;
+    }
+    return 0;
+}
+
+// Former format has one byte of SectorStatus per sector
+static int convert_legacy(DC_CopyJournal *journal) {
+    uint8_t *chunk = malloc(1*1024*1024);
+    if (!chunk)
+        return 1;
+    uint64_t run_begin = 0;
+    uint8_t run_status = SectorStatus_eUnread;
+    for (uint64_t lba = 0; lba < journal->nb_sectors;) {
+        uint64_t chunklen = journal->nb_sectors - lba < 1*1024*1024 ? journal->nb_sectors - lba : 1*1024*1024;
+        if (pread(journal->fd, chunk, chunklen, lba) != (ssize_t)chunklen)
+            goto fail;
+        for (uint64_t i = 0; i < chunklen; i++) {
+            if (chunk[i] == run_status)
+                continue;
+            if (run_status != SectorStatus_eUnread && set_range(journal, run_begin, lba + i, run_status))
+                goto fail;
+            run_begin = lba + i;
+            run_status = chunk[i] <= SectorStatus_eSectorReadError ? chunk[i] : SectorStatus_eUnread;
+        }
+        lba += chunklen;
+    }
+    if (run_status != SectorStatus_eUnread && set_range(journal, run_begin, journal->nb_sectors, run_status))
+        goto fail;
+    free(chunk);
+    dc_log(DC_LOG_INFO, "Journal %s is converted to extents format\n", journal->path);
+    return compact(journal);
+
+fail:
+    free(chunk);
+    return 1;
+}
+
+int dc_copy_journal_open(DC_CopyJournal *journal, const char *path, uint64_t nb_sectors) {
+    struct stat st;
+    char magic[8];
+    int r;
+
+    memset(journal, 0, sizeof(*journal));
+    journal->nb_sectors = nb_sectors;
+    journal->path = strdup(path);
+    if (!journal->path)
+        return 1;
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_NOATIME | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (journal->fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open journal file %s\n", path);
+        goto fail_open;
+    }
+    r = fstat(journal->fd, &st);
+    if (r)
+        goto fail;
+
+    if (st.st_size == 0) {
+        r = compact(journal);
+    } else if (pread(journal->fd, magic, sizeof(magic), 0) == sizeof(magic)
+            && !memcmp(magic, DC_COPY_JOURNAL_MAGIC, sizeof(magic))) {
+        r = load(journal, st.st_size);
+    } else if ((uint64_t)st.st_size == nb_sectors) {
+        r = convert_legacy(journal);
+    } else {
+        dc_log(DC_LOG_ERROR, "Wrong size of journal file %s\n", path);
+        r = 1;
+    }
+    if (r)
+        goto fail;
+    pthread_mutex_init(&journal->mutex, NULL);
+    return 0;
+
+fail:
+    free(journal->extents);
+    close(journal->fd);
+fail_open:
+    free(journal->path);
+    return 1;
+}
+
+void dc_copy_journal_close(DC_CopyJournal *journal) {
+    dc_copy_journal_commit(journal);
+    if (journal->nb_records)
+        compact(journal);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->mutex);
+    free(journal->pending);
+    free(journal->extents);
+    free(journal->path);
+}
+
+void dc_copy_journal_set_commit(DC_CopyJournal *journal, int (*sync_data)(void *opaque), void *opaque,
+        uint64_t interval_ms, uint64_t interval_bytes) {
+    journal->sync_data = sync_data;
+    journal->sync_opaque = opaque;
+    journal->commit_interval_ms = interval_ms;
+    journal->commit_interval_bytes = interval_bytes;
+    clock_gettime(CLOCK_MONOTONIC, &journal->last_commit);
+}
+
+static int commit_locked(DC_CopyJournal *journal) {
+    int r;
+    clock_gettime(CLOCK_MONOTONIC, &journal->last_commit);
+    if (!journal->nb_pending)
+        return 0;
+    // Journal must never claim data which may be lost
+    if (journal->sync_data && journal->sync_data(journal->sync_opaque)) {
+        dc_log(DC_LOG_ERROR, "Failed to sync destination\n");
+        return 1;
+    }
+    for (uint64_t i = 0; i < journal->nb_pending; i++)
+        journal->pending[i].check = record_check(&journal->pending[i]);
+    r = write_full(journal->fd, journal->pending, journal->nb_pending * sizeof(DC_CopyJournalRecord));
+    if (!r)
+        r = fdatasync(journal->fd);
+    if (r) {
+        dc_log(DC_LOG_ERROR, "Failed to write journal %s\n", journal->path);
+        return 1;
+    }
+    journal->nb_records += journal->nb_pending;
+    journal->nb_pending = 0;
+    journal->pending_bytes = 0;
+    if (journal->nb_records >= DC_COPY_JOURNAL_COMPACT_MIN_RECORDS && journal->nb_records > 4 * journal->nb_extents)
+        return compact(journal);
+    return 0;
+}
+
+int dc_copy_journal_commit(DC_CopyJournal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    int r = commit_locked(journal);
+    pthread_mutex_unlock(&journal->mutex);
+    return r;
+}
+
+static int commit_due(DC_CopyJournal *journal) {
+    struct timespec now;
+    if (journal->pending_bytes >= journal->commit_interval_bytes)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_ms = (now.tv_sec - journal->last_commit.tv_sec) * 1000
+        + (now.tv_nsec - journal->last_commit.tv_nsec) / 1000000;
+    return elapsed_ms >= journal->commit_interval_ms;
+}
+
+int dc_copy_journal_mark(DC_CopyJournal *journal, uint64_t lba, uint64_t sectors, SectorStatus status) {
+    int r;
+    pthread_mutex_lock(&journal->mutex);
+    r = set_range(journal, lba, lba + sectors, status);
+    if (r)
+        goto out;
+    DC_CopyJournalRecord *last = journal->nb_pending ? &journal->pending[journal->nb_pending - 1] : NULL;
+    if (last && last->status == status && last->lba + last->sectors == lba) {
+        last->sectors += sectors;
+    } else {
+        if (journal->nb_pending == journal->pending_allocated) {
+            uint64_t allocated = journal->pending_allocated ? journal->pending_allocated * 2 : 64;
+            DC_CopyJournalRecord *pending = realloc(journal->pending, allocated * sizeof(*pending));
+            if (!pending) {
+                r = 1;
+                goto out;
+            }
+            journal->pending = pending;
+            journal->pending_allocated = allocated;
+        }
+        journal->pending[journal->nb_pending++] = (DC_CopyJournalRecord){ lba, sectors, status, 0 };
+    }
+    // Nothing is written for skipped sectors, so they don't hasten commit
+    if (status != SectorStatus_eSkipped)
+        journal->pending_bytes += sectors * 512;
+    if (commit_due(journal))
+        r = commit_locked(journal);
+out:
+    pthread_mutex_unlock(&journal->mutex);
+    return r;
+}
@@ -0,0 +1,100 @@
+#ifndef COPY_JOURNAL_H
+#define COPY_JOURNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Journal of copy procedure: status of each sector of source, kept as sorted list of extents,
+ * so that its size depends on number of status changes rather than on size of disk.
+ * File is snapshot of extents list followed by log of updates, which are only appended.
+ * When log grows large compared to snapshot, file is rewritten as new snapshot
+ * and atomically renamed over the old one.
+ * Journal of former format, one byte of status per sector, is converted on open.
+ *
+ * Updates are kept in memory and committed in groups: data is synced first,
+ * then pending records are appended to log and log is synced. Thus after crash or power loss
+ * each sector which journal marks as read is on destination, and copy resumes from
+ * the last commit, losing at most one commit interval of work. Snapshots are written
+ * only on commit, so they never contain uncommitted updates.
+ */
+
+typedef enum SectorStatus {
+    SectorStatus_eUnread = 0,
+    SectorStatus_eReadOk = 1,
+    SectorStatus_eBlockReadError = 2,
+    SectorStatus_eSectorReadError = 3,
+    SectorStatus_eSkipped = 4,  // free space of file system, not copied
+} SectorStatus;
+
+#define DC_COPY_JOURNAL_MAGIC "XHDDCJNL"
+#define DC_COPY_JOURNAL_VERSION 1
+// Log is compacted when it has this many records and they outnumber extents in snapshot 4 times
+#define DC_COPY_JOURNAL_COMPACT_MIN_RECORDS 4096
+
+typedef struct dc_copy_journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t nb_sectors;
+    uint64_t nb_extents;  // in snapshot, which follows header
+} DC_CopyJournalHeader;
+
+typedef struct dc_copy_journal_extent {
+    uint64_t begin_lba;
+    uint64_t end_lba;  // LBA of the first sector beyond extent
+    uint32_t status;  // SectorStatus, never eUnread
+    uint32_t reserved;
+} DC_CopyJournalExtent;
+
+typedef struct dc_copy_journal_record {
+    uint64_t lba;
+    uint64_t sectors;
+    uint32_t status;
+    uint32_t check;  // to tell torn record at the end of log
+} DC_CopyJournalRecord;
+
+typedef struct dc_copy_journal {
+    char *path;
+    int fd;
+    uint64_t nb_sectors;
+    // Sorted and not overlapping, adjacent extents differ in status; unread sectors are not covered
+    DC_CopyJournalExtent *extents;
+    uint64_t nb_extents;
+    uint64_t extents_allocated;
+    uint64_t nb_records;  // in log after snapshot
+    pthread_mutex_t mutex;  // marks may come from several threads
+
+    // Group commit
+    DC_CopyJournalRecord *pending;  // not yet written records, adjacent ones of same status are merged
+    uint64_t nb_pending;
+    uint64_t pending_allocated;
+    uint64_t pending_bytes;  // amount of data covered by pending records
+    struct timespec last_commit;
+    int (*sync_data)(void *opaque);  // called before commit, NULL if none
+    void *sync_opaque;
+    uint64_t commit_interval_ms;
+    uint64_t commit_interval_bytes;
+} DC_CopyJournal;
+
+// Opens existing journal or creates new one, in which all sectors are unread
+int dc_copy_journal_open(DC_CopyJournal *journal, const char *path, uint64_t nb_sectors);
+// Commits pending updates, compacts journal and closes it
+void dc_copy_journal_close(DC_CopyJournal *journal);
+
+/**
+ * Sets how data which marks refer to is made durable, and how often pending marks are committed:
+ * when interval_ms passed since last commit, or interval_bytes of data are marked.
+ * sync_data returns non-zero on failure, then nothing is committed.
+ * Until this is called, each mark is committed immediately and no data is synced
+ */
+void dc_copy_journal_set_commit(DC_CopyJournal *journal, int (*sync_data)(void *opaque), void *opaque,
+        uint64_t interval_ms, uint64_t interval_bytes);
+// Data being marked must be written to data file already
+int dc_copy_journal_mark(DC_CopyJournal *journal, uint64_t lba, uint64_t sectors, SectorStatus status);
+int dc_copy_journal_commit(DC_CopyJournal *journal);
+// Index of first extent which ends beyond lba; nb_extents if none
+uint64_t dc_copy_journal_find(DC_CopyJournal *journal, uint64_t lba);
+
+#endif  // COPY_JOURNAL_H
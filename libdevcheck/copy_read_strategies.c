@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "copy.h"
 
@@ -11,15 +13,36 @@ typedef struct SkipfailStrategyCtx {
     int dummy;
 } SkipfailStrategyCtx;
 
+typedef struct MultipassStrategyCtx {
+    // Unread zones are areas not tried yet; they are swept at block level before anything is trimmed.
+    // Jump over failure, in sectors: it is halved each time no gap is left to jump into, down to single block
+    int64_t skip_sectors;
+    // Areas where read of several sectors at once failed. Defective flags mean that
+    // edge is trimmed, i.e. sector at it was read alone and failed
+    ZoneIndex failed_zones;
+    Zone *task_zone;  // failed zone which current task reads, NULL if task is in unread zone
+    int task_trim;  // otherwise task is scraping
+    int task_reverse;
+} MultipassStrategyCtx;
+
+typedef struct ExtentsFirstStrategyCtx {
+    // Priority extents, then metadata of file systems, each part in LBA order
+    DC_FsExtent *extents;
+    uint64_t nb_extents;
+    uint64_t next;  // extent being read; when all are, the rest goes to bulk strategy
+    int64_t next_lba;  // extent is read on from here, past blocks which failed
+    int task_first;  // current task reads one of extents
+} ExtentsFirstStrategyCtx;
+
 static int common_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, DC_BlockReport *report);
 
 static int plain_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
-    Zone *zone = priv->unread_zones;
+    Zone *zone = zone_index_first(&priv->unread_zones);
     priv->current_zone = zone;
     *lba_to_read = zone->begin_lba;
     *sectors_to_read = zone->end_lba - zone->begin_lba;
-    if (*sectors_to_read > SECTORS_AT_ONCE)
-        *sectors_to_read = SECTORS_AT_ONCE;
+    if (*sectors_to_read > (size_t)priv->blk_sectors)
+        *sectors_to_read = priv->blk_sectors;
     return 0;
 }
 
@@ -28,21 +51,10 @@ static int plain_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sector
     return report->blk_status;
 }
 
-static Zone *find_largest_zone(CopyPriv *priv) {
-    Zone *largest_zone = priv->unread_zones;
-    Zone *entry;
-    for (entry = priv->unread_zones->next; entry; entry = entry->next) {
-        if ((largest_zone->end_lba - largest_zone->begin_lba)
-                < (entry->end_lba - entry->begin_lba))
-            largest_zone = entry;
-    }
-    return largest_zone;
-}
-
 static int give_task_proceeding_current_zone(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
     Zone *entry = priv->current_zone;
     int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
-    *sectors_to_read = (zone_length_sectors < SECTORS_AT_ONCE) ? zone_length_sectors : SECTORS_AT_ONCE;
+    *sectors_to_read = (zone_length_sectors < priv->blk_sectors) ? zone_length_sectors : priv->blk_sectors;
     if (priv->current_zone_read_direction_reversive)
         *lba_to_read = entry->end_lba - *sectors_to_read;
     else
@@ -51,31 +63,37 @@ static int give_task_proceeding_current_zone(CopyPriv *priv, int64_t *lba_to_rea
 }
 
 static int smart_set_first_processable_zone_current(CopyPriv *priv) {
-    Zone *entry;
     // Search for zone with non-defective border (beginning or end)
-    for (entry = priv->unread_zones; entry; entry = entry->next) {
-        if (!entry->begin_lba_defective) {
-            priv->current_zone = entry;
-            priv->current_zone_read_direction_reversive = 0;
-            return 0;
-        }
-        if (priv->read_strategy == ReadStrategy_eSmartNoReverse)
-            continue;
-        if (!entry->end_lba_defective) {
-            priv->current_zone = entry;
-            priv->current_zone_read_direction_reversive = 1;
-            return 0;
-        }
-    }
-    return 1;
+    Zone *entry = zone_index_first_matching(&priv->unread_zones,
+            1, priv->read_strategy != ReadStrategy_eSmartNoReverse, INT64_MAX);
+    if (!entry)
+        return 1;
+    priv->current_zone = entry;
+    priv->current_zone_read_direction_reversive = entry->begin_lba_defective;
+    return 0;
+}
+
+// Splits zone at new_begin_lba, new zone gets the end part
+static Zone *split_zone(CopyPriv *priv, Zone *entry, int64_t new_begin_lba) {
+    Zone *newentry = calloc(1, sizeof(Zone));
+    assert(newentry);
+    newentry->end_lba = entry->end_lba;
+    newentry->end_lba_defective = entry->end_lba_defective;
+    newentry->begin_lba = new_begin_lba;
+    newentry->begin_lba -= (newentry->begin_lba % priv->blk_sectors);  // align to block size
+    assert((entry->begin_lba < newentry->begin_lba) && (newentry->begin_lba < newentry->end_lba));
+    entry->end_lba = newentry->begin_lba;
+    entry->end_lba_defective = 0;
+    zone_index_update(&priv->unread_zones, entry);
+    zone_index_insert(&priv->unread_zones, newentry);
+    return newentry;
 }
 
 static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
     int r;
     Zone *entry;
     SmartStrategyCtx *smart_ctx = priv->read_strategy_priv;
-    assert(priv->unread_zones);  // We should not be there if all space has been read
-    assert(priv->nb_zones);
+    assert(priv->unread_zones.nb_zones);  // We should not be there if all space has been read
 
     // If we have current zone and it is ok, proceed with it to avoid jumps
     if (priv->current_zone)
@@ -83,7 +101,7 @@ static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_
 
     if (smart_ctx->stage == 1) {
         // Consequentially read forward, ignoring errors
-        priv->current_zone = priv->unread_zones;
+        priv->current_zone = zone_index_first(&priv->unread_zones);
         priv->current_zone_read_direction_reversive = 0;
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     }
@@ -95,24 +113,12 @@ static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_
 
     // There are only zones with defective borders (both ends, in case of ReadStrategy_eSmart)
     // Find largest unread zone
-    entry = find_largest_zone(priv);
+    entry = zone_index_largest(&priv->unread_zones);
     assert(entry->begin_lba_defective);
     assert((priv->read_strategy == ReadStrategy_eSmartNoReverse) || entry->end_lba_defective);
     int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
-    if ((zone_length_sectors > INDIVISIBLE_DEFECT_ZONE_SIZE_SECTORS)  // Enough big zone to try in middle of it
-            && (priv->nb_zones < 1000)) {  // And we won't get in trouble of inflation of zones list
-        priv->nb_zones++;
-        Zone *newentry = calloc(1, sizeof(Zone));
-        assert(newentry);
-        newentry->next = entry->next;
-        entry->next = newentry;
-        newentry->end_lba = entry->end_lba;
-        newentry->end_lba_defective = entry->end_lba_defective;
-        newentry->begin_lba = entry->begin_lba + (zone_length_sectors / 2);
-        newentry->begin_lba -= (newentry->begin_lba % SECTORS_AT_ONCE);  // align to block size
-        assert((entry->begin_lba < newentry->begin_lba) && (newentry->begin_lba < newentry->end_lba));
-        entry->end_lba = newentry->begin_lba;
-        entry->end_lba_defective = 0;
+    if (zone_length_sectors > INDIVISIBLE_DEFECT_ZONE_SIZE_SECTORS) {  // Enough big zone to try in middle of it
+        split_zone(priv, entry, entry->begin_lba + (zone_length_sectors / 2));
 
         r = smart_set_first_processable_zone_current(priv);
         if (r)
@@ -120,7 +126,7 @@ static int smart_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     } else {
         smart_ctx->stage = 1;
-        priv->current_zone = priv->unread_zones;
+        priv->current_zone = zone_index_first(&priv->unread_zones);
         priv->current_zone_read_direction_reversive = 0;
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     }
@@ -152,20 +158,11 @@ static int common_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t secto
     assert(zone->begin_lba <= zone->end_lba);
     // Check if zone got zero length and remove it in such case
     if (zone->begin_lba == zone->end_lba) {
-        Zone *prev;
-        Zone *entry;
-        for (prev = NULL, entry = priv->unread_zones; entry; prev = entry, entry = entry->next) {
-            if (entry == zone) {
-                if (prev)
-                    prev->next = entry->next;
-                else
-                    priv->unread_zones = entry->next;
-                free(entry);
-                priv->nb_zones--;
-                break;
-            }
-        }
+        zone_index_remove(&priv->unread_zones, zone);
+        free(zone);
         priv->current_zone = NULL;
+    } else {
+        zone_index_update(&priv->unread_zones, zone);
     }
     return 0;
 }
@@ -174,57 +171,42 @@ static int skipfail_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *secto
     Zone *entry;
     SkipfailStrategyCtx *skipfail_ctx = priv->read_strategy_priv;
     (void)skipfail_ctx;
-    assert(priv->unread_zones);  // We should not be there if all space has been read
-    assert(priv->nb_zones);
+    assert(priv->unread_zones.nb_zones);  // We should not be there if all space has been read
 
     // If we have current zone and it is ok, proceed with it to avoid jumps
     if (priv->current_zone)
         return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
 
     // There are only zones with defective borders
-    entry = priv->unread_zones;
-    while (entry) {
-        int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
-        if (!entry->begin_lba_defective) {
-            priv->current_zone = entry;
+    int reverse_allowed = priv->read_strategy != ReadStrategy_eSkipfailNoReverse;
+    entry = zone_index_first_matching(&priv->unread_zones, 1, reverse_allowed, priv->skip_blocks * priv->blk_sectors);
+    if (!entry)
+        return 1;  // All remaining zones are too small to jump into them
+    int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
+    if (!entry->begin_lba_defective) {
+        priv->current_zone = entry;
+        priv->current_zone_read_direction_reversive = 0;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+    } else if (reverse_allowed
+            && !entry->end_lba_defective
+            && zone_index_next(entry) /* Don't read from end of disk */) {
+        priv->current_zone = entry;
+        priv->current_zone_read_direction_reversive = 1;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+    } else if ((zone_length_sectors > priv->skip_blocks * priv->blk_sectors)  // Enough big zone to try in middle of it
+            ) {
+        Zone *newentry = split_zone(priv, entry, entry->begin_lba + priv->skip_blocks * priv->blk_sectors);
+        if (!reverse_allowed) {
+            priv->current_zone = newentry;
             priv->current_zone_read_direction_reversive = 0;
-            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
-        } else if ((priv->read_strategy != ReadStrategy_eSkipfailNoReverse)
-                && !entry->end_lba_defective
-                && entry->next /* Don't read from end of disk */) {
+        } else {
             priv->current_zone = entry;
             priv->current_zone_read_direction_reversive = 1;
-            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
-        } else if ((zone_length_sectors > priv->skip_blocks * SECTORS_AT_ONCE)  // Enough big zone to try in middle of it
-                ) {
-            priv->nb_zones++;
-            Zone *newentry = calloc(1, sizeof(Zone));
-            assert(newentry);
-            newentry->next = entry->next;
-            entry->next = newentry;
-            newentry->end_lba = entry->end_lba;
-            newentry->end_lba_defective = entry->end_lba_defective;
-            newentry->begin_lba = entry->begin_lba + priv->skip_blocks * SECTORS_AT_ONCE;
-            newentry->begin_lba -= (newentry->begin_lba % SECTORS_AT_ONCE);  // align to block size
-            assert((entry->begin_lba < newentry->begin_lba) && (newentry->begin_lba < newentry->end_lba));
-            entry->end_lba = newentry->begin_lba;
-            entry->end_lba_defective = 0;
-            //fprintf(stderr, "Made up new zone. New zones list:\n");
-            //for (Zone *iter = priv->unread_zones; iter; iter = iter->next) {
-            //    fprintf(stderr, "begin_lba %"PRId64", end_lba %"PRId64"; begin defective: %d, end defective: %d\n", iter->begin_lba, iter->end_lba, iter->begin_lba_defective, iter->end_lba_defective);
-            //}
-            if (priv->read_strategy == ReadStrategy_eSkipfailNoReverse) {
-                priv->current_zone = newentry;
-                priv->current_zone_read_direction_reversive = 0;
-            } else {
-                priv->current_zone = entry;
-                priv->current_zone_read_direction_reversive = 1;
-            }
-            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
         }
-        entry = entry->next;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
     }
-    return 1;  // All remaining zones are too small to jump into them
+    // Only the last zone, at the end of disk, has non-defective end, and it is too small
+    return 1;
 }
 
 static int skipfail_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, DC_BlockReport *report) {
@@ -236,6 +218,186 @@ static int skipfail_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sec
     return 0;
 }
 
+static void multipass_add_failed_zone(MultipassStrategyCtx *multipass_ctx, int64_t begin_lba, int64_t end_lba) {
+    Zone *zone = calloc(1, sizeof(Zone));
+    assert(zone);
+    zone->begin_lba = begin_lba;
+    zone->end_lba = end_lba;
+    zone_index_insert(&multipass_ctx->failed_zones, zone);
+}
+
+static int multipass_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
+    MultipassStrategyCtx *multipass_ctx = priv->read_strategy_priv;
+    ZoneIndex *unread = &priv->unread_zones;
+    Zone *entry;
+
+    multipass_ctx->task_zone = NULL;
+    while (unread->nb_zones) {
+        // Sweep: read forward while it succeeds
+        entry = zone_index_first_matching(unread, 1, 0, INT64_MAX);
+        if (entry) {
+            priv->current_zone = entry;
+            priv->current_zone_read_direction_reversive = 0;
+            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+        }
+        // Jump forward over failure
+        entry = zone_index_first_matching(unread, 0, 0, multipass_ctx->skip_sectors);
+        if (entry) {
+            priv->current_zone = split_zone(priv, entry, entry->begin_lba + multipass_ctx->skip_sectors);
+            priv->current_zone_read_direction_reversive = 0;
+            return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+        }
+        // Remaining gaps are skipped over, not tried inside: they are swept again with shorter jump.
+        // Reading them forward from farther point costs one seek, reading backward costs one per block
+        if (multipass_ctx->skip_sectors > priv->blk_sectors) {
+            multipass_ctx->skip_sectors /= 2;
+            if (multipass_ctx->skip_sectors < priv->blk_sectors)
+                multipass_ctx->skip_sectors = priv->blk_sectors;
+            continue;
+        }
+        // Gaps of single block are left, read them as they are
+        priv->current_zone = zone_index_first(unread);
+        priv->current_zone_read_direction_reversive = 0;
+        return give_task_proceeding_current_zone(priv, lba_to_read, sectors_to_read);
+    }
+
+    priv->current_zone = NULL;
+    if (!multipass_ctx->failed_zones.nb_zones)
+        return 1;
+    // Trim: read single sectors from edges of failed areas until bad sector is met
+    entry = zone_index_first_matching(&multipass_ctx->failed_zones, 1, 1, INT64_MAX);
+    if (entry) {
+        multipass_ctx->task_zone = entry;
+        multipass_ctx->task_trim = 1;
+        multipass_ctx->task_reverse = entry->begin_lba_defective;
+        *lba_to_read = multipass_ctx->task_reverse ? entry->end_lba - 1 : entry->begin_lba;
+        *sectors_to_read = 1;
+        return 0;
+    }
+    // Scrape: read first half of trimmed area, halving it further on failure
+    entry = zone_index_first(&multipass_ctx->failed_zones);
+    int64_t zone_length_sectors = entry->end_lba - entry->begin_lba;
+    multipass_ctx->task_zone = entry;
+    multipass_ctx->task_trim = 0;
+    *lba_to_read = entry->begin_lba;
+    *sectors_to_read = zone_length_sectors > 1 ? zone_length_sectors / 2 : 1;
+    if (*sectors_to_read > (size_t)priv->blk_sectors)
+        *sectors_to_read = priv->blk_sectors;
+    return 0;
+}
+
+static int multipass_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, DC_BlockReport *report) {
+    MultipassStrategyCtx *multipass_ctx = priv->read_strategy_priv;
+    Zone *zone = multipass_ctx->task_zone;
+    int read_failed = report->blk_status;
+
+    // Sectors of failed multi-sector read are read again later, by smaller pieces
+    if (read_failed && sectors_to_read > 1)
+        priv->sectors_to_reread += sectors_to_read;
+
+    if (!zone) {
+        common_update_zones(priv, lba_to_read, sectors_to_read, report);
+        if (read_failed) {
+            if (sectors_to_read > 1)
+                multipass_add_failed_zone(multipass_ctx, lba_to_read, lba_to_read + sectors_to_read);
+            priv->current_zone = NULL;
+        }
+        return 0;
+    }
+
+    if (multipass_ctx->task_trim) {
+        if (multipass_ctx->task_reverse) {
+            zone->end_lba--;
+            zone->end_lba_defective = read_failed;
+        } else {
+            zone->begin_lba++;
+            zone->begin_lba_defective = read_failed;
+        }
+    } else if (!read_failed || sectors_to_read == 1) {
+        // Single sector which failed while scraping is given up
+        zone->begin_lba += sectors_to_read;
+    } else {
+        Zone *rest = calloc(1, sizeof(Zone));
+        assert(rest);
+        rest->begin_lba = lba_to_read + sectors_to_read;
+        rest->end_lba = zone->end_lba;
+        rest->begin_lba_defective = rest->end_lba_defective = 1;
+        zone->end_lba = rest->begin_lba;
+        zone_index_update(&multipass_ctx->failed_zones, zone);
+        zone_index_insert(&multipass_ctx->failed_zones, rest);
+    }
+
+    if (zone->begin_lba == zone->end_lba) {
+        zone_index_remove(&multipass_ctx->failed_zones, zone);
+        free(zone);
+    } else {
+        zone_index_update(&multipass_ctx->failed_zones, zone);
+    }
+    multipass_ctx->task_zone = NULL;
+    return 0;
+}
+
+static int extents_first_get_task(CopyPriv *priv, int64_t *lba_to_read, size_t *sectors_to_read) {
+    ExtentsFirstStrategyCtx *first_ctx = priv->first_strategy_priv;
+    first_ctx->task_first = 0;
+    while (first_ctx->next < first_ctx->nb_extents) {
+        DC_FsExtent *extent = &first_ctx->extents[first_ctx->next];
+        int64_t from_lba = first_ctx->next_lba > (int64_t)extent->begin_lba ? first_ctx->next_lba : (int64_t)extent->begin_lba;
+        Zone *zone = zone_index_find(&priv->unread_zones, from_lba);
+        // What is left of extent is read already, or failed
+        if (!zone || zone->begin_lba >= (int64_t)extent->end_lba) {
+            first_ctx->next++;
+            first_ctx->next_lba = 0;
+            priv->current_zone = NULL;
+            continue;
+        }
+        // Zone is split at block boundary, so a few sectors before extent may be read with it
+        if (zone->begin_lba + priv->blk_sectors <= from_lba)
+            zone = split_zone(priv, zone, from_lba);
+        priv->current_zone = zone;
+        priv->current_zone_read_direction_reversive = 0;
+        first_ctx->task_first = 1;
+        *lba_to_read = zone->begin_lba;
+        *sectors_to_read = extent->end_lba - zone->begin_lba;
+        if (*sectors_to_read > (size_t)(zone->end_lba - zone->begin_lba))
+            *sectors_to_read = zone->end_lba - zone->begin_lba;
+        if (*sectors_to_read > (size_t)priv->blk_sectors)
+            *sectors_to_read = priv->blk_sectors;
+        return 0;
+    }
+    return priv->bulk_strategy_impl->get_task(priv, lba_to_read, sectors_to_read);
+}
+
+static int extents_first_update_zones(CopyPriv *priv, int64_t lba_to_read, size_t sectors_to_read, DC_BlockReport *report) {
+    ExtentsFirstStrategyCtx *first_ctx = priv->first_strategy_priv;
+    if (!first_ctx->task_first)
+        return priv->bulk_strategy_impl->use_results(priv, lba_to_read, sectors_to_read, report);
+    if (report->blk_status) {
+        // Failed block stays unread as zone of its own, with defective borders, for bulk strategy to deal with
+        // as with its own failures. Reading of extent goes on past it
+        Zone *zone = priv->current_zone;
+        int64_t end_lba = lba_to_read + sectors_to_read;
+        if (end_lba < zone->end_lba) {
+            Zone *rest = calloc(1, sizeof(Zone));
+            assert(rest);
+            rest->begin_lba = end_lba;
+            rest->end_lba = zone->end_lba;
+            rest->end_lba_defective = zone->end_lba_defective;
+            zone->end_lba = end_lba;
+            zone->end_lba_defective = 1;
+            zone_index_insert(&priv->unread_zones, rest);
+        }
+        zone->begin_lba_defective = 1;
+        zone_index_update(&priv->unread_zones, zone);
+        priv->sectors_to_reread += sectors_to_read;
+        priv->current_zone = NULL;
+        first_ctx->next_lba = end_lba;
+        return 0;
+    }
+    common_update_zones(priv, lba_to_read, sectors_to_read, report);
+    return 0;
+}
+
 int plain_init(CopyPriv *copy_ctx) {
     (void)copy_ctx;
     return 0;
@@ -269,6 +431,54 @@ void skipfail_close(CopyPriv *copy_ctx) {
     free(copy_ctx->read_strategy_priv);
 }
 
+int multipass_init(CopyPriv *copy_ctx) {
+    copy_ctx->read_strategy_priv = calloc(1, sizeof(MultipassStrategyCtx));
+    assert(copy_ctx->read_strategy_priv);
+    MultipassStrategyCtx *multipass_ctx = copy_ctx->read_strategy_priv;
+    multipass_ctx->skip_sectors = copy_ctx->skip_blocks * copy_ctx->blk_sectors;
+    if (multipass_ctx->skip_sectors < copy_ctx->blk_sectors)
+        multipass_ctx->skip_sectors = copy_ctx->blk_sectors;
+    if (!copy_ctx->use_journal)
+        return 0;
+    // Resume: areas which failed at block level are trimmed and scraped again
+    DC_CopyJournal *journal = &copy_ctx->journal;
+    for (uint64_t i = 0; i < journal->nb_extents; i++) {
+        if (journal->extents[i].status != SectorStatus_eBlockReadError)
+            continue;
+        multipass_add_failed_zone(multipass_ctx, journal->extents[i].begin_lba, journal->extents[i].end_lba);
+        copy_ctx->sectors_to_reread += journal->extents[i].end_lba - journal->extents[i].begin_lba;
+    }
+    return 0;
+}
+
+void multipass_close(CopyPriv *copy_ctx) {
+    MultipassStrategyCtx *multipass_ctx = copy_ctx->read_strategy_priv;
+    zone_index_clear(&multipass_ctx->failed_zones);
+    free(copy_ctx->read_strategy_priv);
+}
+
+int extents_first_init(CopyPriv *copy_ctx) {
+    copy_ctx->first_strategy_priv = calloc(1, sizeof(ExtentsFirstStrategyCtx));
+    assert(copy_ctx->first_strategy_priv);
+    ExtentsFirstStrategyCtx *first_ctx = copy_ctx->first_strategy_priv;
+    // Without map of file systems, there is no metadata to read first
+    uint64_t nb_metadata = copy_ctx->metadata_first && copy_ctx->use_fs_map ? copy_ctx->fs_map.nb_metadata : 0;
+    first_ctx->nb_extents = copy_ctx->nb_priority_extents + nb_metadata;
+    first_ctx->extents = malloc((first_ctx->nb_extents + 1) * sizeof(DC_FsExtent));
+    assert(first_ctx->extents);
+    memcpy(first_ctx->extents, copy_ctx->priority_extents, copy_ctx->nb_priority_extents * sizeof(DC_FsExtent));
+    if (nb_metadata)
+        memcpy(first_ctx->extents + copy_ctx->nb_priority_extents, copy_ctx->fs_map.metadata, nb_metadata * sizeof(DC_FsExtent));
+    return copy_ctx->bulk_strategy_impl->init(copy_ctx);
+}
+
+void extents_first_close(CopyPriv *copy_ctx) {
+    ExtentsFirstStrategyCtx *first_ctx = copy_ctx->first_strategy_priv;
+    copy_ctx->bulk_strategy_impl->close(copy_ctx);
+    free(first_ctx->extents);
+    free(first_ctx);
+}
+
 ReadStrategyImpl read_strategy_plain = {
     .name = "plain",
     .init = plain_init,
@@ -308,3 +518,19 @@ ReadStrategyImpl read_strategy_skipfail_noreverse = {
     .use_results = skipfail_update_zones,
     .close = skipfail_close,
 };
+
+ReadStrategyImpl read_strategy_multipass = {
+    .name = "multipass",
+    .init = multipass_init,
+    .get_task = multipass_get_task,
+    .use_results = multipass_update_zones,
+    .close = multipass_close,
+};
+
+ReadStrategyImpl read_strategy_extents_first = {
+    .name = "extents_first",
+    .init = extents_first_init,
+    .get_task = extents_first_get_task,
+    .use_results = extents_first_update_zones,
+    .close = extents_first_close,
+};
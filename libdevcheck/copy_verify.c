@@ -0,0 +1,172 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "procedure.h"
+#include "merkle.h"
+#include "image.h"
+
+struct copy_verify_priv {
+    const char *dst_file;
+    int64_t threads;
+    int fd;
+    int use_image;
+    DC_Image image;
+    DC_Merkle merkle;
+    DC_MerklePool pool;
+    uint64_t next_chunk;
+    uint64_t nb_mismatches;
+    uint64_t nb_missing;
+    uint64_t nb_read_errors;
+};
+typedef struct copy_verify_priv CopyVerifyPriv;
+
+static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
+    (void)dev;
+    if (!strcmp(setting->name, "dst_file")) {
+        setting->value = strdup("");
+    } else if (!strcmp(setting->name, "threads")) {
+        setting->value = strdup("4");
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+static ssize_t image_read(void *opaque, void *buf, size_t size, uint64_t offset) {
+    return dc_image_pread(opaque, buf, size, offset);
+}
+
+static void close_image(CopyVerifyPriv *priv) {
+    if (priv->use_image)
+        dc_image_close(&priv->image);
+    else
+        close(priv->fd);
+}
+
+static int Open(DC_ProcedureCtx *ctx) {
+    int r;
+    CopyVerifyPriv *priv = ctx->priv;
+    char hashes_file_name[100];
+
+    if (priv->threads < 1)
+        return 1;
+    snprintf(hashes_file_name, sizeof(hashes_file_name), "whdd_copy_hashes__%s__%s", ctx->dev->model_str, ctx->dev->serial_no);
+    r = dc_merkle_open(&priv->merkle, hashes_file_name, ctx->dev->capacity / 512, 0);
+    if (r) {
+        dc_log(DC_LOG_FATAL, "No hashes of copy of this device, it must be copied with hash=yes\n");
+        return 1;
+    }
+    priv->use_image = dc_image_probe(priv->dst_file, NULL);
+    if (priv->use_image) {
+        r = dc_image_open(&priv->image, priv->dst_file, 0, 0);
+    } else {
+        // Raw image is read from media rather than from page cache, where possible
+        priv->fd = open(priv->dst_file, O_RDONLY | O_DIRECT | O_LARGEFILE | O_NOATIME);
+        if (priv->fd == -1 && errno == EINVAL)
+            priv->fd = open(priv->dst_file, O_RDONLY | O_LARGEFILE | O_NOATIME);
+        r = priv->fd == -1;
+    }
+    if (r) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", priv->dst_file);
+        goto fail_open;
+    }
+    r = dc_merkle_pool_start(&priv->pool, &priv->merkle, priv->use_image ? image_read : dc_merkle_read_fd,
+            priv->use_image ? (void*)&priv->image : (void*)&priv->fd, priv->threads, 1);
+    if (r) {
+        dc_log(DC_LOG_FATAL, "Failed to start hashing threads\n");
+        goto fail_pool;
+    }
+    ctx->blk_size = priv->merkle.header->chunk_sectors * 512;
+    ctx->progress.den = priv->merkle.header->nb_chunks;
+    return 0;
+
+fail_pool:
+    close_image(priv);
+fail_open:
+    dc_merkle_close(&priv->merkle);
+    return 1;
+}
+
+static int Perform(DC_ProcedureCtx *ctx) {
+    CopyVerifyPriv *priv = ctx->priv;
+    uint64_t chunk = priv->next_chunk++;
+    uint32_t time_us;
+    uint64_t chunk_sectors = priv->merkle.header->chunk_sectors;
+
+    DC_MerkleResult result = dc_merkle_pool_wait(&priv->pool, chunk, &time_us);
+    ctx->report.lba = chunk * chunk_sectors;
+    ctx->report.sectors_processed = chunk_sectors;
+    if (ctx->report.lba + chunk_sectors > priv->merkle.header->nb_sectors)
+        ctx->report.sectors_processed = priv->merkle.header->nb_sectors - ctx->report.lba;
+    ctx->report.blk_access_time = time_us;
+    ctx->report.blk_status = DC_BlockStatus_eOk;
+    switch (result) {
+        case DC_MerkleResult_eMismatch:
+            dc_log(DC_LOG_ERROR, "Image differs from copied data at LBA %"PRIu64"-%"PRIu64"\n",
+                    ctx->report.lba, ctx->report.lba + ctx->report.sectors_processed - 1);
+            ctx->report.blk_status = DC_BlockStatus_eError;
+            priv->nb_mismatches++;
+            break;
+        case DC_MerkleResult_eMissing:
+            ctx->report.blk_status = DC_BlockStatus_eWarning;
+            priv->nb_missing++;
+            break;
+        case DC_MerkleResult_eReadError:
+            ctx->report.blk_status = DC_BlockStatus_eError;
+            priv->nb_read_errors++;
+            break;
+        default:
+            break;
+    }
+    ctx->progress.num++;
+    return 0;
+}
+
+static void Close(DC_ProcedureCtx *ctx) {
+    CopyVerifyPriv *priv = ctx->priv;
+    char root_hex[2 * DC_SHA256_SIZE + 1];
+
+    dc_merkle_pool_stop(&priv->pool);
+    if (priv->nb_missing)
+        dc_log(DC_LOG_WARNING, "%"PRIu64" chunks were not hashed, copying is incomplete\n", priv->nb_missing);
+    if (priv->nb_read_errors)
+        dc_log(DC_LOG_ERROR, "%"PRIu64" chunks of image failed to be read\n", priv->nb_read_errors);
+    if (priv->next_chunk == priv->merkle.header->nb_chunks && !priv->nb_mismatches && !priv->nb_missing
+            && !priv->nb_read_errors && priv->merkle.header->root_valid) {
+        dc_sha256_to_hex(priv->merkle.header->root, root_hex);
+        dc_log(DC_LOG_INFO, "Image matches digest %s\n", root_hex);
+    } else if (priv->nb_mismatches) {
+        dc_log(DC_LOG_ERROR, "%"PRIu64" chunks of image differ from copied data\n", priv->nb_mismatches);
+    }
+    close_image(priv);
+    dc_merkle_close(&priv->merkle);
+}
+
+static DC_ProcedureOption options[] = {
+    { "dst_file", "set path of image to verify", offsetof(CopyVerifyPriv, dst_file), DC_ProcedureOptionType_eString },
+    { "threads", "set number of chunks read and hashed in parallel", offsetof(CopyVerifyPriv, threads), DC_ProcedureOptionType_eInt64 },
+    { NULL }
+};
+
+DC_Procedure copy_verify = {
+    .name = "copy_verify",
+    .display_name = "Copy verification",
+    .help = "Verifies image made by \"copy\" procedure with hash=yes: image is read and hashed by 1 MiB chunks "
+        "in several threads, and each chunk is compared with hash of data which was copied. "
+        "Chunks which differ are reported as errors. If all match, image digest is reported.\n"
+        "Parameters:\n"
+        "dst_file: image file or device, \"dst_file\" of copying; compressed image is recognized by itself.\n"
+        "threads: number of chunks read and hashed in parallel.\n",
+    .suggest_default_value = SuggestDefaultValue,
+    .open = Open,
+    .perform = Perform,
+    .close = Close,
+    .priv_data_size = sizeof(CopyVerifyPriv),
+    .flags = DC_PROC_FLAG_DESTINATION,
+    .options = options,
+};
@@ -0,0 +1,175 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "copy_writer.h"
+#include "log.h"
+
+static void *writer_thread_proc(void *arg) {
+    DC_CopyWriter *writer = arg;
+    struct iovec iov[DC_COPY_WRITER_MAX_RUN];
+
+    pthread_mutex_lock(&writer->mutex);
+    while (1) {
+        while (writer->head == writer->tail && !writer->stop)
+            pthread_cond_wait(&writer->queued_cond, &writer->mutex);
+        if (writer->head == writer->tail)
+            break;
+
+        // Take run of adjacent blocks from queue head
+        DC_CopyWriterBlock *first = &writer->queue[writer->head % writer->nb_buffers];
+        int64_t run_end = first->lba + first->sectors;
+        int nb_blocks = 1;
+        while (nb_blocks < DC_COPY_WRITER_MAX_RUN && writer->head + nb_blocks != writer->tail) {
+            DC_CopyWriterBlock *block = &writer->queue[(writer->head + nb_blocks) % writer->nb_buffers];
+            if (block->lba != run_end)
+                break;
+            run_end += block->sectors;
+            nb_blocks++;
+        }
+        int failed = writer->failed;
+        pthread_mutex_unlock(&writer->mutex);
+
+        // Queue entries of run are not touched by reader until they are freed below.
+        // With sparse destination, run is cut where blocks change from data to zeros or back
+        int zero = 0;
+        for (int i = 0; i < nb_blocks; i++) {
+            DC_CopyWriterBlock *block = &writer->queue[(writer->head + i) % writer->nb_buffers];
+            if (writer->sparse && writer->sparse->mode != DC_SparseMode_eNone) {
+                if (block->zero == -1)
+                    block->zero = dc_buffer_is_zero(block->buf, block->sectors * 512);
+                if (i == 0) {
+                    zero = block->zero;
+                } else if (block->zero != zero) {
+                    nb_blocks = i;
+                    run_end = block->lba;
+                    break;
+                }
+            }
+            iov[i].iov_base = block->buf;
+            iov[i].iov_len = block->sectors * 512;
+        }
+        if (!failed) {
+            if (writer->image) {
+                for (int i = 0; i < nb_blocks && !failed; i++) {
+                    DC_CopyWriterBlock *block = &writer->queue[(writer->head + i) % writer->nb_buffers];
+                    failed = dc_image_write(writer->image, block->lba, block->sectors, block->buf);
+                }
+            } else if (!zero || dc_sparse_dst_zero(writer->sparse, first->lba, run_end - first->lba)) {
+                failed = dc_dst_io_pwritev(writer->dst, iov, nb_blocks, first->lba * 512);
+            }
+            if (failed) {
+                dc_log(DC_LOG_ERROR, "Writing to destination at LBA %"PRId64" failed, errno %d\n", first->lba, errno);
+            } else {
+                for (int i = 0; writer->block_written_cb && i < nb_blocks; i++) {
+                    DC_CopyWriterBlock *block = &writer->queue[(writer->head + i) % writer->nb_buffers];
+                    writer->block_written_cb(writer->opaque, block->lba, block->sectors, block->buf);
+                }
+            }
+        }
+
+        pthread_mutex_lock(&writer->mutex);
+        if (failed)
+            writer->failed = 1;
+        for (int i = 0; i < nb_blocks; i++)
+            writer->free_bufs[writer->nb_free++] = writer->queue[(writer->head + i) % writer->nb_buffers].buf;
+        writer->head += nb_blocks;
+        pthread_cond_signal(&writer->freed_cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+int dc_copy_writer_open(DC_CopyWriter *writer, DC_DstIo *dst, DC_SparseDst *sparse, DC_Image *image,
+        int nb_buffers, size_t buf_size,
+        void (*block_written_cb)(void *opaque, int64_t lba, size_t sectors, const void *buf), void *opaque) {
+    int r;
+    memset(writer, 0, sizeof(*writer));
+    writer->dst = dst;
+    writer->sparse = sparse;
+    writer->image = image;
+    writer->nb_buffers = nb_buffers;
+    writer->buf_size = buf_size;
+    writer->block_written_cb = block_written_cb;
+    writer->opaque = opaque;
+
+    r = posix_memalign(&writer->bufs, sysconf(_SC_PAGESIZE), buf_size * nb_buffers);
+    if (r)
+        goto fail_bufs;
+    writer->free_bufs = calloc(nb_buffers, sizeof(void*));
+    if (!writer->free_bufs)
+        goto fail_free_bufs;
+    writer->queue = calloc(nb_buffers, sizeof(DC_CopyWriterBlock));
+    if (!writer->queue)
+        goto fail_queue;
+    for (int i = 0; i < nb_buffers; i++)
+        writer->free_bufs[i] = (uint8_t*)writer->bufs + i * buf_size;
+    writer->nb_free = nb_buffers;
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->queued_cond, NULL);
+    pthread_cond_init(&writer->freed_cond, NULL);
+    r = pthread_create(&writer->tid, NULL, writer_thread_proc, writer);
+    if (r)
+        goto fail_thread;
+    return 0;
+
+fail_thread:
+    pthread_cond_destroy(&writer->freed_cond);
+    pthread_cond_destroy(&writer->queued_cond);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->queue);
+fail_queue:
+    free(writer->free_bufs);
+fail_free_bufs:
+    free(writer->bufs);
+fail_bufs:
+    return 1;
+}
+
+int dc_copy_writer_close(DC_CopyWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->queued_cond);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->tid, NULL);
+
+    pthread_cond_destroy(&writer->freed_cond);
+    pthread_cond_destroy(&writer->queued_cond);
+    pthread_mutex_destroy(&writer->mutex);
+    free(writer->queue);
+    free(writer->free_bufs);
+    free(writer->bufs);
+    return writer->failed;
+}
+
+void *dc_copy_writer_get_buffer(DC_CopyWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    while (!writer->nb_free)
+        pthread_cond_wait(&writer->freed_cond, &writer->mutex);
+    void *buf = writer->free_bufs[--writer->nb_free];
+    pthread_mutex_unlock(&writer->mutex);
+    return buf;
+}
+
+void dc_copy_writer_queue(DC_CopyWriter *writer, void *buf, int64_t lba, size_t sectors) {
+    pthread_mutex_lock(&writer->mutex);
+    DC_CopyWriterBlock *block = &writer->queue[writer->tail % writer->nb_buffers];
+    block->buf = buf;
+    block->lba = lba;
+    block->sectors = sectors;
+    block->zero = -1;
+    writer->tail++;
+    pthread_cond_signal(&writer->queued_cond);
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+int dc_copy_writer_failed(DC_CopyWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    int failed = writer->failed;
+    pthread_mutex_unlock(&writer->mutex);
+    return failed;
+}
@@ -0,0 +1,66 @@
+#ifndef COPY_WRITER_H
+#define COPY_WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "dst_io.h"
+#include "sparse_dst.h"
+#include "image.h"
+
+/*
+ * Destination writer of copy procedure, running in its own thread so that source reading
+ * never waits on destination. Blocks are read into buffers of fixed pool and queued;
+ * writer thread takes them in FIFO order and writes runs of adjacent ones with single pwritev().
+ * When all buffers are queued, reader waits for one to be written: that bounds memory
+ * and the amount of data lost on crash.
+ * With sparse destination, blocks of zeros are not written: runs of them are deallocated instead.
+ * With image destination, blocks are passed to image, which compresses them.
+ */
+
+#define DC_COPY_WRITER_MAX_RUN 64  // blocks coalesced into one write at most
+
+typedef struct dc_copy_writer_block {
+    int64_t lba;
+    size_t sectors;
+    void *buf;
+    int zero;  // -1 until checked by writer thread
+} DC_CopyWriterBlock;
+
+typedef struct dc_copy_writer {
+    DC_DstIo *dst;
+    DC_SparseDst *sparse;  // NULL if zeros are written as any data
+    DC_Image *image;  // written instead of dst, if set
+    int nb_buffers;
+    size_t buf_size;
+    void *bufs;
+    void **free_bufs;  // stack
+    int nb_free;
+    DC_CopyWriterBlock *queue;  // ring of nb_buffers entries, queued blocks are head..tail
+    uint64_t head;
+    uint64_t tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued_cond;
+    pthread_cond_t freed_cond;
+    pthread_t tid;
+    int stop;
+    int failed;  // set on first failed write; data queued after that is dropped
+    // Called from writer thread for each block of run which is written successfully, in order of queueing,
+    // while buffer is valid
+    void (*block_written_cb)(void *opaque, int64_t lba, size_t sectors, const void *buf);
+    void *opaque;
+} DC_CopyWriter;
+
+int dc_copy_writer_open(DC_CopyWriter *writer, DC_DstIo *dst, DC_SparseDst *sparse, DC_Image *image,
+        int nb_buffers, size_t buf_size,
+        void (*block_written_cb)(void *opaque, int64_t lba, size_t sectors, const void *buf), void *opaque);
+// Writes out all queued blocks, stops thread and releases buffers. Returns 1 if some write failed
+int dc_copy_writer_close(DC_CopyWriter *writer);
+
+// Waits until a buffer is free
+void *dc_copy_writer_get_buffer(DC_CopyWriter *writer);
+void dc_copy_writer_queue(DC_CopyWriter *writer, void *buf, int64_t lba, size_t sectors);
+int dc_copy_writer_failed(DC_CopyWriter *writer);
+
+#endif  // COPY_WRITER_H
@@ -13,6 +13,7 @@ struct dc_dev {
     uint64_t capacity;
     uint64_t native_capacity;
     int mounted;
+    struct dc_virtual_dev *virt;  // image and faults of virtual device, NULL for real one
     struct dc_dev *next;
 };
 
@@ -0,0 +1,146 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dst_io.h"
+#include "log.h"
+
+int dc_dst_io_open(DC_DstIo *dst, const char *path, int flags, int direct) {
+    memset(dst, 0, sizeof(*dst));
+    dst->fd = -1;
+    if (direct) {
+        dst->fd = open(path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+        if (dst->fd == -1 && errno != EINVAL)
+            return 1;
+        if (dst->fd == -1)
+            dc_log(DC_LOG_INFO, "Destination doesn't support direct I/O, it is written through page cache\n");
+    }
+    dst->direct = dst->fd != -1;
+    dst->buffered_fd = open(path, flags, S_IRUSR | S_IWUSR);
+    if (dst->buffered_fd == -1) {
+        if (dst->direct)
+            close(dst->fd);
+        return 1;
+    }
+    if (!dst->direct) {
+        dst->fd = dst->buffered_fd;
+        dst->write_behind = 1;
+    }
+    return 0;
+}
+
+// Waits for writeback of oldest range and drops it from page cache
+static void drop_oldest(DC_DstIo *dst) {
+    DC_DstIoRange *range = &dst->pending[dst->pending_head % DC_DST_IO_WRITE_BEHIND_RANGES];
+    sync_file_range(dst->buffered_fd, range->offset, range->size,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(dst->buffered_fd, range->offset, range->size, POSIX_FADV_DONTNEED);
+    dst->pending_bytes -= range->size;
+    dst->pending_head++;
+}
+
+static void write_behind(DC_DstIo *dst, off_t offset, off_t size) {
+    if (!dst->write_behind)
+        return;
+    // Not supported by e.g. pipes and character devices, which have no page cache to care of anyway
+    if (sync_file_range(dst->buffered_fd, offset, size, SYNC_FILE_RANGE_WRITE)) {
+        dc_log(DC_LOG_DEBUG, "Destination doesn't support write-behind, errno %d\n", errno);
+        dst->write_behind = 0;
+        return;
+    }
+    DC_DstIoRange *last = &dst->pending[(dst->pending_tail - 1) % DC_DST_IO_WRITE_BEHIND_RANGES];
+    if (dst->pending_head != dst->pending_tail && last->offset + last->size == offset) {
+        last->size += size;
+    } else {
+        if (dst->pending_tail - dst->pending_head == DC_DST_IO_WRITE_BEHIND_RANGES)
+            drop_oldest(dst);
+        dst->pending[dst->pending_tail++ % DC_DST_IO_WRITE_BEHIND_RANGES] = (DC_DstIoRange){ offset, size };
+    }
+    dst->pending_bytes += size;
+    while (dst->pending_bytes > DC_DST_IO_WRITE_BEHIND_BYTES && dst->pending_tail - dst->pending_head > 1)
+        drop_oldest(dst);
+}
+
+void dc_dst_io_close(DC_DstIo *dst) {
+    while (dst->write_behind && dst->pending_head != dst->pending_tail)
+        drop_oldest(dst);
+    if (dst->buffered_writes)
+        dc_log(DC_LOG_INFO, "%"PRIu64" writes were refused by direct I/O and written through page cache\n",
+                dst->buffered_writes);
+    if (dst->direct)
+        close(dst->fd);
+    close(dst->buffered_fd);
+}
+
+int dc_dst_io_preallocate(DC_DstIo *dst, off_t size, int sparse) {
+    struct stat st;
+    if (fstat(dst->fd, &st) || !S_ISREG(st.st_mode) || st.st_size >= size)
+        return 0;
+    if (!sparse) {
+        if (!fallocate(dst->fd, 0, 0, size))
+            return 0;
+        if (errno == ENOSPC)
+            return 1;
+        // E.g. EOPNOTSUPP of file systems without extents; file is extended block by block then
+    }
+    return ftruncate(dst->fd, size) ? 1 : 0;
+}
+
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt) {
+        (*iov)->iov_base = (uint8_t*)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+// On failure iov and offset are left at the part which is not written yet, errno tells why
+static int pwritev_full(int fd, struct iovec **iov, int *iovcnt, off_t *offset) {
+    while (*iovcnt) {
+        ssize_t r = pwritev(fd, *iov, *iovcnt, *offset);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 1;
+        *offset += r;
+        iov_advance(iov, iovcnt, r);
+    }
+    return 0;
+}
+
+int dc_dst_io_pwritev(DC_DstIo *dst, struct iovec *iov, int iovcnt, off_t offset) {
+    off_t pos = offset;
+    off_t end = offset;
+    for (int i = 0; i < iovcnt; i++)
+        end += iov[i].iov_len;
+    if (!dst->direct) {
+        if (pwritev_full(dst->fd, &iov, &iovcnt, &pos))
+            return 1;
+        write_behind(dst, offset, end - offset);
+        return 0;
+    }
+
+    if (!pwritev_full(dst->fd, &iov, &iovcnt, &pos))
+        return 0;
+    if (errno != EINVAL)
+        return 1;
+    if (!dst->buffered_writes++)
+        dc_log(DC_LOG_DEBUG, "Direct write at offset %"PRId64" refused, writing through page cache\n", (int64_t)pos);
+    off_t buffered_offset = pos;
+    if (pwritev_full(dst->buffered_fd, &iov, &iovcnt, &pos))
+        return 1;
+    // Not to leave data of direct destination in page cache
+    if (!sync_file_range(dst->buffered_fd, buffered_offset, end - buffered_offset,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER))
+        posix_fadvise(dst->buffered_fd, buffered_offset, end - buffered_offset, POSIX_FADV_DONTNEED);
+    return 0;
+}
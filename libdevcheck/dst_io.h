@@ -0,0 +1,60 @@
+#ifndef DST_IO_H
+#define DST_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Writing of raw copy destination, keeping page cache out of the way of imaging.
+ * Direct destination is opened with O_DIRECT; writes it refuses (e.g. not aligned to 4096-byte
+ * sectors of destination) go through second, buffered descriptor of the same file.
+ * Buffered destination gets write-behind: writeback of each written range is started at once,
+ * and when more than DC_DST_IO_WRITE_BEHIND_BYTES are in flight, oldest ranges are waited for
+ * and dropped from page cache. Either way, memory use doesn't grow with amount of data copied.
+ */
+
+#define DC_DST_IO_WRITE_BEHIND_BYTES (32 * 1024 * 1024)
+#define DC_DST_IO_WRITE_BEHIND_RANGES 64
+
+typedef struct dc_dst_io_range {
+    off_t offset;
+    off_t size;
+} DC_DstIoRange;
+
+typedef struct dc_dst_io {
+    int fd;
+    int buffered_fd;  // same as fd, unless fd is direct
+    int direct;
+    uint64_t buffered_writes;  // refused by direct descriptor
+    int write_behind;
+    // Ranges written back but not dropped yet, FIFO pending_head..pending_tail
+    DC_DstIoRange pending[DC_DST_IO_WRITE_BEHIND_RANGES];
+    uint64_t pending_head;
+    uint64_t pending_tail;
+    off_t pending_bytes;
+} DC_DstIo;
+
+/**
+ * Opens destination with given flags, adding O_DIRECT if direct is set.
+ * If file system doesn't support direct I/O, destination is opened buffered
+ */
+int dc_dst_io_open(DC_DstIo *dst, const char *path, int flags, int direct);
+// Drops what is left of written data from page cache and closes destination
+void dc_dst_io_close(DC_DstIo *dst);
+
+/**
+ * Extends regular file to size, so that it is allocated in one go rather than block by block.
+ * Sparse file only gets its size, as zeros are not to take space in it.
+ * Other destinations are left as they are. Returns 1 if file system has no space for it
+ */
+int dc_dst_io_preallocate(DC_DstIo *dst, off_t size, int sparse);
+
+/**
+ * Writes whole iov at offset. Returns 1 on failure.
+ * Thread-unsafe: there must be only one writer of destination
+ */
+int dc_dst_io_pwritev(DC_DstIo *dst, struct iovec *iov, int iovcnt, off_t offset);
+
+#endif  // DST_IO_H
@@ -9,18 +9,19 @@
 #include <signal.h>
 #include "procedure.h"
 #include "device.h"
-
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512)
+#include "utils.h"
+#include "io_backend.h"
 
 static volatile sig_atomic_t interrupt_flag = 0;
 void handle_sigint(int sig) { interrupt_flag = 1; }
 
 struct erase_priv {
-    int fd;
+    DC_Io io;
+    DC_IoRequest io_req;
     uint64_t start_lba;
     uint64_t current_lba;
     uint64_t end_lba;
+    int64_t blk_sectors;
     void *buf;
     uint64_t count_erased;
     uint64_t count_good;
@@ -33,6 +34,8 @@ typedef struct erase_priv ErasePriv;
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     if (!strcmp(setting->name, "start_lba"))
         setting->value = strdup("0");
+    else if (!strcmp(setting->name, "blk_sectors"))
+        setting->value = strdup(DC_STRINGIFY(DC_DEFAULT_BLK_SECTORS));
     return 0;
 }
 
@@ -42,19 +45,23 @@ static int Open(DC_ProcedureCtx *ctx) {
     priv->current_lba = priv->start_lba;
     priv->end_lba = ctx->dev->capacity / 512;
 
-    priv->buf = calloc(1, BLK_SIZE);
+    int64_t max_blk_sectors = dc_dev_max_blk_sectors(ctx->dev);
+    if (priv->blk_sectors < 1 || priv->blk_sectors > max_blk_sectors) {
+        dc_log(DC_LOG_FATAL, "Block size must be within 1..%"PRId64" sectors for this device\n", max_blk_sectors);
+        return 1;
+    }
+
+    priv->buf = calloc(1, priv->blk_sectors * 512);
     if (!priv->buf) return 1;
 
-    priv->fd = open(ctx->dev->dev_path, O_RDWR | O_LARGEFILE);
-    if (priv->fd == -1) {
-        perror("open device");
+    if (dc_io_open(&priv->io, ctx->dev, &dc_io_backend_posix, 1, DC_IO_FLAG_WRITE | DC_IO_FLAG_BUFFERED)) {
         free(priv->buf);
         return 1;
     }
 
-    ctx->blk_size = BLK_SIZE;
+    ctx->blk_size = priv->blk_sectors * 512;
     ctx->progress.num = 0;
-    ctx->progress.den = (priv->end_lba - priv->start_lba + SECTORS_AT_ONCE - 1) / SECTORS_AT_ONCE;
+    ctx->progress.den = (priv->end_lba - priv->start_lba + priv->blk_sectors - 1) / priv->blk_sectors;
 
     signal(SIGINT, handle_sigint);
     interrupt_flag = 0;
@@ -72,35 +79,35 @@ static int Perform(DC_ProcedureCtx *ctx) {
     if (interrupt_flag) return 1;
 
     ErasePriv *priv = ctx->priv;
-    size_t sectors_to_process = (priv->end_lba - priv->current_lba < SECTORS_AT_ONCE) ?
+    size_t sectors_to_process = (priv->end_lba - priv->current_lba < (uint64_t)priv->blk_sectors) ?
                                 (size_t)(priv->end_lba - priv->current_lba) :
-                                SECTORS_AT_ONCE;
+                                (size_t)priv->blk_sectors;
     if (sectors_to_process == 0) return 1;
 
-    ctx->report.lba = priv->current_lba;
-    ctx->report.sectors_processed = sectors_to_process;
-
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    ssize_t r = pread(priv->fd, priv->buf, sectors_to_process * 512, priv->current_lba * 512);
-    clock_gettime(CLOCK_MONOTONIC, &end);
+    DC_IoRequest *req = &priv->io_req;
+    req->op = DC_IoOp_eRead;
+    req->lba = priv->current_lba;
+    req->sectors = sectors_to_process;
+    req->buf = priv->buf;
+    dc_io_execute(&priv->io, req);
+    ctx->report = req->report;
 
-    uint64_t elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 +
-                          (end.tv_nsec - start.tv_nsec) / 1000000;
+    uint64_t elapsed_ms = req->report.blk_access_time / 1000;
 
-    // Map sector status based on read speed or error
-    if (r != (ssize_t)(sectors_to_process * 512)) {
+    // Map sector status based on read speed or error; erasing rewrites block with zeros
+    req->op = DC_IoOp_eWrite;
+    if (req->report.blk_status) {
         ctx->report.blk_status = DC_BlockStatus_eError; // red/error
         memset(priv->buf, 0, sectors_to_process * 512);
-        pwrite(priv->fd, priv->buf, sectors_to_process * 512, priv->current_lba * 512);
+        dc_io_execute(&priv->io, req);
     } else if (elapsed_ms >= 500) {
         ctx->report.blk_status = DC_BlockStatus_eError; // red
         memset(priv->buf, 0, sectors_to_process * 512);
-        pwrite(priv->fd, priv->buf, sectors_to_process * 512, priv->current_lba * 512);
+        dc_io_execute(&priv->io, req);
     } else if (elapsed_ms >= 150) {
         ctx->report.blk_status = DC_BlockStatus_eAmnf; // green (slow)
         memset(priv->buf, 0, sectors_to_process * 512);
-        pwrite(priv->fd, priv->buf, sectors_to_process * 512, priv->current_lba * 512);
+        dc_io_execute(&priv->io, req);
     } else if (elapsed_ms >= 50) {
         ctx->report.blk_status = DC_BlockStatus_eUnc; // dark green
     } else if (elapsed_ms >= 10) {
@@ -134,7 +141,7 @@ static int Perform(DC_ProcedureCtx *ctx) {
 // Close procedure
 static void Close(DC_ProcedureCtx *ctx) {
     ErasePriv *priv = ctx->priv;
-    if (priv->fd >= 0) close(priv->fd);
+    dc_io_close(&priv->io);
     free(priv->buf);
     signal(SIGINT, SIG_DFL);
 
@@ -148,6 +155,7 @@ static void Close(DC_ProcedureCtx *ctx) {
 // Options
 static DC_ProcedureOption options[] = {
     { "start_lba", "LBA to start erasing from", offsetof(ErasePriv, start_lba), DC_ProcedureOptionType_eInt64, NULL },
+    { "blk_sectors", "Block size in sectors, up to the limit of device", offsetof(ErasePriv, blk_sectors), DC_ProcedureOptionType_eInt64, NULL },
     { NULL }
 };
 
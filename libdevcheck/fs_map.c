@@ -0,0 +1,591 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fs_map.h"
+#include "log.h"
+
+#define EXT_MAGIC 0xEF53
+#define EXT_COMPAT_RESIZE_INODE 0x10
+#define EXT_COMPAT_SPARSE_SUPER2 0x200
+#define EXT_INCOMPAT_META_BG 0x10
+#define EXT_INCOMPAT_64BIT 0x80
+#define EXT_RO_COMPAT_SPARSE_SUPER 0x1
+#define EXT_RO_COMPAT_GDT_CSUM 0x10
+#define EXT_RO_COMPAT_BIGALLOC 0x200
+#define EXT_RO_COMPAT_METADATA_CSUM 0x400
+#define EXT_BG_BLOCK_UNINIT 0x2
+
+#define NTFS_ATTR_DATA 0x80
+#define NTFS_ATTR_END 0xFFFFFFFF
+#define NTFS_FIXUP_STRIDE 512
+#define NTFS_BITMAP_RECORD 6  // $Bitmap in MFT
+#define NTFS_SYSTEM_RECORDS 16  // $MFT..$Extend and reserved ones
+#define NTFS_MFT_MIRROR_RECORDS 4
+#define NTFS_BOOT_SECTORS 16
+#define BITMAP_READ_SIZE (1024 * 1024)
+
+typedef struct partition {
+    uint64_t begin_lba;
+    uint64_t end_lba;
+} Partition;
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static int read_full(DC_FsMap *map, void *buf, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = pread(map->fd, (uint8_t*)buf + done, size - done, offset + done);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 1;
+        done += r;
+    }
+    return 0;
+}
+
+static int append_extent(DC_FsExtent **list, uint64_t *nb, uint64_t *allocated, uint64_t begin_lba, uint64_t end_lba) {
+    if (*nb == *allocated) {
+        uint64_t new_allocated = *allocated ? *allocated * 2 : 1024;
+        DC_FsExtent *extents = realloc(*list, new_allocated * sizeof(*extents));
+        if (!extents)
+            return 1;
+        *list = extents;
+        *allocated = new_allocated;
+    }
+    (*list)[(*nb)++] = (DC_FsExtent){ begin_lba, end_lba };
+    return 0;
+}
+
+// Extents of volume are added in order; they are not merged with those of previous volume, to be dropped alone
+static int add_free(DC_FsMap *map, uint64_t begin_lba, uint64_t end_lba) {
+    if (begin_lba >= end_lba)
+        return 0;
+    if (map->nb_free > map->volume_first_free && map->free[map->nb_free - 1].end_lba == begin_lba) {
+        map->free[map->nb_free - 1].end_lba = end_lba;
+        return 0;
+    }
+    return append_extent(&map->free, &map->nb_free, &map->free_allocated, begin_lba, end_lba);
+}
+
+// Metadata is only read first, so that which is not consistent with the rest is kept anyway; order doesn't matter
+static int add_metadata(DC_FsMap *map, uint64_t begin_lba, uint64_t end_lba) {
+    if (end_lba > map->nb_sectors)
+        end_lba = map->nb_sectors;
+    if (begin_lba >= end_lba)
+        return 0;
+    return append_extent(&map->metadata, &map->nb_metadata, &map->metadata_allocated, begin_lba, end_lba);
+}
+
+static uint64_t volume_free_sectors(DC_FsMap *map) {
+    uint64_t sectors = 0;
+    for (uint64_t i = map->volume_first_free; i < map->nb_free; i++)
+        sectors += map->free[i].end_lba - map->free[i].begin_lba;
+    return sectors;
+}
+
+// Adds runs of clear bits of bitmap as free space; bit 0 is unit at first_lba
+static int add_free_bits(DC_FsMap *map, const uint8_t *bitmap, uint64_t nb_bits, uint64_t first_lba, uint64_t unit_sectors) {
+    uint64_t i = 0;
+    while (i < nb_bits) {
+        // Whole bytes in use are skipped at once, as most of them are
+        if (i % 8 == 0 && nb_bits - i >= 8 && bitmap[i / 8] == 0xff) {
+            i += 8;
+            continue;
+        }
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            i++;
+            continue;
+        }
+        uint64_t run_begin = i;
+        while (i < nb_bits && !(bitmap[i / 8] & (1 << (i % 8))))
+            i++;
+        if (add_free(map, first_lba + run_begin * unit_sectors, first_lba + i * unit_sectors))
+            return 1;
+    }
+    return 0;
+}
+
+static int ext_group_has_super(const uint8_t *sb, uint64_t group) {
+    if (group == 0)
+        return 1;
+    if (le32(sb + 0x5C) & EXT_COMPAT_SPARSE_SUPER2)
+        return group == le32(sb + 0x24C) || group == le32(sb + 0x250);
+    if (!(le32(sb + 0x64) & EXT_RO_COMPAT_SPARSE_SUPER) || group == 1)
+        return 1;
+    for (uint64_t base = 3; base <= 7; base += 2) {
+        uint64_t power = base;
+        while (power < group)
+            power *= base;
+        if (power == group)
+            return 1;
+    }
+    return 0;
+}
+
+static int compare_extents(const void *a, const void *b) {
+    const DC_FsExtent *x = a;
+    const DC_FsExtent *y = b;
+    return x->begin_lba < y->begin_lba ? -1 : x->begin_lba > y->begin_lba;
+}
+
+/**
+ * Groups with uninitialized bitmap have only metadata in use: backup of superblock and descriptors,
+ * and bitmaps and inode tables, of own group or of others with flex_bg. Extents are in blocks here
+ */
+static int ext_add_uninit_group(DC_FsMap *map, const DC_FsExtent *metadata, uint64_t nb_metadata,
+        uint64_t begin, uint64_t end, uint64_t backup_blocks, uint64_t first_lba, uint64_t block_sectors) {
+    uint64_t lo = 0, hi = nb_metadata;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (metadata[mid].begin_lba < begin)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // Extent starting before group may reach into it
+    if (lo > 0)
+        lo--;
+    uint64_t cursor = begin + backup_blocks;
+    for (uint64_t i = lo; i < nb_metadata && metadata[i].begin_lba < end; i++) {
+        if (metadata[i].end_lba <= cursor)
+            continue;
+        if (metadata[i].begin_lba > cursor
+                && add_free(map, first_lba + cursor * block_sectors, first_lba + metadata[i].begin_lba * block_sectors))
+            return 1;
+        cursor = metadata[i].end_lba;
+    }
+    if (cursor < end && add_free(map, first_lba + cursor * block_sectors, first_lba + end * block_sectors))
+        return 1;
+    return 0;
+}
+
+static int ext_map(DC_FsMap *map, const Partition *part, const uint8_t *sb) {
+    uint32_t compat = le32(sb + 0x5C);
+    uint32_t incompat = le32(sb + 0x60);
+    uint32_t ro_compat = le32(sb + 0x64);
+    uint32_t log_block_size = le32(sb + 0x18);
+    if (log_block_size > 6)
+        return 1;
+    uint64_t block_size = 1024 << log_block_size;
+    uint64_t block_sectors = block_size / 512;
+    uint64_t blocks_count = le32(sb + 0x04) | (incompat & EXT_INCOMPAT_64BIT ? (uint64_t)le32(sb + 0x150) << 32 : 0);
+    uint64_t first_data_block = le32(sb + 0x14);
+    uint64_t blocks_per_group = le32(sb + 0x20);
+    uint64_t inodes_per_group = le32(sb + 0x28);
+    uint64_t inode_size = le32(sb + 0x4C) >= 1 ? le16(sb + 0x58) : 128;
+    uint64_t desc_size = incompat & EXT_INCOMPAT_64BIT ? le16(sb + 0xFE) : 32;
+    uint64_t reserved_gdt_blocks = compat & EXT_COMPAT_RESIZE_INODE ? le16(sb + 0xCE) : 0;
+    int uninit_valid = !!(ro_compat & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM));
+
+    if ((incompat & EXT_INCOMPAT_META_BG) || (ro_compat & EXT_RO_COMPAT_BIGALLOC)) {
+        dc_log(DC_LOG_INFO, "ext2/3/4 at LBA %"PRIu64" uses meta_bg or bigalloc, which are not supported\n", part->begin_lba);
+        return 1;
+    }
+    if (!blocks_per_group || blocks_per_group > 8 * block_size || !inodes_per_group || !inode_size
+            || desc_size < 32 || desc_size > block_size || ((incompat & EXT_INCOMPAT_64BIT) && desc_size < 64)
+            || first_data_block >= blocks_count
+            || blocks_count > (part->end_lba - part->begin_lba) / block_sectors)
+        return 1;
+    uint64_t nb_groups = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+    uint64_t gdt_blocks = (nb_groups * desc_size + block_size - 1) / block_size;
+    uint64_t inode_table_blocks = (inodes_per_group * inode_size + block_size - 1) / block_size;
+
+    int r = 1;
+    uint8_t *gdt = malloc(gdt_blocks * block_size);
+    uint8_t *bitmap = malloc(block_size);
+    DC_FsExtent *metadata = malloc(3 * nb_groups * sizeof(*metadata));
+    if (!gdt || !bitmap || !metadata)
+        goto out;
+    if (read_full(map, gdt, gdt_blocks * block_size, part->begin_lba * 512 + (first_data_block + 1) * block_size))
+        goto out;
+
+    for (uint64_t g = 0; g < nb_groups; g++) {
+        const uint8_t *desc = gdt + g * desc_size;
+        int hi = desc_size >= 64;
+        uint64_t block_bitmap = le32(desc + 0x00) | (hi ? (uint64_t)le32(desc + 0x20) << 32 : 0);
+        uint64_t inode_bitmap = le32(desc + 0x04) | (hi ? (uint64_t)le32(desc + 0x24) << 32 : 0);
+        uint64_t inode_table = le32(desc + 0x08) | (hi ? (uint64_t)le32(desc + 0x28) << 32 : 0);
+        if (block_bitmap >= blocks_count || inode_bitmap >= blocks_count || inode_table + inode_table_blocks > blocks_count)
+            goto out;
+        metadata[3 * g] = (DC_FsExtent){ block_bitmap, block_bitmap + 1 };
+        metadata[3 * g + 1] = (DC_FsExtent){ inode_bitmap, inode_bitmap + 1 };
+        metadata[3 * g + 2] = (DC_FsExtent){ inode_table, inode_table + inode_table_blocks };
+    }
+    qsort(metadata, 3 * nb_groups, sizeof(*metadata), compare_extents);
+    // Superblock with descriptors, then bitmaps and inode tables; directories and files are found by the latter
+    if (add_metadata(map, part->begin_lba, part->begin_lba + (first_data_block + 1 + gdt_blocks + reserved_gdt_blocks) * block_sectors))
+        goto out;
+    for (uint64_t i = 0; i < 3 * nb_groups; i++)
+        if (add_metadata(map, part->begin_lba + metadata[i].begin_lba * block_sectors, part->begin_lba + metadata[i].end_lba * block_sectors))
+            goto out;
+
+    for (uint64_t g = 0; g < nb_groups; g++) {
+        const uint8_t *desc = gdt + g * desc_size;
+        uint64_t begin = first_data_block + g * blocks_per_group;
+        uint64_t end = begin + blocks_per_group < blocks_count ? begin + blocks_per_group : blocks_count;
+        if (uninit_valid && (le16(desc + 0x12) & EXT_BG_BLOCK_UNINIT)) {
+            uint64_t backup_blocks = ext_group_has_super(sb, g) ? 1 + gdt_blocks + reserved_gdt_blocks : 0;
+            if (ext_add_uninit_group(map, metadata, 3 * nb_groups, begin, end, backup_blocks, part->begin_lba, block_sectors))
+                goto out;
+            continue;
+        }
+        uint64_t block_bitmap = le32(desc + 0x00) | (desc_size >= 64 ? (uint64_t)le32(desc + 0x20) << 32 : 0);
+        // Group which bitmap fails to read is left as in use
+        if (read_full(map, bitmap, block_size, part->begin_lba * 512 + block_bitmap * block_size))
+            continue;
+        if (add_free_bits(map, bitmap, end - begin, part->begin_lba + begin * block_sectors, block_sectors))
+            goto out;
+    }
+    dc_log(DC_LOG_INFO, "ext2/3/4 at LBA %"PRIu64": %"PRIu64" of %"PRIu64" MiB are free\n", part->begin_lba,
+            volume_free_sectors(map) / 2048, blocks_count * block_sectors / 2048);
+    r = 0;
+out:
+    free(metadata);
+    free(bitmap);
+    free(gdt);
+    return r;
+}
+
+// Replaces update sequence numbers at the end of each stride of MFT record with saved bytes
+static int ntfs_apply_fixups(uint8_t *record, uint32_t record_size) {
+    uint16_t usa_offset = le16(record + 0x04);
+    uint16_t usa_count = le16(record + 0x06);
+    if (memcmp(record, "FILE", 4) || usa_count != record_size / NTFS_FIXUP_STRIDE + 1
+            || usa_offset + usa_count * 2u > record_size)
+        return 1;
+    for (uint16_t i = 1; i < usa_count; i++) {
+        uint8_t *end = record + i * NTFS_FIXUP_STRIDE - 2;
+        if (memcmp(end, record + usa_offset, 2))
+            return 1;
+        memcpy(end, record + usa_offset + i * 2, 2);
+    }
+    return 0;
+}
+
+static uint64_t le_var(const uint8_t *p, int size, int is_signed) {
+    uint64_t v = 0;
+    for (int i = 0; i < size; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    if (is_signed && size && size < 8 && (p[size - 1] & 0x80))
+        v |= ~(uint64_t)0 << (8 * size);
+    return v;
+}
+
+// Unnamed non-resident $DATA attribute of MFT record, NULL if there is none
+static const uint8_t *ntfs_find_data(const uint8_t *record, uint64_t record_size) {
+    uint64_t offset = le16(record + 0x14);
+    while (offset + 16 <= record_size && le32(record + offset) != NTFS_ATTR_END) {
+        uint32_t length = le32(record + offset + 4);
+        if (length < 16 || offset + length > record_size)
+            return NULL;
+        if (le32(record + offset) == NTFS_ATTR_DATA && record[offset + 9] == 0 && record[offset + 8] == 1)
+            return length >= 0x40 && le16(record + offset + 0x20) < length ? record + offset : NULL;
+        offset += length;
+    }
+    return NULL;
+}
+
+/**
+ * Decodes next data run of attribute into its first cluster and length; lcn must hold the previous one.
+ * Returns 1 at the end of runs list, -1 if run is damaged or sparse, which makes no sense for metadata
+ */
+static int ntfs_next_run(const uint8_t **run, const uint8_t *end, uint64_t nb_clusters, uint64_t *lcn, uint64_t *length) {
+    if (*run >= end || !**run)
+        return 1;
+    int length_size = **run & 0xf;
+    int offset_size = **run >> 4;
+    if (!length_size || length_size > 8 || !offset_size || offset_size > 8 || *run + 1 + length_size + offset_size > end)
+        return -1;
+    *length = le_var(*run + 1, length_size, 0);
+    *lcn += le_var(*run + 1 + length_size, offset_size, 1);
+    *run += 1 + length_size + offset_size;
+    if (*lcn >= nb_clusters || *length > nb_clusters - *lcn)
+        return -1;
+    return 0;
+}
+
+static int ntfs_map(DC_FsMap *map, const Partition *part, const uint8_t *boot) {
+    uint64_t bytes_per_sector = le16(boot + 0x0B);
+    uint8_t spc_raw = boot[0x0D];
+    uint64_t sectors_per_cluster = spc_raw <= 0x80 ? spc_raw : (uint64_t)1 << (256 - spc_raw);
+    uint64_t total_sectors = le64(boot + 0x28);
+    uint64_t mft_lcn = le64(boot + 0x30);
+    uint64_t mft_mirror_lcn = le64(boot + 0x38);
+    int8_t clusters_per_record = boot[0x40];
+
+    if ((bytes_per_sector != 512 && bytes_per_sector != 1024 && bytes_per_sector != 2048 && bytes_per_sector != 4096)
+            || !sectors_per_cluster || (sectors_per_cluster & (sectors_per_cluster - 1)))
+        return 1;
+    uint64_t cluster_size = bytes_per_sector * sectors_per_cluster;
+    uint64_t cluster_sectors = cluster_size / 512;
+    uint64_t nb_clusters = total_sectors / sectors_per_cluster;
+    if (cluster_size > 2 * 1024 * 1024 || total_sectors * bytes_per_sector > (part->end_lba - part->begin_lba) * 512
+            || mft_lcn >= nb_clusters)
+        return 1;
+    uint64_t record_size = clusters_per_record > 0 ? clusters_per_record * cluster_size
+        : (clusters_per_record > -32 ? (uint64_t)1 << -clusters_per_record : 0);
+    if (record_size < NTFS_FIXUP_STRIDE || record_size > 65536 || record_size % NTFS_FIXUP_STRIDE)
+        return 1;
+    uint64_t mft_offset = part->begin_lba * 512 + mft_lcn * cluster_size;
+
+    int r = 1;
+    const uint8_t *attr;
+    const uint8_t *run;
+    uint64_t lcn = 0;
+    uint64_t run_clusters = 0;
+    int run_r = 0;
+    uint8_t *record = malloc(record_size);
+    uint8_t *bitmap = malloc(BITMAP_READ_SIZE);
+    if (!record || !bitmap)
+        goto out;
+
+    // $Boot, $MFTMirr and $MFT itself, as its own $DATA tells; if it doesn't, system files at least
+    if (add_metadata(map, part->begin_lba, part->begin_lba + NTFS_BOOT_SECTORS))
+        goto out;
+    if (mft_mirror_lcn < nb_clusters && add_metadata(map, part->begin_lba + mft_mirror_lcn * cluster_sectors,
+                part->begin_lba + mft_mirror_lcn * cluster_sectors + (NTFS_MFT_MIRROR_RECORDS * record_size + 511) / 512))
+        goto out;
+    attr = NULL;
+    if (!read_full(map, record, record_size, mft_offset) && !ntfs_apply_fixups(record, record_size))
+        attr = ntfs_find_data(record, record_size);
+    run = attr ? attr + le16(attr + 0x20) : NULL;
+    while (run && !(run_r = ntfs_next_run(&run, attr + le32(attr + 4), nb_clusters, &lcn, &run_clusters)))
+        if (add_metadata(map, part->begin_lba + lcn * cluster_sectors, part->begin_lba + (lcn + run_clusters) * cluster_sectors))
+            goto out;
+    if ((!run || run_r < 0) && add_metadata(map, part->begin_lba + mft_lcn * cluster_sectors,
+                part->begin_lba + mft_lcn * cluster_sectors + NTFS_SYSTEM_RECORDS * record_size / 512))
+        goto out;
+
+    // First records of MFT are never fragmented
+    if (read_full(map, record, record_size, mft_offset + NTFS_BITMAP_RECORD * record_size)
+            || ntfs_apply_fixups(record, record_size))
+        goto out;
+    attr = ntfs_find_data(record, record_size);
+    if (!attr || le64(attr + 0x30) * 8 < nb_clusters)
+        goto out;
+
+    run = attr + le16(attr + 0x20);
+    lcn = 0;
+    // Bitmap is read by runs and pieces; cluster of bit b is free if bit is clear
+    for (uint64_t vcn = 0; vcn * cluster_size * 8 < nb_clusters; vcn += run_clusters) {
+        run_r = ntfs_next_run(&run, attr + le32(attr + 4), nb_clusters, &lcn, &run_clusters);
+        if (run_r)
+            goto out;
+        if (add_metadata(map, part->begin_lba + lcn * cluster_sectors, part->begin_lba + (lcn + run_clusters) * cluster_sectors))
+            goto out;
+        for (uint64_t done = 0; done < run_clusters * cluster_size; ) {
+            uint64_t first_bit = (vcn * cluster_size + done) * 8;
+            if (first_bit >= nb_clusters)
+                break;
+            uint64_t size = run_clusters * cluster_size - done < BITMAP_READ_SIZE ? run_clusters * cluster_size - done : BITMAP_READ_SIZE;
+            uint64_t nb_bits = nb_clusters - first_bit < size * 8 ? nb_clusters - first_bit : size * 8;
+            // Clusters of piece which fails to read are left as in use
+            if (!read_full(map, bitmap, size, part->begin_lba * 512 + lcn * cluster_size + done)
+                    && add_free_bits(map, bitmap, nb_bits, part->begin_lba + first_bit * cluster_sectors, cluster_sectors))
+                goto out;
+            done += size;
+        }
+    }
+    dc_log(DC_LOG_INFO, "NTFS at LBA %"PRIu64": %"PRIu64" of %"PRIu64" MiB are free\n", part->begin_lba,
+            volume_free_sectors(map) / 2048, nb_clusters * cluster_sectors / 2048);
+    r = 0;
+out:
+    free(bitmap);
+    free(record);
+    return r;
+}
+
+static void probe_volume(DC_FsMap *map, const Partition *part) {
+    uint8_t boot[512];
+    uint8_t sb[1024];
+    int r;
+
+    map->volume_first_free = map->nb_free;
+    if (read_full(map, boot, sizeof(boot), part->begin_lba * 512))
+        return;
+    if (!memcmp(boot + 3, "NTFS    ", 8)) {
+        r = ntfs_map(map, part, boot);
+    } else if (part->end_lba - part->begin_lba >= 4 && !read_full(map, sb, sizeof(sb), part->begin_lba * 512 + 1024)
+            && le16(sb + 0x38) == EXT_MAGIC) {
+        r = ext_map(map, part, sb);
+    } else {
+        dc_log(DC_LOG_DEBUG, "No known file system at LBA %"PRIu64", it is copied whole\n", part->begin_lba);
+        return;
+    }
+    if (r) {
+        dc_log(DC_LOG_WARNING, "File system at LBA %"PRIu64" can't be read or looks inconsistent, it is copied whole\n", part->begin_lba);
+        map->nb_free = map->volume_first_free;
+    }
+}
+
+static int add_partition(DC_FsMap *map, Partition *parts, int *nb_parts, uint64_t begin_lba, uint64_t nb_sectors) {
+    if (!nb_sectors || begin_lba >= map->nb_sectors || nb_sectors > map->nb_sectors - begin_lba)
+        return 1;
+    if (*nb_parts == DC_FS_MAP_MAX_PARTITIONS)
+        return 1;
+    parts[(*nb_parts)++] = (Partition){ begin_lba, begin_lba + nb_sectors };
+    return 0;
+}
+
+static void read_gpt(DC_FsMap *map, Partition *parts, int *nb_parts) {
+    uint8_t header[512];
+    uint64_t sector_size;
+    // Header is in second logical sector, either 512 or 4096 bytes
+    for (sector_size = 512; sector_size <= 4096; sector_size *= 8)
+        if (!read_full(map, header, sizeof(header), sector_size) && !memcmp(header, "EFI PART", 8))
+            break;
+    if (sector_size > 4096) {
+        dc_log(DC_LOG_WARNING, "GPT header is not found\n");
+        return;
+    }
+    uint64_t alternate_lba = le64(header + 32);
+    uint64_t entries_lba = le64(header + 72);
+    uint32_t nb_entries = le32(header + 80);
+    uint32_t entry_size = le32(header + 84);
+    if (entry_size < 128 || entry_size > 4096 || nb_entries > 4096)
+        return;
+    // Header with entries, and their backup at the end of device
+    uint64_t entries_sectors = ((uint64_t)nb_entries * entry_size + sector_size - 1) / sector_size;
+    add_metadata(map, 0, (entries_lba + entries_sectors) * (sector_size / 512));
+    if (alternate_lba > entries_sectors)
+        add_metadata(map, (alternate_lba - entries_sectors) * (sector_size / 512), (alternate_lba + 1) * (sector_size / 512));
+    uint8_t *entries = malloc((size_t)nb_entries * entry_size);
+    if (!entries)
+        return;
+    if (!read_full(map, entries, (size_t)nb_entries * entry_size, entries_lba * sector_size)) {
+        static const uint8_t unused[16];
+        for (uint32_t i = 0; i < nb_entries; i++) {
+            const uint8_t *entry = entries + (size_t)i * entry_size;
+            uint64_t first = le64(entry + 32);
+            uint64_t last = le64(entry + 40);
+            if (!memcmp(entry, unused, sizeof(unused)) || last < first)
+                continue;
+            if (add_partition(map, parts, nb_parts, first * (sector_size / 512), (last - first + 1) * (sector_size / 512)))
+                dc_log(DC_LOG_WARNING, "GPT entry %u is beyond device\n", i);
+        }
+    }
+    free(entries);
+}
+
+static void read_mbr(DC_FsMap *map, const uint8_t *mbr, Partition *parts, int *nb_parts) {
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *entry = mbr + 446 + 16 * i;
+        uint8_t type = entry[4];
+        uint64_t begin_lba = le32(entry + 8);
+        uint64_t nb_sectors = le32(entry + 12);
+        if (!type || !nb_sectors)
+            continue;
+        if (type == 0xEE) {
+            read_gpt(map, parts, nb_parts);
+            return;
+        }
+        if (type != 0x05 && type != 0x0F && type != 0x85) {
+            if (add_partition(map, parts, nb_parts, begin_lba, nb_sectors))
+                dc_log(DC_LOG_WARNING, "Partition %d is beyond device\n", i + 1);
+            continue;
+        }
+        // Chain of extended boot records, each with logical partition and link to next one
+        uint64_t ebr_lba = begin_lba;
+        for (int nb_logical = 0; nb_logical < DC_FS_MAP_MAX_PARTITIONS; nb_logical++) {
+            uint8_t ebr[512];
+            if (read_full(map, ebr, sizeof(ebr), ebr_lba * 512) || ebr[510] != 0x55 || ebr[511] != 0xAA)
+                break;
+            add_metadata(map, ebr_lba, ebr_lba + 1);
+            if (ebr[446 + 4] && le32(ebr + 446 + 12))
+                add_partition(map, parts, nb_parts, ebr_lba + le32(ebr + 446 + 8), le32(ebr + 446 + 12));
+            if (!ebr[462 + 4] || !le32(ebr + 462 + 8))
+                break;
+            ebr_lba = begin_lba + le32(ebr + 462 + 8);
+        }
+    }
+}
+
+static int compare_partitions(const void *a, const void *b) {
+    const Partition *x = a;
+    const Partition *y = b;
+    return x->begin_lba < y->begin_lba ? -1 : x->begin_lba > y->begin_lba;
+}
+
+int dc_fs_map_build(DC_FsMap *map, const char *dev_path, uint64_t nb_sectors) {
+    Partition parts[DC_FS_MAP_MAX_PARTITIONS];
+    int nb_parts = 0;
+    uint8_t mbr[512];
+
+    memset(map, 0, sizeof(*map));
+    map->nb_sectors = nb_sectors;
+    // Metadata is read through page cache, as it is small and scattered
+    map->fd = open(dev_path, O_RDONLY | O_LARGEFILE);
+    if (map->fd == -1)
+        return 1;
+    if (read_full(map, mbr, sizeof(mbr), 0)) {
+        close(map->fd);
+        return 1;
+    }
+    // Volume boot record of NTFS has the same signature as MBR
+    if (mbr[510] == 0x55 && mbr[511] == 0xAA && memcmp(mbr + 3, "NTFS    ", 8)) {
+        add_metadata(map, 0, 1);
+        read_mbr(map, mbr, parts, &nb_parts);
+    }
+    if (!nb_parts)
+        add_partition(map, parts, &nb_parts, 0, nb_sectors);
+
+    // Free space of one volume may be in use by another overlapping it, so overlapping ones are copied whole
+    qsort(parts, nb_parts, sizeof(*parts), compare_partitions);
+    for (int i = 0; i < nb_parts; i++) {
+        if ((i > 0 && parts[i].begin_lba < parts[i - 1].end_lba)
+                || (i + 1 < nb_parts && parts[i + 1].begin_lba < parts[i].end_lba)) {
+            dc_log(DC_LOG_WARNING, "Partition at LBA %"PRIu64" overlaps another one, it is copied whole\n", parts[i].begin_lba);
+            continue;
+        }
+        probe_volume(map, &parts[i]);
+    }
+    close(map->fd);
+
+    // Volumes are in order and don't overlap, so only extents adjacent across volumes are to be merged
+    uint64_t nb_merged = 0;
+    for (uint64_t i = 0; i < map->nb_free; i++) {
+        if (nb_merged && map->free[nb_merged - 1].end_lba == map->free[i].begin_lba)
+            map->free[nb_merged - 1].end_lba = map->free[i].end_lba;
+        else
+            map->free[nb_merged++] = map->free[i];
+    }
+    map->nb_free = nb_merged;
+    for (uint64_t i = 0; i < map->nb_free; i++)
+        map->free_sectors += map->free[i].end_lba - map->free[i].begin_lba;
+
+    qsort(map->metadata, map->nb_metadata, sizeof(*map->metadata), compare_extents);
+    nb_merged = 0;
+    for (uint64_t i = 0; i < map->nb_metadata; i++) {
+        if (nb_merged && map->metadata[nb_merged - 1].end_lba >= map->metadata[i].begin_lba) {
+            if (map->metadata[nb_merged - 1].end_lba < map->metadata[i].end_lba)
+                map->metadata[nb_merged - 1].end_lba = map->metadata[i].end_lba;
+        } else {
+            map->metadata[nb_merged++] = map->metadata[i];
+        }
+    }
+    map->nb_metadata = nb_merged;
+    for (uint64_t i = 0; i < map->nb_metadata; i++)
+        map->metadata_sectors += map->metadata[i].end_lba - map->metadata[i].begin_lba;
+    return 0;
+}
+
+void dc_fs_map_free(DC_FsMap *map) {
+    free(map->free);
+    free(map->metadata);
+}
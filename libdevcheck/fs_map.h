@@ -0,0 +1,44 @@
+#ifndef FS_MAP_H
+#define FS_MAP_H
+
+#include <stdint.h>
+
+/*
+ * Map of free space of file systems on device, so that copying may skip it,
+ * and of their metadata, so that copying may read it first.
+ * Partitions are taken from MBR (with logical partitions of extended one) or GPT;
+ * device without partition table is probed as a whole. Free space is taken from
+ * block bitmaps of ext2/3/4 and from $Bitmap of NTFS.
+ * Everything else counts as in use: partition tables and gaps between partitions,
+ * other file systems, and volumes which metadata fails to read or looks inconsistent,
+ * so that nothing in use is ever skipped.
+ */
+
+#define DC_FS_MAP_MAX_PARTITIONS 128
+
+typedef struct dc_fs_extent {
+    uint64_t begin_lba;
+    uint64_t end_lba;
+} DC_FsExtent;
+
+typedef struct dc_fs_map {
+    int fd;
+    uint64_t nb_sectors;
+    DC_FsExtent *free;  // sorted, not overlapping nor adjacent
+    uint64_t nb_free;
+    uint64_t free_allocated;
+    uint64_t volume_first_free;  // extents of volume being read start here, to be dropped if it is inconsistent
+    uint64_t free_sectors;
+    // Areas which give structure to the rest, to be read first: partition tables, superblocks,
+    // group descriptors, bitmaps and inode tables of ext2/3/4, $MFT of NTFS. Sorted and merged
+    DC_FsExtent *metadata;
+    uint64_t nb_metadata;
+    uint64_t metadata_allocated;
+    uint64_t metadata_sectors;
+} DC_FsMap;
+
+// Reads partition table and file system metadata of device. Returns 1 if device can't be read at all
+int dc_fs_map_build(DC_FsMap *map, const char *dev_path, uint64_t nb_sectors);
+void dc_fs_map_free(DC_FsMap *map);
+
+#endif  // FS_MAP_H
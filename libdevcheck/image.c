@@ -0,0 +1,556 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "lz.h"
+#include "sparse_dst.h"
+#include "log.h"
+
+#define CHUNK_SIZE (DC_IMAGE_CHUNK_SECTORS * 512)
+#define INDEX_PAGE_SIZE 4096
+#define INDEX_PAGE_ENTRIES (INDEX_PAGE_SIZE / sizeof(DC_ImageIndexEntry))
+
+static int pread_full(int fd, void *buf, size_t size, uint64_t offset) {
+    while (size) {
+        ssize_t r = pread(fd, buf, size, offset);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 1;
+        buf = (uint8_t*)buf + r;
+        size -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t size, uint64_t offset) {
+    while (size) {
+        ssize_t r = pwrite(fd, buf, size, offset);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 1;
+        buf = (const uint8_t*)buf + r;
+        size -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int header_valid(const DC_ImageHeader *header) {
+    return !memcmp(header->magic, DC_IMAGE_MAGIC, sizeof(header->magic))
+        && header->version == DC_IMAGE_VERSION;
+}
+
+int dc_image_probe(const char *path, uint64_t *nb_sectors) {
+    DC_ImageHeader header;
+    int fd = open(path, O_RDONLY | O_LARGEFILE);
+    if (fd == -1)
+        return 0;
+    int r = pread(fd, &header, sizeof(header), 0) == sizeof(header) && header_valid(&header);
+    close(fd);
+    if (r && nb_sectors)
+        *nb_sectors = header.nb_sectors;
+    return r;
+}
+
+static uint32_t chunk_sectors_of(DC_Image *image, uint64_t chunk) {
+    uint64_t left = image->header.nb_sectors - chunk * DC_IMAGE_CHUNK_SECTORS;
+    return left < DC_IMAGE_CHUNK_SECTORS ? left : DC_IMAGE_CHUNK_SECTORS;
+}
+
+static int create(DC_Image *image, uint64_t nb_sectors) {
+    DC_ImageHeader *header = &image->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, DC_IMAGE_MAGIC, sizeof(header->magic));
+    header->version = DC_IMAGE_VERSION;
+    header->chunk_sectors = DC_IMAGE_CHUNK_SECTORS;
+    header->nb_sectors = nb_sectors;
+    header->nb_chunks = (nb_sectors + DC_IMAGE_CHUNK_SECTORS - 1) / DC_IMAGE_CHUNK_SECTORS;
+    header->index_offset = DC_IMAGE_HEADER_SIZE;
+    uint64_t index_size = header->nb_chunks * sizeof(DC_ImageIndexEntry);
+    header->data_offset = header->index_offset + (index_size + INDEX_PAGE_SIZE - 1) / INDEX_PAGE_SIZE * INDEX_PAGE_SIZE;
+    // Index stays sparse until chunks are written, zeros mean "absent"
+    if (ftruncate(image->fd, header->data_offset))
+        return 1;
+    if (pwrite_full(image->fd, header, sizeof(*header), 0))
+        return 1;
+    return fdatasync(image->fd);
+}
+
+static int load(DC_Image *image) {
+    DC_ImageHeader *header = &image->header;
+    if (pread_full(image->fd, header, sizeof(*header), 0) || !header_valid(header)
+            || header->chunk_sectors != DC_IMAGE_CHUNK_SECTORS
+            || header->nb_chunks != (header->nb_sectors + DC_IMAGE_CHUNK_SECTORS - 1) / DC_IMAGE_CHUNK_SECTORS
+            || header->data_offset < header->index_offset + header->nb_chunks * sizeof(DC_ImageIndexEntry))
+        return 1;
+    if (!header->nb_bad_extents)
+        return 0;
+    image->bad_extents = calloc(header->nb_bad_extents, sizeof(DC_ImageBadExtent));
+    if (!image->bad_extents)
+        return 1;
+    image->nb_bad_extents = header->nb_bad_extents;
+    return pread_full(image->fd, image->bad_extents, image->nb_bad_extents * sizeof(DC_ImageBadExtent),
+            header->bad_map_offset);
+}
+
+static int grow_extents(DC_ImageFreeExtent **extents, uint64_t nb, uint64_t *allocated) {
+    if (nb < *allocated)
+        return 0;
+    uint64_t new_allocated = *allocated ? *allocated * 2 : 64;
+    DC_ImageFreeExtent *new_extents = realloc(*extents, new_allocated * sizeof(DC_ImageFreeExtent));
+    if (!new_extents)
+        return 1;
+    *extents = new_extents;
+    *allocated = new_allocated;
+    return 0;
+}
+
+// Adds space to free list, merging it with neighbours. Without memory for it, space is just not reused
+static void free_space(DC_Image *image, uint64_t offset, uint64_t size) {
+    DC_ImageFreeExtent *extents = image->free_extents;
+    uint64_t lo = 0, hi = image->nb_free_extents;
+    // First extent after offset
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (extents[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int merge_prev = lo > 0 && extents[lo - 1].offset + extents[lo - 1].size == offset;
+    int merge_next = lo < image->nb_free_extents && offset + size == extents[lo].offset;
+    if (merge_prev && merge_next) {
+        extents[lo - 1].size += size + extents[lo].size;
+        memmove(&extents[lo], &extents[lo + 1], (image->nb_free_extents - lo - 1) * sizeof(*extents));
+        image->nb_free_extents--;
+    } else if (merge_prev) {
+        extents[lo - 1].size += size;
+    } else if (merge_next) {
+        extents[lo].offset = offset;
+        extents[lo].size += size;
+    } else {
+        if (grow_extents(&image->free_extents, image->nb_free_extents, &image->free_allocated))
+            return;
+        extents = image->free_extents;
+        memmove(&extents[lo + 1], &extents[lo], (image->nb_free_extents - lo) * sizeof(*extents));
+        extents[lo] = (DC_ImageFreeExtent){ offset, size };
+        image->nb_free_extents++;
+    }
+}
+
+// Offset for blob of size: in first free extent it fits in, or at the end of file
+static uint64_t allocate_space(DC_Image *image, uint64_t size) {
+    for (uint64_t i = 0; i < image->nb_free_extents; i++) {
+        DC_ImageFreeExtent *extent = &image->free_extents[i];
+        if (extent->size < size)
+            continue;
+        uint64_t offset = extent->offset;
+        extent->offset += size;
+        extent->size -= size;
+        if (!extent->size) {
+            memmove(extent, extent + 1, (image->nb_free_extents - i - 1) * sizeof(*extent));
+            image->nb_free_extents--;
+        }
+        return offset;
+    }
+    uint64_t offset = image->append_offset;
+    image->append_offset += size;
+    return offset;
+}
+
+// Synced index may still refer to superseded blob, so its space is freed after next sync
+static void release_space(DC_Image *image, uint64_t offset, uint64_t size) {
+    if (grow_extents(&image->released, image->nb_released, &image->released_allocated))
+        return;
+    image->released[image->nb_released++] = (DC_ImageFreeExtent){ offset, size };
+}
+
+static int compare_free_extents(const void *a, const void *b) {
+    const DC_ImageFreeExtent *x = a, *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Space between blobs which index refers to, and bad map, is free: it was released before image was closed,
+// or it is blob written after last sync
+static int find_free_space(DC_Image *image) {
+    DC_ImageFreeExtent *used = malloc((image->header.nb_chunks + 1) * sizeof(*used));
+    uint64_t nb_used = 0;
+    if (!used)
+        return 1;
+    for (uint64_t chunk = 0; chunk < image->header.nb_chunks; chunk++)
+        if (image->index[chunk].type == DC_ImageChunk_eRaw || image->index[chunk].type == DC_ImageChunk_eLz)
+            used[nb_used++] = (DC_ImageFreeExtent){ image->index[chunk].offset, image->index[chunk].size };
+    if (image->header.nb_bad_extents)
+        used[nb_used++] = (DC_ImageFreeExtent){ image->header.bad_map_offset,
+            image->header.nb_bad_extents * sizeof(DC_ImageBadExtent) };
+    qsort(used, nb_used, sizeof(*used), compare_free_extents);
+    uint64_t offset = image->header.data_offset;
+    for (uint64_t i = 0; i < nb_used; i++) {
+        if (used[i].offset > offset)
+            free_space(image, offset, used[i].offset - offset);
+        if (used[i].offset + used[i].size > offset)
+            offset = used[i].offset + used[i].size;
+    }
+    if (image->append_offset > offset)
+        free_space(image, offset, image->append_offset - offset);
+    free(used);
+    return 0;
+}
+
+int dc_image_open(DC_Image *image, const char *path, uint64_t nb_sectors, int writable) {
+    struct stat st;
+    int r;
+
+    memset(image, 0, sizeof(*image));
+    image->writable = writable;
+    image->chunk_buf_chunk = -1;
+    for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++)
+        image->cache[i].chunk = -1;
+    image->fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_LARGEFILE | O_NOATIME, S_IRUSR | S_IWUSR);
+    if (image->fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open image %s\n", path);
+        return 1;
+    }
+    r = fstat(image->fd, &st);
+    if (r)
+        goto fail;
+    if (st.st_size == 0 && writable) {
+        r = create(image, nb_sectors);
+    } else {
+        r = load(image);
+        if (r) {
+            dc_log(DC_LOG_ERROR, "File %s is not an image\n", path);
+        } else if (writable && image->header.nb_sectors != nb_sectors) {
+            dc_log(DC_LOG_ERROR, "Image %s is of another device size\n", path);
+            r = 1;
+        }
+    }
+    if (r)
+        goto fail;
+    image->append_offset = st.st_size > (off_t)image->header.data_offset ? (uint64_t)st.st_size : image->header.data_offset;
+
+    image->index = calloc(image->header.nb_chunks, sizeof(DC_ImageIndexEntry));
+    if (!image->index)
+        goto fail;
+    r = pread_full(image->fd, image->index, image->header.nb_chunks * sizeof(DC_ImageIndexEntry), image->header.index_offset);
+    if (r)
+        goto fail_index;
+    image->nb_index_pages = (image->header.nb_chunks + INDEX_PAGE_ENTRIES - 1) / INDEX_PAGE_ENTRIES;
+    image->index_dirty = calloc(image->nb_index_pages, 1);
+    if (!image->index_dirty)
+        goto fail_index;
+    image->blob_buf = malloc(DC_LZ_BOUND(CHUNK_SIZE));
+    image->chunk_buf = malloc(CHUNK_SIZE);
+    if (!image->blob_buf || !image->chunk_buf)
+        goto fail_bufs;
+    if (writable) {
+        for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++) {
+            image->cache[i].buf = malloc(CHUNK_SIZE);
+            if (!image->cache[i].buf)
+                goto fail_cache;
+        }
+        if (find_free_space(image))
+            goto fail_cache;
+    }
+    pthread_mutex_init(&image->mutex, NULL);
+    return 0;
+
+fail_cache:
+    for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++)
+        free(image->cache[i].buf);
+    free(image->free_extents);
+fail_bufs:
+    free(image->chunk_buf);
+    free(image->blob_buf);
+    free(image->index_dirty);
+fail_index:
+    free(image->index);
+fail:
+    free(image->bad_extents);
+    close(image->fd);
+    return 1;
+}
+
+// Reads stored version of chunk into chunk_buf
+static int load_chunk(DC_Image *image, uint64_t chunk) {
+    DC_ImageIndexEntry *entry = &image->index[chunk];
+    size_t size = chunk_sectors_of(image, chunk) * 512;
+    if ((int64_t)chunk == image->chunk_buf_chunk)
+        return 0;
+    image->chunk_buf_chunk = -1;
+    switch (entry->type) {
+        case DC_ImageChunk_eAbsent:
+        case DC_ImageChunk_eZero:
+            memset(image->chunk_buf, 0, size);
+            break;
+        case DC_ImageChunk_eRaw:
+            if (entry->size != size || pread_full(image->fd, image->chunk_buf, size, entry->offset))
+                return 1;
+            break;
+        case DC_ImageChunk_eLz:
+            if (entry->size > DC_LZ_BOUND(CHUNK_SIZE)
+                    || pread_full(image->fd, image->blob_buf, entry->size, entry->offset)
+                    || dc_lz_decompress(image->blob_buf, entry->size, image->chunk_buf, size))
+                return 1;
+            break;
+        default:
+            return 1;
+    }
+    image->chunk_buf_chunk = chunk;
+    return 0;
+}
+
+static int store_chunk(DC_Image *image, uint64_t chunk, const void *buf) {
+    size_t size = chunk_sectors_of(image, chunk) * 512;
+    DC_ImageIndexEntry entry = { 0, 0, DC_ImageChunk_eZero };
+    if (!dc_buffer_is_zero(buf, size)) {
+        const void *blob = image->blob_buf;
+        entry.size = dc_lz_compress(buf, size, image->blob_buf, size - 1);
+        entry.type = DC_ImageChunk_eLz;
+        if (!entry.size) {
+            blob = buf;
+            entry.size = size;
+            entry.type = DC_ImageChunk_eRaw;
+        }
+        entry.offset = allocate_space(image, entry.size);
+        if (pwrite_full(image->fd, blob, entry.size, entry.offset)) {
+            free_space(image, entry.offset, entry.size);
+            return 1;
+        }
+    }
+    if (image->index[chunk].type == DC_ImageChunk_eRaw || image->index[chunk].type == DC_ImageChunk_eLz)
+        release_space(image, image->index[chunk].offset, image->index[chunk].size);
+    image->index[chunk] = entry;
+    image->index_dirty[chunk / INDEX_PAGE_ENTRIES] = 1;
+    if ((int64_t)chunk == image->chunk_buf_chunk)
+        image->chunk_buf_chunk = -1;
+    return 0;
+}
+
+static int flush_slot(DC_Image *image, DC_ImageCacheSlot *slot) {
+    uint32_t nb_sectors = chunk_sectors_of(image, slot->chunk);
+    // Sectors not written since chunk got into cache are taken from stored version
+    if (slot->nb_filled < nb_sectors) {
+        if (load_chunk(image, slot->chunk))
+            return 1;
+        for (uint32_t i = 0; i < nb_sectors; i++)
+            if (!(slot->filled[i / 8] & (1 << (i % 8))))
+                memcpy(slot->buf + i * 512, (uint8_t*)image->chunk_buf + i * 512, 512);
+    }
+    int r = store_chunk(image, slot->chunk, slot->buf);
+    slot->chunk = -1;
+    return r;
+}
+
+static DC_ImageCacheSlot *get_slot(DC_Image *image, uint64_t chunk) {
+    DC_ImageCacheSlot *lru = &image->cache[0];
+    for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++) {
+        DC_ImageCacheSlot *slot = &image->cache[i];
+        if (slot->chunk == (int64_t)chunk)
+            return slot;
+        if (slot->chunk == -1 || (lru->chunk != -1 && slot->last_use < lru->last_use))
+            lru = slot;
+    }
+    if (lru->chunk != -1 && flush_slot(image, lru))
+        return NULL;
+    lru->chunk = chunk;
+    lru->nb_filled = 0;
+    memset(lru->filled, 0, sizeof(lru->filled));
+    return lru;
+}
+
+int dc_image_write(DC_Image *image, uint64_t lba, size_t sectors, const void *buf) {
+    const uint8_t *p = buf;
+    int r = 0;
+    if (lba + sectors > image->header.nb_sectors)
+        return 1;
+    pthread_mutex_lock(&image->mutex);
+    while (sectors) {
+        uint64_t chunk = lba / DC_IMAGE_CHUNK_SECTORS;
+        uint32_t first = lba % DC_IMAGE_CHUNK_SECTORS;
+        uint32_t n = chunk_sectors_of(image, chunk) - first < sectors ? chunk_sectors_of(image, chunk) - first : sectors;
+        DC_ImageCacheSlot *slot = get_slot(image, chunk);
+        if (!slot) {
+            r = 1;
+            break;
+        }
+        slot->last_use = ++image->use_counter;
+        memcpy(slot->buf + first * 512, p, n * 512);
+        for (uint32_t i = first; i < first + n; i++) {
+            if (!(slot->filled[i / 8] & (1 << (i % 8)))) {
+                slot->filled[i / 8] |= 1 << (i % 8);
+                slot->nb_filled++;
+            }
+        }
+        if (slot->nb_filled == chunk_sectors_of(image, chunk) && flush_slot(image, slot)) {
+            r = 1;
+            break;
+        }
+        lba += n;
+        p += n * 512;
+        sectors -= n;
+    }
+    pthread_mutex_unlock(&image->mutex);
+    if (r)
+        dc_log(DC_LOG_ERROR, "Failed to write image at LBA %"PRIu64", errno %d\n", lba, errno);
+    return r;
+}
+
+static int sync_locked(DC_Image *image) {
+    for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++)
+        if (image->cache[i].chunk != -1 && flush_slot(image, &image->cache[i]))
+            return 1;
+    if (fdatasync(image->fd))
+        return 1;
+    int dirty = 0;
+    for (uint64_t page = 0; page < image->nb_index_pages; page++) {
+        if (!image->index_dirty[page])
+            continue;
+        uint64_t first = page * INDEX_PAGE_ENTRIES;
+        uint64_t nb_entries = image->header.nb_chunks - first < INDEX_PAGE_ENTRIES ?
+            image->header.nb_chunks - first : INDEX_PAGE_ENTRIES;
+        if (pwrite_full(image->fd, &image->index[first], nb_entries * sizeof(DC_ImageIndexEntry),
+                    image->header.index_offset + first * sizeof(DC_ImageIndexEntry)))
+            return 1;
+        image->index_dirty[page] = 0;
+        dirty = 1;
+    }
+    if (dirty && fdatasync(image->fd))
+        return 1;
+    // Index doesn't refer to superseded blobs anymore
+    for (uint64_t i = 0; i < image->nb_released; i++)
+        free_space(image, image->released[i].offset, image->released[i].size);
+    image->nb_released = 0;
+    // Synced data is clean, so it is dropped from page cache: image of big device is not to evict everything else
+    posix_fadvise(image->fd, 0, 0, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+int dc_image_sync(DC_Image *image) {
+    pthread_mutex_lock(&image->mutex);
+    int r = sync_locked(image);
+    pthread_mutex_unlock(&image->mutex);
+    if (r)
+        dc_log(DC_LOG_ERROR, "Failed to sync image, errno %d\n", errno);
+    return r;
+}
+
+int dc_image_set_bad_map(DC_Image *image, const DC_ImageBadExtent *extents, uint64_t nb_extents) {
+    DC_ImageBadExtent *copy = NULL;
+    if (nb_extents) {
+        copy = malloc(nb_extents * sizeof(*copy));
+        if (!copy)
+            return 1;
+        memcpy(copy, extents, nb_extents * sizeof(*copy));
+    }
+    pthread_mutex_lock(&image->mutex);
+    free(image->bad_extents);
+    image->bad_extents = copy;
+    image->nb_bad_extents = nb_extents;
+    pthread_mutex_unlock(&image->mutex);
+    return 0;
+}
+
+// Map is appended, header is updated after it is durable
+static int store_bad_map(DC_Image *image) {
+    uint64_t offset = image->append_offset;
+    if (image->nb_bad_extents) {
+        if (pwrite_full(image->fd, image->bad_extents, image->nb_bad_extents * sizeof(DC_ImageBadExtent), offset))
+            return 1;
+        image->append_offset += image->nb_bad_extents * sizeof(DC_ImageBadExtent);
+        if (fdatasync(image->fd))
+            return 1;
+    }
+    image->header.bad_map_offset = offset;
+    image->header.nb_bad_extents = image->nb_bad_extents;
+    if (pwrite_full(image->fd, &image->header, sizeof(image->header), 0))
+        return 1;
+    return fdatasync(image->fd);
+}
+
+int dc_image_close(DC_Image *image) {
+    int r = 0;
+    if (image->writable) {
+        r = sync_locked(image) || store_bad_map(image);
+        if (r)
+            dc_log(DC_LOG_ERROR, "Failed to finish image, errno %d\n", errno);
+    }
+    pthread_mutex_destroy(&image->mutex);
+    for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++)
+        free(image->cache[i].buf);
+    free(image->chunk_buf);
+    free(image->blob_buf);
+    free(image->index_dirty);
+    free(image->index);
+    free(image->bad_extents);
+    free(image->free_extents);
+    free(image->released);
+    close(image->fd);
+    return r;
+}
+
+ssize_t dc_image_pread(DC_Image *image, void *buf, size_t size, uint64_t offset) {
+    size_t done = 0;
+    pthread_mutex_lock(&image->mutex);
+    while (done < size && offset < image->header.nb_sectors * 512) {
+        uint64_t chunk = offset / CHUNK_SIZE;
+        size_t chunk_offset = offset % CHUNK_SIZE;
+        size_t n = chunk_sectors_of(image, chunk) * 512 - chunk_offset;
+        if (n > size - done)
+            n = size - done;
+        // Data being written is flushed first, so that reading sees it
+        for (int i = 0; i < DC_IMAGE_CACHE_CHUNKS; i++) {
+            if (image->cache[i].chunk == (int64_t)chunk && flush_slot(image, &image->cache[i])) {
+                pthread_mutex_unlock(&image->mutex);
+                return -1;
+            }
+        }
+        if (load_chunk(image, chunk)) {
+            pthread_mutex_unlock(&image->mutex);
+            errno = EIO;
+            return -1;
+        }
+        memcpy((uint8_t*)buf + done, (uint8_t*)image->chunk_buf + chunk_offset, n);
+        done += n;
+        offset += n;
+    }
+    pthread_mutex_unlock(&image->mutex);
+    return done;
+}
+
+// Index of first bad extent which ends beyond lba; nb_bad_extents if none
+static uint64_t find_bad_extent(DC_Image *image, uint64_t lba) {
+    uint64_t lo = 0, hi = image->nb_bad_extents;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (image->bad_extents[mid].end_lba <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int dc_image_read(DC_Image *image, uint64_t lba, size_t sectors, void *buf) {
+    pthread_mutex_lock(&image->mutex);
+    uint64_t i = find_bad_extent(image, lba);
+    int bad = i < image->nb_bad_extents && image->bad_extents[i].begin_lba < lba + sectors;
+    pthread_mutex_unlock(&image->mutex);
+    if (bad)
+        return 1;
+    return dc_image_pread(image, buf, sectors * 512, lba * 512) != (ssize_t)sectors * 512;
+}
+
+uint64_t dc_image_stored_size(DC_Image *image) {
+    return image->append_offset;
+}
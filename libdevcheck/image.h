@@ -0,0 +1,122 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Compressed image of device. Device is split into chunks of DC_IMAGE_CHUNK_SECTORS,
+ * each stored as compressed (or plain, if compression doesn't pay off) blob, or not stored at all
+ * if it is zeros. Rewritten chunk gets new blob, never in place of blob which synced index refers to:
+ * old one is released on sync, once index without it is durable, and its space is reused by later blobs.
+ * Released space is found anew from index when image is reopened. Index of fixed-size entries,
+ * one per chunk, follows header, so any LBA is found at once.
+ *
+ * Writes are collected in a few chunk buffers, so that chunk is compressed once when it is filled.
+ * Partially written chunk is merged with its stored blob when flushed. On sync, buffered chunks
+ * are flushed, blobs are synced, and only then index is written and synced: index never refers
+ * to blob which may be lost. Map of sectors which were not copied (unread or failed) is appended
+ * on close, so that reading them fails like reading source did.
+ */
+
+#define DC_IMAGE_MAGIC "XHDDCIMG"
+#define DC_IMAGE_VERSION 1
+#define DC_IMAGE_HEADER_SIZE 4096
+#define DC_IMAGE_CHUNK_SECTORS 2048  // 1 MiB
+#define DC_IMAGE_CACHE_CHUNKS 4
+
+typedef enum {
+    DC_ImageChunk_eAbsent = 0,  // never written, reads as zeros
+    DC_ImageChunk_eZero,
+    DC_ImageChunk_eRaw,
+    DC_ImageChunk_eLz,
+} DC_ImageChunkType;
+
+typedef struct dc_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_sectors;
+    uint64_t nb_sectors;
+    uint64_t nb_chunks;
+    uint64_t index_offset;
+    uint64_t data_offset;  // first blob
+    uint64_t bad_map_offset;
+    uint64_t nb_bad_extents;  // 0 if all sectors were copied, or map wasn't stored
+} DC_ImageHeader;
+
+typedef struct dc_image_index_entry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t type;  // DC_ImageChunkType
+} DC_ImageIndexEntry;
+
+typedef struct dc_image_bad_extent {
+    uint64_t begin_lba;
+    uint64_t end_lba;
+    uint32_t status;  // SectorStatus of copy journal
+    uint32_t reserved;
+} DC_ImageBadExtent;
+
+typedef struct dc_image_free_extent {
+    uint64_t offset;
+    uint64_t size;
+} DC_ImageFreeExtent;
+
+typedef struct dc_image_cache_slot {
+    int64_t chunk;  // -1 if slot is free
+    uint64_t last_use;
+    uint32_t nb_filled;
+    uint8_t filled[DC_IMAGE_CHUNK_SECTORS / 8];  // bitmap of written sectors
+    uint8_t *buf;
+} DC_ImageCacheSlot;
+
+typedef struct dc_image {
+    int fd;
+    int writable;
+    DC_ImageHeader header;
+    DC_ImageIndexEntry *index;
+    uint8_t *index_dirty;  // per page of index, written on sync
+    uint64_t nb_index_pages;
+    uint64_t append_offset;
+    DC_ImageFreeExtent *free_extents;  // space between blobs which may be reused, sorted, not adjacent
+    uint64_t nb_free_extents;
+    uint64_t free_allocated;
+    DC_ImageFreeExtent *released;  // blobs superseded since last sync, not free until index is synced
+    uint64_t nb_released;
+    uint64_t released_allocated;
+    DC_ImageBadExtent *bad_extents;  // sorted
+    uint64_t nb_bad_extents;
+    pthread_mutex_t mutex;  // image may be written by one thread and synced by another
+    DC_ImageCacheSlot cache[DC_IMAGE_CACHE_CHUNKS];
+    uint64_t use_counter;
+    void *blob_buf;
+    void *chunk_buf;  // stored chunk, decompressed
+    int64_t chunk_buf_chunk;  // -1 if none
+} DC_Image;
+
+// Returns 1 if file at path is an image, then sets nb_sectors to size of device it is image of, if not NULL
+int dc_image_probe(const char *path, uint64_t *nb_sectors);
+/**
+ * Opens image for reading, or for writing, then creating it if it doesn't exist.
+ * Image opened for writing must be of nb_sectors; for reading, size is taken from image
+ */
+int dc_image_open(DC_Image *image, const char *path, uint64_t nb_sectors, int writable);
+// Syncs image opened for writing and stores map of sectors which were not copied, if set
+int dc_image_close(DC_Image *image);
+
+int dc_image_write(DC_Image *image, uint64_t lba, size_t sectors, const void *buf);
+// Makes written data durable
+int dc_image_sync(DC_Image *image);
+// Replaces map of sectors which were not copied, to be stored on close; extents must be sorted
+int dc_image_set_bad_map(DC_Image *image, const DC_ImageBadExtent *extents, uint64_t nb_extents);
+
+// Reads data as stored, sectors which were not copied read as zeros. Returns bytes read, like pread()
+ssize_t dc_image_pread(DC_Image *image, void *buf, size_t size, uint64_t offset);
+// Reads sectors as source device would: fails if some of them were not copied
+int dc_image_read(DC_Image *image, uint64_t lba, size_t sectors, void *buf);
+// Bytes taken in image file, including free space between blobs
+uint64_t dc_image_stored_size(DC_Image *image);
+
+#endif  // IMAGE_H
@@ -0,0 +1,472 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "io_backend.h"
+#include "libdevcheck.h"
+#include "virtual_dev.h"
+
+static int dev_open(DC_Io *io, int flags) {
+    int open_flags = (flags & DC_IO_FLAG_WRITE ? O_RDWR : O_RDONLY) | O_LARGEFILE | O_NOATIME;
+    if (!(flags & DC_IO_FLAG_BUFFERED))
+        open_flags |= O_DIRECT;
+    io->fd = dc_dev_open(io->dev, open_flags);
+    return io->fd == -1;
+}
+
+// SG_IO needs device opened for writing, and direct I/O means nothing for it
+static int sg_dev_open(DC_Io *io, int flags) {
+    return dev_open(io, flags | DC_IO_FLAG_WRITE | DC_IO_FLAG_BUFFERED);
+}
+
+static void dev_close(DC_Io *io) {
+    close(io->fd);
+}
+
+static uint64_t timespec_diff_us(const struct timespec *pre, const struct timespec *post) {
+    return (post->tv_sec - pre->tv_sec) * 1000000 + (post->tv_nsec - pre->tv_nsec) / 1000;
+}
+
+static void time_diff_us(DC_IoRequest *req) {
+    req->report.blk_access_time = timespec_diff_us(&req->time_submit, &req->time_complete);
+}
+
+// Executes requests one by one and queues them as completed
+static int sync_submit(DC_Io *io, DC_IoRequest **reqs, int nb, int (*execute)(DC_Io *io, DC_IoRequest *req)) {
+    int i;
+    if (io->completed_tail - io->completed_head + nb > (uint64_t)io->depth)
+        return 1;
+    for (i = 0; i < nb; i++) {
+        DC_IoRequest *req = reqs[i];
+        int r;
+        req->report.lba = req->lba;
+        req->report.sectors_processed = req->sectors;
+        clock_gettime(DC_BEST_CLOCK, &req->time_submit);
+        r = execute(io, req);
+        clock_gettime(DC_BEST_CLOCK, &req->time_complete);
+        time_diff_us(req);
+        io->completed[io->completed_tail++ % io->depth] = req;
+        if (r)
+            return 1;
+    }
+    return 0;
+}
+
+static int sync_reap(DC_Io *io, DC_IoRequest **done, int max, int wait) {
+    int nb = 0;
+    (void)wait;
+    while (nb < max && io->completed_head < io->completed_tail)
+        done[nb++] = io->completed[io->completed_head++ % io->depth];
+    return nb;
+}
+
+static int posix_execute(DC_Io *io, DC_IoRequest *req) {
+    size_t size = req->sectors * 512;
+    off_t offset = req->lba * 512;
+    ssize_t r;
+    if (req->op == DC_IoOp_eWrite)
+        r = dc_dev_pwrite(io->dev, io->fd, req->buf, size, offset);
+    else
+        r = dc_dev_pread(io->dev, io->fd, req->buf, size, offset);
+    req->report.blk_status = r == (ssize_t)size ? DC_BlockStatus_eOk : DC_BlockStatus_eError;
+    return 0;
+}
+
+static int posix_submit(DC_Io *io, DC_IoRequest **reqs, int nb) {
+    return sync_submit(io, reqs, nb, posix_execute);
+}
+
+static int ata_execute(DC_Io *io, DC_IoRequest *req) {
+    int cmd;
+    switch (req->op) {
+        case DC_IoOp_eRead:
+            cmd = 0x25;  // READ DMA EXT
+            break;
+        case DC_IoOp_eWrite:
+            cmd = 0x35;  // WRITE DMA EXT
+            break;
+        default:
+            cmd = WIN_VERIFY_EXT;  // 42h
+            break;
+    }
+    memset(&io->ata_command, 0, sizeof(io->ata_command));
+    prepare_ata_command(&io->ata_command, cmd, req->lba, req->sectors);
+    prepare_scsi_command_from_ata(&io->scsi_command, &io->ata_command);
+    if (req->op != DC_IoOp_eVerify) {
+        io->scsi_command.io_hdr.dxfer_direction = req->op == DC_IoOp_eRead ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
+        io->scsi_command.io_hdr.dxferp = req->buf;
+        io->scsi_command.io_hdr.dxfer_len = req->sectors * 512;
+        io->scsi_command.scsi_cmd[1] = (6 << 1) + 1;  // DMA protocol + EXTEND bit
+        // CK_COND=0 T_DIR BYTE_BLOCK=1 T_LENGTH=10b
+        io->scsi_command.scsi_cmd[2] = req->op == DC_IoOp_eRead ? 0x0e : 0x06;
+    }
+    if (dc_dev_ioctl(io->dev, io->fd, SG_IO, &io->scsi_command)) {
+        req->report.blk_status = DC_BlockStatus_eError;
+        return 1;
+    }
+    req->report.blk_status = scsi_ata_check_return_status(&io->scsi_command);
+    return 0;
+}
+
+static int ata_submit(DC_Io *io, DC_IoRequest **reqs, int nb) {
+    return sync_submit(io, reqs, nb, ata_execute);
+}
+
+static int scsi_execute(DC_Io *io, DC_IoRequest *req) {
+    switch (req->op) {
+        case DC_IoOp_eRead:
+            prepare_scsi_command_rw16(&io->scsi_command, 0x88 /* READ (16) */, req->lba, req->sectors, req->buf);
+            break;
+        case DC_IoOp_eWrite:
+            prepare_scsi_command_rw16(&io->scsi_command, 0x8a /* WRITE (16) */, req->lba, req->sectors, req->buf);
+            break;
+        default:
+            // BYTCHK=0, medium is verified without data transfer
+            prepare_scsi_command_rw16(&io->scsi_command, 0x8f /* VERIFY (16) */, req->lba, req->sectors, NULL);
+            break;
+    }
+    if (dc_dev_ioctl(io->dev, io->fd, SG_IO, &io->scsi_command)) {
+        req->report.blk_status = DC_BlockStatus_eError;
+        return 1;
+    }
+    req->report.blk_status = scsi_check_return_status(&io->scsi_command);
+    return 0;
+}
+
+static int scsi_submit(DC_Io *io, DC_IoRequest **reqs, int nb) {
+    return sync_submit(io, reqs, nb, scsi_execute);
+}
+
+// Takes free slot for request and stamps its submission; returns -1 if all slots are taken
+static int async_start(DC_Io *io, DC_IoRequest *req) {
+    int slot;
+    for (slot = 0; slot < io->depth && io->in_flight[slot]; slot++)
+        ;
+    if (slot == io->depth)
+        return -1;
+    io->in_flight[slot] = req;
+    io->nb_in_flight++;
+    req->report.lba = req->lba;
+    req->report.sectors_processed = req->sectors;
+    clock_gettime(DC_BEST_CLOCK, &req->time_submit);
+    return slot;
+}
+
+static void async_cancel(DC_Io *io, int slot) {
+    io->in_flight[slot] = NULL;
+    io->nb_in_flight--;
+}
+
+// Completion is stamped as it is drained. Request waits in queue behind ones submitted before it,
+// so its access time is counted from its submission or from previous completion, whichever is later
+static DC_IoRequest *async_complete(DC_Io *io, int slot, DC_BlockStatus status) {
+    DC_IoRequest *req = io->in_flight[slot];
+    struct timespec *time_start = &req->time_submit;
+    clock_gettime(DC_BEST_CLOCK, &req->time_complete);
+    if (io->time_last_complete.tv_sec > time_start->tv_sec || (io->time_last_complete.tv_sec == time_start->tv_sec
+                && io->time_last_complete.tv_nsec > time_start->tv_nsec))
+        time_start = &io->time_last_complete;
+    req->report.blk_access_time = timespec_diff_us(time_start, &req->time_complete);
+    io->time_last_complete = req->time_complete;
+    req->report.blk_status = status;
+    async_cancel(io, slot);
+    return req;
+}
+
+// Virtual device emulates synchronous I/O only
+static int uring_open(DC_Io *io, int flags) {
+    if (io->dev->virt || dev_open(io, flags))
+        return 1;
+    if (dc_uring_init(&io->ring, io->depth))
+        goto fail_ring;
+    io->in_flight = calloc(io->depth, sizeof(io->in_flight[0]));
+    if (!io->in_flight)
+        goto fail_in_flight;
+    return 0;
+
+fail_in_flight:
+    dc_uring_close(&io->ring);
+fail_ring:
+    dev_close(io);
+    return 1;
+}
+
+static int uring_submit(DC_Io *io, DC_IoRequest **reqs, int nb) {
+    int i;
+    if (io->nb_in_flight + nb > io->depth)
+        return 1;
+    for (i = 0; i < nb; i++) {
+        DC_IoRequest *req = reqs[i];
+        int slot = async_start(io, req);
+        int r;
+        if (req->op == DC_IoOp_eWrite)
+            r = dc_uring_prep_write(&io->ring, io->fd, req->buf, req->sectors * 512, req->lba * 512, slot);
+        else
+            r = dc_uring_prep_read(&io->ring, io->fd, req->buf, req->sectors * 512, req->lba * 512, slot);
+        if (r) {
+            async_cancel(io, slot);
+            break;
+        }
+    }
+    return dc_uring_submit(&io->ring, 0) || i < nb;
+}
+
+static int uring_reap(DC_Io *io, DC_IoRequest **done, int max, int wait) {
+    int nb = 0;
+    uint64_t slot;
+    int32_t res;
+    while (nb < max) {
+        if (dc_uring_reap(&io->ring, &slot, &res)) {
+            if (nb || !wait || !io->nb_in_flight)
+                break;
+            if (dc_uring_submit(&io->ring, 1))
+                return -1;
+            continue;
+        }
+        DC_IoRequest *req = io->in_flight[slot];
+        done[nb++] = async_complete(io, slot, res == (int32_t)(req->sectors * 512) ? DC_BlockStatus_eOk : DC_BlockStatus_eError);
+    }
+    return nb;
+}
+
+static void uring_close(DC_Io *io) {
+    dc_uring_close(&io->ring);
+    free(io->in_flight);
+    dev_close(io);
+}
+
+// Block device is opened as well, for ioctls of dc_io_open()
+static int sg_async_open(DC_Io *io, int flags) {
+    if (io->dev->virt || sg_dev_open(io, flags))
+        return 1;
+    if (dc_sg_queue_open(&io->sg_queue, io->dev, io->depth))
+        goto fail_queue;
+    io->depth = io->sg_queue.depth;
+    io->in_flight = calloc(io->depth, sizeof(io->in_flight[0]));
+    if (!io->in_flight)
+        goto fail_in_flight;
+    io->sg_commands = calloc(io->depth, sizeof(io->sg_commands[0]));
+    if (!io->sg_commands)
+        goto fail_commands;
+    return 0;
+
+fail_commands:
+    free(io->in_flight);
+fail_in_flight:
+    dc_sg_queue_close(&io->sg_queue);
+fail_queue:
+    dev_close(io);
+    return 1;
+}
+
+static int sg_async_submit(DC_Io *io, DC_IoRequest **reqs, int nb) {
+    int i;
+    if (io->nb_in_flight + nb > io->depth)
+        return 1;
+    for (i = 0; i < nb; i++) {
+        DC_IoRequest *req = reqs[i];
+        if (req->op == DC_IoOp_eWrite) {
+            dc_log(DC_LOG_ERROR, "Writing is not queued via asynchronous SG interface\n");
+            return 1;
+        }
+        int slot = async_start(io, req);
+        if (dc_sg_queue_submit_read(&io->sg_queue, &io->sg_commands[slot], slot, req->lba, req->sectors, req->buf)) {
+            async_cancel(io, slot);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int sg_async_reap(DC_Io *io, DC_IoRequest **done, int max, int wait) {
+    int nb = 0;
+    sg_io_hdr_t hdr;
+    while (nb < max) {
+        int r = dc_sg_queue_reap(&io->sg_queue, &hdr, wait && !nb && io->nb_in_flight);
+        if (r == -1)
+            return -1;
+        if (r)
+            break;
+        if (hdr.pack_id < 0 || hdr.pack_id >= io->depth || !io->in_flight[hdr.pack_id])
+            return -1;
+        // Output members (status, duration, etc.); sense data is already in command's sense_buf
+        ScsiCommand *scsi_command = &io->sg_commands[hdr.pack_id];
+        scsi_command->io_hdr = hdr;
+        done[nb++] = async_complete(io, hdr.pack_id, dc_sg_command_status(scsi_command));
+    }
+    return nb;
+}
+
+static void sg_async_close(DC_Io *io) {
+    dc_sg_queue_close(&io->sg_queue);
+    free(io->sg_commands);
+    free(io->in_flight);
+    dev_close(io);
+}
+
+const DC_IoBackend dc_io_backend_posix = {
+    .name = "posix",
+    .open = dev_open,
+    .submit = posix_submit,
+    .reap = sync_reap,
+    .close = dev_close,
+};
+
+const DC_IoBackend dc_io_backend_ata = {
+    .name = "ata",
+    .open = sg_dev_open,
+    .submit = ata_submit,
+    .reap = sync_reap,
+    .close = dev_close,
+};
+
+const DC_IoBackend dc_io_backend_scsi = {
+    .name = "scsi",
+    .open = sg_dev_open,
+    .submit = scsi_submit,
+    .reap = sync_reap,
+    .close = dev_close,
+};
+
+const DC_IoBackend dc_io_backend_uring = {
+    .name = "uring",
+    .open = uring_open,
+    .submit = uring_submit,
+    .reap = uring_reap,
+    .close = uring_close,
+    .fallback = &dc_io_backend_posix,
+};
+
+const DC_IoBackend dc_io_backend_sg_async = {
+    .name = "sg_async",
+    .open = sg_async_open,
+    .submit = sg_async_submit,
+    .reap = sg_async_reap,
+    .close = sg_async_close,
+    .fallback = &dc_io_backend_ata,
+};
+
+static const DC_IoBackend *backends[] = {
+    &dc_io_backend_posix,
+    &dc_io_backend_ata,
+    &dc_io_backend_scsi,
+    &dc_io_backend_uring,
+    &dc_io_backend_sg_async,
+};
+
+const DC_IoBackend *dc_io_backend_find(const char *name) {
+    size_t i;
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+        if (!strcmp(backends[i]->name, name))
+            return backends[i];
+    return NULL;
+}
+
+const DC_IoBackend *dc_io_backend_for_api(enum Api api) {
+    switch (api) {
+        case Api_eAta:
+            return &dc_io_backend_ata;
+        case Api_eScsi:
+            return &dc_io_backend_scsi;
+        default:
+            return &dc_io_backend_posix;
+    }
+}
+
+const DC_IoBackend *dc_io_backend_queued_for_api(enum Api api) {
+    switch (api) {
+        case Api_eAta:
+            return &dc_io_backend_sg_async;
+        case Api_ePosix:
+            return &dc_io_backend_uring;
+        default:
+            return dc_io_backend_for_api(api);
+    }
+}
+
+int dc_io_open(DC_Io *io, DC_Dev *dev, const DC_IoBackend *backend, int depth, int flags) {
+    int r;
+    memset(io, 0, sizeof(*io));
+    io->backend = backend;
+    io->dev = dev;
+    io->depth = depth > 0 ? depth : 1;
+    io->writable = !!(flags & DC_IO_FLAG_WRITE);
+    io->completed = calloc(io->depth, sizeof(io->completed[0]));
+    if (!io->completed)
+        return 1;
+    r = backend->open(io, flags);
+    if (r && backend->fallback) {
+        dc_log(DC_LOG_WARNING, "Backend \"%s\" is unavailable, falling back to synchronous commands\n", backend->name);
+        io->backend = backend->fallback;
+        io->depth = 1;
+        r = io->backend->open(io, flags);
+    }
+    if (r) {
+        dc_log(DC_LOG_FATAL, "open %s fail\n", dev->dev_path);
+        free(io->completed);
+        return 1;
+    }
+    // Reading is to reach media, not cache; writing leaves cache settings as they are
+    if (flags & DC_IO_FLAG_WRITE)
+        return 0;
+
+    r = dc_dev_ioctl(dev, io->fd, BLKFLSBUF, NULL);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
+    r = dc_dev_ioctl(dev, io->fd, BLKRAGET, &io->old_readahead);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Getting block device readahead setting failed\n");
+    r = dc_dev_ioctl(dev, io->fd, BLKRASET, 0);
+    if (r == -1)
+      dc_log(DC_LOG_WARNING, "Disabling block device readahead setting failed\n");
+    return 0;
+}
+
+void dc_io_close(DC_Io *io) {
+    DC_IoRequest *req;
+    // Kernel may still transfer data of requests in flight
+    while (io->nb_in_flight && dc_io_reap(io, &req, 1, 1) == 1)
+        ;
+    if (!io->writable) {
+        int r = dc_dev_ioctl(io->dev, io->fd, BLKRASET, io->old_readahead);
+        if (r == -1)
+          dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
+    }
+    io->backend->close(io);
+    free(io->completed);
+}
+
+int dc_io_submit(DC_Io *io, DC_IoRequest **reqs, int nb) {
+    int i;
+    for (i = 0; i < nb; i++)
+        reqs[i]->done = 0;
+    return io->backend->submit(io, reqs, nb);
+}
+
+int dc_io_reap(DC_Io *io, DC_IoRequest **done, int max, int wait) {
+    int i;
+    int nb = io->backend->reap(io, done, max, wait);
+    for (i = 0; i < nb; i++)
+        done[i]->done = 1;
+    return nb;
+}
+
+int dc_io_wait(DC_Io *io, DC_IoRequest *req) {
+    DC_IoRequest *done;
+    while (!req->done)
+        if (dc_io_reap(io, &done, 1, 1) != 1)
+            return 1;
+    return 0;
+}
+
+int dc_io_execute(DC_Io *io, DC_IoRequest *req) {
+    DC_IoRequest *done;
+    int r = dc_io_submit(io, &req, 1);
+    int nb = dc_io_reap(io, &done, 1, 1);
+    assert(nb == 1 && done == req);
+    return r;
+}
@@ -0,0 +1,122 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "scsi.h"
+#include "device.h"
+#include "procedure.h"
+#include "uring.h"
+#include "sg_async.h"
+
+/*
+ * Block I/O of procedures goes through backend: caller submits batch of requests,
+ * then reaps completed ones, each with its DC_BlockReport filled in.
+ * "posix" does pread() and pwrite() on device node, "ata" issues READ DMA EXT,
+ * READ VERIFY SECTORS EXT and WRITE DMA EXT via ATA PASS-THROUGH, "scsi" issues
+ * READ (16), VERIFY (16) and WRITE (16), for drives behind bridges without SAT.
+ * These are synchronous: request is executed while being submitted and waits
+ * in completion queue until it is reaped. All their I/O is done with dc_dev_* calls,
+ * so that virtual devices work with them.
+ * "uring" and "sg_async" are asynchronous: submission passes requests to kernel and returns,
+ * reaping collects them as they complete, possibly out of order. "uring" does reads and writes
+ * of device node via io_uring, "sg_async" issues READ FPDMA QUEUED via sg v3 asynchronous
+ * interface, so that NCQ drive may reorder them; verify is reading into buf for both,
+ * and "sg_async" doesn't write. If asynchronous backend can't be opened, e.g. for virtual device,
+ * its synchronous fallback is used with depth of 1.
+ * Either way up to depth requests may be in flight or not reaped yet.
+ * While device is open for reading, its buffers are flushed and readahead is off.
+ */
+
+typedef enum {
+    DC_IoOp_eRead,
+    DC_IoOp_eVerify,  // for "posix" it is reading into buf
+    DC_IoOp_eWrite,
+} DC_IoOp;
+
+typedef struct dc_io_request {
+    DC_IoOp op;
+    uint64_t lba;
+    size_t sectors;
+    void *buf;
+    void *opaque;  // caller's
+    // Set on completion
+    DC_BlockReport report;  // blk_status and blk_access_time
+    struct timespec time_submit, time_complete;
+    int done;  // set when request is reaped
+} DC_IoRequest;
+
+#define DC_IO_FLAG_WRITE 1
+#define DC_IO_FLAG_BUFFERED 2  // no O_DIRECT, so buf needs no alignment
+
+typedef struct dc_io DC_Io;
+
+typedef struct dc_io_backend {
+    const char *name;
+    // Sets io->fd; returns 1 on failure
+    int (*open)(DC_Io *io, int flags);
+    int (*submit)(DC_Io *io, DC_IoRequest **reqs, int nb);
+    int (*reap)(DC_Io *io, DC_IoRequest **done, int max, int wait);
+    void (*close)(DC_Io *io);
+    const struct dc_io_backend *fallback;  // synchronous one, if this may fail to open
+} DC_IoBackend;
+
+struct dc_io {
+    const DC_IoBackend *backend;
+    DC_Dev *dev;
+    int fd;
+    int depth;
+    int writable;  // opened with DC_IO_FLAG_WRITE
+    long old_readahead;  // of device opened for reading
+    ScsiCommand scsi_command;
+    AtaCommand ata_command;
+    // Completed requests not reaped yet, FIFO
+    DC_IoRequest **completed;
+    uint64_t completed_head;
+    uint64_t completed_tail;
+
+    // Asynchronous backends: request in flight by its slot, which is its tag for kernel; NULL if slot is free
+    DC_IoRequest **in_flight;
+    int nb_in_flight;
+    struct timespec time_last_complete;
+    DC_Uring ring;
+    DC_SgQueue sg_queue;
+    ScsiCommand *sg_commands;  // by slot
+};
+
+extern const DC_IoBackend dc_io_backend_posix;
+extern const DC_IoBackend dc_io_backend_ata;
+extern const DC_IoBackend dc_io_backend_scsi;
+extern const DC_IoBackend dc_io_backend_uring;
+extern const DC_IoBackend dc_io_backend_sg_async;
+
+// By name ("posix", "ata", "scsi", "uring", "sg_async"), NULL if unknown
+const DC_IoBackend *dc_io_backend_find(const char *name);
+const DC_IoBackend *dc_io_backend_for_api(enum Api api);
+// Asynchronous backend of api ("uring" for posix, "sg_async" for ata), or synchronous one if it has none
+const DC_IoBackend *dc_io_backend_queued_for_api(enum Api api);
+
+// Backend may lower io->depth, e.g. to limit of sg driver, or to 1 if it falls back to synchronous one
+int dc_io_open(DC_Io *io, DC_Dev *dev, const DC_IoBackend *backend, int depth, int flags);
+// Waits for requests in flight, so that their buffers may be freed then
+void dc_io_close(DC_Io *io);
+
+// Returns 1 if batch doesn't fit in depth, or if device stopped responding;
+// requests before failed one are submitted
+int dc_io_submit(DC_Io *io, DC_IoRequest **reqs, int nb);
+/**
+ * Moves up to max completed requests to done[] and sets their done flag, returns their number.
+ * If wait is set and there are requests in flight, waits until at least one completes.
+ * Synchronous backends complete in order of submission, asynchronous ones in any order.
+ * Access time of request of asynchronous backend is counted from its submission or from previous
+ * completion, whichever is later, as it waits in queue behind other ones.
+ * Returns -1 if device stopped responding
+ */
+int dc_io_reap(DC_Io *io, DC_IoRequest **done, int max, int wait);
+// Reaps until req is done; other requests completed meanwhile get their done flag set
+int dc_io_wait(DC_Io *io, DC_IoRequest *req);
+// Submits single request and reaps it; nothing else may be in flight
+int dc_io_execute(DC_Io *io, DC_IoRequest *req);
+
+#endif  // IO_BACKEND_H
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "libdevcheck.h"
+#include "job.h"
+#include "utils.h"
+
+DC_JobEngine *dc_job_engine_new(void) {
+    return calloc(1, sizeof(DC_JobEngine));
+}
+
+DC_Job *dc_job_engine_add(DC_JobEngine *engine, DC_Procedure *procedure, DC_Dev *dev, DC_OptionSetting options[]) {
+    DC_Job *job = calloc(1, sizeof(*job));
+    if (!job)
+        return NULL;
+    job->engine = engine;
+    job->dev = dev;
+    job->procedure = procedure;
+    int r = dc_procedure_open(procedure, dev, &job->ctx, options);
+    if (r) {
+        dc_log(DC_LOG_ERROR, "Procedure init on %s failed\n", dev->dev_path);
+        // dc_procedure_open() frees context itself only on its own failures
+        if (job->ctx && job->ctx->procedure) {
+            free(job->ctx->priv);
+            free(job->ctx);
+        }
+        job->ctx = NULL;
+        job->state = DC_JobState_eFailed;
+    } else {
+        job->progress = job->ctx->progress;
+    }
+
+    // Keep jobs in order of adding, that's the order user has chosen devices in
+    DC_Job **tail = &engine->jobs;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = job;
+    engine->nb_jobs++;
+    return job;
+}
+
+static int job_report_cb(DC_ProcedureCtx *ctx, void *callback_priv) {
+    DC_Job *job = callback_priv;
+    job->last_report = ctx->report;
+    job->progress = ctx->progress;
+    job->blocks_processed++;
+    job->bytes_processed += ctx->report.sectors_processed * 512;
+    if (ctx->report.blk_status)
+        job->errors_count++;
+    else if (ctx->report.blk_access_time > job->max_access_time)
+        job->max_access_time = ctx->report.blk_access_time;
+    if (job->engine->report_callback)
+        return job->engine->report_callback(ctx, job->engine->report_callback_priv);
+    return 0;
+}
+
+static void *job_thread_proc(void *arg) {
+    DC_Job *job = arg;
+    dc_realtime_scheduling_enable_with_prio(1);
+    clock_gettime(DC_BEST_CLOCK, &job->start_time);
+    job->perform_ret = dc_procedure_perform_loop(job->ctx, job_report_cb, job);
+    clock_gettime(DC_BEST_CLOCK, &job->end_time);
+    if (job->perform_ret)
+        job->state = DC_JobState_eFailed;
+    else if (job->ctx->interrupt)
+        job->state = DC_JobState_eAborted;
+    else
+        job->state = DC_JobState_eCompleted;
+    return NULL;
+}
+
+int dc_job_engine_start(DC_JobEngine *engine) {
+    int ret = 0;
+    for (DC_Job *job = engine->jobs; job; job = job->next) {
+        if (job->state != DC_JobState_eQueued)
+            continue;
+        if (!job->procedure->perform) {
+            // Procedure does all its work on open
+            job->state = DC_JobState_eCompleted;
+            continue;
+        }
+        job->state = DC_JobState_eRunning;
+        int r = pthread_create(&job->tid, NULL, job_thread_proc, job);
+        if (r) {
+            dc_log(DC_LOG_ERROR, "Failed to start job thread for %s\n", job->dev->dev_path);
+            job->state = DC_JobState_eFailed;
+            ret = r;
+            continue;
+        }
+        job->thread_started = 1;
+    }
+    return ret;
+}
+
+int dc_job_engine_nb_active(DC_JobEngine *engine) {
+    int nb_active = 0;
+    for (DC_Job *job = engine->jobs; job; job = job->next)
+        if (job->state == DC_JobState_eQueued || job->state == DC_JobState_eRunning)
+            nb_active++;
+    return nb_active;
+}
+
+void dc_job_engine_interrupt(DC_JobEngine *engine) {
+    for (DC_Job *job = engine->jobs; job; job = job->next)
+        if (job->ctx)
+            job->ctx->interrupt = 1;
+}
+
+void dc_job_engine_join(DC_JobEngine *engine) {
+    for (DC_Job *job = engine->jobs; job; job = job->next) {
+        if (job->thread_started) {
+            int r = pthread_join(job->tid, NULL);
+            assert(!r);
+            job->thread_started = 0;
+        }
+        if (job->ctx) {
+            dc_procedure_close(job->ctx);
+            job->ctx = NULL;
+        }
+    }
+}
+
+void dc_job_engine_free(DC_JobEngine *engine) {
+    dc_job_engine_join(engine);
+    while (engine->jobs) {
+        DC_Job *next = engine->jobs->next;
+        free(engine->jobs);
+        engine->jobs = next;
+    }
+    free(engine);
+}
+
+const char *dc_job_state_name(DC_JobState state) {
+    switch (state) {
+        case DC_JobState_eQueued:    return "QUEUED";
+        case DC_JobState_eRunning:   return "RUNNING";
+        case DC_JobState_eCompleted: return "DONE";
+        case DC_JobState_eAborted:   return "ABORTED";
+        case DC_JobState_eFailed:    return "FAILED";
+        default: return "UNKNOWN";
+    }
+}
+
+uint64_t dc_job_avg_speed(DC_Job *job) {
+    struct timespec now;
+    if (job->state == DC_JobState_eQueued || !job->start_time.tv_sec)
+        return 0;
+    if (job->state == DC_JobState_eRunning)
+        clock_gettime(DC_BEST_CLOCK, &now);
+    else
+        now = job->end_time;
+    uint64_t time_elapsed_ms = (now.tv_sec - job->start_time.tv_sec) * 1000
+        + (now.tv_nsec - job->start_time.tv_nsec) / (1000*1000);
+    if (!time_elapsed_ms)
+        return 0;
+    return job->bytes_processed * 1000 / time_elapsed_ms;
+}
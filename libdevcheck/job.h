@@ -0,0 +1,70 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "objects_def.h"
+#include "procedure.h"
+
+/*
+ * Job engine runs procedures on many devices at once, one worker thread per device.
+ * Job statistics are updated by worker threads without locking,
+ * frontends may read them at any time for display purposes.
+ */
+
+typedef enum {
+    DC_JobState_eQueued = 0,
+    DC_JobState_eRunning,
+    DC_JobState_eCompleted,
+    DC_JobState_eAborted,
+    DC_JobState_eFailed,  // procedure failed to open, or perform returned error
+} DC_JobState;
+
+struct dc_job {
+    DC_JobEngine *engine;
+    DC_Dev *dev;
+    DC_Procedure *procedure;
+    DC_ProcedureCtx *ctx;  // NULL if procedure failed to open
+    pthread_t tid;
+    int thread_started;
+    volatile DC_JobState state;
+    int perform_ret;
+
+    struct timespec start_time;
+    struct timespec end_time;
+    uint64_t bytes_processed;
+    uint64_t blocks_processed;
+    uint64_t errors_count;
+    uint64_t max_access_time;  // in μs
+    DC_BlockReport last_report;
+    DC_Rational progress;  // copy of ctx->progress, valid after ctx is closed
+
+    DC_Job *next;
+};
+
+struct dc_job_engine {
+    DC_Job *jobs;
+    int nb_jobs;
+    // Optional; called from worker threads on each block report
+    ProcedureDetachedLoopCB report_callback;
+    void *report_callback_priv;
+};
+
+DC_JobEngine *dc_job_engine_new(void);
+// Opens procedure on device. Job is added even if open fails, with state DC_JobState_eFailed
+DC_Job *dc_job_engine_add(DC_JobEngine *engine, DC_Procedure *procedure, DC_Dev *dev, DC_OptionSetting options[]);
+// Starts worker threads for all queued jobs
+int dc_job_engine_start(DC_JobEngine *engine);
+// Number of jobs which are queued or running
+int dc_job_engine_nb_active(DC_JobEngine *engine);
+void dc_job_engine_interrupt(DC_JobEngine *engine);
+// Waits for worker threads to end and closes procedures
+void dc_job_engine_join(DC_JobEngine *engine);
+void dc_job_engine_free(DC_JobEngine *engine);
+
+const char *dc_job_state_name(DC_JobState state);
+// Average speed since job start, in bytes per second
+uint64_t dc_job_avg_speed(DC_Job *job);
+
+#endif  // JOB_H
@@ -0,0 +1,102 @@
+#include <inttypes.h>
+
+#include "latency_histogram.h"
+
+int dc_latency_histogram_bucket(uint64_t access_time) {
+    if (access_time < DC_LATENCY_SUB_BUCKETS)
+        return access_time;
+    int log2 = 63 - __builtin_clzll(access_time);
+    if (log2 >= DC_LATENCY_MAX_LOG2)
+        return DC_LATENCY_NB_BUCKETS - 1;
+    int shift = log2 - DC_LATENCY_SUB_BUCKETS_LOG2;
+    // Top bit is implied by log2, next bits select sub-bucket
+    int sub_bucket = (access_time >> shift) & (DC_LATENCY_SUB_BUCKETS - 1);
+    return DC_LATENCY_SUB_BUCKETS + shift * DC_LATENCY_SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t dc_latency_histogram_bucket_min(int bucket) {
+    if (bucket < DC_LATENCY_SUB_BUCKETS)
+        return bucket;
+    int shift = (bucket - DC_LATENCY_SUB_BUCKETS) / DC_LATENCY_SUB_BUCKETS;
+    int sub_bucket = (bucket - DC_LATENCY_SUB_BUCKETS) % DC_LATENCY_SUB_BUCKETS;
+    return (uint64_t)(DC_LATENCY_SUB_BUCKETS + sub_bucket) << shift;
+}
+
+uint64_t dc_latency_histogram_bucket_max(int bucket) {
+    if (bucket == DC_LATENCY_NB_BUCKETS - 1)
+        return UINT64_MAX;
+    return dc_latency_histogram_bucket_min(bucket + 1) - 1;
+}
+
+void dc_latency_histogram_add(DC_LatencyHistogram *hist, uint64_t access_time, int failed) {
+    hist->buckets[dc_latency_histogram_bucket(access_time)]++;
+    if (!hist->count || access_time < hist->min)
+        hist->min = access_time;
+    if (access_time > hist->max)
+        hist->max = access_time;
+    hist->count++;
+    hist->total += access_time;
+    if (failed)
+        hist->errors++;
+}
+
+void dc_latency_histogram_merge(DC_LatencyHistogram *dst, const DC_LatencyHistogram *src) {
+    if (!src->count)
+        return;
+    for (int i = 0; i < DC_LATENCY_NB_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    if (!dst->count || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->total += src->total;
+    dst->errors += src->errors;
+}
+
+uint64_t dc_latency_histogram_percentile(const DC_LatencyHistogram *hist, unsigned int permille) {
+    if (!hist->count)
+        return 0;
+    uint64_t rank = (hist->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    if (!rank)
+        rank = 1;
+    for (int i = 0; i < DC_LATENCY_NB_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t bucket_max = dc_latency_histogram_bucket_max(i);
+            return bucket_max < hist->max ? bucket_max : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void dc_latency_histogram_print_summary(const DC_LatencyHistogram *hist, FILE *out) {
+    if (!hist->count) {
+        fprintf(out, "No blocks processed\n");
+        return;
+    }
+    fprintf(out, "Access time of %"PRIu64" blocks (%"PRIu64" failed), ms: avg %.2f, p50 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+            hist->count, hist->errors,
+            (double)hist->total / hist->count / 1000,
+            dc_latency_histogram_percentile(hist, 500) / 1000.0,
+            dc_latency_histogram_percentile(hist, 990) / 1000.0,
+            dc_latency_histogram_percentile(hist, 999) / 1000.0,
+            hist->max / 1000.0);
+}
+
+void dc_latency_histogram_print_buckets(const DC_LatencyHistogram *hist, FILE *out) {
+    uint64_t seen = 0;
+    for (int i = 0; i < DC_LATENCY_NB_BUCKETS; i++) {
+        if (!hist->buckets[i])
+            continue;
+        seen += hist->buckets[i];
+        if (i == DC_LATENCY_NB_BUCKETS - 1)
+            fprintf(out, "%"PRIu64"+ us:", dc_latency_histogram_bucket_min(i));
+        else if (i < DC_LATENCY_SUB_BUCKETS)
+            fprintf(out, "%d us:", i);
+        else
+            fprintf(out, "%"PRIu64"-%"PRIu64" us:", dc_latency_histogram_bucket_min(i), dc_latency_histogram_bucket_max(i));
+        fprintf(out, " %"PRIu64" (%.3f%%)\n", hist->buckets[i], 100.0 * seen / hist->count);
+    }
+}
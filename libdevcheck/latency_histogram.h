@@ -0,0 +1,47 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear histogram of block access times: each power of two of μs is split into
+ * DC_LATENCY_SUB_BUCKETS equal buckets, so bucket width is within 1/DC_LATENCY_SUB_BUCKETS
+ * of its values. Values below DC_LATENCY_SUB_BUCKETS μs get a bucket each,
+ * values of 2^DC_LATENCY_MAX_LOG2 μs (67 s) and more go to the last bucket.
+ */
+
+#define DC_LATENCY_SUB_BUCKETS_LOG2 3
+#define DC_LATENCY_SUB_BUCKETS (1 << DC_LATENCY_SUB_BUCKETS_LOG2)
+#define DC_LATENCY_MAX_LOG2 26
+#define DC_LATENCY_NB_BUCKETS \
+    (DC_LATENCY_SUB_BUCKETS + (DC_LATENCY_MAX_LOG2 - DC_LATENCY_SUB_BUCKETS_LOG2) * DC_LATENCY_SUB_BUCKETS + 1)
+
+typedef struct dc_latency_histogram {
+    uint64_t buckets[DC_LATENCY_NB_BUCKETS];
+    uint64_t count;
+    uint64_t errors;  // failed blocks; their access times are counted too
+    uint64_t total;  // sum of access times, in μs
+    uint64_t min;
+    uint64_t max;
+} DC_LatencyHistogram;
+
+// Zero-filled histogram is empty and ready for use
+void dc_latency_histogram_add(DC_LatencyHistogram *hist, uint64_t access_time, int failed);
+void dc_latency_histogram_merge(DC_LatencyHistogram *dst, const DC_LatencyHistogram *src);
+
+int dc_latency_histogram_bucket(uint64_t access_time);
+uint64_t dc_latency_histogram_bucket_min(int bucket);
+// Inclusive; UINT64_MAX for the last bucket
+uint64_t dc_latency_histogram_bucket_max(int bucket);
+
+// Upper bound of bucket holding nearest-rank percentile, permille is in 0..1000 range.
+// Clamped to max seen value, 0 if histogram is empty
+uint64_t dc_latency_histogram_percentile(const DC_LatencyHistogram *hist, unsigned int permille);
+
+// One line summary: count, errors, average, p50, p99, p99.9 and max
+void dc_latency_histogram_print_summary(const DC_LatencyHistogram *hist, FILE *out);
+// Non-empty buckets, one per line: min and max access time in μs, count, cumulative share
+void dc_latency_histogram_print_buckets(const DC_LatencyHistogram *hist, FILE *out);
+
+#endif  // LATENCY_HISTOGRAM_H
@@ -5,10 +5,12 @@
 #include <string.h>
 #include <sched.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "libdevcheck.h"
 #include "procedure.h"
 #include "utils.h"
+#include "virtual_dev.h"
 
 clockid_t DC_BEST_CLOCK;
 
@@ -50,7 +52,10 @@ int dc_init(void) {
     PROCEDURE_REGISTER(hpa_set);
     PROCEDURE_REGISTER(posix_write_zeros);
     PROCEDURE_REGISTER(copy);
+    PROCEDURE_REGISTER(copy_verify);
     PROCEDURE_REGISTER(read_test);
+    PROCEDURE_REGISTER(quick_scan);
+    PROCEDURE_REGISTER(seek_bench);
     PROCEDURE_REGISTER(smart_show);
 #undef PROCEDURE_REGISTER
     return 0;
@@ -63,6 +68,7 @@ void dc_finish(void) {
 
 static void dev_list_build(DC_DevList *dc_devlist);
 static void dev_list_fill_info(DC_DevList *list);
+static void dev_list_add_virtual(DC_DevList *list);
 
 DC_DevList *dc_dev_list(void) {
     DC_DevList *list = calloc(1, sizeof(*list));
@@ -71,12 +77,17 @@ DC_DevList *dc_dev_list(void) {
     list->arr_size = 0;
     dev_list_build(list);
     dev_list_fill_info(list);
+    dev_list_add_virtual(list);
     return list;
 }
 
 void dc_dev_list_free(DC_DevList *list) {
     while (list->arr) {
         DC_Dev *next = list->arr->next;
+        if (list->arr->virt) {
+            dc_virtual_dev_free(list->arr->virt);
+            free(list->arr->virt);
+        }
         free(list->arr);
         list->arr = next;
     }
@@ -212,3 +223,52 @@ static void dev_mounted_fill(DC_Dev *dev) {
         }
     fclose(mtab);
 }
+
+/*
+ * Virtual devices are listed in XHDD_VIRTUAL_DEVICES as image_path[:faults_path],
+ * separated by commas (see virtual_dev.h). They are added after real devices.
+ */
+static void dev_list_add_virtual(DC_DevList *list) {
+    const char *env = getenv("XHDD_VIRTUAL_DEVICES");
+    if (!env || !*env)
+        return;
+    char *specs = strdup(env);
+    assert(specs);
+    DC_Dev **tail = &list->arr;
+    while (*tail)
+        tail = &(*tail)->next;
+    int index = 0;
+    char *saveptr;
+    for (char *spec = strtok_r(specs, ",", &saveptr); spec; spec = strtok_r(NULL, ",", &saveptr)) {
+        char *faults_path = strchr(spec, ':');
+        if (faults_path)
+            *faults_path++ = '\0';
+        struct stat st;
+        if (stat(spec, &st) || !S_ISREG(st.st_mode)) {
+            dc_log(DC_LOG_ERROR, "Image of virtual device %s is not a regular file\n", spec);
+            continue;
+        }
+        DC_VirtualDev *vdev = calloc(1, sizeof(*vdev));
+        assert(vdev);
+        if (dc_virtual_dev_load(vdev, spec, faults_path)) {
+            free(vdev);
+            continue;
+        }
+        DC_Dev *dev = calloc(1, sizeof(*dev));
+        assert(dev);
+        int ret = asprintf(&dev->dev_fs_name, "virtual%d", index++);
+        assert(ret != -1 && dev->dev_fs_name);
+        dev->dev_path = strdup(spec);
+        dev->model_str = strdup("Virtual");
+        dev->serial_no = strdup(basename(spec));
+        assert(dev->dev_path && dev->model_str && dev->serial_no);
+        dev->ata_capable = 1;  // ATA commands are emulated
+        dev->capacity = st.st_size / 512 * 512;
+        dev->native_capacity = dev->capacity;
+        dev->virt = vdev;
+        *tail = dev;
+        tail = &dev->next;
+        list->arr_size++;
+    }
+    free(specs);
+}
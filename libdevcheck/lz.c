@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+// As in LZ4: last match starts at least 12 bytes before end, last 5 bytes are literals
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Writes length continuation bytes of LZ4 format, for length beyond 15 in token
+static uint8_t *put_length(uint8_t *op, uint8_t *op_end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op == op_end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op == op_end)
+        return NULL;
+    *op++ = length;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, uint8_t *op_end, const uint8_t *literals, size_t nb_literals,
+        size_t offset, size_t match_length) {
+    size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+    if (op == op_end)
+        return NULL;
+    uint8_t *token = op++;
+    *token = (nb_literals < 15 ? nb_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (nb_literals >= 15 && !(op = put_length(op, op_end, nb_literals - 15)))
+        return NULL;
+    if ((size_t)(op_end - op) < nb_literals)
+        return NULL;
+    memcpy(op, literals, nb_literals);
+    op += nb_literals;
+    if (!match_length)
+        return op;
+    if (op_end - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (match_code >= 15 && !(op = put_length(op, op_end, match_code - 15)))
+        return NULL;
+    return op;
+}
+
+size_t dc_lz_compress(const void *src, size_t size, void *dst, size_t dst_capacity) {
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + size;
+    uint8_t *op = dst;
+    uint8_t *op_end = op + dst_capacity;
+    uint32_t table[1 << HASH_BITS];
+
+    if (size > MF_LIMIT) {
+        memset(table, 0, sizeof(table));
+        const uint8_t *match_limit = end - MF_LIMIT;
+        while (ip < match_limit) {
+            uint32_t h = hash32(read32(ip));
+            const uint8_t *ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                // Incompressible data is skipped faster the longer no match is found
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            const uint8_t *match_end = ip + MIN_MATCH;
+            const uint8_t *ref_end = ref + MIN_MATCH;
+            while (match_end < end - LAST_LITERALS && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+            op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, match_end - ip);
+            if (!op)
+                return 0;
+            ip = anchor = match_end;
+        }
+    }
+    op = put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - (uint8_t*)dst;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *length) {
+    uint8_t b;
+    do {
+        if (*ip == end)
+            return 1;
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 0;
+}
+
+int dc_lz_decompress(const void *src, size_t size, void *dst, size_t dst_size) {
+    const uint8_t *ip = src;
+    const uint8_t *end = ip + size;
+    uint8_t *op = dst;
+    uint8_t *op_end = op + dst_size;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t nb_literals = token >> 4;
+        if (nb_literals == 15 && get_length(&ip, end, &nb_literals))
+            return 1;
+        if ((size_t)(end - ip) < nb_literals || (size_t)(op_end - op) < nb_literals)
+            return 1;
+        memcpy(op, ip, nb_literals);
+        ip += nb_literals;
+        op += nb_literals;
+        // Last sequence has literals only
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return 1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match_length = token & 0x0f;
+        if (match_length == 15 && get_length(&ip, end, &match_length))
+            return 1;
+        match_length += MIN_MATCH;
+        if (!offset || offset > (size_t)(op - (uint8_t*)dst) || (size_t)(op_end - op) < match_length)
+            return 1;
+        // Match may overlap output it is copied to, so it goes byte by byte
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match_length; i++)
+            op[i] = ref[i];
+        op += match_length;
+    }
+    return op == op_end ? 0 : 1;
+}
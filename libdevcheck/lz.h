@@ -0,0 +1,23 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+ * Fast LZ77 compressor, producing LZ4 block format: sequences of literals and matches
+ * within 64 KiB window, found through hash table of 4-byte strings, single attempt per position.
+ * Speed matters more than ratio here: it is meant to keep up with disk copying.
+ */
+
+// Worst case of compressed size, for incompressible data
+#define DC_LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+/**
+ * Returns compressed size, or 0 if it would exceed dst_capacity,
+ * so that caller can store data as is when compression doesn't pay off
+ */
+size_t dc_lz_compress(const void *src, size_t size, void *dst, size_t dst_capacity);
+// Returns 0 if src is valid and decompresses to exactly dst_size bytes
+int dc_lz_decompress(const void *src, size_t size, void *dst, size_t dst_size);
+
+#endif  // LZ_H
@@ -0,0 +1,309 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "merkle.h"
+#include "log.h"
+
+static const uint8_t leaf_prefix = 0x00;
+static const uint8_t node_prefix = 0x01;
+static const uint8_t zero_leaf[DC_SHA256_SIZE];
+
+int dc_merkle_open(DC_Merkle *merkle, const char *path, uint64_t nb_sectors, int create) {
+    int r;
+    struct stat st;
+    DC_MerkleHeader header;
+
+    memset(merkle, 0, sizeof(*merkle));
+    merkle->open_chunk = -1;
+    merkle->fd = open(path, O_RDWR | (create ? O_CREAT : 0) | O_NOATIME | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (merkle->fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open hashes file %s\n", path);
+        return 1;
+    }
+    r = fstat(merkle->fd, &st);
+    if (r)
+        goto fail;
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DC_MERKLE_MAGIC, sizeof(header.magic));
+        header.version = DC_MERKLE_VERSION;
+        header.chunk_sectors = DC_MERKLE_CHUNK_SECTORS;
+        header.nb_sectors = nb_sectors;
+        header.nb_chunks = (nb_sectors + DC_MERKLE_CHUNK_SECTORS - 1) / DC_MERKLE_CHUNK_SECTORS;
+        // Leaves area stays sparse until hashed, zeros mean "not hashed"
+        r = ftruncate(merkle->fd, DC_MERKLE_HEADER_SIZE + header.nb_chunks * DC_SHA256_SIZE);
+        if (r)
+            goto fail;
+        if (pwrite(merkle->fd, &header, sizeof(header), 0) != sizeof(header))
+            goto fail;
+    } else {
+        if (pread(merkle->fd, &header, sizeof(header), 0) != sizeof(header)
+                || memcmp(header.magic, DC_MERKLE_MAGIC, sizeof(header.magic))
+                || header.version != DC_MERKLE_VERSION) {
+            dc_log(DC_LOG_ERROR, "File %s is not a hashes file\n", path);
+            goto fail;
+        }
+        if (header.nb_sectors != nb_sectors || !header.chunk_sectors
+                || header.nb_chunks != (nb_sectors + header.chunk_sectors - 1) / header.chunk_sectors
+                || (uint64_t)st.st_size != DC_MERKLE_HEADER_SIZE + header.nb_chunks * DC_SHA256_SIZE) {
+            dc_log(DC_LOG_ERROR, "Hashes file %s doesn't match device size\n", path);
+            goto fail;
+        }
+    }
+
+    merkle->mapping_size = DC_MERKLE_HEADER_SIZE + header.nb_chunks * DC_SHA256_SIZE;
+    merkle->mapping = mmap(NULL, merkle->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, merkle->fd, 0);
+    if (merkle->mapping == MAP_FAILED) {
+        dc_log(DC_LOG_ERROR, "Failed to map hashes file %s\n", path);
+        goto fail;
+    }
+    merkle->header = merkle->mapping;
+    merkle->leaves = (void*)((uint8_t*)merkle->mapping + DC_MERKLE_HEADER_SIZE);
+    pthread_mutex_init(&merkle->mutex, NULL);
+    return 0;
+
+fail:
+    close(merkle->fd);
+    return 1;
+}
+
+void dc_merkle_close(DC_Merkle *merkle) {
+    pthread_mutex_destroy(&merkle->mutex);
+    msync(merkle->mapping, merkle->mapping_size, MS_SYNC);
+    munmap(merkle->mapping, merkle->mapping_size);
+    close(merkle->fd);
+}
+
+int dc_merkle_leaf_valid(DC_Merkle *merkle, uint64_t chunk) {
+    return memcmp(merkle->leaves[chunk], zero_leaf, DC_SHA256_SIZE) != 0;
+}
+
+static uint64_t chunk_end_lba(DC_Merkle *merkle, uint64_t chunk) {
+    uint64_t end_lba = (chunk + 1) * merkle->header->chunk_sectors;
+    return end_lba < merkle->header->nb_sectors ? end_lba : merkle->header->nb_sectors;
+}
+
+void dc_merkle_add_block(DC_Merkle *merkle, int64_t lba, size_t sectors, const void *buf) {
+    uint32_t chunk_sectors = merkle->header->chunk_sectors;
+    const uint8_t *p = buf;
+    pthread_mutex_lock(&merkle->mutex);
+    while (sectors && (uint64_t)lba < merkle->header->nb_sectors) {
+        uint64_t chunk = lba / chunk_sectors;
+        uint64_t end_lba = chunk_end_lba(merkle, chunk);
+        size_t n = end_lba - lba < sectors ? end_lba - lba : sectors;
+        // Data of chunks hashed before is the same, they are left as they are
+        if (!dc_merkle_leaf_valid(merkle, chunk)) {
+            if ((uint64_t)lba == chunk * chunk_sectors) {
+                merkle->open_chunk = chunk;
+                merkle->open_next_lba = lba;
+                dc_sha256_init(&merkle->open_sha);
+                dc_sha256_update(&merkle->open_sha, &leaf_prefix, 1);
+            }
+            if (merkle->open_chunk == (int64_t)chunk && merkle->open_next_lba == (uint64_t)lba) {
+                dc_sha256_update(&merkle->open_sha, p, n * 512);
+                merkle->open_next_lba += n;
+                if (merkle->open_next_lba == end_lba) {
+                    dc_sha256_final(&merkle->open_sha, merkle->leaves[chunk]);
+                    merkle->open_chunk = -1;
+                }
+            } else if (merkle->open_chunk == (int64_t)chunk) {
+                merkle->open_chunk = -1;
+            }
+        }
+        lba += n;
+        p += n * 512;
+        sectors -= n;
+    }
+    pthread_mutex_unlock(&merkle->mutex);
+}
+
+void dc_merkle_invalidate(DC_Merkle *merkle, int64_t lba, size_t sectors) {
+    uint32_t chunk_sectors = merkle->header->chunk_sectors;
+    if (!sectors || (uint64_t)lba >= merkle->header->nb_sectors)
+        return;
+    uint64_t first = lba / chunk_sectors;
+    uint64_t last = (lba + sectors - 1) / chunk_sectors;
+    if (last >= merkle->header->nb_chunks)
+        last = merkle->header->nb_chunks - 1;
+    pthread_mutex_lock(&merkle->mutex);
+    for (uint64_t i = first; i <= last; i++)
+        memset(merkle->leaves[i], 0, DC_SHA256_SIZE);
+    if (merkle->open_chunk >= (int64_t)first && merkle->open_chunk <= (int64_t)last)
+        merkle->open_chunk = -1;
+    merkle->header->root_valid = 0;
+    pthread_mutex_unlock(&merkle->mutex);
+}
+
+ssize_t dc_merkle_read_fd(void *fd_ptr, void *buf, size_t size, uint64_t offset) {
+    return pread(*(int*)fd_ptr, buf, size, offset);
+}
+
+int dc_merkle_hash_chunk(DC_Merkle *merkle, DC_MerkleReadFn read_fn, void *read_opaque, uint64_t chunk,
+        void *buf, uint8_t leaf[DC_SHA256_SIZE]) {
+    uint64_t begin_lba = chunk * merkle->header->chunk_sectors;
+    size_t size = (chunk_end_lba(merkle, chunk) - begin_lba) * 512;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = read_fn(read_opaque, (uint8_t*)buf + done, size - done, begin_lba * 512 + done);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+            return 1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    // Image file may be shorter than device if its tail was never written
+    memset((uint8_t*)buf + done, 0, size - done);
+    DC_Sha256 sha;
+    dc_sha256_init(&sha);
+    dc_sha256_update(&sha, &leaf_prefix, 1);
+    dc_sha256_update(&sha, buf, size);
+    dc_sha256_final(&sha, leaf);
+    return 0;
+}
+
+int dc_merkle_compute_root(DC_Merkle *merkle) {
+    uint64_t nb_nodes = merkle->header->nb_chunks;
+    for (uint64_t i = 0; i < nb_nodes; i++)
+        if (!dc_merkle_leaf_valid(merkle, i))
+            return 1;
+    if (nb_nodes == 1) {
+        memcpy(merkle->header->root, merkle->leaves[0], DC_SHA256_SIZE);
+        merkle->header->root_valid = 1;
+        return 0;
+    }
+    uint8_t (*level)[DC_SHA256_SIZE] = malloc((nb_nodes + 1) / 2 * DC_SHA256_SIZE);
+    if (!level)
+        return 1;
+    uint8_t (*nodes)[DC_SHA256_SIZE] = merkle->leaves;
+    while (nb_nodes > 1) {
+        for (uint64_t i = 0; i < nb_nodes / 2; i++) {
+            DC_Sha256 sha;
+            dc_sha256_init(&sha);
+            dc_sha256_update(&sha, &node_prefix, 1);
+            dc_sha256_update(&sha, nodes[2 * i], 2 * DC_SHA256_SIZE);
+            dc_sha256_final(&sha, level[i]);
+        }
+        if (nb_nodes % 2)
+            memmove(level[nb_nodes / 2], nodes[nb_nodes - 1], DC_SHA256_SIZE);
+        nb_nodes = (nb_nodes + 1) / 2;
+        nodes = level;
+    }
+    memcpy(merkle->header->root, level[0], DC_SHA256_SIZE);
+    merkle->header->root_valid = 1;
+    free(level);
+    return 0;
+}
+
+static uint32_t elapsed_us(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void *pool_thread_proc(void *arg) {
+    DC_MerklePool *pool = arg;
+    DC_Merkle *merkle = pool->merkle;
+    void *buf;
+    if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), merkle->header->chunk_sectors * 512))
+        buf = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stop && pool->next_chunk < merkle->header->nb_chunks) {
+        uint64_t chunk = pool->next_chunk++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        DC_MerkleResult result = DC_MerkleResult_eOk;
+        uint8_t leaf[DC_SHA256_SIZE];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (pool->verify || !dc_merkle_leaf_valid(merkle, chunk)) {
+            if (!buf || dc_merkle_hash_chunk(merkle, pool->read_fn, pool->read_opaque, chunk, buf, leaf))
+                result = DC_MerkleResult_eReadError;
+            else if (!pool->verify)
+                memcpy(merkle->leaves[chunk], leaf, DC_SHA256_SIZE);
+            else if (!dc_merkle_leaf_valid(merkle, chunk))
+                result = DC_MerkleResult_eMissing;
+            else if (memcmp(merkle->leaves[chunk], leaf, DC_SHA256_SIZE))
+                result = DC_MerkleResult_eMismatch;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->results[chunk] = result;
+        pool->times[chunk] = elapsed_us(&start, &end);
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    free(buf);
+    return NULL;
+}
+
+int dc_merkle_pool_start(DC_MerklePool *pool, DC_Merkle *merkle, DC_MerkleReadFn read_fn, void *read_opaque,
+        int nb_threads, int verify) {
+    memset(pool, 0, sizeof(*pool));
+    pool->merkle = merkle;
+    pool->read_fn = read_fn;
+    pool->read_opaque = read_opaque;
+    pool->verify = verify;
+    pool->results = calloc(merkle->header->nb_chunks, sizeof(pool->results[0]));
+    if (!pool->results)
+        goto fail_results;
+    pool->times = calloc(merkle->header->nb_chunks, sizeof(pool->times[0]));
+    if (!pool->times)
+        goto fail_times;
+    pool->threads = calloc(nb_threads, sizeof(pthread_t));
+    if (!pool->threads)
+        goto fail_threads;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (; pool->nb_threads < nb_threads; pool->nb_threads++)
+        if (pthread_create(&pool->threads[pool->nb_threads], NULL, pool_thread_proc, pool))
+            break;
+    if (!pool->nb_threads)
+        goto fail_create;
+    return 0;
+
+fail_create:
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+fail_threads:
+    free(pool->times);
+fail_times:
+    free(pool->results);
+fail_results:
+    return 1;
+}
+
+DC_MerkleResult dc_merkle_pool_wait(DC_MerklePool *pool, uint64_t chunk, uint32_t *time_us) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->results[chunk] == DC_MerkleResult_ePending)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    DC_MerkleResult result = pool->results[chunk];
+    if (time_us)
+        *time_us = pool->times[chunk];
+    pthread_mutex_unlock(&pool->mutex);
+    return result;
+}
+
+void dc_merkle_pool_stop(DC_MerklePool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool->times);
+    free(pool->results);
+}
@@ -0,0 +1,106 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+/*
+ * Merkle tree of image digest, kept in sidecar file, memory-mapped like scan map.
+ * Image is split into chunks of DC_MERKLE_CHUNK_SECTORS; leaf is SHA-256 of 0x00 followed by
+ * chunk data, node is SHA-256 of 0x01 followed by its two children; last node of odd level
+ * goes to next level as is. Sectors past end of image file are hashed as zeros.
+ * Only leaves are stored, all zeros meaning "not hashed yet"; root is computed from them when
+ * all are there. Copying hashes blocks as they are copied, so leaves survive interrupted sessions;
+ * chunks which weren't copied in order are hashed from destination at the end.
+ */
+
+#define DC_MERKLE_MAGIC "XHDDMRKL"
+#define DC_MERKLE_VERSION 1
+#define DC_MERKLE_HEADER_SIZE 4096
+#define DC_MERKLE_CHUNK_SECTORS 2048  // 1 MiB
+
+typedef struct dc_merkle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_sectors;
+    uint64_t nb_sectors;
+    uint64_t nb_chunks;
+    uint32_t root_valid;
+    uint8_t root[DC_SHA256_SIZE];
+} DC_MerkleHeader;
+
+typedef struct dc_merkle {
+    int fd;
+    void *mapping;
+    size_t mapping_size;
+    DC_MerkleHeader *header;
+    uint8_t (*leaves)[DC_SHA256_SIZE];
+    pthread_mutex_t mutex;
+    // Chunk being hashed from copied blocks, as long as they come in order
+    int64_t open_chunk;  // -1 if none
+    uint64_t open_next_lba;
+    DC_Sha256 open_sha;
+} DC_Merkle;
+
+/**
+ * Opens existing sidecar file or creates new one, if create is set.
+ * Existing one must be of the same image size
+ */
+int dc_merkle_open(DC_Merkle *merkle, const char *path, uint64_t nb_sectors, int create);
+void dc_merkle_close(DC_Merkle *merkle);
+
+// Hashes copied block; chunks of which it isn't continuation are left to be hashed from destination
+void dc_merkle_add_block(DC_Merkle *merkle, int64_t lba, size_t sectors, const void *buf);
+// Forgets hashes of chunks containing range, e.g. because reading it has failed
+void dc_merkle_invalidate(DC_Merkle *merkle, int64_t lba, size_t sectors);
+int dc_merkle_leaf_valid(DC_Merkle *merkle, uint64_t chunk);
+// Reads image like pread() does, so that image may be raw file or device, or compressed one
+typedef ssize_t (*DC_MerkleReadFn)(void *opaque, void *buf, size_t size, uint64_t offset);
+// Reader of raw image, opaque points to its descriptor
+ssize_t dc_merkle_read_fd(void *fd_ptr, void *buf, size_t size, uint64_t offset);
+
+// Hashes chunk read from image, buf must be of chunk size. Returns 1 on read error
+int dc_merkle_hash_chunk(DC_Merkle *merkle, DC_MerkleReadFn read_fn, void *read_opaque, uint64_t chunk,
+        void *buf, uint8_t leaf[DC_SHA256_SIZE]);
+// Computes root from leaves and stores it. Returns 1 if some leaves are missing
+int dc_merkle_compute_root(DC_Merkle *merkle);
+
+typedef enum {
+    DC_MerkleResult_ePending = 0,
+    DC_MerkleResult_eOk,
+    DC_MerkleResult_eMismatch,
+    DC_MerkleResult_eMissing,  // no leaf to compare with
+    DC_MerkleResult_eReadError,
+} DC_MerkleResult;
+
+/*
+ * Threads hashing chunks of image in parallel, each taking next chunk in order.
+ * In verify mode all chunks are hashed and compared with leaves,
+ * otherwise only those without leaf are hashed and leaves are stored.
+ */
+typedef struct dc_merkle_pool {
+    DC_Merkle *merkle;
+    DC_MerkleReadFn read_fn;
+    void *read_opaque;
+    int verify;
+    int nb_threads;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    uint64_t next_chunk;
+    uint8_t *results;  // DC_MerkleResult per chunk
+    uint32_t *times;  // of reading and hashing per chunk, in μs
+    int stop;
+} DC_MerklePool;
+
+int dc_merkle_pool_start(DC_MerklePool *pool, DC_Merkle *merkle, DC_MerkleReadFn read_fn, void *read_opaque,
+        int nb_threads, int verify);
+// Waits until chunk is done
+DC_MerkleResult dc_merkle_pool_wait(DC_MerklePool *pool, uint64_t chunk, uint32_t *time_us);
+void dc_merkle_pool_stop(DC_MerklePool *pool);
+
+#endif  // MERKLE_H
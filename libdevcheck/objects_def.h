@@ -8,12 +8,19 @@ typedef struct dc_dev_list DC_DevList;
 
 struct dc_dev;
 typedef struct dc_dev DC_Dev;
+struct dc_virtual_dev;
+typedef struct dc_virtual_dev DC_VirtualDev;
 
 struct dc_procedure;
 typedef struct dc_procedure DC_Procedure;
 struct dc_procedure_ctx;
 typedef struct dc_procedure_ctx DC_ProcedureCtx;
 
+struct dc_job;
+typedef struct dc_job DC_Job;
+struct dc_job_engine;
+typedef struct dc_job_engine DC_JobEngine;
+
 typedef struct dc_renderer DC_Renderer;
 typedef struct dc_renderer_ctx DC_RendererCtx;
 
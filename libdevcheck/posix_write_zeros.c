@@ -12,24 +12,28 @@
 #include <assert.h>
 
 #include "procedure.h"
+#include "utils.h"
+#include "io_backend.h"
+#include "virtual_dev.h"
 
 struct posix_write_zeros_priv {
     int64_t start_lba;
     int64_t end_lba;
     int64_t lba_to_process;
-    int fd;
+    int64_t blk_sectors;
+    DC_Io io;
+    DC_IoRequest io_req;
     void *buf;
     uint64_t blk_index;
 };
 typedef struct posix_write_zeros_priv PosixWriteZerosPriv;
 
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512) // FIXME hardcode
-
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     (void)dev;
     if (!strcmp(setting->name, "start_lba")) {
         setting->value = strdup("0");
+    } else if (!strcmp(setting->name, "blk_sectors")) {
+        setting->value = strdup(DC_STRINGIFY(DC_DEFAULT_BLK_SECTORS));
     } else {
         return 1;
     }
@@ -41,11 +45,16 @@ static int Open(DC_ProcedureCtx *ctx) {
     PosixWriteZerosPriv *priv = ctx->priv;
 
     // Setting context
-    ctx->blk_size = BLK_SIZE;
+    int64_t max_blk_sectors = dc_dev_max_blk_sectors(ctx->dev);
+    if (priv->blk_sectors < 1 || priv->blk_sectors > max_blk_sectors) {
+        dc_log(DC_LOG_FATAL, "Block size must be within 1..%"PRId64" sectors for this device\n", max_blk_sectors);
+        goto fail_buf;
+    }
+    ctx->blk_size = priv->blk_sectors * 512;
     priv->end_lba = ctx->dev->capacity / 512;
     priv->lba_to_process = priv->end_lba - priv->start_lba;
-    ctx->progress.den = priv->lba_to_process / SECTORS_AT_ONCE;
-    if (priv->lba_to_process % SECTORS_AT_ONCE)
+    ctx->progress.den = priv->lba_to_process / priv->blk_sectors;
+    if (priv->lba_to_process % priv->blk_sectors)
         ctx->progress.den++;
 
     r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
@@ -53,13 +62,10 @@ static int Open(DC_ProcedureCtx *ctx) {
         goto fail_buf;
     memset(priv->buf, 0, ctx->blk_size);
 
-    priv->fd = open(ctx->dev->dev_path, O_WRONLY | O_DIRECT | O_LARGEFILE | O_NOATIME);
-    if (priv->fd == -1) {
-        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+    r = dc_io_open(&priv->io, ctx->dev, &dc_io_backend_posix, 1, DC_IO_FLAG_WRITE);
+    if (r)
         goto fail_open;
-    }
-    lseek(priv->fd, 512 * priv->start_lba, SEEK_SET);
-    r = ioctl(priv->fd, BLKFLSBUF, NULL);
+    r = dc_dev_ioctl(ctx->dev, priv->io.fd, BLKFLSBUF, NULL);
     if (r == -1)
       dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
     return 0;
@@ -71,35 +77,22 @@ fail_buf:
 }
 
 static int Perform(DC_ProcedureCtx *ctx) {
-    ssize_t write_ret;
     PosixWriteZerosPriv *priv = ctx->priv;
-    size_t sectors_to_write = (priv->lba_to_process < SECTORS_AT_ONCE) ? priv->lba_to_process : SECTORS_AT_ONCE;
-
-    // Updating context
-    ctx->report.lba = priv->start_lba + SECTORS_AT_ONCE * priv->blk_index;
-    ctx->report.sectors_processed = sectors_to_write;
-    ctx->report.blk_status = DC_BlockStatus_eOk;
-    priv->blk_index++;
-
-    // Timing
-    _dc_proc_time_pre(ctx);
+    size_t sectors_to_write = (priv->lba_to_process < priv->blk_sectors) ? priv->lba_to_process : priv->blk_sectors;
 
     // Acting
-    write_ret = write(priv->fd, priv->buf, sectors_to_write * 512);
-
-    // Error handling
-    if (write_ret != (int)sectors_to_write * 512) {
-        // fd position is undefined, set it to write to next block
-        lseek(priv->fd, 512 * priv->start_lba + ctx->blk_size * priv->blk_index, SEEK_SET);
-
-        // Updating context
-        ctx->report.blk_status = DC_BlockStatus_eError;
-    }
-
-    // Timing
-    _dc_proc_time_post(ctx);
+    DC_IoRequest *req = &priv->io_req;
+    req->op = DC_IoOp_eWrite;
+    req->lba = priv->start_lba + priv->blk_sectors * priv->blk_index;
+    req->sectors = sectors_to_write;
+    req->buf = priv->buf;
+    dc_io_execute(&priv->io, req);
+    priv->blk_index++;
 
     // Updating context
+    ctx->time_pre = req->time_submit;
+    ctx->time_post = req->time_complete;
+    ctx->report = req->report;
     ctx->progress.num++;
     priv->lba_to_process -= sectors_to_write;
 
@@ -108,12 +101,13 @@ static int Perform(DC_ProcedureCtx *ctx) {
 
 static void Close(DC_ProcedureCtx *ctx) {
     PosixWriteZerosPriv *priv = ctx->priv;
+    dc_io_close(&priv->io);
     free(priv->buf);
-    close(priv->fd);
 }
 
 static DC_ProcedureOption options[] = {
     { "start_lba", "set LBA address to begin from", offsetof(PosixWriteZerosPriv, start_lba), DC_ProcedureOptionType_eInt64 },
+    { "blk_sectors", "set block size in sectors, up to the limit of device", offsetof(PosixWriteZerosPriv, blk_sectors), DC_ProcedureOptionType_eInt64 },
     { NULL }
 };
 
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include "utils.h"
 #include "procedure.h"
+#include "log.h"
 #include "erase.h"  // include erase procedure
 #include "run_script.h"
 
@@ -108,8 +109,24 @@ fail_ctx:
     return 1;
 }
 
+static void log_latency(DC_ProcedureCtx *ctx) {
+    char *text;
+    size_t text_size;
+    FILE *f = open_memstream(&text, &text_size);
+    if (!f)
+        return;
+    fprintf(f, "%s on %s: ", ctx->procedure->display_name, ctx->dev->dev_fs_name);
+    dc_latency_histogram_print_summary(&ctx->latency, f);
+    dc_latency_histogram_print_buckets(&ctx->latency, f);
+    fclose(f);
+    dc_log(DC_LOG_INFO, "%s", text);
+    free(text);
+}
+
 // Close a procedure context
 void dc_procedure_close(DC_ProcedureCtx *ctx) {
+    if (ctx->latency.count)
+        log_latency(ctx);
     ctx->procedure->close(ctx);
     free(ctx->priv);
     free(ctx);
@@ -124,6 +141,8 @@ int dc_procedure_perform_loop(DC_ProcedureCtx *ctx, ProcedureDetachedLoopCB call
         if (ctx->progress.num >= ctx->progress.den)
             break;
         perform_ret = ctx->procedure->perform(ctx);
+        if (!perform_ret && ctx->report.sectors_processed)
+            dc_latency_histogram_add(&ctx->latency, ctx->report.blk_access_time, ctx->report.blk_status != DC_BlockStatus_eOk);
         r = callback(ctx, callback_priv);
         if (perform_ret) {
             ret = perform_ret;
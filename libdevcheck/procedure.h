@@ -3,6 +3,7 @@
 
 #include "libdevcheck.h"
 #include "device.h"
+#include "latency_histogram.h"
 #include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>   // for uint64_t
@@ -10,6 +11,15 @@
 
 #define DC_PROC_FLAG_INVASIVE 1
 #define DC_PROC_FLAG_REQUIRES_ATA 2
+#define DC_PROC_FLAG_DESTINATION 4  // options name destination of single device, so it can't run on several at once
+
+// Default number of sectors transferred by procedures at once (128 KiB)
+#define DC_DEFAULT_BLK_SECTORS 256
+// Makes string literal of macro value, e.g. for default option values
+#define DC_STRINGIFY(x) DC_STRINGIFY_(x)
+#define DC_STRINGIFY_(x) #x
+// ATA EXT commands have 16-bit sector count, where 0 means 65536
+#define DC_ATA_MAX_BLK_SECTORS 65536
 
 extern DC_Procedure erase_procedure;
 extern DC_Procedure run_script_procedure;  // <-- add this
@@ -17,6 +27,7 @@ extern DC_Procedure run_script_procedure;  // <-- add this
 enum Api {
     Api_eAta,
     Api_ePosix,
+    Api_eScsi,
 };
 
 typedef enum {
@@ -93,6 +104,7 @@ struct dc_procedure_ctx {
     DC_BlockReport report; // updated by procedure on .perform()
     void *user_priv;  // pointer to user interface private data
     struct timespec time_pre, time_post;  // block processing timing
+    DC_LatencyHistogram latency;  // of all block reports, filled by perform loop
 };
 
 int dc_procedure_open(DC_Procedure *procedure, DC_Dev *dev, DC_ProcedureCtx **ctx, DC_OptionSetting options[]);
@@ -0,0 +1,331 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include "procedure.h"
+#include "ata.h"
+#include "scsi.h"
+#include "utils.h"
+#include "io_backend.h"
+
+/*
+ * Reading is done in passes. Pass N splits surface into (samples << N) strata of equal size
+ * and reads one block at random position within each stratum. Strata are visited in bit-reversed
+ * order, so that surface is covered evenly whenever time runs out, even in the middle of a pass.
+ * Each slow or failed block produces refinement targets, which are read before any further samples:
+ * neighbouring blocks are walked outwards while they are suspect too, and the space between suspect block
+ * and its stratum neighbours is bisected. Suspect areas are remembered, so they are explored only once.
+ */
+
+#define REFINE_MAX_TARGETS 4096
+#define REFINE_MAX_WALK_STEPS 256  // blocks to walk in each direction from suspect sample
+#define MAX_SUSPECT_EXTENTS 1024
+#define SAMPLE_ALIGN_SECTORS 8  // 4 KiB, physical sector of Advanced Format drives
+
+typedef struct refine_target {
+    uint64_t lba;
+    uint64_t span;  // unexplored distance around lba, in sectors
+    int dir;  // -1 or 1 to walk outwards from suspect area, 0 for bisection probe
+    int steps;
+} RefineTarget;
+
+typedef struct suspect_extent {
+    uint64_t start;
+    uint64_t end;
+} SuspectExtent;
+
+struct quick_scan_priv {
+    const char *api_str;
+    int64_t time_budget;
+    int64_t samples;
+    int64_t slow_ms;
+    int64_t blk_sectors;
+    enum Api api;
+    uint64_t end_lba;
+    DC_Io io;
+    DC_IoRequest io_req;
+    void *buf;
+    struct timespec start_time;
+    uint64_t rand_state;
+
+    // Stratified sampling
+    unsigned int pass;
+    unsigned int first_pass_bits;  // log2 of strata count on first pass
+    unsigned int pass_bits;  // log2 of strata count on current pass
+    uint64_t strata_visited;
+    uint64_t stratum_sectors;
+    int sampling_done;
+
+    // Ring of refinement targets
+    RefineTarget targets[REFINE_MAX_TARGETS];
+    unsigned int targets_head;
+    unsigned int targets_len;
+
+    // Areas already found slow or failing, so that later samples hitting them don't explore them again
+    SuspectExtent suspects[MAX_SUSPECT_EXTENTS];
+    unsigned int nb_suspects;
+};
+typedef struct quick_scan_priv QuickScanPriv;
+
+static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
+    if (!strcmp(setting->name, "api")) {
+        if (dev->ata_capable)
+            setting->value = strdup("ata");
+        else
+            setting->value = strdup("posix");
+    } else if (!strcmp(setting->name, "time_budget")) {
+        setting->value = strdup("300");
+    } else if (!strcmp(setting->name, "samples")) {
+        setting->value = strdup("1024");
+    } else if (!strcmp(setting->name, "slow_ms")) {
+        setting->value = strdup("50");
+    } else if (!strcmp(setting->name, "blk_sectors")) {
+        setting->value = strdup(DC_STRINGIFY(DC_DEFAULT_BLK_SECTORS));
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t rand_next(QuickScanPriv *priv) {
+    // xorshift64*
+    priv->rand_state ^= priv->rand_state >> 12;
+    priv->rand_state ^= priv->rand_state << 25;
+    priv->rand_state ^= priv->rand_state >> 27;
+    return priv->rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t bit_reverse(uint64_t value, unsigned int bits) {
+    uint64_t result = 0;
+    for (unsigned int i = 0; i < bits; i++) {
+        result = (result << 1) | (value & 1);
+        value >>= 1;
+    }
+    return result;
+}
+
+static uint64_t ms_elapsed(QuickScanPriv *priv) {
+    struct timespec now;
+    int r = clock_gettime(DC_BEST_CLOCK, &now);
+    assert(!r);
+    return (now.tv_sec - priv->start_time.tv_sec) * 1000
+        + (now.tv_nsec - priv->start_time.tv_nsec) / (1000*1000);
+}
+
+static void start_pass(QuickScanPriv *priv, unsigned int pass) {
+    priv->pass = pass;
+    priv->pass_bits = priv->first_pass_bits + pass;
+    priv->strata_visited = 0;
+    priv->stratum_sectors = priv->end_lba >> priv->pass_bits;
+}
+
+static int Open(DC_ProcedureCtx *ctx) {
+    int r;
+    QuickScanPriv *priv = ctx->priv;
+
+    // Setting context
+    if (!strcmp(priv->api_str, "ata"))
+        priv->api = Api_eAta;
+    else if (!strcmp(priv->api_str, "posix"))
+        priv->api = Api_ePosix;
+    else if (!strcmp(priv->api_str, "scsi"))
+        priv->api = Api_eScsi;
+    else
+        return 1;
+    if (priv->api == Api_eAta && !ctx->dev->ata_capable)
+        return 1;
+    if (priv->time_budget < 1 || priv->samples < 1 || priv->slow_ms < 1)
+        return 1;
+    int64_t max_blk_sectors = dc_dev_max_blk_sectors(ctx->dev);
+    if (priv->blk_sectors < 1 || priv->blk_sectors > max_blk_sectors) {
+        dc_log(DC_LOG_FATAL, "Block size must be within 1..%"PRId64" sectors for this device\n", max_blk_sectors);
+        return 1;
+    }
+    ctx->blk_size = priv->blk_sectors * 512;
+    priv->end_lba = ctx->dev->capacity / 512;
+    if (priv->end_lba < (uint64_t)priv->blk_sectors)
+        return 1;
+
+    // Round strata count up to power of two, so that bit-reversed order is a permutation
+    while ((1ULL << priv->first_pass_bits) < (uint64_t)priv->samples)
+        priv->first_pass_bits++;
+    start_pass(priv, 0);
+    if (priv->stratum_sectors < (uint64_t)priv->blk_sectors)
+        return 1;
+
+    // Progress is counted in milliseconds of time budget
+    ctx->progress.den = priv->time_budget * 1000;
+
+    r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
+    if (r)
+        return 1;
+
+    r = dc_io_open(&priv->io, ctx->dev, dc_io_backend_for_api(priv->api), 1, 0);
+    if (r) {
+        free(priv->buf);
+        return 1;
+    }
+
+    r = clock_gettime(DC_BEST_CLOCK, &priv->start_time);
+    assert(!r);
+    priv->rand_state = (priv->start_time.tv_sec * 1000000000ULL + priv->start_time.tv_nsec) | 1;
+    return 0;
+}
+
+static int is_known_suspect(QuickScanPriv *priv, uint64_t lba, uint64_t sectors) {
+    for (unsigned int i = 0; i < priv->nb_suspects; i++)
+        if (lba >= priv->suspects[i].start && lba + sectors <= priv->suspects[i].end)
+            return 1;
+    return 0;
+}
+
+static void add_suspect(QuickScanPriv *priv, uint64_t lba, uint64_t sectors) {
+    for (unsigned int i = 0; i < priv->nb_suspects; i++) {
+        SuspectExtent *extent = &priv->suspects[i];
+        if (lba <= extent->end && lba + sectors >= extent->start) {
+            if (lba < extent->start)
+                extent->start = lba;
+            if (lba + sectors > extent->end)
+                extent->end = lba + sectors;
+            return;
+        }
+    }
+    if (priv->nb_suspects == MAX_SUSPECT_EXTENTS)
+        return;
+    priv->suspects[priv->nb_suspects].start = lba;
+    priv->suspects[priv->nb_suspects].end = lba + sectors;
+    priv->nb_suspects++;
+}
+
+static void add_target(QuickScanPriv *priv, int64_t lba, uint64_t span, int dir, int steps) {
+    if (priv->targets_len == REFINE_MAX_TARGETS)
+        return;  // Enough work for whole time budget anyway
+    if (lba < 0 || (uint64_t)lba >= priv->end_lba)
+        return;
+    RefineTarget *target = &priv->targets[(priv->targets_head + priv->targets_len) % REFINE_MAX_TARGETS];
+    target->lba = lba;
+    target->span = span;
+    target->dir = dir;
+    target->steps = steps;
+    priv->targets_len++;
+}
+
+// Picks next block to read: pending refinement targets go first, then next stratum sample
+static void next_block(QuickScanPriv *priv, RefineTarget *block) {
+    if (priv->targets_len) {
+        *block = priv->targets[priv->targets_head];
+        priv->targets_head = (priv->targets_head + 1) % REFINE_MAX_TARGETS;
+        priv->targets_len--;
+        return;
+    }
+    assert(!priv->sampling_done);
+
+    uint64_t nb_strata = 1ULL << priv->pass_bits;
+    uint64_t stratum = bit_reverse(priv->strata_visited, priv->pass_bits);
+    uint64_t stratum_start = stratum * priv->stratum_sectors;
+    uint64_t positions = priv->stratum_sectors - priv->blk_sectors + 1;
+    uint64_t lba = stratum_start + rand_next(priv) % positions;
+    lba -= lba % SAMPLE_ALIGN_SECTORS;
+    if (lba < stratum_start)
+        lba = stratum_start;
+
+    block->lba = lba;
+    block->span = priv->stratum_sectors;
+    block->dir = 0;
+    block->steps = 0;
+
+    priv->strata_visited++;
+    if (priv->strata_visited == nb_strata) {
+        // Next pass would read whole surface in block-sized strata, that's a job for read_test
+        if (priv->end_lba / (nb_strata * 2) < (uint64_t)priv->blk_sectors)
+            priv->sampling_done = 1;
+        else
+            start_pass(priv, priv->pass + 1);
+    }
+}
+
+static void refine(QuickScanPriv *priv, RefineTarget *block, uint64_t sectors) {
+    if (block->dir) {
+        if (block->steps < REFINE_MAX_WALK_STEPS)
+            add_target(priv, block->lba + block->dir * (int64_t)sectors, 0, block->dir, block->steps + 1);
+        return;
+    }
+    add_target(priv, (int64_t)block->lba - (int64_t)sectors, 0, -1, 1);
+    add_target(priv, block->lba + sectors, 0, 1, 1);
+    if (block->span / 2 >= 2 * sectors) {
+        add_target(priv, (int64_t)block->lba - (int64_t)(block->span / 2), block->span / 2, 0, 0);
+        add_target(priv, block->lba + block->span / 2, block->span / 2, 0, 0);
+    }
+}
+
+static int Perform(DC_ProcedureCtx *ctx) {
+    int ret = 0;
+    QuickScanPriv *priv = ctx->priv;
+    RefineTarget block;
+
+    next_block(priv, &block);
+    size_t sectors_to_read = priv->end_lba - block.lba < (uint64_t)priv->blk_sectors ?
+        priv->end_lba - block.lba : (uint64_t)priv->blk_sectors;
+
+    // Acting
+    DC_IoRequest *req = &priv->io_req;
+    req->op = DC_IoOp_eVerify;
+    req->lba = block.lba;
+    req->sectors = sectors_to_read;
+    req->buf = priv->buf;
+    ret = dc_io_execute(&priv->io, req);
+
+    // Updating context
+    ctx->time_pre = req->time_submit;
+    ctx->time_post = req->time_complete;
+    ctx->report = req->report;
+
+    if (ctx->report.blk_status || ctx->report.blk_access_time > (uint64_t)priv->slow_ms * 1000) {
+        if (!is_known_suspect(priv, block.lba, sectors_to_read))
+            refine(priv, &block, sectors_to_read);
+        add_suspect(priv, block.lba, sectors_to_read);
+    }
+
+    // Updating context
+    uint64_t elapsed = ms_elapsed(priv);
+    ctx->progress.num = elapsed < ctx->progress.den ? elapsed : ctx->progress.den;
+    if (priv->sampling_done && !priv->targets_len)
+        ctx->progress.num = ctx->progress.den;  // Nothing left to sample or refine
+    return ret;
+}
+
+static void Close(DC_ProcedureCtx *ctx) {
+    QuickScanPriv *priv = ctx->priv;
+    dc_io_close(&priv->io);
+    free(priv->buf);
+}
+
+static const char * const api_choices[] = {"ata", "posix", "scsi", NULL};
+static DC_ProcedureOption options[] = {
+    { "api", "select operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ VERIFY EXT\" command, \"scsi\" for SCSI \"VERIFY (16)\" command", offsetof(QuickScanPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
+    { "time_budget", "set time limit of scan, in seconds", offsetof(QuickScanPriv, time_budget), DC_ProcedureOptionType_eInt64 },
+    { "samples", "set number of blocks sampled on first pass over surface; it is doubled with each next pass", offsetof(QuickScanPriv, samples), DC_ProcedureOptionType_eInt64 },
+    { "slow_ms", "set block access time in milliseconds above which surface around block is examined closer", offsetof(QuickScanPriv, slow_ms), DC_ProcedureOptionType_eInt64 },
+    { "blk_sectors", "set block size in sectors", offsetof(QuickScanPriv, blk_sectors), DC_ProcedureOptionType_eInt64 },
+    { NULL }
+};
+
+DC_Procedure quick_scan = {
+    .name = "quick_scan",
+    .display_name = "Quick scan",
+    .help = "Estimates surface state within given time budget, for triage of devices too large for full read test. First it reads one block in each of \"samples\" equal strata spread over whole surface, then keeps doubling the density of sampling. Each block which fails or takes longer than slow_ms gets its neighbourhood examined before any further samples: adjacent blocks are read outwards while they keep being slow or failing, and the distance to neighbouring strata is bisected. Scan stops when time budget is over. Progress is counted in time.",
+    .suggest_default_value = SuggestDefaultValue,
+    .open = Open,
+    .perform = Perform,
+    .close = Close,
+    .priv_data_size = sizeof(QuickScanPriv),
+    .options = options,
+};
@@ -13,6 +13,17 @@
 #include "procedure.h"
 #include "ata.h"
 #include "scsi.h"
+#include "scan_map.h"
+#include "scan_history.h"
+#include "image.h"
+#include "utils.h"
+#include "io_backend.h"
+
+enum ScanMapMode {
+    ScanMapMode_eNo,
+    ScanMapMode_eResume,  // read only what previous runs haven't
+    ScanMapMode_eRecheck,  // read only what previous runs found failing or slow
+};
 
 struct read_priv {
     const char *api_str;
@@ -20,17 +31,47 @@ struct read_priv {
     enum Api api;
     int64_t end_lba;
     int64_t lba_to_process;
-    int fd;
-    void *buf;
-    AtaCommand ata_command;
-    ScsiCommand scsi_command;
-    int old_readahead;
+    int64_t queue_depth;
+    int64_t blk_sectors;
+    const char *adaptive_str;
+    const char *scan_map_str;
+    const char *history_str;
+    DC_Io io;
+    void *buf;  // of blk_size for each request
     uint64_t current_lba;
+
+    // Adaptive block size: between ADAPTIVE_MIN_BLK_SECTORS and blk_sectors
+    int adaptive;
+    int64_t cur_blk_sectors;
+    int good_streak;
+    uint64_t healthy_ns_per_sector;  // running average over healthy blocks
+
+    // Up to depth of io reads are kept in flight: "uring" backend is used for "posix" API with queue_depth > 1,
+    // and "sg_async" one for "ata" API. They form FIFO blocks_reported..blocks_submitted,
+    // index in reqs is counter modulo depth
+    DC_IoRequest *reqs;
+    DC_IoRequest **batch;
+    uint64_t blocks_submitted;
+    uint64_t blocks_reported;
+    uint64_t submit_lba;
+    int64_t sectors_to_submit;
+
+    // Persistent per-granule status and latency, for resume and recheck
+    enum ScanMapMode scan_map_mode;
+    char *scan_map_path;
+    DC_ScanMap scan_map;
+
+    DC_ScanHistoryRecord *history_record;  // NULL if history is not kept
+
+    // Compressed image made by copying, read instead of device
+    int use_image;
+    DC_Image image;
 };
 typedef struct read_priv ReadPriv;
 
-#define SECTORS_AT_ONCE 256
-#define BLK_SIZE (SECTORS_AT_ONCE * 512) // FIXME hardcode
+#define ADAPTIVE_MIN_BLK_SECTORS 8  // 4 KiB, physical sector of Advanced Format drives
+#define ADAPTIVE_GROW_AFTER_BLOCKS 16  // healthy blocks in a row before doubling block size
+#define ADAPTIVE_SLACK_US 10000  // latency above expected one which is tolerated as healthy
 
 static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
     (void)dev;
@@ -41,6 +82,16 @@ static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
             setting->value = strdup("posix");
     } else if (!strcmp(setting->name, "start_lba")) {
         setting->value = strdup("0");
+    } else if (!strcmp(setting->name, "queue_depth")) {
+        setting->value = strdup("1");
+    } else if (!strcmp(setting->name, "blk_sectors")) {
+        setting->value = strdup(DC_STRINGIFY(DC_DEFAULT_BLK_SECTORS));
+    } else if (!strcmp(setting->name, "adaptive")) {
+        setting->value = strdup("no");
+    } else if (!strcmp(setting->name, "scan_map")) {
+        setting->value = strdup("no");
+    } else if (!strcmp(setting->name, "history")) {
+        setting->value = strdup("no");
     } else {
         return 1;
     }
@@ -49,7 +100,6 @@ static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
 
 static int Open(DC_ProcedureCtx *ctx) {
     int r;
-    int open_flags;
     ReadPriv *priv = ctx->priv;
 
     // Setting context
@@ -57,121 +107,334 @@ static int Open(DC_ProcedureCtx *ctx) {
         priv->api = Api_eAta;
     else if (!strcmp(priv->api_str, "posix"))
         priv->api = Api_ePosix;
+    else if (!strcmp(priv->api_str, "scsi"))
+        priv->api = Api_eScsi;
     else
         return 1;
     if (priv->api == Api_eAta && !ctx->dev->ata_capable)
         return 1;
-    ctx->blk_size = BLK_SIZE;
+    if (!strcmp(priv->adaptive_str, "yes"))
+        priv->adaptive = 1;
+    else if (strcmp(priv->adaptive_str, "no"))
+        return 1;
+    if (!strcmp(priv->scan_map_str, "resume"))
+        priv->scan_map_mode = ScanMapMode_eResume;
+    else if (!strcmp(priv->scan_map_str, "recheck"))
+        priv->scan_map_mode = ScanMapMode_eRecheck;
+    else if (strcmp(priv->scan_map_str, "no"))
+        return 1;
+    if (strcmp(priv->history_str, "yes") && strcmp(priv->history_str, "no"))
+        return 1;
+    int64_t max_blk_sectors = dc_dev_max_blk_sectors(ctx->dev);
+    if (priv->blk_sectors < 1 || priv->blk_sectors > max_blk_sectors) {
+        dc_log(DC_LOG_FATAL, "Block size must be within 1..%"PRId64" sectors for this device\n", max_blk_sectors);
+        return 1;
+    }
+    priv->cur_blk_sectors = priv->blk_sectors;
+    ctx->blk_size = priv->blk_sectors * 512;
     priv->current_lba = priv->start_lba;
     priv->end_lba = ctx->dev->capacity / 512;
+    // Image reads sectors which were not copied from source as failed, the rest as stored
+    uint64_t image_sectors;
+    if (priv->api == Api_ePosix && dc_image_probe(ctx->dev->dev_path, &image_sectors)) {
+        priv->use_image = 1;
+        priv->end_lba = image_sectors;
+    }
     priv->lba_to_process = priv->end_lba - priv->start_lba;
     if (priv->lba_to_process <= 0)
         return 1;
-    ctx->progress.den = priv->lba_to_process / SECTORS_AT_ONCE;
-    if (priv->lba_to_process % SECTORS_AT_ONCE)
-        ctx->progress.den++;
+    // Progress is counted in sectors, as blocks may vary in size
+    ctx->progress.den = priv->lba_to_process;
 
-    if (priv->api == Api_eAta) {
-        open_flags = O_RDWR;
-    } else {
+    if (priv->queue_depth < 1)
+        return 1;
+    if (priv->use_image && priv->queue_depth > 1) {
+        dc_log(DC_LOG_WARNING, "Image is read with queue depth of 1\n");
+        priv->queue_depth = 1;
+    }
+    if (priv->api == Api_eScsi && priv->queue_depth > 1) {
+        dc_log(DC_LOG_WARNING, "SCSI commands are issued with queue depth of 1\n");
+        priv->queue_depth = 1;
+    }
+
+    if (priv->scan_map_mode != ScanMapMode_eNo) {
+        r = asprintf(&priv->scan_map_path, "whdd_scan_map__%s__%s", ctx->dev->model_str, ctx->dev->serial_no);
+        if (r == -1)
+            return 1;
+        r = dc_scan_map_open(&priv->scan_map, priv->scan_map_path, priv->end_lba, priv->blk_sectors);
+        if (r) {
+            free(priv->scan_map_path);
+            return 1;
+        }
+        if (priv->scan_map_mode == ScanMapMode_eResume) {
+            priv->start_lba = dc_scan_map_next_unscanned(&priv->scan_map, priv->start_lba);
+            priv->current_lba = priv->start_lba;
+            priv->lba_to_process = priv->end_lba - priv->start_lba;
+            if (priv->lba_to_process <= 0)
+                dc_log(DC_LOG_INFO, "Scan map %s has no unscanned blocks left\n", priv->scan_map_path);
+        } else {
+            // Suspect ranges are scattered, queue engines only know sequential reading
+            if (priv->queue_depth > 1) {
+                dc_log(DC_LOG_WARNING, "Rechecking is done with queue depth of 1\n");
+                priv->queue_depth = 1;
+            }
+            priv->lba_to_process = dc_scan_map_suspect_sectors(&priv->scan_map);
+            if (priv->lba_to_process <= 0)
+                dc_log(DC_LOG_INFO, "Scan map %s has no failed or slow blocks\n", priv->scan_map_path);
+        }
+        if (priv->lba_to_process <= 0)
+            goto fail_scan_map;
+        ctx->progress.den = priv->lba_to_process;
+    }
+
+    if (!strcmp(priv->history_str, "yes")) {
+        priv->history_record = malloc(sizeof(*priv->history_record));
+        if (!priv->history_record)
+            goto fail_scan_map;
+        dc_scan_history_record_init(priv->history_record, ctx->procedure->name, priv->end_lba);
+    }
+
+    if (priv->use_image) {
         r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
         if (r)
-            return 1;
+            goto fail_buf;
+        r = dc_image_open(&priv->image, ctx->dev->dev_path, 0, 0);
+        if (r) {
+            dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
+            goto fail_open;
+        }
+        return 0;
+    }
 
-        open_flags = O_RDONLY | O_DIRECT | O_LARGEFILE | O_NOATIME;
+    const DC_IoBackend *backend = priv->queue_depth > 1 ? dc_io_backend_queued_for_api(priv->api) : dc_io_backend_for_api(priv->api);
+    r = dc_io_open(&priv->io, ctx->dev, backend, priv->queue_depth, 0);
+    if (r)
+        goto fail_buf;
+    // Depth may be lowered by backend
+    priv->queue_depth = priv->io.depth;
+    r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size * priv->queue_depth);
+    if (r)
+        goto fail_io_buf;
+    priv->reqs = calloc(priv->queue_depth, sizeof(priv->reqs[0]));
+    priv->batch = calloc(priv->queue_depth, sizeof(priv->batch[0]));
+    if (!priv->reqs || !priv->batch)
+        goto fail_reqs;
+    priv->submit_lba = priv->current_lba;
+    priv->sectors_to_submit = priv->lba_to_process;
+    return 0;
+
+fail_reqs:
+    free(priv->batch);
+    free(priv->reqs);
+fail_open:
+    free(priv->buf);
+fail_io_buf:
+    if (!priv->use_image)
+        dc_io_close(&priv->io);
+fail_buf:
+    free(priv->history_record);
+fail_scan_map:
+    if (priv->scan_map_mode != ScanMapMode_eNo) {
+        dc_scan_map_close(&priv->scan_map);
+        free(priv->scan_map_path);
     }
+    return 1;
+}
 
-    priv->fd = open(ctx->dev->dev_path, open_flags);
-    if (priv->fd == -1) {
-        dc_log(DC_LOG_FATAL, "open %s fail\n", ctx->dev->dev_path);
-        return 1;
+static size_t next_block_sectors(ReadPriv *priv, uint64_t lba) {
+    return (priv->end_lba - lba < (uint64_t)priv->cur_blk_sectors) ? priv->end_lba - lba : (uint64_t)priv->cur_blk_sectors;
+}
+
+// Shrinks block size on errors and latency surges, grows it back on healthy surface
+static void adaptive_use_report(ReadPriv *priv, DC_BlockReport *report) {
+    if (!priv->adaptive || !report->sectors_processed)
+        return;
+    uint64_t ns_per_sector = report->blk_access_time * 1000 / report->sectors_processed;
+    uint64_t expected_us = priv->healthy_ns_per_sector * report->sectors_processed / 1000;
+    int slow = priv->healthy_ns_per_sector && (report->blk_access_time > 4 * expected_us + ADAPTIVE_SLACK_US);
+    if (report->blk_status || slow) {
+        priv->cur_blk_sectors /= 4;
+        if (priv->cur_blk_sectors < ADAPTIVE_MIN_BLK_SECTORS)
+            priv->cur_blk_sectors = ADAPTIVE_MIN_BLK_SECTORS;
+        if (priv->cur_blk_sectors > priv->blk_sectors)
+            priv->cur_blk_sectors = priv->blk_sectors;
+        priv->good_streak = 0;
+        return;
+    }
+    if (priv->healthy_ns_per_sector)
+        priv->healthy_ns_per_sector = (priv->healthy_ns_per_sector * 7 + ns_per_sector) / 8;
+    else
+        priv->healthy_ns_per_sector = ns_per_sector;
+    priv->good_streak++;
+    if (priv->good_streak >= ADAPTIVE_GROW_AFTER_BLOCKS && priv->cur_blk_sectors < priv->blk_sectors) {
+        priv->cur_blk_sectors *= 2;
+        if (priv->cur_blk_sectors > priv->blk_sectors)
+            priv->cur_blk_sectors = priv->blk_sectors;
+        priv->good_streak = 0;
     }
+}
 
-    lseek(priv->fd, 512 * priv->start_lba, SEEK_SET);
-    r = ioctl(priv->fd, BLKFLSBUF, NULL);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Flushing block device buffers failed\n");
-    r = ioctl(priv->fd, BLKRAGET, &priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Getting block device readahead setting failed\n");
-    r = ioctl(priv->fd, BLKRASET, 0);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Disabling block device readahead setting failed\n");
+static void use_report(ReadPriv *priv, DC_BlockReport *report) {
+    adaptive_use_report(priv, report);
+    if (priv->scan_map_mode != ScanMapMode_eNo)
+        dc_scan_map_record(&priv->scan_map, report);
+    if (priv->history_record)
+        dc_scan_history_record_add(priv->history_record, report);
+}
 
-    return 0;
+// Block which starts at lba or, when rechecking, at the first suspect sector from lba on
+static void next_block(ReadPriv *priv, uint64_t lba, uint64_t *block_lba, size_t *sectors) {
+    if (priv->scan_map_mode == ScanMapMode_eRecheck) {
+        uint64_t run_end;
+        lba = dc_scan_map_next_suspect(&priv->scan_map, lba, &run_end);
+        *sectors = next_block_sectors(priv, lba);
+        if (lba + *sectors > run_end)
+            *sectors = run_end - lba;
+    } else {
+        *sectors = next_block_sectors(priv, lba);
+    }
+    *block_lba = lba;
 }
 
-static int Perform(DC_ProcedureCtx *ctx) {
-    ssize_t read_ret;
-    int ioctl_ret;
-    int ret = 0;
+static int PerformImage(DC_ProcedureCtx *ctx) {
     ReadPriv *priv = ctx->priv;
-    size_t sectors_to_read = (priv->lba_to_process < SECTORS_AT_ONCE) ? priv->lba_to_process : SECTORS_AT_ONCE;
+    uint64_t lba;
+    size_t sectors_to_read;
+    next_block(priv, priv->current_lba, &lba, &sectors_to_read);
 
     // Updating context
-    ctx->report.lba = priv->current_lba;
+    ctx->report.lba = lba;
     ctx->report.sectors_processed = sectors_to_read;
     ctx->report.blk_status = DC_BlockStatus_eOk;
 
-    // Preparing to act
-    if (priv->api == Api_eAta) {
-        memset(&priv->ata_command, 0, sizeof(priv->ata_command));
-        memset(&priv->scsi_command, 0, sizeof(priv->scsi_command));
-        prepare_ata_command(&priv->ata_command, WIN_VERIFY_EXT /* 42h */, priv->current_lba, sectors_to_read);
-        prepare_scsi_command_from_ata(&priv->scsi_command, &priv->ata_command);
-    }
-
-    // Timing
     _dc_proc_time_pre(ctx);
+    int r = dc_image_read(&priv->image, lba, sectors_to_read, priv->buf);
+    _dc_proc_time_post(ctx);
+    if (r)
+        ctx->report.blk_status = DC_BlockStatus_eError;
 
-    // Acting
-    if (priv->api == Api_eAta)
-        ioctl_ret = ioctl(priv->fd, SG_IO, &priv->scsi_command);
-    else
-        read_ret = read(priv->fd, priv->buf, sectors_to_read * 512);
+    // Updating context
+    use_report(priv, &ctx->report);
+    ctx->progress.num += sectors_to_read;
+    priv->lba_to_process -= sectors_to_read;
+    priv->current_lba = lba + sectors_to_read;
+    return 0;
+}
 
-    // Timing
-    _dc_proc_time_post(ctx);
+// Keeps queue_depth reads submitted, reports blocks strictly in LBA order, though they may complete out of order
+static int Perform(DC_ProcedureCtx *ctx) {
+    ReadPriv *priv = ctx->priv;
+    int nb = 0;
+    int ret = 0;
 
-    // Error handling
-    if (priv->api == Api_eAta) {
-        // Updating context
-        if (ioctl_ret) {
-            ctx->report.blk_status = DC_BlockStatus_eError;
-            ret = 1;
-        }
-        ctx->report.blk_status = scsi_ata_check_return_status(&priv->scsi_command);
-    } else {
-        if ((int)read_ret != (int)sectors_to_read * 512) {
-            // Position of fd is undefined. Set fd position to read next block
-            lseek(priv->fd, 512 * priv->current_lba, SEEK_SET);
+    if (priv->use_image)
+        return PerformImage(ctx);
 
-            // Updating context
-            ctx->report.blk_status = DC_BlockStatus_eError;
-        }
+    while ((priv->blocks_submitted - priv->blocks_reported < (uint64_t)priv->queue_depth)
+            && priv->sectors_to_submit > 0) {
+        int index = priv->blocks_submitted % priv->queue_depth;
+        DC_IoRequest *req = &priv->reqs[index];
+        next_block(priv, priv->submit_lba, &req->lba, &req->sectors);
+        // Data is read into buffer where there is no way to verify in queue
+        req->op = DC_IoOp_eVerify;
+        req->buf = (uint8_t*)priv->buf + index * ctx->blk_size;
+        priv->batch[nb++] = req;
+        priv->blocks_submitted++;
+        priv->submit_lba = req->lba + req->sectors;
+        priv->sectors_to_submit -= req->sectors;
     }
+    // Synchronous backend completes request even if device stopped responding, so it is reported
+    if (nb)
+        ret = dc_io_submit(&priv->io, priv->batch, nb);
 
-    // Updating context
-    ctx->progress.num++;
-    priv->lba_to_process -= sectors_to_read;
-    priv->current_lba += sectors_to_read;
+    DC_IoRequest *req = &priv->reqs[priv->blocks_reported % priv->queue_depth];
+    if (dc_io_wait(&priv->io, req)) {
+        dc_log(DC_LOG_FATAL, "Reading via \"%s\" backend failed\n", priv->io.backend->name);
+        return 1;
+    }
 
+    // Updating context
+    ctx->time_pre = req->time_submit;
+    ctx->time_post = req->time_complete;
+    ctx->report = req->report;
+    use_report(priv, &ctx->report);
+    priv->blocks_reported++;
+    ctx->progress.num += req->sectors;
+    priv->lba_to_process -= req->sectors;
+    priv->current_lba = req->lba + req->sectors;
     return ret;
 }
 
+// Compares scan with the previous one of the same drive, then adds it to history
+static void history_update(DC_ProcedureCtx *ctx) {
+    ReadPriv *priv = ctx->priv;
+    DC_ScanHistory history;
+    char *summary = NULL;
+    size_t summary_size = 0;
+    int r;
+
+    r = dc_scan_history_open(&history, ctx->dev);
+    if (r)
+        return;
+    FILE *f = open_memstream(&summary, &summary_size);
+    if (!f)
+        goto out;
+    DC_ScanHistoryRecord *prev = malloc(sizeof(*prev));
+    if (prev && history.nb_records && !dc_scan_history_read(&history, history.nb_records - 1, prev)) {
+        dc_scan_history_diff(prev, priv->history_record, f);
+        dc_scan_history_print_trend(&history, priv->history_record, f);
+    }
+    free(prev);
+    priv->history_record->timestamp = time(NULL);
+    r = dc_scan_history_append(&history, priv->history_record);
+    if (r)
+        dc_log(DC_LOG_ERROR, "Failed to append scan to history\n");
+    fclose(f);
+    if (summary_size)
+        dc_log(DC_LOG_INFO, "%s", summary);
+    free(summary);
+out:
+    dc_scan_history_close(&history);
+}
+
 static void Close(DC_ProcedureCtx *ctx) {
     ReadPriv *priv = ctx->priv;
-    int r = ioctl(priv->fd, BLKRASET, priv->old_readahead);
-    if (r == -1)
-      dc_log(DC_LOG_WARNING, "Restoring block device readahead setting failed\n");
+    int r;
+    if (priv->use_image)
+        dc_image_close(&priv->image);
+    else
+        dc_io_close(&priv->io);
+    if (priv->scan_map_mode != ScanMapMode_eNo) {
+        char *badblocks_path;
+        r = asprintf(&badblocks_path, "%s.badblocks", priv->scan_map_path);
+        if (r != -1) {
+            dc_scan_map_export_badblocks(&priv->scan_map, badblocks_path, 4096);
+            free(badblocks_path);
+        }
+        dc_scan_map_close(&priv->scan_map);
+        free(priv->scan_map_path);
+    }
+    if (priv->history_record) {
+        if (priv->history_record->blocks)
+            history_update(ctx);
+        free(priv->history_record);
+    }
+    free(priv->batch);
+    free(priv->reqs);
     free(priv->buf);
-    close(priv->fd);
 }
 
-static const char * const api_choices[] = {"ata", "posix", NULL};
+static const char * const api_choices[] = {"ata", "posix", "scsi", NULL};
+static const char * const yesno_choices[] = {"yes", "no", NULL};
+static const char * const scan_map_choices[] = {"no", "resume", "recheck", NULL};
 static DC_ProcedureOption options[] = {
-    { "api", "select operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ VERIFY EXT\" command", offsetof(ReadPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
+    { "api", "select operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ VERIFY EXT\" command, \"scsi\" for SCSI \"VERIFY (16)\" command", offsetof(ReadPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
     { "start_lba", "set LBA address to begin from", offsetof(ReadPriv, start_lba), DC_ProcedureOptionType_eInt64 },
+    { "queue_depth", "set number of reads kept in flight, via io_uring with \"posix\" API or NCQ with \"ata\" API", offsetof(ReadPriv, queue_depth), DC_ProcedureOptionType_eInt64 },
+    { "blk_sectors", "set block size in sectors, the largest one with adaptive block size", offsetof(ReadPriv, blk_sectors), DC_ProcedureOptionType_eInt64 },
+    { "adaptive", "set whether to shrink block size where errors or latency surges occur (yes/no)", offsetof(ReadPriv, adaptive_str), DC_ProcedureOptionType_eString, yesno_choices },
+    { "scan_map", "set scan map use: \"resume\" previous scan, \"recheck\" its failed and slow blocks, or \"no\"", offsetof(ReadPriv, scan_map_str), DC_ProcedureOptionType_eString, scan_map_choices },
+    { "history", "set whether to compare scan with previous one in drive history (yes/no)", offsetof(ReadPriv, history_str), DC_ProcedureOptionType_eString, yesno_choices },
     { NULL }
 };
 
@@ -179,7 +442,7 @@ static DC_ProcedureOption options[] = {
 DC_Procedure read_test = {
     .name = "read_test",
     .display_name = "Read test",
-    .help = "Verifies entire device with reading. It reads data sequentially, from given start LBA up to end. To get data from source device, it may use ATA \"READ VERIFY EXT\" command, or POSIX read() function, by user choice.",
+    .help = "Verifies entire device with reading. It reads data sequentially, from given start LBA up to end. To get data from source device, it may use ATA \"READ VERIFY EXT\" command, or POSIX read() function, by user choice. Scan map and history are kept in whdd_scan_map__<model>__<serial> and whdd_scan_history__<model>__<serial> in current directory.",
     .suggest_default_value = SuggestDefaultValue,
     .open = Open,
     .perform = Perform,
@@ -5,6 +5,7 @@
 
 #include "render.h"
 #include "utils.h"
+#include "job.h"
 
 static int proxy_handle_report(DC_ProcedureCtx *dummy, void *arg) {
     (void)dummy;
@@ -36,6 +37,37 @@ int render_procedure(DC_ProcedureCtx *actctx, DC_Renderer *renderer) {
     return 0;
 }
 
+static int proxy_handle_job_report(DC_ProcedureCtx *actctx, void *arg) {
+    DC_RendererCtx *ctx = arg;
+    (void)actctx;
+    return ctx->renderer->handle_report(ctx);
+}
+
+int render_jobs(DC_JobEngine *engine, DC_Renderer *renderer) {
+    int r;
+    DC_RendererCtx *ctx = calloc(1, sizeof(*ctx));
+    assert(ctx);
+    assert(engine);
+    assert(renderer);
+    ctx->priv = calloc(1, renderer->priv_data_size);
+    assert(ctx->priv);
+    ctx->job_engine = engine;
+    ctx->renderer = renderer;
+    engine->report_callback = proxy_handle_job_report;
+    engine->report_callback_priv = ctx;
+    r = renderer->open(ctx);
+    if (r)
+        return r;
+    r = jobs_perform_until_interrupt(engine);
+    if (r)
+        return r;
+    renderer->close(ctx);
+    engine->report_callback = NULL;
+    free(ctx->priv);
+    free(ctx);
+    return 0;
+}
+
 DC_Renderer *dc_find_renderer(char *name) {
     DC_Renderer *iter = dc_ctx_global->renderer_list;
     while (iter) {
@@ -6,7 +6,8 @@
 struct dc_renderer_ctx {
     void *priv;
     DC_Renderer *renderer;
-    DC_ProcedureCtx *procedure_ctx;
+    DC_ProcedureCtx *procedure_ctx;  // NULL when rendering jobs
+    DC_JobEngine *job_engine;  // NULL when rendering single procedure
 };
 
 struct dc_renderer {
@@ -28,5 +29,7 @@ int dc_renderer_register(DC_Renderer *renderer);
 DC_Renderer *dc_find_renderer(char *name);
 
 int render_procedure(DC_ProcedureCtx *actctx, DC_Renderer *renderer);
+// handle_report is called from job worker threads, renderer->priv is shared among them
+int render_jobs(DC_JobEngine *engine, DC_Renderer *renderer);
 
 #endif // RENDER_H
@@ -0,0 +1,203 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "scan_history.h"
+#include "log.h"
+
+int dc_scan_history_open(DC_ScanHistory *history, DC_Dev *dev) {
+    char data_file_name[200];
+    char index_file_name[220];
+    struct stat index_stat;
+    int r;
+
+    memset(history, 0, sizeof(*history));
+    snprintf(data_file_name, sizeof(data_file_name), "whdd_scan_history__%s__%s", dev->model_str, dev->serial_no);
+    snprintf(index_file_name, sizeof(index_file_name), "%s.idx", data_file_name);
+
+    history->data_fd = open(data_file_name, O_RDWR | O_CREAT | O_APPEND | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (history->data_fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open scan history file %s\n", data_file_name);
+        return 1;
+    }
+    history->index_fd = open(index_file_name, O_RDWR | O_CREAT | O_APPEND | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (history->index_fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open scan history index %s\n", index_file_name);
+        goto fail_index;
+    }
+    r = fstat(history->index_fd, &index_stat);
+    if (r)
+        goto fail_stat;
+    // Incomplete trailing entry is a leftover of interrupted append, ignore it
+    history->nb_records = index_stat.st_size / sizeof(DC_ScanHistoryIndexEntry);
+    return 0;
+
+fail_stat:
+    close(history->index_fd);
+fail_index:
+    close(history->data_fd);
+    return 1;
+}
+
+void dc_scan_history_close(DC_ScanHistory *history) {
+    close(history->index_fd);
+    close(history->data_fd);
+}
+
+int dc_scan_history_read(DC_ScanHistory *history, uint64_t index, DC_ScanHistoryRecord *record) {
+    DC_ScanHistoryIndexEntry entry;
+    if (index >= history->nb_records)
+        return 1;
+    if (pread(history->index_fd, &entry, sizeof(entry), index * sizeof(entry)) != sizeof(entry))
+        return 1;
+    if (pread(history->data_fd, record, sizeof(*record), entry.offset) != sizeof(*record))
+        return 1;
+    if (record->magic != DC_SCAN_HISTORY_MAGIC || record->version != DC_SCAN_HISTORY_VERSION)
+        return 1;
+    return 0;
+}
+
+int dc_scan_history_append(DC_ScanHistory *history, DC_ScanHistoryRecord *record) {
+    DC_ScanHistoryIndexEntry entry;
+    struct stat data_stat;
+    int r;
+
+    r = fstat(history->data_fd, &data_stat);
+    if (r)
+        return 1;
+    entry.timestamp = record->timestamp;
+    entry.offset = data_stat.st_size;
+    if (write(history->data_fd, record, sizeof(*record)) != sizeof(*record))
+        return 1;
+    // Index entry must never point to a record which is not on disk yet
+    r = fdatasync(history->data_fd);
+    if (r)
+        return 1;
+    // Trim torn entry of previous interrupted append, if any
+    r = ftruncate(history->index_fd, history->nb_records * sizeof(entry));
+    if (r)
+        return 1;
+    if (write(history->index_fd, &entry, sizeof(entry)) != sizeof(entry))
+        return 1;
+    r = fdatasync(history->index_fd);
+    if (r)
+        return 1;
+    history->nb_records++;
+    return 0;
+}
+
+void dc_scan_history_record_init(DC_ScanHistoryRecord *record, const char *procedure, uint64_t nb_sectors) {
+    memset(record, 0, sizeof(*record));
+    record->magic = DC_SCAN_HISTORY_MAGIC;
+    record->version = DC_SCAN_HISTORY_VERSION;
+    record->timestamp = time(NULL);
+    record->nb_sectors = nb_sectors;
+    snprintf(record->procedure, sizeof(record->procedure), "%s", procedure);
+}
+
+static uint64_t region_start_lba(const DC_ScanHistoryRecord *record, int region) {
+    return record->nb_sectors * region / DC_SCAN_HISTORY_REGIONS;
+}
+
+void dc_scan_history_record_add(DC_ScanHistoryRecord *record, const DC_BlockReport *report) {
+    if (!report->sectors_processed || report->lba >= record->nb_sectors)
+        return;
+    // Blocks are small compared to regions, so whole block is accounted to region it starts in
+    DC_ScanHistoryRegion *region = &record->regions[report->lba * DC_SCAN_HISTORY_REGIONS / record->nb_sectors];
+    region->sectors += report->sectors_processed;
+    record->blocks++;
+    if (report->blk_status) {
+        region->errors++;
+        record->errors++;
+        return;
+    }
+    region->ok_sectors += report->sectors_processed;
+    region->access_time += report->blk_access_time;
+    record->ok_sectors += report->sectors_processed;
+    record->access_time += report->blk_access_time;
+    if (report->blk_access_time > region->max_access_time)
+        region->max_access_time = report->blk_access_time;
+    if (report->blk_access_time >= DC_SCAN_HISTORY_SLOW_US)
+        region->slow_blocks++;
+}
+
+uint64_t dc_scan_history_speed(uint64_t ok_sectors, uint64_t access_time) {
+    if (!access_time)
+        return 0;
+    return ok_sectors * 512 * 1000000 / access_time;
+}
+
+int dc_scan_history_diff(const DC_ScanHistoryRecord *prev, const DC_ScanHistoryRecord *cur, FILE *out) {
+    int nb_degraded = 0;
+    uint64_t new_errors = 0;
+    uint64_t new_slow_blocks = 0;
+    char time_str[32];
+    struct tm tm;
+    time_t prev_time = prev->timestamp;
+
+    if (prev->nb_sectors != cur->nb_sectors) {
+        fprintf(out, "Previous scan was done on device of different size, not comparing\n");
+        return 0;
+    }
+    localtime_r(&prev_time, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", &tm);
+    fprintf(out, "Compared to %s scan of %s:\n", prev->procedure, time_str);
+
+    for (int i = 0; i < DC_SCAN_HISTORY_REGIONS; i++) {
+        const DC_ScanHistoryRegion *p = &prev->regions[i];
+        const DC_ScanHistoryRegion *c = &cur->regions[i];
+        if (!p->sectors || !c->sectors)
+            continue;
+        int degraded = 0;
+        uint64_t prev_speed = dc_scan_history_speed(p->ok_sectors, p->access_time);
+        uint64_t cur_speed = dc_scan_history_speed(c->ok_sectors, c->access_time);
+        if (prev_speed && cur_speed && cur_speed * 100 <= prev_speed * (100 - DC_SCAN_HISTORY_SLOWDOWN_PERCENT))
+            degraded = 1;
+        if (c->errors > p->errors) {
+            new_errors += c->errors - p->errors;
+            degraded = 1;
+        }
+        if (c->slow_blocks > p->slow_blocks) {
+            new_slow_blocks += c->slow_blocks - p->slow_blocks;
+            degraded = 1;
+        }
+        if (!degraded)
+            continue;
+        nb_degraded++;
+        if (nb_degraded > DC_SCAN_HISTORY_MAX_DIFF_LINES)
+            continue;
+        fprintf(out, "LBA %"PRIu64"-%"PRIu64": %"PRIu64" -> %"PRIu64" kb/s, max %"PRIu64" -> %"PRIu64" ms, "
+                "errors %u -> %u, slow blocks %u -> %u\n",
+                region_start_lba(cur, i), region_start_lba(cur, i + 1) - 1,
+                prev_speed / 1024, cur_speed / 1024,
+                p->max_access_time / 1000, c->max_access_time / 1000,
+                p->errors, c->errors, p->slow_blocks, c->slow_blocks);
+    }
+    if (nb_degraded > DC_SCAN_HISTORY_MAX_DIFF_LINES)
+        fprintf(out, "...\n");
+    fprintf(out, "%d of %d regions degraded, %"PRIu64" new errors, %"PRIu64" new slow blocks\n",
+            nb_degraded, DC_SCAN_HISTORY_REGIONS, new_errors, new_slow_blocks);
+    return nb_degraded;
+}
+
+void dc_scan_history_print_trend(DC_ScanHistory *history, const DC_ScanHistoryRecord *cur, FILE *out) {
+    DC_ScanHistoryRecord *record = malloc(sizeof(*record));
+    if (!record)
+        return;
+    uint64_t first = history->nb_records > DC_SCAN_HISTORY_TREND_RECORDS - 1 ?
+        history->nb_records - (DC_SCAN_HISTORY_TREND_RECORDS - 1) : 0;
+    fprintf(out, "Errors and kb/s by scan, oldest first:");
+    for (uint64_t i = first; i < history->nb_records; i++) {
+        if (dc_scan_history_read(history, i, record))
+            continue;
+        fprintf(out, " %"PRIu64"/%"PRIu64, record->errors, dc_scan_history_speed(record->ok_sectors, record->access_time) / 1024);
+    }
+    fprintf(out, " %"PRIu64"/%"PRIu64"\n", cur->errors, dc_scan_history_speed(cur->ok_sectors, cur->access_time) / 1024);
+    free(record);
+}
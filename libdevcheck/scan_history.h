@@ -0,0 +1,79 @@
+#ifndef SCAN_HISTORY_H
+#define SCAN_HISTORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "procedure.h"
+
+/*
+ * Scan history keeps a compact summary of each scan of a drive: surface is split into
+ * DC_SCAN_HISTORY_REGIONS equal regions, and for each one, speed, worst latency and errors are kept.
+ * Records are appended to data file; index file has fixed-size entry per record, appended after
+ * the record is durable, so that partially written records are never seen.
+ */
+
+#define DC_SCAN_HISTORY_MAGIC 0x48534858  // "XHSH"
+#define DC_SCAN_HISTORY_VERSION 1
+#define DC_SCAN_HISTORY_REGIONS 256
+#define DC_SCAN_HISTORY_SLOW_US 150000  // blocks this slow or slower are counted as slow
+// Region is reported as degraded if its speed dropped by this percentage or more
+#define DC_SCAN_HISTORY_SLOWDOWN_PERCENT 20
+#define DC_SCAN_HISTORY_MAX_DIFF_LINES 16  // degraded regions listed by diff, the rest are only counted
+#define DC_SCAN_HISTORY_TREND_RECORDS 8  // last scans shown in trend, including current one
+
+typedef struct dc_scan_history_region {
+    uint64_t sectors;  // scanned in region, including failed
+    uint64_t ok_sectors;
+    uint64_t access_time;  // of successful blocks, in μs
+    uint64_t max_access_time;  // in μs
+    uint32_t errors;  // failed blocks
+    uint32_t slow_blocks;
+} DC_ScanHistoryRegion;
+
+typedef struct dc_scan_history_record {
+    uint32_t magic;
+    uint32_t version;
+    int64_t timestamp;  // of scan end, UNIX time
+    uint64_t nb_sectors;  // device size
+    uint64_t blocks;
+    uint64_t errors;
+    uint64_t ok_sectors;
+    uint64_t access_time;
+    char procedure[32];
+    DC_ScanHistoryRegion regions[DC_SCAN_HISTORY_REGIONS];
+} DC_ScanHistoryRecord;
+
+typedef struct dc_scan_history_index_entry {
+    int64_t timestamp;
+    uint64_t offset;
+} DC_ScanHistoryIndexEntry;
+
+typedef struct dc_scan_history {
+    int data_fd;
+    int index_fd;
+    uint64_t nb_records;
+} DC_ScanHistory;
+
+// Opens or creates history of given device in current directory
+int dc_scan_history_open(DC_ScanHistory *history, DC_Dev *dev);
+void dc_scan_history_close(DC_ScanHistory *history);
+// Reads record by index, 0 is the oldest one
+int dc_scan_history_read(DC_ScanHistory *history, uint64_t index, DC_ScanHistoryRecord *record);
+int dc_scan_history_append(DC_ScanHistory *history, DC_ScanHistoryRecord *record);
+
+void dc_scan_history_record_init(DC_ScanHistoryRecord *record, const char *procedure, uint64_t nb_sectors);
+void dc_scan_history_record_add(DC_ScanHistoryRecord *record, const DC_BlockReport *report);
+// Average speed of successful blocks, in bytes per second
+uint64_t dc_scan_history_speed(uint64_t ok_sectors, uint64_t access_time);
+
+/**
+ * Prints comparison of cur with prev: regions got slower and new errors, per region and in total.
+ * Only regions which were scanned in both runs are compared.
+ * Returns number of degraded regions
+ */
+int dc_scan_history_diff(const DC_ScanHistoryRecord *prev, const DC_ScanHistoryRecord *cur, FILE *out);
+// Prints total errors and speed of last scans in history, and of cur
+void dc_scan_history_print_trend(DC_ScanHistory *history, const DC_ScanHistoryRecord *cur, FILE *out);
+
+#endif  // SCAN_HISTORY_H
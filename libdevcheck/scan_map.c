@@ -0,0 +1,184 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scan_map.h"
+#include "log.h"
+
+int dc_scan_map_open(DC_ScanMap *map, const char *path, uint64_t nb_sectors, uint32_t granule_sectors) {
+    int r;
+    struct stat st;
+    DC_ScanMapHeader header;
+
+    memset(map, 0, sizeof(*map));
+    map->fd = open(path, O_RDWR | O_CREAT | O_NOATIME | O_LARGEFILE, S_IRUSR | S_IWUSR);
+    if (map->fd == -1) {
+        dc_log(DC_LOG_ERROR, "Failed to open scan map file %s\n", path);
+        return 1;
+    }
+    r = fstat(map->fd, &st);
+    if (r)
+        goto fail;
+
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DC_SCAN_MAP_MAGIC, sizeof(header.magic));
+        header.version = DC_SCAN_MAP_VERSION;
+        header.granule_sectors = granule_sectors;
+        header.nb_sectors = nb_sectors;
+        header.nb_granules = (nb_sectors + granule_sectors - 1) / granule_sectors;
+        // Granules area stays sparse until scanned, zeros mean "not scanned"
+        r = ftruncate(map->fd, DC_SCAN_MAP_HEADER_SIZE + header.nb_granules);
+        if (r)
+            goto fail;
+        if (pwrite(map->fd, &header, sizeof(header), 0) != sizeof(header))
+            goto fail;
+    } else {
+        if (pread(map->fd, &header, sizeof(header), 0) != sizeof(header)
+                || memcmp(header.magic, DC_SCAN_MAP_MAGIC, sizeof(header.magic))
+                || header.version != DC_SCAN_MAP_VERSION) {
+            dc_log(DC_LOG_ERROR, "File %s is not a scan map\n", path);
+            goto fail;
+        }
+        if (header.nb_sectors != nb_sectors || !header.granule_sectors
+                || header.nb_granules != (nb_sectors + header.granule_sectors - 1) / header.granule_sectors
+                || (uint64_t)st.st_size != DC_SCAN_MAP_HEADER_SIZE + header.nb_granules) {
+            dc_log(DC_LOG_ERROR, "Scan map %s doesn't match device size\n", path);
+            goto fail;
+        }
+    }
+
+    map->mapping_size = DC_SCAN_MAP_HEADER_SIZE + header.nb_granules;
+    map->mapping = mmap(NULL, map->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if (map->mapping == MAP_FAILED) {
+        dc_log(DC_LOG_ERROR, "Failed to map scan map file %s\n", path);
+        goto fail;
+    }
+    map->header = map->mapping;
+    map->granules = (uint8_t*)map->mapping + DC_SCAN_MAP_HEADER_SIZE;
+    return 0;
+
+fail:
+    close(map->fd);
+    return 1;
+}
+
+void dc_scan_map_close(DC_ScanMap *map) {
+    msync(map->mapping, map->mapping_size, MS_SYNC);
+    munmap(map->mapping, map->mapping_size);
+    close(map->fd);
+}
+
+static uint8_t latency_class(uint64_t access_time) {
+    int log2 = 0;
+    while (access_time >>= 1)
+        log2++;
+    if (log2 < 6)
+        return 0;
+    if (log2 - 6 > 15)
+        return 15;
+    return log2 - 6;
+}
+
+static int entry_is_worse(uint8_t a, uint8_t b) {
+    int status_a = DC_SCAN_MAP_STATUS(a);
+    int status_b = DC_SCAN_MAP_STATUS(b);
+    if ((status_a > 0) != (status_b > 0))
+        return status_a > 0;
+    return DC_SCAN_MAP_LATENCY_CLASS(a) > DC_SCAN_MAP_LATENCY_CLASS(b);
+}
+
+void dc_scan_map_record(DC_ScanMap *map, const DC_BlockReport *report) {
+    uint32_t granule_sectors = map->header->granule_sectors;
+    if (!report->sectors_processed || report->lba >= map->header->nb_sectors)
+        return;
+    uint8_t entry = (latency_class(report->blk_access_time) << 4) | (report->blk_status + 1);
+    uint64_t first = report->lba / granule_sectors;
+    uint64_t last = (report->lba + report->sectors_processed - 1) / granule_sectors;
+    if (last >= map->header->nb_granules)
+        last = map->header->nb_granules - 1;
+    for (uint64_t i = first; i <= last; i++) {
+        // Block starting the granule overwrites what previous scans found;
+        // the rest of blocks within it, if block is smaller, may only make it worse
+        if (report->lba <= i * granule_sectors || map->granules[i] == DC_SCAN_MAP_UNSCANNED
+                || entry_is_worse(entry, map->granules[i]))
+            map->granules[i] = entry;
+    }
+}
+
+static int granule_is_suspect(uint8_t entry) {
+    return entry != DC_SCAN_MAP_UNSCANNED
+        && (DC_SCAN_MAP_STATUS(entry) != DC_BlockStatus_eOk || DC_SCAN_MAP_LATENCY_CLASS(entry) >= DC_SCAN_MAP_SLOW_CLASS);
+}
+
+uint64_t dc_scan_map_next_unscanned(DC_ScanMap *map, uint64_t lba) {
+    uint32_t granule_sectors = map->header->granule_sectors;
+    for (uint64_t i = lba / granule_sectors; i < map->header->nb_granules; i++)
+        if (map->granules[i] == DC_SCAN_MAP_UNSCANNED)
+            return i * granule_sectors > lba ? i * granule_sectors : lba;
+    return map->header->nb_sectors;
+}
+
+uint64_t dc_scan_map_next_suspect(DC_ScanMap *map, uint64_t lba, uint64_t *run_end) {
+    uint32_t granule_sectors = map->header->granule_sectors;
+    uint64_t i;
+    *run_end = map->header->nb_sectors;
+    for (i = lba / granule_sectors; i < map->header->nb_granules; i++)
+        if (granule_is_suspect(map->granules[i]))
+            break;
+    if (i == map->header->nb_granules)
+        return map->header->nb_sectors;
+    uint64_t start = i * granule_sectors > lba ? i * granule_sectors : lba;
+    for (; i < map->header->nb_granules; i++)
+        if (!granule_is_suspect(map->granules[i]))
+            break;
+    if (i < map->header->nb_granules)
+        *run_end = i * granule_sectors;
+    return start;
+}
+
+uint64_t dc_scan_map_suspect_sectors(DC_ScanMap *map) {
+    uint64_t sectors = 0;
+    uint64_t lba = 0;
+    uint64_t run_end;
+    while ((lba = dc_scan_map_next_suspect(map, lba, &run_end)) < map->header->nb_sectors) {
+        sectors += run_end - lba;
+        lba = run_end;
+    }
+    return sectors;
+}
+
+int dc_scan_map_export_badblocks(DC_ScanMap *map, const char *path, unsigned int block_size) {
+    uint32_t granule_sectors = map->header->granule_sectors;
+    uint64_t block_sectors = block_size / 512;
+    uint64_t last_block_written = UINT64_MAX;
+    if (!block_sectors)
+        return 1;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        dc_log(DC_LOG_ERROR, "Failed to open %s for writing\n", path);
+        return 1;
+    }
+    for (uint64_t i = 0; i < map->header->nb_granules; i++) {
+        int status = DC_SCAN_MAP_STATUS(map->granules[i]);
+        if (status <= DC_BlockStatus_eOk)
+            continue;
+        uint64_t granule_end = (i + 1) * granule_sectors;
+        if (granule_end > map->header->nb_sectors)
+            granule_end = map->header->nb_sectors;
+        for (uint64_t block = i * granule_sectors / block_sectors; block * block_sectors < granule_end; block++) {
+            // Blocks may span several granules
+            if (last_block_written != UINT64_MAX && block <= last_block_written)
+                continue;
+            fprintf(f, "%"PRIu64"\n", block);
+            last_block_written = block;
+        }
+    }
+    return fclose(f) ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+#ifndef SCAN_MAP_H
+#define SCAN_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "procedure.h"
+
+/*
+ * Scan map is a file with one byte per granule (fixed run of sectors, set on map creation),
+ * memory-mapped so that each block report costs only memory writes.
+ * Low nibble of byte is 1 + DC_BlockStatus, or 0 if granule was never scanned.
+ * High nibble is latency class: floor(log2(access time in μs)) - 6, clamped to 0..15.
+ */
+
+#define DC_SCAN_MAP_MAGIC "XHDDSMAP"
+#define DC_SCAN_MAP_VERSION 1
+#define DC_SCAN_MAP_HEADER_SIZE 4096
+
+#define DC_SCAN_MAP_UNSCANNED 0
+#define DC_SCAN_MAP_STATUS(entry) ((int)((entry) & 0x0f) - 1)  // DC_BlockStatus, or -1 if not scanned
+#define DC_SCAN_MAP_LATENCY_CLASS(entry) ((entry) >> 4)
+#define DC_SCAN_MAP_LATENCY_CLASS_MIN_US(class) (1ULL << ((class) + 6))
+// Granules this slow or slower are subject to recheck
+#define DC_SCAN_MAP_SLOW_CLASS 11  // 131 ms
+
+typedef struct dc_scan_map_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t granule_sectors;
+    uint64_t nb_sectors;
+    uint64_t nb_granules;
+} DC_ScanMapHeader;
+
+typedef struct dc_scan_map {
+    int fd;
+    void *mapping;
+    size_t mapping_size;
+    DC_ScanMapHeader *header;
+    uint8_t *granules;
+} DC_ScanMap;
+
+/**
+ * Opens existing map file or creates new one.
+ * Existing map must be of the same device size; granule size is taken from it then,
+ * otherwise it is granule_sectors
+ */
+int dc_scan_map_open(DC_ScanMap *map, const char *path, uint64_t nb_sectors, uint32_t granule_sectors);
+void dc_scan_map_close(DC_ScanMap *map);
+
+void dc_scan_map_record(DC_ScanMap *map, const DC_BlockReport *report);
+
+// First LBA not less than lba of granule which was never scanned; nb_sectors if none
+uint64_t dc_scan_map_next_unscanned(DC_ScanMap *map, uint64_t lba);
+// First LBA not less than lba of granule which failed or was slow; nb_sectors if none.
+// Sets *run_end to end of contiguous run of such granules
+uint64_t dc_scan_map_next_suspect(DC_ScanMap *map, uint64_t lba, uint64_t *run_end);
+uint64_t dc_scan_map_suspect_sectors(DC_ScanMap *map);
+
+/**
+ * Writes numbers of blocks of block_size bytes which contain failed granules, one per line,
+ * as "badblocks" utility does
+ */
+int dc_scan_map_export_badblocks(DC_ScanMap *map, const char *path, unsigned int block_size);
+
+#endif  // SCAN_MAP_H
@@ -37,6 +37,39 @@ void prepare_scsi_command_from_ata(ScsiCommand *scsi_cmd, AtaCommand *ata_cmd) {
     scsi_cmd->scsi_cmd[14] = ata_cmd->task.io_ports[7];  // command
 }
 
+void prepare_scsi_command_fpdma_in(ScsiCommand *scsi_cmd, AtaCommand *ata_cmd, void *buf, size_t len) {
+    prepare_scsi_command_from_ata(scsi_cmd, ata_cmd);
+    scsi_cmd->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    scsi_cmd->io_hdr.dxferp = buf;
+    scsi_cmd->io_hdr.dxfer_len = len;
+    scsi_cmd->scsi_cmd[1] = (12 << 1) + 1;  // FPDMA protocol + EXTEND bit
+    scsi_cmd->scsi_cmd[2] = 0x0d;  // CK_COND=0 T_DIR=1 BYTE_BLOCK=1 T_LENGTH=01b (in FEATURES)
+}
+
+void prepare_scsi_command_rw16(ScsiCommand *scsi_cmd, uint8_t opcode, uint64_t lba, uint32_t sectors, void *buf) {
+    int i;
+    memset(scsi_cmd, 0, sizeof(ScsiCommand));
+    scsi_cmd->io_hdr.interface_id = 'S';
+    scsi_cmd->io_hdr.dxfer_direction = SG_DXFER_NONE;
+    if (buf) {
+        scsi_cmd->io_hdr.dxfer_direction = opcode == 0x8a /* WRITE (16) */ ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+        scsi_cmd->io_hdr.dxferp = buf;
+        scsi_cmd->io_hdr.dxfer_len = sectors * 512;
+    }
+    scsi_cmd->io_hdr.cmd_len = 16;
+    scsi_cmd->io_hdr.mx_sb_len = sizeof(scsi_cmd->sense_buf);
+    scsi_cmd->io_hdr.cmdp = scsi_cmd->scsi_cmd;
+    scsi_cmd->io_hdr.sbp = scsi_cmd->sense_buf;
+    scsi_cmd->io_hdr.timeout = 1000;  // In millisec
+    scsi_cmd->io_hdr.flags = SG_FLAG_DIRECT_IO;
+
+    scsi_cmd->scsi_cmd[0] = opcode;
+    for (i = 0; i < 8; i++)
+        scsi_cmd->scsi_cmd[2 + i] = lba >> (56 - 8 * i);  // LBA, big endian
+    for (i = 0; i < 4; i++)
+        scsi_cmd->scsi_cmd[10 + i] = sectors >> (24 - 8 * i);  // Transfer length
+}
+
 void fill_scsi_ata_return_descriptor(ScsiAtaReturnDescriptor *scsi_ata_ret, ScsiCommand *scsi_cmd) {
     uint8_t *descr = &scsi_cmd->sense_buf[8];
     memcpy(scsi_ata_ret->descriptor, descr, sizeof(scsi_ata_ret->descriptor));
@@ -51,6 +84,19 @@ void fill_scsi_ata_return_descriptor(ScsiAtaReturnDescriptor *scsi_ata_ret, Scsi
     scsi_ata_ret->lba |= (uint64_t)descr[10] << 40;
 }
 
+static int get_asc_from_sense_buffer(uint8_t *buf) {
+    switch (buf[0]) {
+        case 0x70:
+        case 0x71:
+            return buf[12];
+        case 0x72:
+        case 0x73:
+            return buf[2];
+        default:
+            return -1;
+    }
+}
+
 int get_sense_key_from_sense_buffer(uint8_t *buf) {
     switch (buf[0]) {
         case 0x70:
@@ -112,3 +158,37 @@ DC_BlockStatus scsi_ata_check_return_status(ScsiCommand *scsi_command) {
 
     return DC_BlockStatus_eOk;
 }
+
+DC_BlockStatus scsi_check_return_status(ScsiCommand *scsi_command) {
+    if (scsi_command->io_hdr.host_status == 0x03 /* DID_TIME_OUT */)
+        return DC_BlockStatus_eTimeout;
+    if (scsi_command->io_hdr.status == 0 && scsi_command->io_hdr.host_status == 0)
+        return DC_BlockStatus_eOk;
+    if (scsi_command->io_hdr.status != 0x02 /* CHECK_CONDITION */)
+        return DC_BlockStatus_eError;
+    int sense_key = get_sense_key_from_sense_buffer(scsi_command->sense_buf);
+    int asc = get_asc_from_sense_buffer(scsi_command->sense_buf);
+    switch (sense_key) {
+        case 0x01:  // RECOVERED ERROR
+            return DC_BlockStatus_eOk;
+        case 0x03:  // MEDIUM ERROR
+        case 0x04:  // HARDWARE ERROR
+            if (asc == 0x11)  // UNRECOVERED READ ERROR
+                return DC_BlockStatus_eUnc;
+            else if (asc == 0x14)  // RECORDED ENTITY NOT FOUND
+                return DC_BlockStatus_eIdnf;
+            else if (asc == 0x12 || asc == 0x13)  // ADDRESS MARK NOT FOUND
+                return DC_BlockStatus_eAmnf;
+            else
+                return DC_BlockStatus_eError;
+        case 0x05:  // ILLEGAL REQUEST
+            if (asc == 0x21)  // LOGICAL BLOCK ADDRESS OUT OF RANGE
+                return DC_BlockStatus_eIdnf;
+            else
+                return DC_BlockStatus_eAbrt;
+        case 0x0b:  // ABORTED COMMAND
+            return DC_BlockStatus_eAbrt;
+        default:
+            return DC_BlockStatus_eError;
+    }
+}
@@ -39,11 +39,18 @@ typedef struct scsi_ata_return_descriptor {
 } ScsiAtaReturnDescriptor;
 
 void prepare_scsi_command_from_ata(ScsiCommand *scsi_cmd, AtaCommand *ata_cmd);
+// Wrap NCQ (FPDMA) data-in command, made with prepare_ata_fpdma_command()
+void prepare_scsi_command_fpdma_in(ScsiCommand *scsi_cmd, AtaCommand *ata_cmd, void *buf, size_t len);
+
+// READ (16), VERIFY (16) or WRITE (16); buf may be NULL for VERIFY
+void prepare_scsi_command_rw16(ScsiCommand *scsi_cmd, uint8_t opcode, uint64_t lba, uint32_t sectors, void *buf);
 
 void fill_scsi_ata_return_descriptor(ScsiAtaReturnDescriptor *scsi_ata_ret, ScsiCommand *scsi_cmd);
 
 int get_sense_key_from_sense_buffer(uint8_t *buf);
 
 DC_BlockStatus scsi_ata_check_return_status(ScsiCommand *scsi_command);
+// For native SCSI commands, status is taken from sense key and additional sense code
+DC_BlockStatus scsi_check_return_status(ScsiCommand *scsi_command);
 
 #endif  // SCSI_H
@@ -0,0 +1,313 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include "procedure.h"
+#include "ata.h"
+#include "scsi.h"
+#include "utils.h"
+#include "io_backend.h"
+
+enum SeekBenchMode {
+    SeekBenchMode_eRandom4k,
+    SeekBenchMode_eButterfly,
+    SeekBenchMode_eFullStroke,
+    SeekBenchMode_eZoned,
+};
+
+struct seek_bench_priv {
+    const char *api_str;
+    const char *mode_str;
+    int64_t ops;
+    int64_t zones;
+    int64_t zone_sectors;
+    int64_t blk_sectors;
+    enum Api api;
+    enum SeekBenchMode mode;
+    uint64_t end_lba;
+    DC_Io io;
+    DC_IoRequest io_req;
+    void *buf;
+    uint64_t rand_state;
+
+    uint64_t ops_done;
+    uint64_t *latencies;  // of successful operations, in μs
+    uint64_t nb_latencies;
+    uint64_t errors;
+    uint64_t total_access_time;
+
+    // Zoned mode
+    uint64_t blocks_per_zone;
+    uint64_t *zone_access_time;
+};
+typedef struct seek_bench_priv SeekBenchPriv;
+
+#define RANDOM_BLK_SECTORS 8  // 4 KiB, physical sector of Advanced Format drives
+#define FULL_STROKE_BAND_DIVISOR 1024  // seeks land randomly within outermost and innermost 1/1024 of surface
+
+static int SuggestDefaultValue(DC_Dev *dev, DC_OptionSetting *setting) {
+    if (!strcmp(setting->name, "api")) {
+        if (dev->ata_capable)
+            setting->value = strdup("ata");
+        else
+            setting->value = strdup("posix");
+    } else if (!strcmp(setting->name, "mode")) {
+        setting->value = strdup("random4k");
+    } else if (!strcmp(setting->name, "ops")) {
+        setting->value = strdup("2000");
+    } else if (!strcmp(setting->name, "zones")) {
+        setting->value = strdup("16");
+    } else if (!strcmp(setting->name, "zone_sectors")) {
+        setting->value = strdup("131072");
+    } else if (!strcmp(setting->name, "blk_sectors")) {
+        setting->value = strdup(DC_STRINGIFY(DC_DEFAULT_BLK_SECTORS));
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t rand_next(SeekBenchPriv *priv) {
+    // xorshift64*
+    priv->rand_state ^= priv->rand_state >> 12;
+    priv->rand_state ^= priv->rand_state << 25;
+    priv->rand_state ^= priv->rand_state >> 27;
+    return priv->rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int Open(DC_ProcedureCtx *ctx) {
+    int r;
+    SeekBenchPriv *priv = ctx->priv;
+
+    // Setting context
+    if (!strcmp(priv->api_str, "ata"))
+        priv->api = Api_eAta;
+    else if (!strcmp(priv->api_str, "posix"))
+        priv->api = Api_ePosix;
+    else if (!strcmp(priv->api_str, "scsi"))
+        priv->api = Api_eScsi;
+    else
+        return 1;
+    if (priv->api == Api_eAta && !ctx->dev->ata_capable)
+        return 1;
+    if (!strcmp(priv->mode_str, "random4k"))
+        priv->mode = SeekBenchMode_eRandom4k;
+    else if (!strcmp(priv->mode_str, "butterfly"))
+        priv->mode = SeekBenchMode_eButterfly;
+    else if (!strcmp(priv->mode_str, "full_stroke"))
+        priv->mode = SeekBenchMode_eFullStroke;
+    else if (!strcmp(priv->mode_str, "zoned"))
+        priv->mode = SeekBenchMode_eZoned;
+    else
+        return 1;
+
+    priv->end_lba = ctx->dev->capacity / 512;
+    if (priv->mode == SeekBenchMode_eZoned) {
+        int64_t max_blk_sectors = dc_dev_max_blk_sectors(ctx->dev);
+        if (priv->blk_sectors < 1 || priv->blk_sectors > max_blk_sectors) {
+            dc_log(DC_LOG_FATAL, "Block size must be within 1..%"PRId64" sectors for this device\n", max_blk_sectors);
+            return 1;
+        }
+        if (priv->zones < 1 || priv->zone_sectors < priv->blk_sectors
+                || (uint64_t)priv->zone_sectors > priv->end_lba / priv->zones) {
+            dc_log(DC_LOG_FATAL, "Zones of %"PRId64" sectors don't fit device %"PRId64" times\n",
+                    priv->zone_sectors, priv->zones);
+            return 1;
+        }
+        priv->blocks_per_zone = priv->zone_sectors / priv->blk_sectors;
+        ctx->progress.den = priv->zones * priv->blocks_per_zone;
+        priv->zone_access_time = calloc(priv->zones, sizeof(uint64_t));
+        if (!priv->zone_access_time)
+            return 1;
+    } else {
+        if (priv->ops < 1 || priv->end_lba < (uint64_t)priv->ops * RANDOM_BLK_SECTORS)
+            return 1;
+        priv->blk_sectors = RANDOM_BLK_SECTORS;
+        ctx->progress.den = priv->ops;
+    }
+    ctx->blk_size = priv->blk_sectors * 512;
+
+    priv->latencies = calloc(ctx->progress.den, sizeof(uint64_t));
+    if (!priv->latencies)
+        goto fail_latencies;
+    r = posix_memalign(&priv->buf, sysconf(_SC_PAGESIZE), ctx->blk_size);
+    if (r)
+        goto fail_buf;
+
+    r = dc_io_open(&priv->io, ctx->dev, dc_io_backend_for_api(priv->api), 1, 0);
+    if (r)
+        goto fail_open;
+
+    struct timespec now;
+    clock_gettime(DC_BEST_CLOCK, &now);
+    priv->rand_state = (now.tv_sec * 1000000000ULL + now.tv_nsec) | 1;
+    return 0;
+
+fail_open:
+    free(priv->buf);
+fail_buf:
+    free(priv->latencies);
+fail_latencies:
+    free(priv->zone_access_time);
+    return 1;
+}
+
+static uint64_t zone_start_lba(SeekBenchPriv *priv, uint64_t zone) {
+    // Zones are spread evenly, last one ends at the end of surface
+    uint64_t space = priv->end_lba - priv->blocks_per_zone * priv->blk_sectors;
+    if (priv->zones == 1)
+        return 0;
+    uint64_t lba = space * zone / (priv->zones - 1);
+    return lba - lba % RANDOM_BLK_SECTORS;
+}
+
+static uint64_t next_op_lba(SeekBenchPriv *priv) {
+    uint64_t last_lba = priv->end_lba - RANDOM_BLK_SECTORS;
+    uint64_t lba = 0;
+    switch (priv->mode) {
+        case SeekBenchMode_eRandom4k:
+            lba = rand_next(priv) % (last_lba + 1);
+            break;
+        case SeekBenchMode_eButterfly: {
+            // Alternate between ends, converging to the middle
+            uint64_t step = last_lba / priv->ops;
+            uint64_t k = priv->ops_done / 2;
+            lba = (priv->ops_done % 2) ? last_lba - k * step : k * step;
+            break;
+        }
+        case SeekBenchMode_eFullStroke: {
+            // Vary position a bit, so that drive cache doesn't serve repeated reads
+            uint64_t band = priv->end_lba / FULL_STROKE_BAND_DIVISOR;
+            uint64_t offset = band ? rand_next(priv) % band : 0;
+            lba = (priv->ops_done % 2) ? last_lba - offset : offset;
+            break;
+        }
+        case SeekBenchMode_eZoned:
+            return zone_start_lba(priv, priv->ops_done / priv->blocks_per_zone)
+                + (priv->ops_done % priv->blocks_per_zone) * priv->blk_sectors;
+    }
+    return lba - lba % RANDOM_BLK_SECTORS;
+}
+
+static int Perform(DC_ProcedureCtx *ctx) {
+    int ret = 0;
+    SeekBenchPriv *priv = ctx->priv;
+    uint64_t lba = next_op_lba(priv);
+
+    // Acting
+    DC_IoRequest *req = &priv->io_req;
+    req->op = DC_IoOp_eVerify;
+    req->lba = lba;
+    req->sectors = priv->blk_sectors;
+    req->buf = priv->buf;
+    ret = dc_io_execute(&priv->io, req);
+
+    // Updating context
+    ctx->time_pre = req->time_submit;
+    ctx->time_post = req->time_complete;
+    ctx->report = req->report;
+
+    // Accounting
+    if (ctx->report.blk_status) {
+        priv->errors++;
+    } else {
+        priv->latencies[priv->nb_latencies++] = ctx->report.blk_access_time;
+        priv->total_access_time += ctx->report.blk_access_time;
+        if (priv->mode == SeekBenchMode_eZoned)
+            priv->zone_access_time[priv->ops_done / priv->blocks_per_zone] += ctx->report.blk_access_time;
+    }
+
+    // Updating context
+    priv->ops_done++;
+    ctx->progress.num++;
+    return ret;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile, permille is in 0..1000 range
+static uint64_t percentile(uint64_t *sorted, uint64_t nb, unsigned int permille) {
+    uint64_t rank = (nb * permille + 999) / 1000;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static void log_summary(DC_ProcedureCtx *ctx) {
+    SeekBenchPriv *priv = ctx->priv;
+    char *summary = NULL;
+    size_t summary_size = 0;
+    FILE *f = open_memstream(&summary, &summary_size);
+    if (!f)
+        return;
+
+    fprintf(f, "%s on %s: %"PRIu64" operations, %"PRIu64" errors\n",
+            priv->mode_str, ctx->dev->dev_path, priv->ops_done, priv->errors);
+    if (priv->nb_latencies) {
+        qsort(priv->latencies, priv->nb_latencies, sizeof(uint64_t), compare_u64);
+        fprintf(f, "IOPS %"PRIu64"\n", priv->total_access_time ?
+                priv->nb_latencies * 1000000 / priv->total_access_time : 0);
+        fprintf(f, "Latency, ms: min %.2f, p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+                priv->latencies[0] / 1000.0,
+                percentile(priv->latencies, priv->nb_latencies, 500) / 1000.0,
+                percentile(priv->latencies, priv->nb_latencies, 900) / 1000.0,
+                percentile(priv->latencies, priv->nb_latencies, 990) / 1000.0,
+                percentile(priv->latencies, priv->nb_latencies, 999) / 1000.0,
+                priv->latencies[priv->nb_latencies - 1] / 1000.0);
+    }
+    if (priv->mode == SeekBenchMode_eZoned) {
+        uint64_t zones_done = (priv->ops_done + priv->blocks_per_zone - 1) / priv->blocks_per_zone;
+        for (uint64_t zone = 0; zone < zones_done; zone++) {
+            uint64_t access_time = priv->zone_access_time[zone];
+            fprintf(f, "Zone %2"PRIu64" at LBA %"PRIu64": %"PRIu64" kb/s\n", zone, zone_start_lba(priv, zone),
+                    access_time ? priv->blocks_per_zone * priv->blk_sectors * 512 * 1000000 / 1024 / access_time : 0);
+        }
+    }
+    fclose(f);
+    dc_log(DC_LOG_INFO, "%s", summary);
+    free(summary);
+}
+
+static void Close(DC_ProcedureCtx *ctx) {
+    SeekBenchPriv *priv = ctx->priv;
+    if (priv->ops_done)
+        log_summary(ctx);
+    dc_io_close(&priv->io);
+    free(priv->zone_access_time);
+    free(priv->latencies);
+    free(priv->buf);
+}
+
+static const char * const api_choices[] = {"ata", "posix", "scsi", NULL};
+static const char * const mode_choices[] = {"random4k", "butterfly", "full_stroke", "zoned", NULL};
+static DC_ProcedureOption options[] = {
+    { "api", "select operation API: \"posix\" for POSIX read(), \"ata\" for ATA \"READ VERIFY EXT\" command, \"scsi\" for SCSI \"VERIFY (16)\" command", offsetof(SeekBenchPriv, api_str), DC_ProcedureOptionType_eString, api_choices },
+    { "mode", "select access pattern: random4k, butterfly, full_stroke, zoned", offsetof(SeekBenchPriv, mode_str), DC_ProcedureOptionType_eString, mode_choices },
+    { "ops", "set number of seeks to measure, except in zoned mode", offsetof(SeekBenchPriv, ops), DC_ProcedureOptionType_eInt64 },
+    { "zones", "set number of zones to measure sequential speed at, in zoned mode", offsetof(SeekBenchPriv, zones), DC_ProcedureOptionType_eInt64 },
+    { "zone_sectors", "set number of sectors to read sequentially in each zone, in zoned mode", offsetof(SeekBenchPriv, zone_sectors), DC_ProcedureOptionType_eInt64 },
+    { "blk_sectors", "set block size in sectors for zoned mode; seeks always read 8 sectors", offsetof(SeekBenchPriv, blk_sectors), DC_ProcedureOptionType_eInt64 },
+    { NULL }
+};
+
+DC_Procedure seek_bench = {
+    .name = "seek_bench",
+    .display_name = "Seek benchmark",
+    .help = "Measures random access performance of device. In random4k mode, 4 KiB blocks are read at random positions over whole surface. In butterfly mode, reads alternate between beginning and end of surface, converging to the middle. In full_stroke mode, reads alternate between outermost and innermost 1/1024 of surface. In zoned mode, sequential read speed is measured in evenly spread zones. After the run, IOPS and latency percentiles are reported, and per-zone speed in zoned mode.",
+    .suggest_default_value = SuggestDefaultValue,
+    .open = Open,
+    .perform = Perform,
+    .close = Close,
+    .priv_data_size = sizeof(SeekBenchPriv),
+    .options = options,
+};
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "sg_async.h"
+#include "libdevcheck.h"
+#include "utils.h"
+
+int dc_sg_queue_open(DC_SgQueue *queue, DC_Dev *dev, int depth) {
+    int r;
+    char *sg_path;
+    memset(queue, 0, sizeof(*queue));
+    if (depth > SG_MAX_QUEUE) {
+        dc_log(DC_LOG_WARNING, "Queue depth is limited to %d by sg driver\n", SG_MAX_QUEUE);
+        depth = SG_MAX_QUEUE;
+    }
+    queue->depth = depth;
+
+    r = dc_dev_sg_path(dev->dev_fs_name, &sg_path);
+    if (r) {
+        dc_log(DC_LOG_ERROR, "No generic SCSI device found for %s\n", dev->dev_path);
+        return 1;
+    }
+    queue->fd = open(sg_path, O_RDWR | O_NONBLOCK);
+    if (queue->fd == -1) {
+        dc_log(DC_LOG_ERROR, "open %s fail\n", sg_path);
+        free(sg_path);
+        return 1;
+    }
+    free(sg_path);
+    return 0;
+}
+
+void dc_sg_queue_close(DC_SgQueue *queue) {
+    close(queue->fd);
+}
+
+int dc_sg_queue_submit_read(DC_SgQueue *queue, ScsiCommand *scsi_command, int pack_id, uint64_t lba, size_t sectors, void *buf) {
+    AtaCommand ata_command;
+    int size = sectors * 512;
+    ssize_t r;
+    // Reserved buffer is used when direct I/O to buf is impossible
+    if (size > queue->reserved_size) {
+        r = ioctl(queue->fd, SG_SET_RESERVED_SIZE, &size);
+        if (r == -1)
+            dc_log(DC_LOG_WARNING, "Setting sg reserved buffer size failed\n");
+        queue->reserved_size = size;
+    }
+    memset(&ata_command, 0, sizeof(ata_command));
+    prepare_ata_fpdma_command(&ata_command, ATA_CMD_READ_FPDMA_QUEUED, lba, sectors);
+    prepare_scsi_command_fpdma_in(scsi_command, &ata_command, buf, size);
+    scsi_command->io_hdr.pack_id = pack_id;
+    do {
+        r = write(queue->fd, &scsi_command->io_hdr, sizeof(scsi_command->io_hdr));
+    } while (r == -1 && errno == EINTR);
+    return r == -1;
+}
+
+int dc_sg_queue_reap(DC_SgQueue *queue, sg_io_hdr_t *hdr, int wait) {
+    ssize_t r;
+    while (1) {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->interface_id = 'S';
+        hdr->pack_id = -1;
+        r = read(queue->fd, hdr, sizeof(*hdr));
+        if (r != -1)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return -1;
+        if (!wait)
+            return 1;
+        struct pollfd pfd = { .fd = queue->fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            return -1;
+    }
+}
+
+DC_BlockStatus dc_sg_command_status(ScsiCommand *scsi_command) {
+    if (scsi_command->io_hdr.host_status == 0x03 /* DID_TIME_OUT */)
+        return DC_BlockStatus_eTimeout;
+    if (scsi_command->io_hdr.host_status)
+        return DC_BlockStatus_eError;
+    return scsi_ata_check_return_status(scsi_command);
+}
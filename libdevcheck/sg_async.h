@@ -0,0 +1,35 @@
+#ifndef SG_ASYNC_H
+#define SG_ASYNC_H
+
+#include "scsi.h"
+#include "device.h"
+
+/*
+ * Queue of ATA pass-through commands issued via sg v3 asynchronous interface:
+ * write() of sg_io_hdr_t submits, read() fetches a completed one.
+ * Requests are correlated by io_hdr.pack_id, which caller chooses.
+ * Commands are READ FPDMA QUEUED, so NCQ-capable drive may reorder them.
+ * It is transport of "sg_async" I/O backend, which keeps command of each request.
+ */
+typedef struct dc_sg_queue {
+    int fd;
+    int depth;
+    int reserved_size;  // of sg buffer, grown to the largest request
+} DC_SgQueue;
+
+// Opens generic SCSI device node (/dev/sgN) which backs dev; depth is limited by SG_MAX_QUEUE
+int dc_sg_queue_open(DC_SgQueue *queue, DC_Dev *dev, int depth);
+// Commands in flight must be reaped before
+void dc_sg_queue_close(DC_SgQueue *queue);
+
+// scsi_command must stay intact until command is reaped: sense data is returned into it
+int dc_sg_queue_submit_read(DC_SgQueue *queue, ScsiCommand *scsi_command, int pack_id, uint64_t lba, size_t sectors, void *buf);
+/**
+ * Fetches output members of one completed command into hdr, waiting for it if wait is set.
+ * Returns 0 if got one, 1 if none is completed yet, -1 on failure
+ */
+int dc_sg_queue_reap(DC_SgQueue *queue, sg_io_hdr_t *hdr, int wait);
+
+DC_BlockStatus dc_sg_command_status(ScsiCommand *scsi_command);
+
+#endif  // SG_ASYNC_H
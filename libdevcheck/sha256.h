@@ -0,0 +1,23 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DC_SHA256_SIZE 32
+
+typedef struct dc_sha256 {
+    uint32_t state[8];
+    uint64_t length;  // in bytes
+    uint8_t block[64];
+    size_t block_len;
+} DC_Sha256;
+
+void dc_sha256_init(DC_Sha256 *ctx);
+void dc_sha256_update(DC_Sha256 *ctx, const void *data, size_t size);
+void dc_sha256_final(DC_Sha256 *ctx, uint8_t digest[DC_SHA256_SIZE]);
+
+// Writes 64 hex digits and terminating zero
+void dc_sha256_to_hex(const uint8_t digest[DC_SHA256_SIZE], char hex[2 * DC_SHA256_SIZE + 1]);
+
+#endif  // SHA256_H
@@ -0,0 +1,99 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sparse_dst.h"
+#include "log.h"
+
+int dc_buffer_is_zero(const void *buf, size_t size) {
+    const uint8_t *p = buf;
+    size_t i = 0;
+#ifdef __SSE2__
+    // 64 bytes per iteration; data blocks usually differ from zeros within first ones
+    for (; i + 64 <= size; i += 64) {
+        __m128i v = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return 0;
+    }
+#endif
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if (word)
+            return 0;
+    }
+    for (; i < size; i++)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+int dc_sparse_dst_open(DC_SparseDst *dst, int fd, int zero_out_blockdev) {
+    struct stat st;
+    memset(dst, 0, sizeof(*dst));
+    dst->fd = fd;
+    if (fstat(fd, &st))
+        return 1;
+    if (S_ISREG(st.st_mode))
+        dst->mode = DC_SparseMode_ePunchHole;
+    else if (S_ISBLK(st.st_mode) && zero_out_blockdev)
+        dst->mode = DC_SparseMode_eZeroOut;
+    else
+        return 1;
+    return 0;
+}
+
+static int punch_hole(DC_SparseDst *dst, uint64_t begin, uint64_t end) {
+    struct stat st;
+    if (fstat(dst->fd, &st))
+        return 1;
+    uint64_t file_size = st.st_size;
+    if (begin < file_size) {
+        uint64_t punch_end = end < file_size ? end : file_size;
+        if (fallocate(dst->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, punch_end - begin))
+            return 1;
+    }
+    // Past end of file, extending it is enough: new space is a hole
+    if (end > file_size && ftruncate(dst->fd, end))
+        return 1;
+    return 0;
+}
+
+int dc_sparse_dst_zero(DC_SparseDst *dst, int64_t lba, size_t sectors) {
+    uint64_t begin = lba * 512;
+    uint64_t end = begin + sectors * 512;
+    int r;
+    switch (dst->mode) {
+        case DC_SparseMode_ePunchHole:
+            r = punch_hole(dst, begin, end);
+            break;
+        case DC_SparseMode_eZeroOut:
+            {
+                uint64_t range[2] = { begin, end - begin };
+                r = ioctl(dst->fd, BLKZEROOUT, range) == -1;
+            }
+            break;
+        default:
+            return 1;
+    }
+    if (r) {
+        dc_log(DC_LOG_WARNING, "Destination doesn't support deallocation of zeros (errno %d), writing them\n", errno);
+        dst->mode = DC_SparseMode_eNone;
+        return 1;
+    }
+    dst->zeroed_bytes += end - begin;
+    return 0;
+}
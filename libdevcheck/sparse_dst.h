@@ -0,0 +1,42 @@
+#ifndef SPARSE_DST_H
+#define SPARSE_DST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Sparse destination: blocks of zeros are not written, but deallocated on destination instead.
+ * Regular file gets a hole punched (or is just extended, if block is past its end);
+ * block device gets BLKZEROOUT, which lets device unmap or WRITE SAME the range, if asked to:
+ * some devices implement it by writing zeros slower than plain writes would.
+ * Either way the range reads back as zeros, so copy stays exact.
+ */
+
+typedef enum {
+    DC_SparseMode_eNone,  // destination doesn't support it, e.g. /dev/null or pipe
+    DC_SparseMode_ePunchHole,
+    DC_SparseMode_eZeroOut,
+} DC_SparseMode;
+
+typedef struct dc_sparse_dst {
+    int fd;
+    DC_SparseMode mode;
+    uint64_t zeroed_bytes;  // not written because of zeros
+} DC_SparseDst;
+
+// Returns 1 if buffer is all zeros
+int dc_buffer_is_zero(const void *buf, size_t size);
+
+/**
+ * Detects how zeros can be deallocated on destination; block device is zeroed out only with zero_out_blockdev.
+ * Returns 1 if destination supports none of the ways
+ */
+int dc_sparse_dst_open(DC_SparseDst *dst, int fd, int zero_out_blockdev);
+/**
+ * Makes range of destination read as zeros without writing them.
+ * Returns 1 if that failed; then caller must write zeros, and further calls fail without trying.
+ * Thread-unsafe: there must be only one writer of destination
+ */
+int dc_sparse_dst_zero(DC_SparseDst *dst, int64_t lba, size_t sectors);
+
+#endif  // SPARSE_DST_H
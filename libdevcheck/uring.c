@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#ifdef __NR_io_uring_setup
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Reads and writes at offset came with kernel 5.6, as did probing; older kernel sets ring up,
+// but fails each request with EINVAL
+static int rw_supported(int fd) {
+    unsigned nb_ops = IORING_OP_WRITE + 1;
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + nb_ops * sizeof(struct io_uring_probe_op));
+    int r;
+    if (!probe)
+        return 0;
+    r = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, nb_ops) == 0
+        && probe->last_op >= IORING_OP_WRITE
+        && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+        && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return r;
+}
+
+int dc_uring_init(DC_Uring *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return 1;
+    if (!rw_supported(ring->fd))
+        goto fail_sq;
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail_sq;
+    ring->sq_head  = (unsigned*)((uint8_t*)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail  = (unsigned*)((uint8_t*)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask  = (unsigned*)((uint8_t*)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((uint8_t*)ring->sq_ring + p.sq_off.array);
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_sqes;
+
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+        goto fail_cq;
+    ring->cq_head = (unsigned*)((uint8_t*)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned*)((uint8_t*)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)((uint8_t*)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((uint8_t*)ring->cq_ring + p.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    munmap(ring->sqes, ring->sqes_size);
+fail_sqes:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail_sq:
+    close(ring->fd);
+    return 1;
+}
+
+void dc_uring_close(DC_Uring *ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static int prep_rw(DC_Uring *ring, int opcode, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries)
+        return 1;  // Submission queue is full
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return 0;
+}
+
+int dc_uring_prep_read(DC_Uring *ring, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    return prep_rw(ring, IORING_OP_READ, fd, buf, len, offset, user_data);
+}
+
+int dc_uring_prep_write(DC_Uring *ring, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    return prep_rw(ring, IORING_OP_WRITE, fd, buf, len, offset, user_data);
+}
+
+int dc_uring_submit(DC_Uring *ring, unsigned wait_nr) {
+    int r;
+    do {
+        r = sys_io_uring_enter(ring->fd, ring->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        return 1;
+    ring->to_submit -= r;
+    return 0;
+}
+
+int dc_uring_reap(DC_Uring *ring, uint64_t *user_data, int32_t *res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 1;
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#else  // __NR_io_uring_setup
+
+int dc_uring_init(DC_Uring *ring, unsigned entries) {
+    (void)ring;
+    (void)entries;
+    return 1;
+}
+
+void dc_uring_close(DC_Uring *ring) {
+    (void)ring;
+}
+
+int dc_uring_prep_read(DC_Uring *ring, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    (void)ring; (void)fd; (void)buf; (void)len; (void)offset; (void)user_data;
+    return 1;
+}
+
+int dc_uring_prep_write(DC_Uring *ring, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data) {
+    (void)ring; (void)fd; (void)buf; (void)len; (void)offset; (void)user_data;
+    return 1;
+}
+
+int dc_uring_submit(DC_Uring *ring, unsigned wait_nr) {
+    (void)ring;
+    (void)wait_nr;
+    return 1;
+}
+
+int dc_uring_reap(DC_Uring *ring, uint64_t *user_data, int32_t *res) {
+    (void)ring; (void)user_data; (void)res;
+    return 1;
+}
+
+#endif  // __NR_io_uring_setup
@@ -0,0 +1,50 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper, talking to kernel via raw syscalls,
+ * so no liburing is required at build time.
+ * Only what procedures need is here: queue reads and writes, submit, reap completions.
+ */
+typedef struct dc_uring {
+    int fd;
+    unsigned entries;
+    unsigned to_submit;  // SQEs queued but not yet passed to kernel
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} DC_Uring;
+
+// Returns 0 on success; non-zero if io_uring is unavailable (old kernel, seccomp, etc.) or can't read and write
+int dc_uring_init(DC_Uring *ring, unsigned entries);
+void dc_uring_close(DC_Uring *ring);
+
+// Queue read of len bytes at offset; user_data comes back with completion
+int dc_uring_prep_read(DC_Uring *ring, int fd, void *buf, size_t len, uint64_t offset, uint64_t user_data);
+int dc_uring_prep_write(DC_Uring *ring, int fd, const void *buf, size_t len, uint64_t offset, uint64_t user_data);
+
+// Pass queued requests to kernel, and wait until at least wait_nr completions are available
+int dc_uring_submit(DC_Uring *ring, unsigned wait_nr);
+
+// Fetch one completion, if available. Returns 0 if got one, 1 if completion queue is empty
+int dc_uring_reap(DC_Uring *ring, uint64_t *user_data, int32_t *res);
+
+#endif  // URING_H
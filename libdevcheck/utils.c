@@ -7,9 +7,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/ioctl.h>
 
 #include "utils.h"
+#include "job.h"
 #include "log.h"
 #include "scsi.h"
 
@@ -182,6 +184,34 @@ fail:
     return 1;
 }
 
+int jobs_perform_until_interrupt(DC_JobEngine *engine) {
+    int r;
+
+    r = signal_handling_setup();
+    if (r) {
+        printf("failed to setup signal handling\n");
+        return 1;
+    }
+
+    r = dc_job_engine_start(engine);
+    if (r)
+        printf("some of jobs failed to start\n");
+
+    while (dc_job_engine_nb_active(engine)) {
+        if (termination_signal_caught) {
+            termination_signal_caught = 0;
+            dc_job_engine_interrupt(engine);
+            break;
+        }
+        usleep(100000);
+    }
+
+    signal_handling_unset();
+
+    dc_job_engine_join(engine);
+    return 0;
+}
+
 int dc_dev_get_native_capacity(char *dev_fs_path, uint64_t *capacity) {
     int ret = dc_dev_get_native_max_lba(dev_fs_path, capacity);
     if (!ret)
@@ -265,6 +295,49 @@ int dc_dev_ata_capable(char *dev_fs_path) {
     return !dc_dev_get_max_lba(dev_fs_path, &dummy);
 }
 
+int64_t dc_dev_max_blk_sectors(DC_Dev *dev) {
+    int r;
+    char *file_name;
+    int64_t max_hw_kb;
+    int64_t max_sectors = DC_ATA_MAX_BLK_SECTORS;
+    r = asprintf(&file_name, "/sys/block/%s/queue/max_hw_sectors_kb", dev->dev_fs_name);
+    if (r == -1)
+        return max_sectors;
+    FILE *f = fopen(file_name, "r");
+    free(file_name);
+    if (!f)
+        return max_sectors;
+    r = fscanf(f, "%"SCNd64, &max_hw_kb);
+    fclose(f);
+    if (r == 1 && max_hw_kb > 0 && max_hw_kb * 2 < max_sectors)
+        max_sectors = max_hw_kb * 2;
+    return max_sectors;
+}
+
+int dc_dev_sg_path(const char *dev_fs_name, char **sg_path) {
+    int r;
+    char *dir_name;
+    r = asprintf(&dir_name, "/sys/block/%s/device/scsi_generic", dev_fs_name);
+    if (r == -1)
+        return -1;
+    DIR *dir = opendir(dir_name);
+    free(dir_name);
+    if (!dir)
+        return -1;
+    struct dirent *entry;
+    int ret = -1;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "sg", 2))
+            continue;
+        r = asprintf(sg_path, "/dev/%s", entry->d_name);
+        if (r != -1)
+            ret = 0;
+        break;
+    }
+    closedir(dir);
+    return ret;
+}
+
 int dc_dev_ata_identify(char *dev_fs_path, uint8_t identify[512]) {
     int ioctl_ret;
     int fd = open(dev_fs_path, O_RDWR);
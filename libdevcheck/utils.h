@@ -26,6 +26,8 @@ char *commaprint(uint64_t n, char *retbuf, size_t bufsize);
 
 int procedure_perform_until_interrupt(DC_ProcedureCtx *actctx,
         ProcedureDetachedLoopCB callback, void *callback_priv);
+// Runs all jobs of engine, interrupts them on termination signal, then joins them
+int jobs_perform_until_interrupt(DC_JobEngine *engine);
 
 int dc_dev_get_capacity(char *dev_fs_path, uint64_t *capacity);
 int dc_dev_get_max_lba(char *dev_fs_path, uint64_t *max_lba);
@@ -38,6 +40,16 @@ int dc_dev_set_max_capacity(char *dev_fs_path, uint64_t capacity);
 int dc_dev_set_max_lba(char *dev_fs_path, uint64_t lba);
 
 int dc_dev_ata_capable(char *dev_fs_path);
+/**
+ * Largest transfer in sectors which device accepts in one command,
+ * as limited by kernel queue (max_hw_sectors_kb) and by ATA EXT commands format
+ */
+int64_t dc_dev_max_blk_sectors(DC_Dev *dev);
+/**
+ * Find generic SCSI node (/dev/sgN) of given block device (e.g. "sda").
+ * Result is dynamic buffer that must be free()d
+ */
+int dc_dev_sg_path(const char *dev_fs_name, char **sg_path);
 int dc_dev_ata_identify(char *dev_fs_path, uint8_t identify[512]);
 
 void dc_ata_ascii_to_c_string(uint8_t *ata_ascii_string, unsigned int ata_length_in_words, char *dst);
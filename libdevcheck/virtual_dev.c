@@ -0,0 +1,440 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <time.h>
+#include <unistd.h>
+#include <scsi/sg.h>
+
+#include "libdevcheck.h"
+#include "device.h"
+#include "virtual_dev.h"
+
+#define VIRTUAL_POSIX_TIMEOUT_US (1000 * 1000)
+
+static const struct {
+    const char *name;
+    DC_BlockStatus status;
+} fault_kinds[] = {
+    { "slow", DC_BlockStatus_eOk },
+    { "unc", DC_BlockStatus_eUnc },
+    { "idnf", DC_BlockStatus_eIdnf },
+    { "abrt", DC_BlockStatus_eAbrt },
+    { "amnf", DC_BlockStatus_eAmnf },
+    { "timeout", DC_BlockStatus_eTimeout },
+};
+
+static int compare_faults(const void *a, const void *b) {
+    const DC_VirtualFault *x = a;
+    const DC_VirtualFault *y = b;
+    if (x->begin_lba != y->begin_lba)
+        return x->begin_lba < y->begin_lba ? -1 : 1;
+    return 0;
+}
+
+int dc_virtual_dev_load(DC_VirtualDev *vdev, const char *image_path, const char *faults_path) {
+    char line[256];
+    uint64_t allocated = 0;
+    memset(vdev, 0, sizeof(*vdev));
+    vdev->image_path = strdup(image_path);
+    if (!vdev->image_path)
+        return 1;
+    if (!faults_path)
+        return 0;
+
+    FILE *file = fopen(faults_path, "r");
+    if (!file) {
+        dc_log(DC_LOG_ERROR, "Failed to open faults file %s\n", faults_path);
+        goto fail;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        uint64_t lba, sectors, latency_ms = 0;
+        char kind[16];
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        int nb_fields = sscanf(p, "%"SCNu64" %"SCNu64" %15s %"SCNu64, &lba, &sectors, kind, &latency_ms);
+        size_t i;
+        for (i = 0; nb_fields >= 3 && i < sizeof(fault_kinds) / sizeof(fault_kinds[0]); i++)
+            if (!strcmp(kind, fault_kinds[i].name))
+                break;
+        if (nb_fields < 3 || !sectors || i == sizeof(fault_kinds) / sizeof(fault_kinds[0])
+                || (fault_kinds[i].status == DC_BlockStatus_eOk && nb_fields < 4)) {
+            dc_log(DC_LOG_ERROR, "Malformed line in faults file %s: %s", faults_path, line);
+            goto fail_file;
+        }
+        if (vdev->nb_faults == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            DC_VirtualFault *faults = realloc(vdev->faults, allocated * sizeof(DC_VirtualFault));
+            if (!faults)
+                goto fail_file;
+            vdev->faults = faults;
+        }
+        DC_VirtualFault *fault = &vdev->faults[vdev->nb_faults++];
+        fault->begin_lba = lba;
+        fault->end_lba = lba + sectors;
+        fault->status = fault_kinds[i].status;
+        fault->latency_us = latency_ms * 1000;
+    }
+    fclose(file);
+
+    qsort(vdev->faults, vdev->nb_faults, sizeof(DC_VirtualFault), compare_faults);
+    for (uint64_t i = 1; i < vdev->nb_faults; i++) {
+        if (vdev->faults[i].begin_lba < vdev->faults[i - 1].end_lba) {
+            dc_log(DC_LOG_ERROR, "Ranges in faults file %s overlap at LBA %"PRIu64"\n",
+                    faults_path, vdev->faults[i].begin_lba);
+            goto fail;
+        }
+    }
+    dc_log(DC_LOG_INFO, "Virtual device %s has %"PRIu64" faulty ranges\n", image_path, vdev->nb_faults);
+    return 0;
+
+fail_file:
+    fclose(file);
+fail:
+    dc_virtual_dev_free(vdev);
+    return 1;
+}
+
+void dc_virtual_dev_free(DC_VirtualDev *vdev) {
+    free(vdev->image_path);
+    free(vdev->faults);
+    memset(vdev, 0, sizeof(*vdev));
+}
+
+/*
+ * Finds what command on [lba, lba + sectors) meets: returns the first range which fails it, or NULL,
+ * and sets latency_us to the longest latency of ranges. Timeout without latency lasts for timeout_us
+ */
+static const DC_VirtualFault *find_faults(DC_VirtualDev *vdev, uint64_t lba, uint64_t sectors, int is_write,
+        uint64_t timeout_us, uint64_t *latency_us) {
+    const DC_VirtualFault *failed = NULL;
+    uint64_t lo = 0, hi = vdev->nb_faults;
+    // First range which ends beyond lba
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (vdev->faults[mid].end_lba <= lba)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *latency_us = 0;
+    for (uint64_t i = lo; i < vdev->nb_faults && vdev->faults[i].begin_lba < lba + sectors; i++) {
+        const DC_VirtualFault *fault = &vdev->faults[i];
+        uint64_t latency = fault->latency_us;
+        if (fault->status == DC_BlockStatus_eTimeout && !latency)
+            latency = timeout_us;
+        if (latency > *latency_us)
+            *latency_us = latency;
+        if (failed || fault->status == DC_BlockStatus_eOk)
+            continue;
+        // Drive reallocates sectors which fail to read, when they are written
+        if (is_write && (fault->status == DC_BlockStatus_eUnc || fault->status == DC_BlockStatus_eAmnf))
+            continue;
+        failed = fault;
+    }
+    return failed;
+}
+
+static void sleep_us(uint64_t us) {
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = us % 1000000 * 1000 };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+static ssize_t virtual_pio(DC_Dev *dev, int fd, void *buf, size_t count, off_t offset, int is_write) {
+    uint64_t latency_us;
+    const DC_VirtualFault *fault = find_faults(dev->virt, offset / 512, (count + 511) / 512, is_write,
+            VIRTUAL_POSIX_TIMEOUT_US, &latency_us);
+    sleep_us(latency_us);
+    if (fault) {
+        errno = EIO;
+        return -1;
+    }
+    return is_write ? pwrite(fd, buf, count, offset) : pread(fd, buf, count, offset);
+}
+
+int dc_dev_open(DC_Dev *dev, int flags) {
+    if (!dev->virt)
+        return open(dev->dev_path, flags);
+    // Image may be on file system without direct I/O, e.g. tmpfs
+    return open(dev->virt->image_path, flags & ~O_DIRECT);
+}
+
+ssize_t dc_dev_pread(DC_Dev *dev, int fd, void *buf, size_t count, off_t offset) {
+    if (!dev->virt)
+        return pread(fd, buf, count, offset);
+    return virtual_pio(dev, fd, buf, count, offset, 0);
+}
+
+ssize_t dc_dev_pwrite(DC_Dev *dev, int fd, const void *buf, size_t count, off_t offset) {
+    if (!dev->virt)
+        return pwrite(fd, buf, count, offset);
+    return virtual_pio(dev, fd, (void *)buf, count, offset, 1);
+}
+
+ssize_t dc_dev_read(DC_Dev *dev, int fd, void *buf, size_t count) {
+    if (!dev->virt)
+        return read(fd, buf, count);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1)
+        return -1;
+    ssize_t r = virtual_pio(dev, fd, buf, count, offset, 0);
+    if (r > 0)
+        lseek(fd, offset + r, SEEK_SET);
+    return r;
+}
+
+ssize_t dc_dev_write(DC_Dev *dev, int fd, const void *buf, size_t count) {
+    if (!dev->virt)
+        return write(fd, buf, count);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1)
+        return -1;
+    ssize_t r = virtual_pio(dev, fd, (void *)buf, count, offset, 1);
+    if (r > 0)
+        lseek(fd, offset + r, SEEK_SET);
+    return r;
+}
+
+// CHECK CONDITION with ATA Status Return descriptor, as SAT layer reports it
+static void sg_ata_return(sg_io_hdr_t *hdr, int sense_key, uint8_t error, uint8_t status, uint64_t lba) {
+    hdr->status = 0x02;  // CHECK CONDITION
+    hdr->masked_status = 0x01;  // Status shifted right by one bit
+    hdr->driver_status = 0x08;  // DRIVER_SENSE
+    if (!hdr->sbp || hdr->mx_sb_len < 22)
+        return;
+    uint8_t *sense = hdr->sbp;
+    memset(sense, 0, hdr->mx_sb_len);
+    sense[0] = 0x72;  // Current error, descriptor format
+    sense[1] = sense_key;
+    sense[3] = 0x1d;  // ATA PASS THROUGH INFORMATION AVAILABLE
+    sense[7] = 14;  // Additional length, i.e. one descriptor
+    uint8_t *descr = &sense[8];
+    descr[0] = 0x09;  // ATA Status Return
+    descr[1] = 0x0c;
+    descr[2] = 0x01;  // EXTEND
+    descr[3] = error;
+    descr[6] = lba >> 24;
+    descr[7] = lba;
+    descr[8] = lba >> 32;
+    descr[9] = lba >> 8;
+    descr[10] = lba >> 40;
+    descr[11] = lba >> 16;
+    descr[13] = status;
+    hdr->sb_len_wr = 22;
+}
+
+static uint8_t ata_error_bit(DC_BlockStatus status) {
+    switch (status) {
+        case DC_BlockStatus_eUnc:
+            return 1 << 6;
+        case DC_BlockStatus_eIdnf:
+            return 1 << 4;
+        case DC_BlockStatus_eAmnf:
+            return 1 << 0;
+        default:
+            return 1 << 2;  // ABRT
+    }
+}
+
+// CHECK CONDITION with sense data in descriptor format and LBA in Information descriptor, as SCSI drive reports errors
+static void sg_scsi_return(sg_io_hdr_t *hdr, int sense_key, uint8_t asc, uint64_t lba) {
+    hdr->status = 0x02;  // CHECK CONDITION
+    hdr->masked_status = 0x01;
+    hdr->driver_status = 0x08;  // DRIVER_SENSE
+    if (!hdr->sbp || hdr->mx_sb_len < 20)
+        return;
+    uint8_t *sense = hdr->sbp;
+    memset(sense, 0, hdr->mx_sb_len);
+    sense[0] = 0x72;  // Current error, descriptor format
+    sense[1] = sense_key;
+    sense[2] = asc;
+    sense[7] = 12;
+    uint8_t *descr = &sense[8];
+    descr[0] = 0x00;  // Information
+    descr[1] = 0x0a;
+    descr[2] = 0x80;  // VALID
+    int i;
+    for (i = 0; i < 8; i++)
+        descr[4 + i] = lba >> (56 - 8 * i);
+    hdr->sb_len_wr = 20;
+}
+
+static uint8_t scsi_asc(DC_BlockStatus status) {
+    switch (status) {
+        case DC_BlockStatus_eUnc:
+            return 0x11;  // UNRECOVERED READ ERROR
+        case DC_BlockStatus_eIdnf:
+            return 0x14;  // RECORDED ENTITY NOT FOUND
+        case DC_BlockStatus_eAmnf:
+            return 0x13;  // ADDRESS MARK NOT FOUND FOR DATA FIELD
+        default:
+            return 0x00;
+    }
+}
+
+// Reports failure the way drive does for command of given command set
+static void sg_fail(sg_io_hdr_t *hdr, int ata, DC_BlockStatus status, uint64_t lba) {
+    int sense_key = status == DC_BlockStatus_eAbrt ? 0x0b /* ABORTED COMMAND */ : 0x03 /* MEDIUM ERROR */;
+    if (ata)
+        sg_ata_return(hdr, sense_key, ata_error_bit(status), 0x40 /* DRDY */ | 0x01 /* ERR */, lba);
+    else
+        sg_scsi_return(hdr, sense_key, scsi_asc(status), lba);
+}
+
+static uint64_t timespec_diff_ms(struct timespec *pre, struct timespec *post) {
+    return (post->tv_sec - pre->tv_sec) * 1000 + (post->tv_nsec - pre->tv_nsec) / 1000000;
+}
+
+// Emulates ATA PASS-THROUGH (16) of reading, verifying and writing commands, including NCQ ones,
+// and READ (16), VERIFY (16) and WRITE (16)
+static int virtual_sg_io(DC_Dev *dev, int fd, sg_io_hdr_t *hdr) {
+    const uint8_t status_drdy = 0x40;
+    uint8_t *cdb = hdr->cmdp;
+    struct timespec pre, post;
+    clock_gettime(DC_BEST_CLOCK, &pre);
+    hdr->status = hdr->masked_status = 0;
+    hdr->host_status = hdr->driver_status = 0;
+    hdr->sb_len_wr = 0;
+    hdr->resid = 0;
+    hdr->info = 0;
+    hdr->duration = 0;
+    if (hdr->cmd_len < 16) {
+        sg_scsi_return(hdr, 0x05 /* ILLEGAL REQUEST */, 0x20 /* INVALID COMMAND OPERATION CODE */, 0);
+        return 0;
+    }
+
+    int ata = cdb[0] == 0x85;
+    int ck_cond = 0;
+    uint64_t lba, sectors;
+    int is_write, transfer;
+    int i;
+    if (ata) {
+        int ncq = ((cdb[1] >> 1) & 0x0f) == 12;  // FPDMA protocol
+        ck_cond = cdb[2] & 0x20;
+        lba = (uint64_t)cdb[8] | (uint64_t)cdb[10] << 8 | (uint64_t)cdb[12] << 16
+            | (uint64_t)cdb[7] << 24 | (uint64_t)cdb[9] << 32 | (uint64_t)cdb[11] << 40;
+        sectors = ncq ? ((uint64_t)cdb[3] << 8 | cdb[4]) : ((uint64_t)cdb[5] << 8 | cdb[6]);
+        if (!sectors)
+            sectors = 65536;
+        switch (cdb[14]) {
+            case 0x24:  // READ SECTORS EXT
+            case 0x25:  // READ DMA EXT
+            case 0x60:  // READ FPDMA QUEUED
+                is_write = 0;
+                transfer = 1;
+                break;
+            case 0x42:  // READ VERIFY SECTORS EXT
+                is_write = 0;
+                transfer = 0;
+                break;
+            case 0x34:  // WRITE SECTORS EXT
+            case 0x35:  // WRITE DMA EXT
+            case 0x61:  // WRITE FPDMA QUEUED
+                is_write = 1;
+                transfer = 1;
+                break;
+            default:
+                sg_fail(hdr, ata, DC_BlockStatus_eAbrt, 0);
+                return 0;
+        }
+    } else {
+        switch (cdb[0]) {
+            case 0x88:  // READ (16)
+                is_write = 0;
+                transfer = 1;
+                break;
+            case 0x8f:  // VERIFY (16)
+                is_write = 0;
+                transfer = 0;
+                break;
+            case 0x8a:  // WRITE (16)
+                is_write = 1;
+                transfer = 1;
+                break;
+            default:
+                sg_scsi_return(hdr, 0x05 /* ILLEGAL REQUEST */, 0x20 /* INVALID COMMAND OPERATION CODE */, 0);
+                return 0;
+        }
+        lba = 0;
+        for (i = 2; i < 10; i++)
+            lba = lba << 8 | cdb[i];
+        sectors = (uint64_t)cdb[10] << 24 | (uint64_t)cdb[11] << 16 | (uint64_t)cdb[12] << 8 | cdb[13];
+        if (!sectors)
+            return 0;
+    }
+
+    off_t image_size = lseek(fd, 0, SEEK_END);
+    if (image_size == -1 || lba + sectors > (uint64_t)image_size / 512) {
+        if (ata)
+            sg_fail(hdr, ata, DC_BlockStatus_eIdnf, lba);
+        else
+            sg_scsi_return(hdr, 0x05 /* ILLEGAL REQUEST */, 0x21 /* LOGICAL BLOCK ADDRESS OUT OF RANGE */, lba);
+        return 0;
+    }
+
+    uint64_t timeout_us = (uint64_t)hdr->timeout * 1000;
+    uint64_t latency_us;
+    const DC_VirtualFault *fault = find_faults(dev->virt, lba, sectors, is_write, timeout_us, &latency_us);
+    // Command which takes longer than its timeout gets aborted by host
+    int timed_out = latency_us >= timeout_us || (fault && fault->status == DC_BlockStatus_eTimeout);
+    sleep_us(timed_out ? timeout_us : latency_us);
+
+    if (!timed_out && !fault && transfer) {
+        size_t size = sectors * 512;
+        if (!hdr->dxferp || hdr->iovec_count || hdr->dxfer_len < size) {
+            sg_fail(hdr, ata, DC_BlockStatus_eAbrt, lba);
+            return 0;
+        }
+        ssize_t r = is_write ? pwrite(fd, hdr->dxferp, size, lba * 512) : pread(fd, hdr->dxferp, size, lba * 512);
+        if (r != (ssize_t)size)
+            return -1;
+        hdr->resid = hdr->dxfer_len - size;
+    }
+
+    clock_gettime(DC_BEST_CLOCK, &post);
+    hdr->duration = timespec_diff_ms(&pre, &post);
+    if (timed_out) {
+        if (hdr->duration < hdr->timeout)
+            hdr->duration = hdr->timeout;
+        hdr->host_status = 0x03;  // DID_TIME_OUT
+        if (ata)
+            sg_ata_return(hdr, 0, 0, status_drdy, lba);
+    } else if (fault) {
+        sg_fail(hdr, ata, fault->status, fault->begin_lba > lba ? fault->begin_lba : lba);
+    } else if (ck_cond) {
+        sg_ata_return(hdr, 0x01 /* RECOVERED ERROR */, 0, status_drdy, lba + sectors - 1);
+    }
+    return 0;
+}
+
+int dc_dev_ioctl(DC_Dev *dev, int fd, unsigned long request, ...) {
+    // Argument is pointer or integer, as with ioctl()
+    va_list ap;
+    va_start(ap, request);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+    if (!dev->virt)
+        return ioctl(fd, request, arg);
+    switch (request) {
+        // Image has neither buffers of block device nor readahead to tune
+        case BLKFLSBUF:
+        case BLKRAGET:
+        case BLKRASET:
+            return 0;
+        case SG_IO:
+            return virtual_sg_io(dev, fd, arg);
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
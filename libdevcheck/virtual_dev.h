@@ -0,0 +1,54 @@
+#ifndef VIRTUAL_DEV_H
+#define VIRTUAL_DEV_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "objects_def.h"
+#include "procedure.h"
+
+/*
+ * Virtual device: regular file which behaves as failing drive, so that procedures
+ * may be tried, benchmarked and regression-tested without broken disks at hand.
+ * Virtual devices are listed in XHDD_VIRTUAL_DEVICES environment variable as
+ * image_path[:faults_path], separated by commas; they follow real ones in device list.
+ * Faults file has a line per range of sectors: "LBA sectors kind [latency_ms]", where kind is
+ * unc, idnf, abrt or amnf for command failing with that ATA error, timeout for command which
+ * gets no answer, or slow for command which succeeds after latency_ms. Ranges must not overlap;
+ * lines starting with '#' are comments.
+ * Command which touches several ranges waits for the longest latency, and fails as the first failing
+ * range does. UNC and AMNF ranges fail reading only, as drive reallocates such sectors on writing.
+ * Timeout lasts for latency_ms if given, or for timeout of SG command (1 second for POSIX calls).
+ *
+ * Procedures do I/O on device with dc_dev_* calls below. For real device they are plain system calls,
+ * for virtual one they go to image with faults applied; SG_IO gets ATA PASS-THROUGH read, verify
+ * and write commands emulated, with ATA status returned in sense data, as drive does, and so do
+ * READ (16), VERIFY (16) and WRITE (16), which fail with sense key and ASC of SCSI drive.
+ */
+
+typedef struct dc_virtual_fault {
+    uint64_t begin_lba;
+    uint64_t end_lba;
+    DC_BlockStatus status;  // DC_BlockStatus_eOk for range which is just slow
+    uint64_t latency_us;
+} DC_VirtualFault;
+
+struct dc_virtual_dev {
+    char *image_path;
+    DC_VirtualFault *faults;  // sorted, not overlapping
+    uint64_t nb_faults;
+};
+
+// faults_path may be NULL for device without faults. Returns 1 if faults file can't be read or is malformed
+int dc_virtual_dev_load(DC_VirtualDev *vdev, const char *image_path, const char *faults_path);
+void dc_virtual_dev_free(DC_VirtualDev *vdev);
+
+int dc_dev_open(DC_Dev *dev, int flags);
+ssize_t dc_dev_read(DC_Dev *dev, int fd, void *buf, size_t count);
+ssize_t dc_dev_write(DC_Dev *dev, int fd, const void *buf, size_t count);
+ssize_t dc_dev_pread(DC_Dev *dev, int fd, void *buf, size_t count, off_t offset);
+ssize_t dc_dev_pwrite(DC_Dev *dev, int fd, const void *buf, size_t count, off_t offset);
+// Block device ioctls of procedures are no-ops for virtual device, SG_IO is emulated
+int dc_dev_ioctl(DC_Dev *dev, int fd, unsigned long request, ...);
+
+#endif  // VIRTUAL_DEV_H
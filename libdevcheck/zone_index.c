@@ -0,0 +1,183 @@
+#include <stdlib.h>
+
+#include "zone_index.h"
+
+static int64_t zone_length(const Zone *zone) {
+    return zone->end_lba - zone->begin_lba;
+}
+
+static void recompute(Zone *zone) {
+    zone->max_length = zone_length(zone);
+    zone->nb_begin_ok = !zone->begin_lba_defective;
+    zone->nb_end_ok = !zone->end_lba_defective;
+    Zone *children[2] = { zone->left, zone->right };
+    for (int i = 0; i < 2; i++) {
+        if (!children[i])
+            continue;
+        if (children[i]->max_length > zone->max_length)
+            zone->max_length = children[i]->max_length;
+        zone->nb_begin_ok += children[i]->nb_begin_ok;
+        zone->nb_end_ok += children[i]->nb_end_ok;
+    }
+}
+
+static void recompute_to_root(Zone *zone) {
+    for (; zone; zone = zone->parent)
+        recompute(zone);
+}
+
+static void replace_child(ZoneIndex *index, Zone *parent, Zone *old_child, Zone *new_child) {
+    if (!parent)
+        index->root = new_child;
+    else if (parent->left == old_child)
+        parent->left = new_child;
+    else
+        parent->right = new_child;
+    if (new_child)
+        new_child->parent = parent;
+}
+
+// Makes zone take place of its parent
+static void rotate_up(ZoneIndex *index, Zone *zone) {
+    Zone *parent = zone->parent;
+    replace_child(index, parent->parent, parent, zone);
+    if (parent->left == zone) {
+        parent->left = zone->right;
+        if (zone->right)
+            zone->right->parent = parent;
+        zone->right = parent;
+    } else {
+        parent->right = zone->left;
+        if (zone->left)
+            zone->left->parent = parent;
+        zone->left = parent;
+    }
+    parent->parent = zone;
+    recompute(parent);
+    recompute(zone);
+}
+
+static uint32_t next_priority(ZoneIndex *index) {
+    // xorshift32
+    uint32_t x = index->seed ? index->seed : 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    index->seed = x;
+    return x;
+}
+
+void zone_index_insert(ZoneIndex *index, Zone *zone) {
+    Zone *parent = NULL;
+    Zone **link = &index->root;
+    while (*link) {
+        parent = *link;
+        link = zone->begin_lba < parent->begin_lba ? &parent->left : &parent->right;
+    }
+    zone->parent = parent;
+    zone->left = zone->right = NULL;
+    zone->priority = next_priority(index);
+    *link = zone;
+    recompute_to_root(zone);
+    while (zone->parent && zone->parent->priority < zone->priority)
+        rotate_up(index, zone);
+    recompute_to_root(zone->parent);
+    index->nb_zones++;
+}
+
+void zone_index_remove(ZoneIndex *index, Zone *zone) {
+    // Rotate zone down to leaf, keeping heap order of priorities
+    while (zone->left && zone->right)
+        rotate_up(index, zone->left->priority > zone->right->priority ? zone->left : zone->right);
+    Zone *child = zone->left ? zone->left : zone->right;
+    Zone *parent = zone->parent;
+    replace_child(index, parent, zone, child);
+    recompute_to_root(parent);
+    index->nb_zones--;
+}
+
+void zone_index_update(ZoneIndex *index, Zone *zone) {
+    (void)index;
+    recompute_to_root(zone);
+}
+
+static void free_subtree(Zone *zone) {
+    if (!zone)
+        return;
+    free_subtree(zone->left);
+    free_subtree(zone->right);
+    free(zone);
+}
+
+void zone_index_clear(ZoneIndex *index) {
+    free_subtree(index->root);
+    index->root = NULL;
+    index->nb_zones = 0;
+}
+
+Zone *zone_index_first(ZoneIndex *index) {
+    Zone *zone = index->root;
+    while (zone && zone->left)
+        zone = zone->left;
+    return zone;
+}
+
+Zone *zone_index_next(Zone *zone) {
+    if (zone->right) {
+        zone = zone->right;
+        while (zone->left)
+            zone = zone->left;
+        return zone;
+    }
+    while (zone->parent && zone->parent->right == zone)
+        zone = zone->parent;
+    return zone->parent;
+}
+
+Zone *zone_index_largest(ZoneIndex *index) {
+    Zone *zone = index->root;
+    while (zone) {
+        if (zone->left && zone->left->max_length == zone->max_length)
+            zone = zone->left;
+        else if (zone_length(zone) == zone->max_length)
+            return zone;
+        else
+            zone = zone->right;
+    }
+    return NULL;
+}
+
+Zone *zone_index_find(ZoneIndex *index, int64_t lba) {
+    Zone *zone = index->root;
+    Zone *found = NULL;
+    // Zones don't overlap, so they are ordered by end_lba as well
+    while (zone) {
+        if (zone->end_lba > lba) {
+            found = zone;
+            zone = zone->left;
+        } else {
+            zone = zone->right;
+        }
+    }
+    return found;
+}
+
+static int subtree_may_match(const Zone *zone, int begin_ok, int end_ok, int64_t min_length) {
+    return (begin_ok && zone->nb_begin_ok) || (end_ok && zone->nb_end_ok) || zone->max_length > min_length;
+}
+
+static Zone *first_matching(Zone *zone, int begin_ok, int end_ok, int64_t min_length) {
+    if (!zone || !subtree_may_match(zone, begin_ok, end_ok, min_length))
+        return NULL;
+    Zone *found = first_matching(zone->left, begin_ok, end_ok, min_length);
+    if (found)
+        return found;
+    if ((begin_ok && !zone->begin_lba_defective) || (end_ok && !zone->end_lba_defective)
+            || zone_length(zone) > min_length)
+        return zone;
+    return first_matching(zone->right, begin_ok, end_ok, min_length);
+}
+
+Zone *zone_index_first_matching(ZoneIndex *index, int begin_ok, int end_ok, int64_t min_length) {
+    return first_matching(index->root, begin_ok, end_ok, min_length);
+}
@@ -0,0 +1,58 @@
+#ifndef ZONE_INDEX_H
+#define ZONE_INDEX_H
+
+#include <stdint.h>
+
+/*
+ * Unread zones of copy procedure, kept in treap ordered by begin_lba.
+ * Each node also keeps aggregates of its subtree: maximal zone length
+ * and number of zones with non-defective begin and end. That allows to find
+ * the largest zone, or the first zone in LBA order which may be read from its border
+ * or is long enough to jump into it, in logarithmic time.
+ */
+
+typedef struct zone {
+    // begin_lba < end_lba
+    int64_t begin_lba;
+    int64_t end_lba;  // LBA of the first sector beyond zone
+    int begin_lba_defective;  // Whether reading near begin_lba failed
+    int end_lba_defective;  // Whether reading near end_lba failed
+
+    // Managed by index
+    struct zone *parent;
+    struct zone *left;
+    struct zone *right;
+    uint32_t priority;
+    int64_t max_length;
+    uint64_t nb_begin_ok;
+    uint64_t nb_end_ok;
+} Zone;
+
+typedef struct zone_index {
+    Zone *root;
+    uint64_t nb_zones;
+    uint32_t seed;
+} ZoneIndex;
+
+// Zone must not overlap with zones in index
+void zone_index_insert(ZoneIndex *index, Zone *zone);
+// Zone is not freed
+void zone_index_remove(ZoneIndex *index, Zone *zone);
+// Must be called after bounds or defectiveness of zone in index have changed; begin_lba must not cross neighbours
+void zone_index_update(ZoneIndex *index, Zone *zone);
+// Removes and frees all zones
+void zone_index_clear(ZoneIndex *index);
+
+Zone *zone_index_first(ZoneIndex *index);
+Zone *zone_index_next(Zone *zone);
+// Zone which contains lba, or the first one after it; NULL if there is none
+Zone *zone_index_find(ZoneIndex *index, int64_t lba);
+// The first one in LBA order, if there are several of the same length
+Zone *zone_index_largest(ZoneIndex *index);
+/**
+ * First zone in LBA order which has non-defective begin if begin_ok is set,
+ * or non-defective end if end_ok is set, or is longer than min_length sectors
+ */
+Zone *zone_index_first_matching(ZoneIndex *index, int begin_ok, int end_ok, int64_t min_length);
+
+#endif  // ZONE_INDEX_H
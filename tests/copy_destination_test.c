@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libdevcheck.h"
+#include "copy_journal.h"
+
+/*
+ * Copies file to /dev/full, so that the only destination fails while written blocks are still
+ * queued to it. Journal must not tell that any sector was copied then, or resume would skip it.
+ */
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define SOURCE_SECTORS 8192
+
+static int make_source(const char *path) {
+    char buf[512];
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return 1;
+    // Not zeros, so that nothing is deallocated instead of written
+    for (int i = 0; i < SOURCE_SECTORS; i++) {
+        for (size_t j = 0; j < sizeof(buf); j++)
+            buf[j] = rand();
+        fwrite(buf, sizeof(buf), 1, f);
+    }
+    return fclose(f);
+}
+
+static int report_cb(DC_ProcedureCtx *ctx, void *opaque) {
+    (void)ctx;
+    (void)opaque;
+    return 0;
+}
+
+static void test_only_destination_fails(void) {
+    DC_Dev dev;
+    DC_ProcedureCtx *ctx;
+    DC_CopyJournal journal;
+    DC_OptionSetting options[] = {
+        { "api", "posix" },
+        { "dst_file", "/dev/full" },
+        { "dst_direct", "no" },
+        { "write_buffers", "16" },
+        { "blk_sectors", "64" },
+        { NULL, NULL },
+    };
+
+    CHECK(!make_source("source.img"));
+    memset(&dev, 0, sizeof(dev));
+    dev.dev_path = "source.img";
+    dev.dev_fs_name = "source.img";
+    dev.model_str = "test";
+    dev.serial_no = "only_destination_fails";
+    dev.capacity = SOURCE_SECTORS * 512;
+
+    DC_Procedure *copy = dc_find_procedure("copy");
+    CHECK(copy);
+    if (!copy)
+        return;
+    CHECK(!dc_procedure_open(copy, &dev, &ctx, options));
+    if (failures)
+        return;
+    CHECK(dc_procedure_perform_loop(ctx, report_cb, NULL));
+    dc_procedure_close(ctx);
+
+    CHECK(!dc_copy_journal_open(&journal, "whdd_copy_journal__test__only_destination_fails", SOURCE_SECTORS));
+    for (uint64_t i = 0; i < journal.nb_extents; i++)
+        CHECK(journal.extents[i].status != SectorStatus_eReadOk);
+    dc_copy_journal_close(&journal);
+    unlink("whdd_copy_journal__test__only_destination_fails");
+    unlink("source.img");
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/xhdd_copy_destination_test_XXXXXX";
+    (void)argc;
+    (void)argv;
+    // Journal is kept in current directory
+    if (!mkdtemp(dir) || chdir(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (dc_init())
+        return 1;
+
+    test_only_destination_fails();
+
+    rmdir(dir);
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy_journal.h"
+#include "log.h"
+
+/*
+ * Checks extents of copy journal across reopening. Journal loaded from file has its extents array
+ * allocated to exact size, so splitting extent right after loading must grow it enough.
+ */
+
+void dc_log(enum DC_LogLevel level, const char* fmt, ...) {
+    va_list ap;
+    (void)level;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void check_extent(DC_CopyJournal *journal, uint64_t i, uint64_t begin, uint64_t end, SectorStatus status) {
+    CHECK(i < journal->nb_extents);
+    if (i >= journal->nb_extents)
+        return;
+    CHECK(journal->extents[i].begin_lba == begin);
+    CHECK(journal->extents[i].end_lba == end);
+    CHECK(journal->extents[i].status == status);
+}
+
+static void test_split_after_reload(const char *path) {
+    DC_CopyJournal journal;
+    unlink(path);
+
+    CHECK(!dc_copy_journal_open(&journal, path, 1000));
+    CHECK(!dc_copy_journal_mark(&journal, 100, 200, SectorStatus_eBlockReadError));
+    dc_copy_journal_close(&journal);
+
+    // Snapshot holds single extent, so array is allocated for one
+    CHECK(!dc_copy_journal_open(&journal, path, 1000));
+    CHECK(journal.nb_extents == 1);
+    CHECK(!dc_copy_journal_mark(&journal, 150, 10, SectorStatus_eReadOk));
+    CHECK(journal.nb_extents == 3);
+    CHECK(journal.extents_allocated >= journal.nb_extents);
+    check_extent(&journal, 0, 100, 150, SectorStatus_eBlockReadError);
+    check_extent(&journal, 1, 150, 160, SectorStatus_eReadOk);
+    check_extent(&journal, 2, 160, 300, SectorStatus_eBlockReadError);
+    dc_copy_journal_close(&journal);
+
+    // Split survives reopening, replayed from log or from compacted snapshot
+    CHECK(!dc_copy_journal_open(&journal, path, 1000));
+    CHECK(journal.nb_extents == 3);
+    check_extent(&journal, 1, 150, 160, SectorStatus_eReadOk);
+    dc_copy_journal_close(&journal);
+    unlink(path);
+}
+
+static void test_split_many_after_reload(const char *path) {
+    DC_CopyJournal journal;
+    unlink(path);
+
+    CHECK(!dc_copy_journal_open(&journal, path, 100000));
+    for (uint64_t lba = 0; lba < 10000; lba += 100)
+        CHECK(!dc_copy_journal_mark(&journal, lba, 50, SectorStatus_eBlockReadError));
+    dc_copy_journal_close(&journal);
+
+    // Every extent is split in three, as multipass copy does when it scrapes them
+    CHECK(!dc_copy_journal_open(&journal, path, 100000));
+    CHECK(journal.nb_extents == 100);
+    for (uint64_t lba = 0; lba < 10000; lba += 100)
+        CHECK(!dc_copy_journal_mark(&journal, lba + 20, 1, SectorStatus_eReadOk));
+    CHECK(journal.nb_extents == 300);
+    CHECK(journal.extents_allocated >= journal.nb_extents);
+    check_extent(&journal, 297, 9900, 9920, SectorStatus_eBlockReadError);
+    check_extent(&journal, 298, 9920, 9921, SectorStatus_eReadOk);
+    check_extent(&journal, 299, 9921, 9950, SectorStatus_eBlockReadError);
+    dc_copy_journal_close(&journal);
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    char path[] = "/tmp/xhdd_copy_journal_test_XXXXXX";
+    int fd = mkstemp(path);
+    (void)argc;
+    (void)argv;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_split_after_reload(path);
+    test_split_many_after_reload(path);
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
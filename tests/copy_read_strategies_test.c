@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "copy.h"
+
+/*
+ * Drives extents_first strategy over simulated disk with bad sectors inside priority and metadata extents.
+ * Whole extents except failed blocks must be read before anything else is.
+ */
+
+extern ReadStrategyImpl read_strategy_plain;
+extern ReadStrategyImpl read_strategy_extents_first;
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define DISK_SECTORS 100000
+
+static const int64_t bad_lbas[] = { 10, 1000, 5000, 5005, 50000, 70000 };
+
+static int read_fails(int64_t lba, size_t sectors) {
+    for (size_t i = 0; i < sizeof(bad_lbas) / sizeof(bad_lbas[0]); i++)
+        if (bad_lbas[i] >= lba && bad_lbas[i] < lba + (int64_t)sectors)
+            return 1;
+    return 0;
+}
+
+static int in_extents(const DC_FsExtent *extents, uint64_t nb_extents, int64_t lba, size_t sectors) {
+    for (uint64_t i = 0; i < nb_extents; i++)
+        if ((int64_t)extents[i].begin_lba < lba + (int64_t)sectors && lba < (int64_t)extents[i].end_lba)
+            return 1;
+    return 0;
+}
+
+// Extents are priority ones, then metadata ones; either part may be empty
+static void check_extents_read_first(DC_FsExtent *priority, uint64_t nb_priority, DC_FsExtent *metadata, uint64_t nb_metadata) {
+    static unsigned char state[DISK_SECTORS];  // 1 if read, 2 if failed
+    DC_FsExtent extents[8];
+    uint64_t nb_extents = nb_priority + nb_metadata;
+    CopyPriv *priv = calloc(1, sizeof(CopyPriv));
+    Zone *zone = calloc(1, sizeof(Zone));
+    int first_pass = 1;
+
+    memset(state, 0, sizeof(state));
+    memcpy(extents, priority, nb_priority * sizeof(DC_FsExtent));
+    memcpy(extents + nb_priority, metadata, nb_metadata * sizeof(DC_FsExtent));
+    priv->blk_sectors = 256;
+    priv->end_lba = DISK_SECTORS;
+    priv->priority_extents = priority;
+    priv->nb_priority_extents = nb_priority;
+    priv->metadata_first = nb_metadata > 0;
+    priv->use_fs_map = nb_metadata > 0;
+    priv->fs_map.metadata = metadata;
+    priv->fs_map.nb_metadata = nb_metadata;
+    priv->read_strategy = ReadStrategy_ePlain;
+    priv->read_strategy_impl = &read_strategy_extents_first;
+    priv->bulk_strategy_impl = &read_strategy_plain;
+    zone->end_lba = DISK_SECTORS;
+    zone_index_insert(&priv->unread_zones, zone);
+    CHECK(!priv->read_strategy_impl->init(priv));
+
+    while (priv->unread_zones.nb_zones) {
+        int64_t lba;
+        size_t sectors;
+        if (priv->read_strategy_impl->get_task(priv, &lba, &sectors))
+            break;
+        DC_BlockReport report = {
+            .lba = lba,
+            .sectors_processed = sectors,
+            .blk_status = read_fails(lba, sectors) ? DC_BlockStatus_eUnc : DC_BlockStatus_eOk,
+        };
+        if (first_pass && !in_extents(extents, nb_extents, lba, sectors)) {
+            first_pass = 0;
+            // Extents are read through, except failed blocks
+            for (uint64_t i = 0; i < nb_extents; i++)
+                for (uint64_t s = extents[i].begin_lba; s < extents[i].end_lba; s++)
+                    CHECK(state[s] == 1 || (state[s] == 2 && read_fails(s - s % 256, 256)));
+        }
+        for (size_t s = 0; s < sectors; s++)
+            if (!state[lba + s])
+                state[lba + s] = report.blk_status ? 2 : 1;
+        priv->read_strategy_impl->use_results(priv, lba, sectors, &report);
+    }
+    CHECK(!first_pass);
+
+    priv->read_strategy_impl->close(priv);
+    zone_index_clear(&priv->unread_zones);
+    free(priv);
+}
+
+static void test_priority_read_past_failure(void) {
+    // Bad sectors at extent start, in its middle twice within one block, and past its end
+    DC_FsExtent priority[] = { { 1000, 21000 }, { 50000, 51000 } };
+    check_extents_read_first(priority, 2, NULL, 0);
+}
+
+static void test_metadata_read_past_failure(void) {
+    // Boot sector fails, and so does block of inode table past priority extent
+    DC_FsExtent priority[] = { { 50000, 51000 } };
+    DC_FsExtent metadata[] = { { 0, 64 }, { 4096, 8192 }, { 69000, 72000 } };
+    check_extents_read_first(priority, 1, metadata, 3);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    test_priority_read_past_failure();
+    test_metadata_read_past_failure();
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "log.h"
+
+/*
+ * Writes small scattered pieces to image, syncing after each, as copying with frequent journal commits does.
+ * Partially filled chunks get new blobs on every sync, so image must reuse space of superseded ones
+ * rather than grow with each sync; data must read back after reopening.
+ */
+
+void dc_log(enum DC_LogLevel level, const char* fmt, ...) {
+    va_list ap;
+    (void)level;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define NB_CHUNKS 16
+#define NB_SECTORS (NB_CHUNKS * DC_IMAGE_CHUNK_SECTORS)
+#define PIECE_SECTORS 16
+#define NB_PIECES 1000
+
+static uint64_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) ? 0 : st.st_size;
+}
+
+static void test_scattered_syncs(const char *path) {
+    static uint8_t data[NB_SECTORS * 512];
+    uint8_t buf[PIECE_SECTORS * 512];
+    DC_Image image;
+    unlink(path);
+
+    // Random data doesn't compress, so each chunk takes as much as data written to it
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = rand();
+    CHECK(!dc_image_open(&image, path, NB_SECTORS, 1));
+    for (int i = 0; i < NB_PIECES; i++) {
+        uint64_t lba = (uint64_t)(rand() % (NB_SECTORS / PIECE_SECTORS)) * PIECE_SECTORS;
+        CHECK(!dc_image_write(&image, lba, PIECE_SECTORS, data + lba * 512));
+        CHECK(!dc_image_sync(&image));
+        // Halfway image is reopened, as resumed copying does
+        if (i == NB_PIECES / 2) {
+            CHECK(!dc_image_close(&image));
+            CHECK(!dc_image_open(&image, path, NB_SECTORS, 1));
+        }
+    }
+    // Live blobs take at most whole device; superseded ones may take as much again until reused
+    uint64_t bound = image.header.data_offset + 2 * (uint64_t)NB_SECTORS * 512;
+    CHECK(dc_image_stored_size(&image) <= bound);
+    CHECK(!dc_image_close(&image));
+    CHECK(file_size(path) <= bound);
+
+    CHECK(!dc_image_open(&image, path, NB_SECTORS, 0));
+    for (uint64_t lba = 0; lba < NB_SECTORS; lba += PIECE_SECTORS) {
+        CHECK(dc_image_pread(&image, buf, sizeof(buf), lba * 512) == sizeof(buf));
+        // Pieces not written read as zeros
+        int zero = 1;
+        for (size_t i = 0; i < sizeof(buf) && zero; i++)
+            zero = !buf[i];
+        CHECK(zero || !memcmp(buf, data + lba * 512, sizeof(buf)));
+    }
+    dc_image_close(&image);
+    unlink(path);
+}
+
+int main(int argc, char **argv) {
+    char path[] = "/tmp/xhdd_image_test_XXXXXX";
+    int fd = mkstemp(path);
+    (void)argc;
+    (void)argv;
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_scattered_syncs(path);
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}